@@ -0,0 +1,466 @@
+/**
+ * Licensed to the University Corporation for Advanced Internet
+ * Development, Inc. (UCAID) under one or more contributor license
+ * agreements. See the NOTICE file distributed with this work for
+ * additional information regarding copyright ownership.
+ *
+ * UCAID licenses this file to you under the Apache License,
+ * Version 2.0 (the "License"); you may not use this file except
+ * in compliance with the License. You may obtain a copy of the
+ * License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+ */
+
+/**
+ * loadgen.cpp
+ *
+ * End-to-end load generator: loads the plugin the same way shibd does, then
+ * drives the StorageService it creates from multiple threads with a
+ * configurable mix of operations, and reports the throughput and latency
+ * percentiles of each kind of operation.
+ *
+ * The server setup (single instance, cluster, TLS) is whatever the given
+ * StorageService configuration describes.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "redis-stats.h"
+
+#include <boost/atomic.hpp>
+#include <xercesc/dom/DOMDocument.hpp>
+#include <xmltooling/XMLToolingConfig.h>
+#include <xmltooling/util/ParserPool.h>
+#include <xmltooling/util/StorageService.h>
+#include <xmltooling/util/Threads.h>
+
+#ifndef WIN32
+#include <dlfcn.h>
+#endif
+
+using namespace spredis;
+using namespace xmltooling;
+
+namespace {
+    enum Operation {
+        OP_CREATE,
+        OP_READ,
+        OP_UPDATE,
+        OP_DELETE,
+        OP_CONTEXT,
+        OPERATION_COUNT
+    };
+
+    const char* const operationNames[] = {"create", "read", "update", "delete", "updateContext"};
+
+    struct Range {
+        Range(const unsigned int min, const unsigned int max) : min(min), max(max) {
+        }
+
+        unsigned int min;
+        unsigned int max;
+    };
+
+    struct Options {
+        Options()
+            : plugin(),
+              config(),
+              threads(8),
+              duration(10),
+              keys(10000),
+              contexts(100),
+              keySize(32, 64),
+              valueSize(256, 4096),
+              ttl(3600),
+              prepopulate(true) {
+            const unsigned int defaultMix[OPERATION_COUNT] = {10, 70, 15, 5, 0};
+            for (unsigned int i = 0; i < OPERATION_COUNT; ++i) mix[i] = defaultMix[i];
+        }
+
+        std::string plugin;
+        std::string config;
+        unsigned int threads;
+        unsigned int duration;
+        unsigned int keys;
+        unsigned int contexts;
+        Range keySize;
+        Range valueSize;
+        unsigned int ttl;
+        bool prepopulate;
+        unsigned int mix[OPERATION_COUNT];
+    };
+
+    /**
+     * A small and fast generator, so generating the load does not show up in
+     * the measurements; every worker has its own.
+     */
+    class Random {
+    public:
+        explicit Random(const unsigned long long seed) : m_state(seed * 0x9E3779B97F4A7C15ULL + 1) {
+        }
+
+        unsigned long long next() {
+            m_state ^= m_state >> 12;
+            m_state ^= m_state << 25;
+            m_state ^= m_state >> 27;
+            return m_state * 0x2545F4914F6CDD1DULL;
+        }
+
+        unsigned int below(const unsigned int bound) {
+            return static_cast<unsigned int>(next() % bound);
+        }
+
+        unsigned int in(const Range& range) {
+            return range.min + below(range.max - range.min + 1);
+        }
+
+    private:
+        unsigned long long m_state;
+    };
+
+    /**
+     * The records the load is generated on: keys and their sizes are derived
+     * from their number, so every worker agrees on them; values are slices of
+     * a single buffer of printable characters.
+     */
+    class Dataset {
+    public:
+        explicit Dataset(const Options& options) : m_options(options), m_contexts(), m_values() {
+            for (unsigned int i = 0; i < options.contexts; ++i) {
+                m_contexts.push_back("_bench_context_" + std::to_string(i));
+            }
+
+            Random random(1);
+            m_values.resize(options.valueSize.max * 2);
+            for (size_t i = 0; i < m_values.size(); ++i) {
+                m_values[i] = static_cast<char>('!' + random.below('~' - '!' + 1));
+            }
+        }
+
+        const char* context(const unsigned int record) const {
+            return m_contexts[record % m_contexts.size()].c_str();
+        }
+
+        std::string key(const unsigned int record) const {
+            Random sizes(record + 1);
+            std::string key = "bench-" + std::to_string(record) + "-";
+            key.resize(std::max<size_t>(key.size(), sizes.in(m_options.keySize)), 'k');
+            return key;
+        }
+
+        std::string value(Random& random) const {
+            const unsigned int size = random.in(m_options.valueSize);
+            return m_values.substr(random.below(static_cast<unsigned int>(m_values.size() - size + 1)), size);
+        }
+
+    private:
+        const Options& m_options;
+        std::vector<std::string> m_contexts;
+        std::string m_values;
+    };
+
+    struct Shared {
+        Shared(const Options& options, const Dataset& dataset, StorageService& storage)
+            : options(options),
+              dataset(dataset),
+              storage(storage),
+              deadline(),
+              errors(),
+              notFound() {
+            for (unsigned int i = 0; i < OPERATION_COUNT; ++i) {
+                errors[i].store(0);
+                notFound[i].store(0);
+            }
+        }
+
+        const Options& options;
+        const Dataset& dataset;
+        StorageService& storage;
+        std::chrono::steady_clock::time_point deadline;
+        LatencyHistogram latencies[OPERATION_COUNT];
+        boost::atomic<unsigned long long> errors[OPERATION_COUNT];
+        // operations on records another worker deleted, or not yet created
+        boost::atomic<unsigned long long> notFound[OPERATION_COUNT];
+    };
+
+    struct Worker {
+        Worker(Shared& shared, const unsigned int number) : shared(shared), number(number) {
+        }
+
+        Shared& shared;
+        unsigned int number;
+    };
+
+    Operation pickOperation(const Options& options, Random& random) {
+        unsigned int total = 0;
+        for (unsigned int i = 0; i < OPERATION_COUNT; ++i) total += options.mix[i];
+
+        unsigned int pick = random.below(total);
+        for (unsigned int i = 0; i < OPERATION_COUNT; ++i) {
+            if (pick < options.mix[i]) return static_cast<Operation>(i);
+            pick -= options.mix[i];
+        }
+        return OP_READ;
+    }
+
+    /**
+     * Performs one operation, and returns whether the record it operated on
+     * was found.
+     */
+    bool perform(Shared& shared, const Operation op, Random& random) {
+        const unsigned int record = random.below(shared.options.keys);
+        const char* const context = shared.dataset.context(record);
+        const std::string key = shared.dataset.key(record);
+        const time_t expiration = time(NULL) + shared.options.ttl;
+
+        switch (op) {
+            case OP_CREATE:
+                return shared.storage.createString(context, key.c_str(), shared.dataset.value(random).c_str(), expiration);
+            case OP_READ: {
+                std::string value;
+                return shared.storage.readString(context, key.c_str(), &value) > 0;
+            }
+            case OP_UPDATE: {
+                // a versioned read-modify-write, like the session cache does
+                const int version = shared.storage.readString(context, key.c_str());
+                if (version <= 0) return false;
+                return shared.storage.updateString(context, key.c_str(), shared.dataset.value(random).c_str(),
+                                                   expiration, version) > 0;
+            }
+            case OP_DELETE:
+                return shared.storage.deleteString(context, key.c_str());
+            case OP_CONTEXT:
+                shared.storage.updateContext(context, expiration);
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    void* workerMain(void* arg) {
+        Worker& worker = *static_cast<Worker*>(arg);
+        Shared& shared = worker.shared;
+        Random random(worker.number + 1000);
+
+        while (std::chrono::steady_clock::now() < shared.deadline) {
+            const Operation op = pickOperation(shared.options, random);
+            const RedisStats::Timer timer(shared.latencies[op]);
+            try {
+                if (!perform(shared, op, random)) shared.notFound[op].fetch_add(1, boost::memory_order_relaxed);
+            } catch (const std::exception& ex) {
+                if (shared.errors[op].fetch_add(1, boost::memory_order_relaxed) == 0)
+                    std::fprintf(stderr, "%s failed: %s\n", operationNames[op], ex.what());
+            }
+        }
+        return NULL;
+    }
+
+    void prepopulate(const Options& options, const Dataset& dataset, StorageService& storage) {
+        Random random(2);
+        const time_t expiration = time(NULL) + options.ttl;
+        for (unsigned int record = 0; record < options.keys; ++record) {
+            const std::string key = dataset.key(record);
+            storage.deleteString(dataset.context(record), key.c_str());
+            storage.createString(dataset.context(record), key.c_str(), dataset.value(random).c_str(), expiration);
+        }
+    }
+
+    void report(const Shared& shared, const double seconds) {
+        std::printf("%-14s %10s %10s %9s %9s %9s %9s %9s %9s %8s\n",
+                    "operation", "count", "ops/s", "mean_us", "p50_us", "p90_us", "p99_us", "p999_us", "max_us",
+                    "errors");
+
+        unsigned long long total = 0;
+        for (unsigned int i = 0; i < OPERATION_COUNT; ++i) {
+            const LatencyHistogram::Snapshot snapshot = shared.latencies[i].snapshot();
+            if (snapshot.count == 0) continue;
+            total += snapshot.count;
+
+            std::printf("%-14s %10llu %10.0f %9llu %9llu %9llu %9llu %9llu %9llu %8llu\n",
+                        operationNames[i],
+                        snapshot.count,
+                        static_cast<double>(snapshot.count) / seconds,
+                        snapshot.sum / snapshot.count,
+                        snapshot.quantile(0.5),
+                        snapshot.quantile(0.9),
+                        snapshot.quantile(0.99),
+                        snapshot.quantile(0.999),
+                        snapshot.max,
+                        shared.errors[i].load());
+            if (shared.notFound[i].load() != 0)
+                std::printf("%-14s %10llu not found\n", "", shared.notFound[i].load());
+        }
+        std::printf("%-14s %10llu %10.0f\n", "total", total, static_cast<double>(total) / seconds);
+    }
+
+    /**
+     * Prints the statistics collected by the plugin itself, which break the
+     * latencies down by server.
+     */
+    void reportPluginStats(const Options& options) {
+#ifndef WIN32
+        // XXX Win32 - GetModuleHandle and GetProcAddress
+        void* const module = dlopen(options.plugin.c_str(), RTLD_LAZY | RTLD_NOLOAD);
+        if (module == NULL) return;
+
+        typedef size_t (*report_fn)(char*, size_t);
+        const report_fn statsReport = reinterpret_cast<report_fn>(dlsym(module, "spredis_stats_report"));
+        if (statsReport != NULL) {
+            std::vector<char> buffer(statsReport(NULL, 0) + 1);
+            statsReport(&buffer[0], buffer.size());
+            std::printf("\nplugin statistics:\n%s", &buffer[0]);
+        }
+        dlclose(module);
+#else
+        (void) options;
+#endif
+    }
+
+    bool parseRange(const char* text, Range& out_range) {
+        char* end = NULL;
+        out_range.min = static_cast<unsigned int>(std::strtoul(text, &end, 10));
+        out_range.max = *end == ':' ? static_cast<unsigned int>(std::strtoul(end + 1, &end, 10)) : out_range.min;
+        return *end == '\0' && out_range.min <= out_range.max;
+    }
+
+    bool parseMix(const char* text, unsigned int* out_mix) {
+        char* end = const_cast<char*>(text);
+        unsigned int total = 0;
+        for (unsigned int i = 0; i < OPERATION_COUNT; ++i) {
+            out_mix[i] = static_cast<unsigned int>(std::strtoul(end, &end, 10));
+            total += out_mix[i];
+            if (i + 1 < OPERATION_COUNT && *end++ != ':') return false;
+        }
+        return *end == '\0' && total > 0;
+    }
+
+    void usage(const char* self) {
+        std::fprintf(stderr,
+                     "usage: %s --plugin PATH --config FILE [options]\n"
+                     "  --plugin PATH          the plugin module to load (redis-store.so)\n"
+                     "  --config FILE          XML file holding the StorageService element to test\n"
+                     "  --threads N            concurrent workers [8]\n"
+                     "  --duration SECONDS     how long to generate load [10]\n"
+                     "  --keys N               amount of distinct records [10000]\n"
+                     "  --contexts N           amount of contexts the records are spread over [100]\n"
+                     "  --key-size MIN[:MAX]   uniform distribution of key sizes in bytes [32:64]\n"
+                     "  --value-size MIN[:MAX] uniform distribution of value sizes in bytes [256:4096]\n"
+                     "  --mix C:R:U:D:X        weights of create, read, update, delete and\n"
+                     "                         updateContext operations [10:70:15:5:0]\n"
+                     "  --ttl SECONDS          expiration of the records written [3600]\n"
+                     "  --no-prepopulate       do not create every record before the run\n",
+                     self);
+    }
+
+    bool parseOptions(const int argc, char** const argv, Options& out_options) {
+        for (int i = 1; i < argc; ++i) {
+            const std::string arg = argv[i];
+            if (arg == "--no-prepopulate") {
+                out_options.prepopulate = false;
+                continue;
+            }
+            if (i + 1 >= argc) return false;
+
+            const char* const value = argv[++i];
+            if (arg == "--plugin") out_options.plugin = value;
+            else if (arg == "--config") out_options.config = value;
+            else if (arg == "--threads") out_options.threads = static_cast<unsigned int>(std::atoi(value));
+            else if (arg == "--duration") out_options.duration = static_cast<unsigned int>(std::atoi(value));
+            else if (arg == "--keys") out_options.keys = static_cast<unsigned int>(std::atoi(value));
+            else if (arg == "--contexts") out_options.contexts = static_cast<unsigned int>(std::atoi(value));
+            else if (arg == "--ttl") out_options.ttl = static_cast<unsigned int>(std::atoi(value));
+            else if (arg == "--key-size") {
+                if (!parseRange(value, out_options.keySize)) return false;
+            } else if (arg == "--value-size") {
+                if (!parseRange(value, out_options.valueSize) || out_options.valueSize.max == 0) return false;
+            } else if (arg == "--mix") {
+                if (!parseMix(value, out_options.mix)) return false;
+            } else return false;
+        }
+        return !out_options.plugin.empty() && !out_options.config.empty()
+               && out_options.threads > 0 && out_options.keys > 0 && out_options.contexts > 0;
+    }
+}
+
+int main(int argc, char** argv) {
+    Options options;
+    if (!parseOptions(argc, argv, options)) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    XMLToolingConfig& config = XMLToolingConfig::getConfig();
+    config.log_config(std::getenv("XMLTOOLING_LOG_CONFIG"));
+    if (!config.init()) {
+        std::fprintf(stderr, "cannot initialize the XMLTooling library\n");
+        return 1;
+    }
+
+    int status = 0;
+    try {
+        if (!config.load_library(options.plugin.c_str())) throw std::runtime_error("cannot load " + options.plugin);
+
+        std::ifstream in(options.config.c_str());
+        if (!in) throw std::runtime_error("cannot open " + options.config);
+        xercesc::DOMDocument* const document = config.getParser().parse(in);
+
+        std::unique_ptr<StorageService> storage;
+        try {
+            storage.reset(config.StorageServiceManager.newPlugin("REDIS", document->getDocumentElement(), false));
+        } catch (...) {
+            document->release();
+            throw;
+        }
+        document->release();
+
+        const Dataset dataset(options);
+        if (options.prepopulate) {
+            std::printf("creating %u records...\n", options.keys);
+            prepopulate(options, dataset, *storage);
+        }
+
+        Shared shared(options, dataset, *storage);
+        std::vector<Worker> workers;
+        for (unsigned int i = 0; i < options.threads; ++i) workers.push_back(Worker(shared, i));
+
+        std::printf("running %u threads for %u seconds...\n", options.threads, options.duration);
+        const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        shared.deadline = start + std::chrono::seconds(options.duration);
+
+        std::vector<Thread*> threads;
+        for (unsigned int i = 0; i < options.threads; ++i) {
+            threads.push_back(Thread::create(&workerMain, &workers[i]));
+        }
+        for (size_t i = 0; i < threads.size(); ++i) {
+            threads[i]->join(NULL);
+            delete threads[i];
+        }
+        const double seconds = std::chrono::duration_cast<std::chrono::duration<double> >(
+            std::chrono::steady_clock::now() - start).count();
+
+        report(shared, seconds);
+        reportPluginStats(options);
+    } catch (const std::exception& ex) {
+        std::fprintf(stderr, "%s\n", ex.what());
+        status = 1;
+    }
+
+    config.term();
+    return status;
+}
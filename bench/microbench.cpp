@@ -0,0 +1,421 @@
+/**
+ * Licensed to the University Corporation for Advanced Internet
+ * Development, Inc. (UCAID) under one or more contributor license
+ * agreements. See the NOTICE file distributed with this work for
+ * additional information regarding copyright ownership.
+ *
+ * UCAID licenses this file to you under the Apache License,
+ * Version 2.0 (the "License"); you may not use this file except
+ * in compliance with the License. You may obtain a copy of the
+ * License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+ */
+
+/**
+ * microbench.cpp
+ *
+ * Microbenchmarks of the hot paths of the plugin which do not need a server:
+ * hash-slot calculation, cluster routing, command formatting and reply
+ * parsing. Each benchmark is run for at least the given time, and reported in
+ * nanoseconds per operation.
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "cluster-node.h"
+#include "cluster-range.h"
+#include "cluster-slot-table.h"
+#include "redis-command-group.h"
+#include "redis-crc-16.h"
+#include "redis-reply-arena.h"
+#include "storage-id.h"
+
+#include <boost/container/flat_map.hpp>
+#include <boost/container/stable_vector.hpp>
+#include <hiredis/hiredis.h>
+
+using namespace spredis;
+
+namespace {
+    struct Options {
+        Options()
+            : filter(),
+              minTimeMillis(500),
+              keySize(48),
+              valueSize(512),
+              masters(3) {
+        }
+
+        std::string filter;
+        unsigned int minTimeMillis;
+        unsigned int keySize;
+        unsigned int valueSize;
+        unsigned int masters;
+    };
+
+    // results are written here, so the compiler cannot optimize the measured
+    // code away
+    volatile unsigned long long sink = 0;
+
+    class Benchmark {
+    public:
+        explicit Benchmark(const char* name) : m_name(name) {
+        }
+
+        virtual ~Benchmark() {
+        }
+
+        const char* name() const { return m_name; }
+
+        virtual void run(unsigned long long iterations) = 0;
+
+    private:
+        const char* m_name;
+    };
+
+    std::string makeKey(const unsigned int size, const unsigned int seed) {
+        std::string key = "_" + std::to_string(seed) + "_";
+        while (key.size() < size) key += static_cast<char>('a' + (key.size() * 7 + seed) % 26);
+        key.resize(size);
+        return key;
+    }
+
+    /**
+     * A pool of keys, so the benchmarks do not keep on hashing the same
+     * (cached) data.
+     */
+    struct Keys {
+        static const unsigned int count = 1024;
+
+        explicit Keys(const unsigned int size) : keys(), ids() {
+            for (unsigned int i = 0; i < count; ++i) {
+                keys.push_back(makeKey(size, i));
+            }
+            for (unsigned int i = 0; i < count; ++i) {
+                ids.push_back(StorageId("_shibsp_context", keys[i].c_str(), "bench:"));
+            }
+        }
+
+        std::vector<std::string> keys;
+        std::vector<StorageId> ids;
+    };
+
+    class Crc16 : public Benchmark {
+    public:
+        Crc16(const char* name, const unsigned int size) : Benchmark(name), m_data(makeKey(size, 42)) {
+        }
+
+        void run(const unsigned long long iterations) {
+            const char* const begin = m_data.data();
+            const char* const end = begin + m_data.size();
+            for (unsigned long long i = 0; i < iterations; ++i) {
+                sink += RedisCrc16::calculate(begin, end);
+            }
+        }
+
+    private:
+        const std::string m_data;
+    };
+
+    class HashSlot : public Benchmark {
+    public:
+        explicit HashSlot(const Keys& keys) : Benchmark("hash-slot"), m_keys(keys) {
+        }
+
+        void run(const unsigned long long iterations) {
+            for (unsigned long long i = 0; i < iterations; ++i) {
+                sink += m_keys.ids[i % Keys::count].hashSlotUsing<RedisCrc16>();
+            }
+        }
+
+    private:
+        const Keys& m_keys;
+    };
+
+    class MakeIdAndHashSlot : public Benchmark {
+    public:
+        explicit MakeIdAndHashSlot(const Keys& keys) : Benchmark("storage-id+hash-slot"), m_keys(keys) {
+        }
+
+        void run(const unsigned long long iterations) {
+            for (unsigned long long i = 0; i < iterations; ++i) {
+                const StorageId id("_shibsp_context", m_keys.keys[i % Keys::count].c_str(), "bench:");
+                sink += id.hashSlotUsing<RedisCrc16>();
+            }
+        }
+
+    private:
+        const Keys& m_keys;
+    };
+
+    std::vector<ClusterRange<> > splitSlots(const unsigned int masters) {
+        std::vector<ClusterRange<> > ranges;
+        for (unsigned int i = 0; i < masters; ++i) {
+            ranges.push_back(ClusterRange<>(ClusterSlotTable::SlotCount * i / masters,
+                                            ClusterSlotTable::SlotCount * (i + 1) / masters - 1));
+        }
+        return ranges;
+    }
+
+    ClusterNode nodeNumber(const unsigned int i) {
+        return ClusterNode("10.0.0." + std::to_string(i + 1), 6379);
+    }
+
+    class RouteSlotTable : public Benchmark {
+    public:
+        RouteSlotTable(const Keys& keys, const unsigned int masters)
+            : Benchmark("route-slot-table"),
+              m_keys(keys),
+              m_table() {
+            const std::vector<ClusterRange<> > ranges = splitSlots(masters);
+            for (unsigned int i = 0; i < ranges.size(); ++i) {
+                m_table.assign(ranges[i], nodeNumber(i));
+            }
+        }
+
+        void run(const unsigned long long iterations) {
+            for (unsigned long long i = 0; i < iterations; ++i) {
+                const ClusterNode* const node =
+                        m_table.nodeForSlot(m_keys.ids[i % Keys::count].hashSlotUsing<RedisCrc16>());
+                sink += node->port();
+            }
+        }
+
+    private:
+        const Keys& m_keys;
+        ClusterSlotTable m_table;
+    };
+
+    /**
+     * The routing used before the slot table: a binary search of the ranges,
+     * hashing the key at each comparison.
+     */
+    class RouteRangeMap : public Benchmark {
+        typedef boost::container::flat_map<
+            ClusterRange<>,
+            ClusterNode,
+            ClusterCompareLess,
+            boost::container::stable_vector<std::pair<ClusterRange<>, ClusterNode> > > map_type;
+
+    public:
+        RouteRangeMap(const Keys& keys, const unsigned int masters)
+            : Benchmark("route-range-map"),
+              m_keys(keys),
+              m_map() {
+            const std::vector<ClusterRange<> > ranges = splitSlots(masters);
+            for (unsigned int i = 0; i < ranges.size(); ++i) {
+                m_map.insert_or_assign(ranges[i], nodeNumber(i));
+            }
+        }
+
+        void run(const unsigned long long iterations) {
+            for (unsigned long long i = 0; i < iterations; ++i) {
+                const map_type::const_iterator it = m_map.find(m_keys.ids[i % Keys::count]);
+                sink += it->second.port();
+            }
+        }
+
+    private:
+        const Keys& m_keys;
+        map_type m_map;
+    };
+
+    /**
+     * Formats the commands of creating a record in the hash layout.
+     */
+    class FormatGroup : public Benchmark {
+    public:
+        FormatGroup(const Keys& keys, const unsigned int valueSize)
+            : Benchmark("format-group"),
+              m_keys(keys),
+              m_value(makeKey(valueSize, 7)) {
+        }
+
+        void run(const unsigned long long iterations) {
+            for (unsigned long long i = 0; i < iterations; ++i) {
+                const StorageId& id = m_keys.ids[i % Keys::count];
+                RedisCommandGroup command;
+                command.append("MULTI");
+                command.append("HSETNX " SPREDIS_SID_FMT " value %s", SPREDIS_SID_FPARAM(id), m_value.c_str());
+                command.append("HSETNX " SPREDIS_SID_FMT " version 1", SPREDIS_SID_FPARAM(id));
+                command.append("EXPIREAT " SPREDIS_SID_FMT " %lld NX", SPREDIS_SID_FPARAM(id), 1700000000LL);
+                command.append("EXEC");
+                sink += command.buffer().size();
+            }
+        }
+
+    private:
+        const Keys& m_keys;
+        const std::string m_value;
+    };
+
+    /**
+     * Formats a single command with the key as a C string or as a binary
+     * safe argument, to show the cost of measuring the key each time.
+     */
+    class FormatCommand : public Benchmark {
+    public:
+        FormatCommand(const char* name, const Keys& keys, const bool binary)
+            : Benchmark(name),
+              m_keys(keys),
+              m_binary(binary) {
+        }
+
+        void run(const unsigned long long iterations) {
+            for (unsigned long long i = 0; i < iterations; ++i) {
+                const StorageId& id = m_keys.ids[i % Keys::count];
+                char* command = NULL;
+                const int length = m_binary
+                                       ? redisFormatCommand(&command, "GET %b", id.wire(), id.wireLength())
+                                       : redisFormatCommand(&command, "GET %s", id.wire());
+                sink += static_cast<unsigned long long>(length);
+                redisFreeCommand(command);
+            }
+        }
+
+    private:
+        const Keys& m_keys;
+        const bool m_binary;
+    };
+
+    /**
+     * Parses the reply of reading a record in the hash layout (the EXEC of
+     * HMGET and EXPIRETIME), then frees it.
+     */
+    class ParseReply : public Benchmark {
+    public:
+        ParseReply(const char* name, const unsigned int valueSize, const bool arena)
+            : Benchmark(name),
+              m_reply(),
+              m_reader(redisReaderCreate()),
+              m_arena(),
+              m_use_arena(arena) {
+            const std::string value = makeKey(valueSize, 11);
+            m_reply = "*3\r\n+OK\r\n+QUEUED\r\n*2\r\n*2\r\n$1\r\n3\r\n$" + std::to_string(value.size()) + "\r\n"
+                      + value + "\r\n:1700000000\r\n";
+            if (m_reader == NULL) {
+                std::fprintf(stderr, "cannot create hiredis reader\n");
+                std::exit(1);
+            }
+            if (arena) m_arena.install(m_reader);
+        }
+
+        ~ParseReply() {
+            redisReaderFree(m_reader);
+        }
+
+        void run(const unsigned long long iterations) {
+            for (unsigned long long i = 0; i < iterations; ++i) {
+                redisReaderFeed(m_reader, m_reply.data(), m_reply.size());
+                void* reply = NULL;
+                if (redisReaderGetReply(m_reader, &reply) != REDIS_OK || reply == NULL) {
+                    std::fprintf(stderr, "cannot parse reply: %s\n", m_reader->errstr);
+                    std::exit(1);
+                }
+                sink += static_cast<redisReply*>(reply)->elements;
+                if (m_use_arena) RedisReplyArena::freeReply(reply);
+                else freeReplyObject(reply);
+            }
+        }
+
+    private:
+        std::string m_reply;
+        redisReader* m_reader;
+        RedisReplyArena m_arena;
+        const bool m_use_arena;
+    };
+
+    void measure(Benchmark& benchmark, const Options& options) {
+        typedef std::chrono::steady_clock clock;
+        const std::chrono::nanoseconds minTime = std::chrono::milliseconds(options.minTimeMillis);
+
+        // grow the amount of iterations until a run takes long enough to be
+        // measured reliably
+        unsigned long long iterations = 1;
+        for (;;) {
+            const clock::time_point start = clock::now();
+            benchmark.run(iterations);
+            const std::chrono::nanoseconds elapsed = clock::now() - start;
+
+            if (elapsed >= minTime) {
+                const double nsPerOp = static_cast<double>(elapsed.count()) / static_cast<double>(iterations);
+                std::printf("%-24s %14llu %12.1f %14.0f\n",
+                            benchmark.name(), iterations, nsPerOp, 1e9 / nsPerOp);
+                return;
+            }
+            iterations = elapsed.count() < minTime.count() / 100
+                             ? iterations * 10
+                             : static_cast<unsigned long long>(
+                                 static_cast<double>(iterations) * 1.2 * minTime.count() / elapsed.count()) + 1;
+        }
+    }
+
+    void usage(const char* self) {
+        std::fprintf(stderr,
+                     "usage: %s [--filter SUBSTRING] [--min-time MS] [--key-size BYTES] [--value-size BYTES]"
+                     " [--masters N]\n",
+                     self);
+    }
+
+    bool parseOptions(const int argc, char** const argv, Options& out_options) {
+        for (int i = 1; i < argc; ++i) {
+            const std::string arg = argv[i];
+            if (i + 1 >= argc) return false;
+
+            const char* const value = argv[++i];
+            if (arg == "--filter") out_options.filter = value;
+            else if (arg == "--min-time") out_options.minTimeMillis = static_cast<unsigned int>(std::atoi(value));
+            else if (arg == "--key-size") out_options.keySize = static_cast<unsigned int>(std::atoi(value));
+            else if (arg == "--value-size") out_options.valueSize = static_cast<unsigned int>(std::atoi(value));
+            else if (arg == "--masters") out_options.masters = static_cast<unsigned int>(std::atoi(value));
+            else return false;
+        }
+        return out_options.masters > 0;
+    }
+}
+
+int main(int argc, char** argv) {
+    Options options;
+    if (!parseOptions(argc, argv, options)) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    const Keys keys(options.keySize);
+    Crc16 crcKey("crc16-key", options.keySize);
+    Crc16 crcKiB("crc16-1KiB", 1024);
+    HashSlot hashSlot(keys);
+    MakeIdAndHashSlot makeId(keys);
+    RouteSlotTable routeTable(keys, options.masters);
+    RouteRangeMap routeMap(keys, options.masters);
+    FormatGroup formatGroup(keys, options.valueSize);
+    FormatCommand formatC("format-get-%s", keys, false);
+    FormatCommand formatBinary("format-get-%b", keys, true);
+    ParseReply parseDefault("parse-reply-default", options.valueSize, false);
+    ParseReply parseArena("parse-reply-arena", options.valueSize, true);
+
+    Benchmark* const benchmarks[] = {
+        &crcKey, &crcKiB, &hashSlot, &makeId, &routeTable, &routeMap,
+        &formatGroup, &formatC, &formatBinary, &parseDefault, &parseArena
+    };
+
+    std::printf("%-24s %14s %12s %14s\n", "benchmark", "iterations", "ns/op", "ops/s");
+    for (size_t i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); ++i) {
+        if (!options.filter.empty() && std::strstr(benchmarks[i]->name(), options.filter.c_str()) == NULL)
+            continue;
+        measure(*benchmarks[i], options);
+    }
+    return 0;
+}
@@ -0,0 +1,107 @@
+/**
+ * Licensed to the University Corporation for Advanced Internet
+ * Development, Inc. (UCAID) under one or more contributor license
+ * agreements. See the NOTICE file distributed with this work for
+ * additional information regarding copyright ownership.
+ *
+ * UCAID licenses this file to you under the Apache License,
+ * Version 2.0 (the "License"); you may not use this file except
+ * in compliance with the License. You may obtain a copy of the
+ * License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+ */
+
+/**
+ * circuit-breaker.cpp
+ *
+ * Implementation of the CircuitBreaker type.
+ */
+
+#include <chrono>
+#include <string>
+
+#include "circuit-breaker.h"
+#include "redis.h"
+#include "redis-stats.h"
+
+using namespace xmltooling;
+
+spredis::CircuitBreaker::Call::Call(CircuitBreaker& breaker)
+    : m_breaker(breaker),
+      m_failed(false) {
+    if (!m_breaker.allow()) {
+        RedisStats::getInstance().count(RedisStats::BREAKER_REJECTIONS);
+        throw ConnectionLostException("Redis server " + m_breaker.m_host + ":" + std::to_string(m_breaker.m_port)
+                                      + " is known to be unreachable: circuit breaker open");
+    }
+}
+
+spredis::CircuitBreaker::Call::~Call() {
+    if (m_failed) m_breaker.failed();
+    else m_breaker.succeeded();
+}
+
+spredis::CircuitBreaker::CircuitBreaker(const RedisConfig& config, const std::string& host, const int port)
+    : m_threshold(config.breakerThreshold),
+      m_cooldown(config.breakerCooldown),
+      m_host(host),
+      m_port(port),
+      m_logger(logging::Category::getInstance("XMLTooling.StorageService.REDIS")),
+      m_failures(0),
+      m_open_until(0),
+      m_trial(false) {
+}
+
+bool spredis::CircuitBreaker::open() const {
+    return m_threshold != 0 && m_failures.load(boost::memory_order_relaxed) >= m_threshold;
+}
+
+bool spredis::CircuitBreaker::allow() {
+    // the closed breaker, which is the common case, only costs a load
+    if (!open()) return true;
+    if (now() < m_open_until.load(boost::memory_order_relaxed)) return false;
+
+    // half-open: the first caller after the cooldown is the trial, the
+    // others keep on failing fast until it is over
+    bool expected = false;
+    return m_trial.compare_exchange_strong(expected, true, boost::memory_order_acquire);
+}
+
+void spredis::CircuitBreaker::succeeded() {
+    // the breaker is only written to on a change, so the operations of a
+    // healthy server do not contend on it
+    if (m_failures.load(boost::memory_order_relaxed) == 0) return;
+
+    if (open())
+        m_logger.notice("circuit breaker of Redis server %s:%d closed: the server is reachable again",
+                        m_host.c_str(), m_port);
+    m_failures.store(0, boost::memory_order_relaxed);
+    m_trial.store(false, boost::memory_order_release);
+}
+
+void spredis::CircuitBreaker::failed() {
+    if (m_threshold == 0) return;
+
+    const unsigned int failures = m_failures.fetch_add(1, boost::memory_order_relaxed) + 1;
+    if (failures < m_threshold) return;
+
+    // opened for the first time, or the trial failed: either way the server
+    // gets a new cooldown
+    if (failures == m_threshold)
+        m_logger.warn("circuit breaker of Redis server %s:%d opened after %u consecutive lost connections",
+                      m_host.c_str(), m_port, failures);
+    m_open_until.store(now() + m_cooldown, boost::memory_order_relaxed);
+    m_trial.store(false, boost::memory_order_release);
+}
+
+long long spredis::CircuitBreaker::now() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
@@ -0,0 +1,120 @@
+/**
+ * Licensed to the University Corporation for Advanced Internet
+ * Development, Inc. (UCAID) under one or more contributor license
+ * agreements. See the NOTICE file distributed with this work for
+ * additional information regarding copyright ownership.
+ *
+ * UCAID licenses this file to you under the Apache License,
+ * Version 2.0 (the "License"); you may not use this file except
+ * in compliance with the License. You may obtain a copy of the
+ * License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+ */
+
+/**
+ * circuit-breaker.h
+ *
+ * Provides the CircuitBreaker class, which fails the operations sent to a
+ * Redis server fast while the server is known to be unreachable.
+ */
+
+#ifndef CIRCUIT_BREAKER_H
+#define CIRCUIT_BREAKER_H
+
+#include <string>
+
+#include "common.h"
+#include "connection-lost-exception.h"
+
+#include <boost/atomic.hpp>
+#include <xmltooling/logging.h>
+
+namespace spredis {
+    class RedisConfig;
+
+    /**
+     * The circuit breaker of a single Redis server. After breakerThreshold
+     * consecutive operations lost their connection to the server, the breaker
+     * opens: operations fail at once with a ConnectionLostException, without
+     * waiting for the timeouts of the server, for breakerCooldown
+     * milliseconds. Then a single operation is let through as a trial: if it
+     * reaches the server, the breaker closes, otherwise it opens again.
+     *
+     * Any other outcome than a lost connection, errors included, means the
+     * server answered, and counts as a success.
+     */
+    class SHIBSP_HIDDEN CircuitBreaker SHIBSP_FINAL {
+        MAKE_NONCOPYABLE(CircuitBreaker);
+
+    public:
+        /**
+         * An operation let through the breaker. The operation succeeded,
+         * unless failed is called before it is destroyed.
+         */
+        class SHIBSP_HIDDEN Call SHIBSP_FINAL {
+            MAKE_NONCOPYABLE(Call);
+
+        public:
+            /**
+             * Throws a ConnectionLostException if the breaker is open.
+             */
+            explicit Call(CircuitBreaker& breaker);
+
+            ~Call();
+
+            void failed() { m_failed = true; }
+
+        private:
+            CircuitBreaker& m_breaker;
+            bool m_failed;
+        };
+
+        CircuitBreaker(const RedisConfig& config, const std::string& host, int port);
+
+        bool open() const;
+
+    private:
+        bool allow();
+
+        void succeeded();
+
+        void failed();
+
+        static long long now();
+
+        const unsigned int m_threshold;
+        const long long m_cooldown;
+        const std::string m_host;
+        const int m_port;
+        xmltooling::logging::Category& m_logger;
+        boost::atomic<unsigned int> m_failures;
+        // the steady clock in milliseconds, until which operations fail fast
+        boost::atomic<long long> m_open_until;
+        // set while the trial operation of a half-open breaker is running
+        boost::atomic<bool> m_trial;
+    };
+
+    /**
+     * Calls fn with target through the breaker, counting a lost connection
+     * as a failure of the breaker's server.
+     */
+    template<class R, class Target, class CallFn>
+    R breakerCall(CircuitBreaker& breaker, Target* const target, const CallFn& fn) {
+        CircuitBreaker::Call call(breaker);
+        try {
+            return fn(target);
+        } catch (const ConnectionLostException&) {
+            call.failed();
+            throw;
+        }
+    }
+}
+
+#endif //CIRCUIT_BREAKER_H
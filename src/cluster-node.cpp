@@ -26,7 +26,12 @@
 
 #include "cluster-node.h"
 #include "redis-connection.h"
+#include "redis-connection-pool.h"
 
 spredis::RedisConnection* spredis::ClusterNode::connect(const RedisConfig& config) const {
     return new RedisConnection(config, m_host, m_port);
 }
+
+spredis::RedisConnectionPool* spredis::ClusterNode::createPool(const RedisConfig& config) const {
+    return new RedisConnectionPool(config, m_host, m_port);
+}
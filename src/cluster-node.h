@@ -32,6 +32,7 @@
 
 namespace spredis {
     class RedisConnection;
+    class RedisConnectionPool;
     class RedisConfig;
 
     /**
@@ -62,6 +63,8 @@ namespace spredis {
 
         RedisConnection* connect(const RedisConfig& config) const;
 
+        RedisConnectionPool* createPool(const RedisConfig& config) const;
+
     private:
         friend bool operator==(const ClusterNode& lhs, const ClusterNode& rhs) {
             return lhs.m_host == rhs.m_host
@@ -71,6 +74,11 @@ namespace spredis {
         friend bool operator!=(const ClusterNode& lhs, const ClusterNode& rhs) {
             return !(lhs == rhs);
         }
+
+        friend bool operator<(const ClusterNode& lhs, const ClusterNode& rhs) {
+            if (lhs.m_host != rhs.m_host) return lhs.m_host < rhs.m_host;
+            return lhs.m_port < rhs.m_port;
+        }
     };
 }
 
@@ -0,0 +1,173 @@
+/**
+ * Licensed to the University Corporation for Advanced Internet
+ * Development, Inc. (UCAID) under one or more contributor license
+ * agreements. See the NOTICE file distributed with this work for
+ * additional information regarding copyright ownership.
+ *
+ * UCAID licenses this file to you under the Apache License,
+ * Version 2.0 (the "License"); you may not use this file except
+ * in compliance with the License. You may obtain a copy of the
+ * License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+ */
+
+/**
+ * cluster-slot-table.cpp
+ *
+ * Implementation of the ClusterSlotTable class.
+ */
+
+#include "cluster-slot-table.h"
+
+#include <algorithm>
+
+const unsigned int spredis::ClusterSlotTable::SlotCount;
+const unsigned short spredis::ClusterSlotTable::noNode;
+
+spredis::ClusterSlotTable::ClusterSlotTable()
+    : m_nodes(),
+      m_replicas(),
+      m_replicas_of(),
+      m_down(),
+      m_pools(),
+      m_replica_pools() {
+    std::fill(m_slots, m_slots + SlotCount, noNode);
+    std::fill(m_read_slots, m_read_slots + SlotCount, noNode);
+    std::fill(m_hedge_slots, m_hedge_slots + SlotCount, noNode);
+}
+
+unsigned short spredis::ClusterSlotTable::indexOf(const ClusterNode& node) {
+    const std::vector<ClusterNode>::const_iterator it = std::find(m_nodes.begin(), m_nodes.end(), node);
+    if (it != m_nodes.end()) return static_cast<unsigned short>(it - m_nodes.begin());
+
+    m_nodes.push_back(node);
+    m_replicas_of.push_back(std::vector<unsigned short>());
+    m_down.push_back(false);
+    m_pools.push_back(pool_ptr());
+    return static_cast<unsigned short>(m_nodes.size() - 1);
+}
+
+void spredis::ClusterSlotTable::addReplica(const unsigned short master, const ClusterNode& replica) {
+    std::vector<ClusterNode>::const_iterator it = std::find(m_replicas.begin(), m_replicas.end(), replica);
+    if (it == m_replicas.end()) {
+        it = m_replicas.insert(m_replicas.end(), replica);
+        m_replica_pools.push_back(pool_ptr());
+    }
+
+    const unsigned short index = static_cast<unsigned short>(it - m_replicas.begin());
+    std::vector<unsigned short>& replicasOfMaster = m_replicas_of[master];
+    if (std::find(replicasOfMaster.begin(), replicasOfMaster.end(), index) == replicasOfMaster.end())
+        replicasOfMaster.push_back(index);
+}
+
+void spredis::ClusterSlotTable::reassign(const unsigned int slot, const ClusterNode& master, const pool_ptr& pool) {
+    const unsigned short index = indexOf(master);
+    m_slots[slot % SlotCount] = index;
+    m_read_slots[slot % SlotCount] = noNode;
+    m_hedge_slots[slot % SlotCount] = noNode;
+    if (!m_pools[index]) m_pools[index] = pool;
+}
+
+void spredis::ClusterSlotTable::attachPool(const ClusterNode& node, const pool_ptr& pool) {
+    const std::vector<ClusterNode>::const_iterator master = std::find(m_nodes.begin(), m_nodes.end(), node);
+    if (master != m_nodes.end()) m_pools[master - m_nodes.begin()] = pool;
+
+    const std::vector<ClusterNode>::const_iterator replica = std::find(m_replicas.begin(), m_replicas.end(), node);
+    if (replica != m_replicas.end()) m_replica_pools[replica - m_replicas.begin()] = pool;
+}
+
+spredis::RedisConnectionPool* spredis::ClusterSlotTable::poolOf(const ClusterNode& node) const {
+    const std::vector<ClusterNode>::const_iterator master = std::find(m_nodes.begin(), m_nodes.end(), node);
+    if (master != m_nodes.end()) return m_pools[master - m_nodes.begin()].get();
+
+    const std::vector<ClusterNode>::const_iterator replica = std::find(m_replicas.begin(), m_replicas.end(), node);
+    if (replica != m_replicas.end()) return m_replica_pools[replica - m_replicas.begin()].get();
+    return NULL;
+}
+
+void spredis::ClusterSlotTable::routeReads(const RedisConfig::ReadPreference preference,
+                                           const boost::container::flat_map<ClusterNode, long>& latencies) {
+    typedef boost::container::flat_map<ClusterNode, long>::const_iterator latency_it;
+
+    std::fill(m_read_slots, m_read_slots + SlotCount, noNode);
+    std::fill(m_hedge_slots, m_hedge_slots + SlotCount, noNode);
+    if (preference == RedisConfig::READ_MASTER) return;
+
+    // the candidates of each master: its reachable replicas with "prefer
+    // replica", and only the nearest node (which may be the master itself)
+    // with "nearest"
+    std::vector<std::vector<unsigned short> > candidates(m_nodes.size());
+    std::vector<std::vector<unsigned short> > reachable(m_nodes.size());
+    for (size_t master = 0; master < m_nodes.size(); ++master) {
+        const latency_it masterLatency = latencies.find(m_nodes[master]);
+        long best = masterLatency == latencies.end() ? -1 : masterLatency->second;
+
+        const std::vector<unsigned short>& replicasOfMaster = m_replicas_of[master];
+        for (size_t i = 0; i < replicasOfMaster.size(); ++i) {
+            const latency_it replicaLatency = latencies.find(m_replicas[replicasOfMaster[i]]);
+            if (replicaLatency == latencies.end()) continue;
+            reachable[master].push_back(replicasOfMaster[i]);
+
+            if (preference == RedisConfig::READ_PREFER_REPLICA) {
+                candidates[master].push_back(replicasOfMaster[i]);
+            } else if (best < 0 || replicaLatency->second < best) {
+                best = replicaLatency->second;
+                candidates[master].assign(1, replicasOfMaster[i]);
+            }
+        }
+    }
+
+    // spread the slots of a master over its candidates, so each replica
+    // serves a part of the keys
+    for (unsigned int slot = 0; slot < SlotCount; ++slot) {
+        if (m_slots[slot] == noNode) continue;
+
+        const std::vector<unsigned short>& slotCandidates = candidates[m_slots[slot]];
+        if (!slotCandidates.empty()) m_read_slots[slot] = slotCandidates[slot % slotCandidates.size()];
+
+        // reads are hedged to the next reachable replica, the master being
+        // the last resort after the replica read from
+        const std::vector<unsigned short>& slotReachable = reachable[m_slots[slot]];
+        const std::vector<unsigned short>::const_iterator read =
+                std::find(slotReachable.begin(), slotReachable.end(), m_read_slots[slot]);
+        if (read == slotReachable.end()) {
+            if (!slotReachable.empty()) m_hedge_slots[slot] = slotReachable[slot % slotReachable.size()];
+        } else if (read + 1 != slotReachable.end()) {
+            m_hedge_slots[slot] = *(read + 1);
+        } else if (latencies.find(m_nodes[m_slots[slot]]) == latencies.end()) {
+            // not to the master found unreachable: to the first replica, or
+            // not at all if it is the one read from
+            m_hedge_slots[slot] = slotReachable.front();
+        }
+    }
+}
+
+void spredis::ClusterSlotTable::updateHealth(const boost::container::flat_map<ClusterNode, long>& latencies) {
+    for (size_t master = 0; master < m_nodes.size(); ++master) {
+        m_down[master] = latencies.find(m_nodes[master]) == latencies.end();
+    }
+}
+
+bool spredis::ClusterSlotTable::anyDown() const {
+    return std::find(m_down.begin(), m_down.end(), true) != m_down.end();
+}
+
+bool spredis::ClusterSlotTable::sameRoutingAs(const ClusterSlotTable& other) const {
+    // indexes are only comparable if the nodes are listed the same way, and
+    // a table with a pool attached since is routed more efficiently
+    return m_nodes == other.m_nodes
+           && m_replicas == other.m_replicas
+           && m_down == other.m_down
+           && m_pools == other.m_pools
+           && m_replica_pools == other.m_replica_pools
+           && std::equal(m_slots, m_slots + SlotCount, other.m_slots)
+           && std::equal(m_read_slots, m_read_slots + SlotCount, other.m_read_slots)
+           && std::equal(m_hedge_slots, m_hedge_slots + SlotCount, other.m_hedge_slots);
+}
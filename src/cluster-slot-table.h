@@ -0,0 +1,248 @@
+/**
+ * Licensed to the University Corporation for Advanced Internet
+ * Development, Inc. (UCAID) under one or more contributor license
+ * agreements. See the NOTICE file distributed with this work for
+ * additional information regarding copyright ownership.
+ *
+ * UCAID licenses this file to you under the Apache License,
+ * Version 2.0 (the "License"); you may not use this file except
+ * in compliance with the License. You may obtain a copy of the
+ * License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+ */
+
+/**
+ * cluster-slot-table.h
+ *
+ * Provides the ClusterSlotTable class, the direct hash-slot to node mapping
+ * used to route operations in cluster mode.
+ */
+
+#ifndef CLUSTER_SLOT_TABLE_H
+#define CLUSTER_SLOT_TABLE_H
+
+#include <vector>
+
+#include "cluster-node.h"
+#include "cluster-range.h"
+#include "common.h"
+#include "redis.h"
+
+#include <boost/container/flat_map.hpp>
+#include <boost/shared_ptr.hpp>
+
+namespace spredis {
+    class RedisConnectionPool;
+
+    /**
+     * A table directly mapping each of the hash-slots of the cluster to the
+     * node serving it.
+     * The table stores a small index into its own list of distinct nodes for
+     * every slot, so finding the node for a key is a single array lookup once
+     * the hash-slot of the key is calculated.
+     *
+     * The table is filled while exploring the cluster topology, then it is
+     * published and never modified again, so it can be read concurrently
+     * without any locking.
+     *
+     * The table also holds the connection pools of its nodes, so dispatching
+     * an operation needs neither a lookup nor a lock: a pool stays open for
+     * as long as any table referring to it is in use, even after the node has
+     * left the cluster.
+     */
+    class SHIBSP_HIDDEN ClusterSlotTable SHIBSP_FINAL {
+    public:
+        typedef boost::shared_ptr<RedisConnectionPool> pool_ptr;
+
+        static const unsigned int SlotCount = 16384;
+
+        ClusterSlotTable();
+
+        /**
+         * Assigns all slots in the range to the given master, and records
+         * the replicas of the master.
+         */
+        template<class Hash, unsigned int Slots>
+        void assign(const ClusterRange<Hash, Slots>& range,
+                    const ClusterNode& master,
+                    const std::vector<ClusterNode>& replicas = std::vector<ClusterNode>()) {
+            const unsigned short index = indexOf(master);
+            for (int slot = range.from(); slot <= range.to(); ++slot) {
+                m_slots[slot] = index;
+            }
+            for (size_t i = 0; i < replicas.size(); ++i) {
+                addReplica(index, replicas[i]);
+            }
+        }
+
+        /**
+         * Assigns a single slot to the given master, as directed by a MOVED
+         * redirection. Reads of the slot are routed to the master, until the
+         * replicas of the new master are learned by a refresh.
+         */
+        void reassign(unsigned int slot, const ClusterNode& master, const pool_ptr& pool);
+
+        /**
+         * Sets the pool of connections to a master or replica of the table.
+         */
+        void attachPool(const ClusterNode& node, const pool_ptr& pool);
+
+        /**
+         * Returns the pool of connections to a master or replica of the
+         * table, or NULL if none is attached.
+         */
+        RedisConnectionPool* poolOf(const ClusterNode& node) const;
+
+        /**
+         * Chooses the node reads of each slot are routed to, according to the
+         * preference, and the other node slow reads are hedged to. Latencies
+         * holds the measured round-trip time of every reachable node:
+         * replicas missing from it are never read from.
+         * Until called, all reads are routed to the masters.
+         */
+        void routeReads(RedisConfig::ReadPreference preference,
+                        const boost::container::flat_map<ClusterNode, long>& latencies);
+
+        /**
+         * Marks the masters missing from latencies as unreachable, and the
+         * ones present as reachable again.
+         */
+        void updateHealth(const boost::container::flat_map<ClusterNode, long>& latencies);
+
+        /**
+         * Returns whether the master serving the slot was found unreachable
+         * by the last health check.
+         */
+        bool slotDown(const unsigned int slot) const {
+            const unsigned short index = m_slots[slot % SlotCount];
+            return index != noNode && m_down[index];
+        }
+
+        /**
+         * Returns whether any of the masters is unreachable.
+         */
+        bool anyDown() const;
+
+        /**
+         * Returns whether both tables route every slot, both for writes and
+         * reads, the same way.
+         */
+        bool sameRoutingAs(const ClusterSlotTable& other) const;
+
+        /**
+         * Returns the node serving the given slot, or NULL if no node is known
+         * to serve it.
+         */
+        const ClusterNode* nodeForSlot(const unsigned int slot) const {
+            const unsigned short index = m_slots[slot % SlotCount];
+            if (index == noNode) return NULL;
+            return &m_nodes[index];
+        }
+
+        /**
+         * Returns the node reads of the given slot are routed to: either a
+         * replica, or the same node as nodeForSlot.
+         */
+        const ClusterNode* readNodeForSlot(const unsigned int slot) const {
+            const unsigned short replica = m_read_slots[slot % SlotCount];
+            if (replica == noNode) return nodeForSlot(slot);
+            return &m_replicas[replica];
+        }
+
+        /**
+         * Returns the pool of the master serving the slot, or NULL if the slot
+         * is not served, or no pool could be opened to its master.
+         */
+        RedisConnectionPool* poolForSlot(const unsigned int slot) const {
+            const unsigned short index = m_slots[slot % SlotCount];
+            if (index == noNode) return NULL;
+            return m_pools[index].get();
+        }
+
+        /**
+         * Returns the pool of the node reads of the slot are routed to, see
+         * readNodeForSlot.
+         */
+        RedisConnectionPool* readPoolForSlot(const unsigned int slot) const {
+            const unsigned short replica = m_read_slots[slot % SlotCount];
+            if (replica == noNode) return poolForSlot(slot);
+            return m_replica_pools[replica].get();
+        }
+
+        /**
+         * Returns the pool of the node reads of the slot are hedged to: another
+         * reachable replica of the master than the one read from, or the
+         * master. NULL if there is no such node, or no pool is attached to it.
+         */
+        RedisConnectionPool* hedgePoolForSlot(const unsigned int slot) const {
+            const unsigned short replica = m_hedge_slots[slot % SlotCount];
+            if (replica == m_read_slots[slot % SlotCount]) return NULL;
+            if (replica == noNode) return poolForSlot(slot);
+            return m_replica_pools[replica].get();
+        }
+
+        /**
+         * Returns the masters serving slots.
+         */
+        const std::vector<ClusterNode>& nodes() const { return m_nodes; }
+
+        const std::vector<ClusterNode>& replicas() const { return m_replicas; }
+
+        /**
+         * Calls callback with each range of consecutive slots served by the
+         * same master, the master, and its replicas, the same way as
+         * RedisConnection::iterateSlots does while exploring the topology.
+         */
+        template<class Fn>
+        void iterateRanges(Fn callback) const {
+            std::vector<ClusterNode> replicas;
+            unsigned int from = 0;
+            while (from < SlotCount) {
+                const unsigned short index = m_slots[from];
+                unsigned int to = from;
+                while (to + 1 < SlotCount && m_slots[to + 1] == index) ++to;
+
+                if (index != noNode) {
+                    replicas.clear();
+                    const std::vector<unsigned short>& replicasOfMaster = m_replicas_of[index];
+                    for (size_t i = 0; i < replicasOfMaster.size(); ++i) {
+                        replicas.push_back(m_replicas[replicasOfMaster[i]]);
+                    }
+                    callback(ClusterRange<>(from, to), m_nodes[index], replicas);
+                }
+                from = to + 1;
+            }
+        }
+
+    private:
+        static const unsigned short noNode = 0xFFFF;
+
+        unsigned short indexOf(const ClusterNode& node);
+
+        void addReplica(unsigned short master, const ClusterNode& replica);
+
+        std::vector<ClusterNode> m_nodes;
+        std::vector<ClusterNode> m_replicas;
+        // the indexes of the replicas of each master, by index of the master
+        std::vector<std::vector<unsigned short> > m_replicas_of;
+        // whether each master is unreachable, by index of the master
+        std::vector<char> m_down;
+        std::vector<pool_ptr> m_pools;
+        std::vector<pool_ptr> m_replica_pools;
+        unsigned short m_slots[SlotCount];
+        // index of the replica to read the slot from, noNode for the master
+        unsigned short m_read_slots[SlotCount];
+        // index of the replica to hedge the reads of the slot to, noNode for
+        // the master; the same as m_read_slots if reads are not hedged
+        unsigned short m_hedge_slots[SlotCount];
+    };
+}
+
+#endif //CLUSTER_SLOT_TABLE_H
@@ -0,0 +1,135 @@
+/**
+ * Licensed to the University Corporation for Advanced Internet
+ * Development, Inc. (UCAID) under one or more contributor license
+ * agreements. See the NOTICE file distributed with this work for
+ * additional information regarding copyright ownership.
+ *
+ * UCAID licenses this file to you under the Apache License,
+ * Version 2.0 (the "License"); you may not use this file except
+ * in compliance with the License. You may obtain a copy of the
+ * License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+ */
+
+/**
+ * cluster-topology-snapshot.cpp
+ *
+ * Implementation of the ClusterTopologySnapshot class.
+ */
+
+#include "cluster-topology-snapshot.h"
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+#include <xmltooling/logging.h>
+
+using namespace xmltooling;
+
+namespace {
+    const char* const header = "# Redis cluster topology snapshot: from to host port [replica-host replica-port]...";
+
+    // XXX lambda when possible
+    struct RangeWriter {
+        explicit RangeWriter(std::ostream& out)
+            : out(out) {
+        }
+
+        void
+        operator()(const spredis::ClusterRange<>& range, const spredis::ClusterNode& master,
+                   const std::vector<spredis::ClusterNode>& replicas) const {
+            out << range.from() << ' ' << range.to() << ' ' << master.host() << ' ' << master.port();
+            for (size_t i = 0; i < replicas.size(); ++i) {
+                out << ' ' << replicas[i].host() << ' ' << replicas[i].port();
+            }
+            out << '\n';
+        }
+
+        std::ostream& out;
+    };
+
+    bool readNode(std::istream& in, std::string& out_host, unsigned short& out_port) {
+        unsigned int port = 0;
+        if (!(in >> out_host >> port) || port == 0 || port > 65535) return false;
+
+        out_port = static_cast<unsigned short>(port);
+        return true;
+    }
+}
+
+spredis::ClusterTopologySnapshot::ClusterTopologySnapshot(const std::string& path)
+    : m_path(path) {
+}
+
+bool spredis::ClusterTopologySnapshot::read(std::vector<Entry>& out_entries) const {
+    logging::Category& logger = logging::Category::getInstance("XMLTooling.StorageService.REDIS");
+
+    std::ifstream in(m_path.c_str());
+    if (!in) {
+        logger.info("no Redis cluster topology snapshot found at %s", m_path.c_str());
+        return false;
+    }
+
+    std::string line;
+    while (std::getline(in, line)) {
+        if (line.empty() || line[0] == '#') continue;
+
+        std::istringstream fields(line);
+        unsigned int from = 0;
+        unsigned int to = 0;
+        std::string host;
+        unsigned short port = 0;
+        if (!(fields >> from >> to) || to < from || to >= ClusterSlotTable::SlotCount
+            || !readNode(fields, host, port)) {
+            logger.warn("ignoring corrupt Redis cluster topology snapshot %s: invalid line `%s'",
+                        m_path.c_str(), line.c_str());
+            return false;
+        }
+
+        Entry entry(from, to, ClusterNode(host, port));
+        while (fields >> std::ws && !fields.eof()) {
+            if (!readNode(fields, host, port)) {
+                logger.warn("ignoring corrupt Redis cluster topology snapshot %s: invalid replica in line `%s'",
+                            m_path.c_str(), line.c_str());
+                return false;
+            }
+            entry.replicas.push_back(ClusterNode(host, port));
+        }
+        out_entries.push_back(entry);
+    }
+
+    return !out_entries.empty();
+}
+
+void spredis::ClusterTopologySnapshot::save(const ClusterSlotTable& table) const {
+    logging::Category& logger = logging::Category::getInstance("XMLTooling.StorageService.REDIS");
+
+    // written aside, then moved in place, so a crash never leaves a partial
+    // snapshot behind
+    const std::string temporary = m_path + ".tmp";
+    {
+        std::ofstream out(temporary.c_str(), std::ios::out | std::ios::trunc);
+        out << header << '\n';
+        table.iterateRanges(RangeWriter(out));
+        out.close();
+        if (!out) {
+            logger.warn("cannot write Redis cluster topology snapshot %s", temporary.c_str());
+            std::remove(temporary.c_str());
+            return;
+        }
+    }
+
+    // XXX Win32 - rename does not replace an existing file
+    if (std::rename(temporary.c_str(), m_path.c_str()) != 0) {
+        logger.warn("cannot replace Redis cluster topology snapshot %s", m_path.c_str());
+        std::remove(temporary.c_str());
+    }
+}
@@ -0,0 +1,97 @@
+/**
+ * Licensed to the University Corporation for Advanced Internet
+ * Development, Inc. (UCAID) under one or more contributor license
+ * agreements. See the NOTICE file distributed with this work for
+ * additional information regarding copyright ownership.
+ *
+ * UCAID licenses this file to you under the Apache License,
+ * Version 2.0 (the "License"); you may not use this file except
+ * in compliance with the License. You may obtain a copy of the
+ * License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+ */
+
+/**
+ * cluster-topology-snapshot.h
+ *
+ * Provides the ClusterTopologySnapshot class, which persists the last known
+ * topology of the cluster to a local file.
+ */
+
+#ifndef CLUSTER_TOPOLOGY_SNAPSHOT_H
+#define CLUSTER_TOPOLOGY_SNAPSHOT_H
+
+#include <string>
+#include <vector>
+
+#include "cluster-node.h"
+#include "cluster-range.h"
+#include "cluster-slot-table.h"
+#include "common.h"
+
+namespace spredis {
+    /**
+     * A snapshot of the slot ranges of the cluster, their masters and their
+     * replicas, stored in a text file, one range per line:
+     * `from to host port [replica-host replica-port]...'.
+     *
+     * A snapshot is only a hint: it lets operations be routed right after
+     * startup, while the actual topology is explored in the background, and
+     * redirections correct a stale one as usual.
+     */
+    class SHIBSP_HIDDEN ClusterTopologySnapshot SHIBSP_FINAL {
+    public:
+        explicit ClusterTopologySnapshot(const std::string& path);
+
+        /**
+         * Calls callback with each range of the snapshot, the same way as
+         * RedisConnection::iterateSlots does while exploring the topology.
+         *
+         * @return false if there is no snapshot, or it cannot be read.
+         */
+        template<class Fn>
+        bool load(Fn callback) const {
+            std::vector<Entry> entries;
+            if (!read(entries)) return false;
+
+            for (size_t i = 0; i < entries.size(); ++i) {
+                callback(ClusterRange<>(entries[i].from, entries[i].to), entries[i].master, entries[i].replicas);
+            }
+            return true;
+        }
+
+        /**
+         * Replaces the snapshot with the topology of the table. Failures are
+         * logged, and otherwise ignored.
+         */
+        void save(const ClusterSlotTable& table) const;
+
+    private:
+        struct Entry {
+            Entry(unsigned int from, unsigned int to, const ClusterNode& master)
+                : from(from),
+                  to(to),
+                  master(master),
+                  replicas() {
+            }
+
+            unsigned int from;
+            unsigned int to;
+            ClusterNode master;
+            std::vector<ClusterNode> replicas;
+        };
+
+        bool read(std::vector<Entry>& out_entries) const;
+
+        const std::string m_path;
+    };
+}
+
+#endif //CLUSTER_TOPOLOGY_SNAPSHOT_H
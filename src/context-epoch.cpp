@@ -0,0 +1,84 @@
+/**
+ * Licensed to the University Corporation for Advanced Internet
+ * Development, Inc. (UCAID) under one or more contributor license
+ * agreements. See the NOTICE file distributed with this work for
+ * additional information regarding copyright ownership.
+ *
+ * UCAID licenses this file to you under the Apache License,
+ * Version 2.0 (the "License"); you may not use this file except
+ * in compliance with the License. You may obtain a copy of the
+ * License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+ */
+
+/**
+ * context-epoch.cpp
+ *
+ * Implementation of the EpochStamp class.
+ */
+
+#include "context-epoch.h"
+
+#include <cstdio>
+#include <cstdlib>
+
+#include <xmltooling/exceptions.h>
+
+using namespace xmltooling;
+
+namespace {
+    // Shibboleth never stores values starting with a control character, and
+    // ValueCodec uses \x01 for its own header
+    const char stampByte = '\x02';
+    const char separator = ':';
+
+    long long parseField(const std::string& value, size_t& inout_pos) {
+        const char* const start = value.c_str() + inout_pos;
+        char* end = NULL;
+        const long long field = std::strtoll(start, &end, 10);
+        if (end == start || *end != separator)
+            throw IOException("Redis value is corrupt: invalid context epoch stamp");
+
+        inout_pos += static_cast<size_t>(end - start) + 1;
+        return field;
+    }
+}
+
+spredis::EpochStamp::EpochStamp()
+    : m_generation(0),
+      m_expiration(0) {
+}
+
+spredis::EpochStamp::EpochStamp(const long long generation, const time_t expiration)
+    : m_generation(generation),
+      m_expiration(expiration) {
+}
+
+spredis::EpochStamp spredis::EpochStamp::strip(std::string& value, const time_t unstampedExpiration) {
+    if (value.empty() || value[0] != stampByte) return EpochStamp(0, unstampedExpiration);
+
+    size_t pos = 1;
+    const long long generation = parseField(value, pos);
+    const long long expiration = parseField(value, pos);
+    value.erase(0, pos);
+    return EpochStamp(generation, static_cast<time_t>(expiration));
+}
+
+void spredis::EpochStamp::apply(const char* const value, std::string& out_stamped) const {
+    char stamp[64];
+    const int length = std::snprintf(stamp, sizeof(stamp), "%c%lld%c%lld%c",
+                                     stampByte,
+                                     m_generation,
+                                     separator,
+                                     static_cast<long long>(m_expiration),
+                                     separator);
+    out_stamped.assign(stamp, static_cast<size_t>(length));
+    out_stamped.append(value);
+}
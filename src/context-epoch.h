@@ -0,0 +1,88 @@
+/**
+ * Licensed to the University Corporation for Advanced Internet
+ * Development, Inc. (UCAID) under one or more contributor license
+ * agreements. See the NOTICE file distributed with this work for
+ * additional information regarding copyright ownership.
+ *
+ * UCAID licenses this file to you under the Apache License,
+ * Version 2.0 (the "License"); you may not use this file except
+ * in compliance with the License. You may obtain a copy of the
+ * License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+ */
+
+/**
+ * context-epoch.h
+ *
+ * Provides the EpochStamp class, which marks the values of records with the
+ * generation of the context epoch they were written in.
+ */
+
+#ifndef CONTEXT_EPOCH_H
+#define CONTEXT_EPOCH_H
+
+#include <ctime>
+#include <string>
+
+#include "common.h"
+#include "redis.h"
+
+namespace spredis {
+    /**
+     * The generation of the context epoch a record was written in, and the
+     * expiration it was written with, stored in front of its value when
+     * context epochs are enabled.
+     *
+     * Stamped values start with a header byte distinct from the one of
+     * ValueCodec, followed by the generation and the expiration in decimal,
+     * each terminated by a colon, and the value itself. Values written
+     * without a stamp are read as stamped with generation 0, which predates
+     * every context operation.
+     */
+    class SHIBSP_HIDDEN EpochStamp SHIBSP_FINAL {
+    public:
+        EpochStamp();
+
+        EpochStamp(long long generation, time_t expiration);
+
+        /**
+         * Reads the stamp from the start of value, and removes it. Values
+         * which are not stamped are left untouched, and get an empty stamp
+         * with the expiration defaulted to unstampedExpiration.
+         */
+        static EpochStamp strip(std::string& value, time_t unstampedExpiration);
+
+        /**
+         * Stores the stamped value into out_stamped.
+         */
+        void apply(const char* value, std::string& out_stamped) const;
+
+        bool deletedIn(const ContextEpoch& epoch) const { return m_generation < epoch.deleted; }
+
+        /**
+         * The expiration of the record, given the epoch of its context: the
+         * one of the last updateContext if it happened after the record was
+         * written. 0 if not known.
+         */
+        time_t expirationIn(const ContextEpoch& epoch) const {
+            return m_generation < epoch.expired ? epoch.expiration : m_expiration;
+        }
+
+        long long generation() const { return m_generation; }
+
+        time_t expiration() const { return m_expiration; }
+
+    private:
+        long long m_generation;
+        time_t m_expiration;
+    };
+}
+
+#endif //CONTEXT_EPOCH_H
@@ -0,0 +1,137 @@
+/**
+ * Licensed to the University Corporation for Advanced Internet
+ * Development, Inc. (UCAID) under one or more contributor license
+ * agreements. See the NOTICE file distributed with this work for
+ * additional information regarding copyright ownership.
+ *
+ * UCAID licenses this file to you under the Apache License,
+ * Version 2.0 (the "License"); you may not use this file except
+ * in compliance with the License. You may obtain a copy of the
+ * License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+ */
+
+/**
+ * parallel-scan.cpp
+ *
+ * Implementation of the ParallelScan type.
+ */
+
+#include <algorithm>
+
+#include "parallel-scan.h"
+#include "connection-lost-exception.h"
+
+#include <xmltooling/exceptions.h>
+
+using namespace xmltooling;
+
+namespace {
+    // XXX lambda when possible
+    struct callback_wrap {
+        callback_wrap(const spredis::ParallelScan::CallbackType callback, void* const callback_context)
+            : callback(callback),
+              callbackContext(callback_context) {
+        }
+
+        void
+        operator()(spredis::RedisConnection* connection, const std::vector<std::string>& keys) const {
+            callback(callbackContext, connection, keys);
+        }
+
+        spredis::ParallelScan::CallbackType callback;
+        void* callbackContext;
+    };
+}
+
+spredis::ParallelScan::ParallelScan(const char* const context, const CallbackType callback,
+                                    void* const callbackContext, const std::vector<ClusterNode>& nodes,
+                                    const std::vector<RedisConnectionPool*>& pools,
+                                    logging::Category& logger)
+    : m_context(context),
+      m_callback(callback),
+      m_callback_context(callbackContext),
+      m_nodes(nodes),
+      m_pools(pools),
+      m_logger(logger),
+      m_mutex(Mutex::create()),
+      m_next(0),
+      m_failed(false),
+      m_error(),
+      m_connection_lost(false) {
+}
+
+void spredis::ParallelScan::run(const unsigned int workers) {
+    // the calling thread is one of the workers
+    const size_t threadCount = std::min<size_t>(workers, m_nodes.size());
+    std::vector<Thread*> threads;
+    for (size_t i = 1; i < threadCount; ++i) {
+        try {
+            threads.push_back(Thread::create(&ParallelScan::workerMain, this));
+        } catch (const std::exception& ex) {
+            // the remaining workers take over the servers of this one
+            m_logger.warn("cannot start Redis scan worker: %s", ex.what());
+            break;
+        }
+    }
+    work();
+    for (size_t i = 0; i < threads.size(); ++i) {
+        threads[i]->join(NULL);
+        delete threads[i];
+    }
+
+    if (m_connection_lost) throw ConnectionLostException(m_error);
+    if (m_failed) throw IOException(m_error);
+}
+
+void* spredis::ParallelScan::workerMain(void* scan) {
+    static_cast<ParallelScan*>(scan)->work();
+    return NULL;
+}
+
+void spredis::ParallelScan::work() {
+    for (;;) {
+        size_t node;
+        {
+            const Lock lock(m_mutex);
+            // stop taking work after the first failure, it is reported anyways
+            if (m_next == m_nodes.size() || m_failed) return;
+            node = m_next++;
+        }
+
+        try {
+            // this call is tricky, we wrap our typeless callback into a typed
+            // callback, which will perform the same transformation we did, when
+            // we got the outermost callback, so when calling this callback, two
+            // layers of this type-erasure trickery will happen:
+            //   1) in the impl of conn->scanContext
+            //   2) in our callback call in callback_wrap,
+            // in this order
+            m_pools[node]->scanContext(m_context, callback_wrap(m_callback, m_callback_context));
+        } catch (const std::exception& ex) {
+            m_logger.error("scanning Redis node %s:%u failed: %s",
+                           m_nodes[node].host().c_str(), m_nodes[node].port(), ex.what());
+
+            const Lock lock(m_mutex);
+            if (m_failed) continue;
+            m_failed = true;
+            m_error = ex.what();
+            m_connection_lost = dynamic_cast<const ConnectionLostException*>(&ex) != NULL;
+        } catch (...) {
+            m_logger.error("scanning Redis node %s:%u failed with unknown error",
+                           m_nodes[node].host().c_str(), m_nodes[node].port());
+
+            const Lock lock(m_mutex);
+            if (m_failed) continue;
+            m_failed = true;
+            m_error = "unknown error while scanning Redis node";
+        }
+    }
+}
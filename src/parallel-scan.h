@@ -0,0 +1,91 @@
+/**
+ * Licensed to the University Corporation for Advanced Internet
+ * Development, Inc. (UCAID) under one or more contributor license
+ * agreements. See the NOTICE file distributed with this work for
+ * additional information regarding copyright ownership.
+ *
+ * UCAID licenses this file to you under the Apache License,
+ * Version 2.0 (the "License"); you may not use this file except
+ * in compliance with the License. You may obtain a copy of the
+ * License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+ */
+
+/**
+ * parallel-scan.h
+ *
+ * Provides the ParallelScan class, which scans a context on multiple Redis
+ * servers at the same time.
+ */
+
+#ifndef PARALLEL_SCAN_H
+#define PARALLEL_SCAN_H
+
+#include <string>
+#include <vector>
+
+#include "cluster-node.h"
+#include "common.h"
+#include "redis-connection-pool.h"
+
+#include <boost/scoped_ptr.hpp>
+#include <xmltooling/util/Threads.h>
+#include <xmltooling/logging.h>
+
+namespace spredis {
+    /**
+     * The state shared by the workers scanning a context on every server
+     * (the masters of a cluster, or the shards) in parallel: each worker
+     * takes the next server to scan, until none is left. The callbacks are
+     * called on the worker scanning the keys.
+     */
+    class SHIBSP_HIDDEN ParallelScan SHIBSP_FINAL {
+        MAKE_NONCOPYABLE(ParallelScan);
+
+    public:
+        typedef void (*CallbackType)(void*, RedisConnection*, const std::vector<std::string>&);
+
+        /**
+         * Prepares the scan of context on the servers, pools being the pools
+         * of nodes in the same order. The pools must stay open until the scan
+         * is done.
+         */
+        ParallelScan(const char* context, CallbackType callback, void* callbackContext,
+                     const std::vector<ClusterNode>& nodes, const std::vector<RedisConnectionPool*>& pools,
+                     xmltooling::logging::Category& logger);
+
+        /**
+         * Scans every server exactly once, using up to workers threads, the
+         * calling thread being one of them. Once all are done, the first
+         * failure of any of them is thrown.
+         */
+        void run(unsigned int workers);
+
+    private:
+        static void* workerMain(void* scan);
+
+        void work();
+
+        const char* m_context;
+        CallbackType m_callback;
+        void* m_callback_context;
+        const std::vector<ClusterNode>& m_nodes;
+        const std::vector<RedisConnectionPool*>& m_pools;
+        xmltooling::logging::Category& m_logger;
+        boost::scoped_ptr<xmltooling::Mutex> m_mutex;
+        size_t m_next;
+        // the first failure of any worker, reported once all finished
+        bool m_failed;
+        std::string m_error;
+        bool m_connection_lost;
+    };
+}
+
+#endif //PARALLEL_SCAN_H
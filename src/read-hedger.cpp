@@ -0,0 +1,271 @@
+/**
+ * Licensed to the University Corporation for Advanced Internet
+ * Development, Inc. (UCAID) under one or more contributor license
+ * agreements. See the NOTICE file distributed with this work for
+ * additional information regarding copyright ownership.
+ *
+ * UCAID licenses this file to you under the Apache License,
+ * Version 2.0 (the "License"); you may not use this file except
+ * in compliance with the License. You may obtain a copy of the
+ * License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+ */
+
+/**
+ * read-hedger.cpp
+ *
+ * Implementation of the ReadHedger type.
+ */
+
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+
+#include "read-hedger.h"
+#include "redis.h"
+#include "redis-connection-pool.h"
+#include "redis-stats.h"
+
+using namespace xmltooling;
+
+/**
+ * The two reads of a record, shared by the caller and the threads performing
+ * them. The record is identified by copies of the strings of the caller, as
+ * the slower read goes on after the caller returned.
+ *
+ * XXX CondWait only waits whole seconds, while the caller waits for the
+ * delay of the hedge: the race uses the standard primitives instead.
+ */
+struct spredis::ReadHedger::Race {
+    Race(const keep_alive_type& keepAlive,
+         const StorageId& id,
+         const bool versioned,
+         const int minVersion,
+         const bool wantValue,
+         const bool wantExpiration)
+        : keepAlive(keepAlive),
+          context(id.context()),
+          key(id.key()),
+          prefix(id.prefix()),
+          id(context.c_str(), key.c_str(), prefix.c_str(), id.hashTag(), id.buckets()),
+          versioned(versioned),
+          minVersion(minVersion),
+          wantValue(wantValue),
+          wantExpiration(wantExpiration),
+          mutex(),
+          done(),
+          refs(1),
+          running(0),
+          answered(false),
+          fromHedge(false),
+          version(0),
+          value(),
+          expiration(0),
+          error() {
+    }
+
+    const keep_alive_type keepAlive;
+    const std::string context;
+    const std::string key;
+    const std::string prefix;
+    const StorageId id;
+    const bool versioned;
+    const int minVersion;
+    const bool wantValue;
+    const bool wantExpiration;
+
+    std::mutex mutex;
+    // notified whenever a read is over
+    std::condition_variable done;
+    unsigned int refs;
+    unsigned int running;
+    bool answered;
+    // the answer of the first successful read
+    bool fromHedge;
+    int version;
+    std::string value;
+    time_t expiration;
+    // the error of the first failed read, thrown if neither succeeds
+    std::exception_ptr error;
+};
+
+spredis::ReadHedger::ReadHedger(const RedisConfig& config)
+    : m_logger(logging::Category::getInstance("XMLTooling.StorageService.REDIS")),
+      m_mutex(Mutex::create()),
+      m_queued(CondWait::create()),
+      m_queue(),
+      m_idle(0),
+      m_shutdown(false),
+      m_threads() {
+    for (unsigned int i = 0; i < config.hedgeWorkers; ++i) {
+        try {
+            m_threads.push_back(Thread::create(&ReadHedger::workerMain, this));
+        } catch (const std::exception& ex) {
+            // reads are not hedged while the started threads are all busy
+            m_logger.warn("cannot start Redis read hedging thread: %s", ex.what());
+            break;
+        }
+    }
+}
+
+spredis::ReadHedger::~ReadHedger() {
+    {
+        const Lock lock(m_mutex);
+        m_shutdown = true;
+        m_queued->broadcast();
+    }
+    for (size_t i = 0; i < m_threads.size(); ++i) {
+        m_threads[i]->join(NULL);
+        delete m_threads[i];
+    }
+}
+
+int spredis::ReadHedger::read(RedisConnectionPool* const primary,
+                              RedisConnectionPool* const hedge,
+                              const unsigned long long delay,
+                              const keep_alive_type& keepAlive,
+                              const StorageId& id,
+                              std::string* const out_value,
+                              time_t* const out_expiration,
+                              const bool versioned,
+                              const int minVersion,
+                              bool* const out_fromHedge) {
+    *out_fromHedge = false;
+
+    Race* const race = new Race(keepAlive, id, versioned, minVersion, out_value != NULL, out_expiration != NULL);
+    ++race->refs;
+    ++race->running;
+    if (!submit(Task(race, primary, false))) {
+        delete race;
+        if (versioned) return primary->getVersioned(id, out_value, out_expiration, minVersion);
+        return primary->forceGet(id, out_value, out_expiration);
+    }
+
+    std::unique_lock<std::mutex> lock(race->mutex);
+    const std::chrono::steady_clock::time_point due =
+            std::chrono::steady_clock::now() + std::chrono::microseconds(delay);
+    while (!race->answered && race->running > 0) {
+        if (race->done.wait_until(lock, due) == std::cv_status::timeout) break;
+    }
+
+    // a failed read is retried by the caller, only a slow one is hedged
+    if (!race->answered && race->running > 0) {
+        ++race->refs;
+        ++race->running;
+        lock.unlock();
+        const bool hedged = submit(Task(race, hedge, true));
+        lock.lock();
+        if (hedged) {
+            RedisStats::getInstance().count(RedisStats::HEDGED_READS);
+        } else {
+            --race->refs;
+            --race->running;
+        }
+    }
+
+    while (!race->answered && race->running > 0) {
+        race->done.wait(lock);
+    }
+
+    int version = 0;
+    std::exception_ptr error;
+    if (race->answered) {
+        version = race->version;
+        if (out_value) out_value->swap(race->value);
+        if (out_expiration) *out_expiration = race->expiration;
+        *out_fromHedge = race->fromHedge;
+        if (race->fromHedge) RedisStats::getInstance().count(RedisStats::HEDGE_WINS);
+    } else {
+        error = race->error;
+    }
+    lock.unlock();
+    release(race);
+
+    if (error) std::rethrow_exception(error);
+    return version;
+}
+
+bool spredis::ReadHedger::submit(const Task& task) {
+    const Lock lock(m_mutex);
+    if (m_idle == 0 || m_shutdown) return false;
+
+    --m_idle;
+    m_queue.push_back(task);
+    m_queued->signal();
+    return true;
+}
+
+void* spredis::ReadHedger::workerMain(void* const self) {
+    static_cast<ReadHedger*>(self)->work();
+    return NULL;
+}
+
+void spredis::ReadHedger::work() {
+    for (;;) {
+        Task task(NULL, NULL, false);
+        {
+            const Lock lock(m_mutex);
+            ++m_idle;
+            while (m_queue.empty() && !m_shutdown) {
+                m_queued->wait(m_mutex.get());
+            }
+            // the tasks still queued are performed before stopping
+            if (m_queue.empty()) return;
+            task = m_queue.front();
+            m_queue.pop_front();
+        }
+        run(task);
+    }
+}
+
+void spredis::ReadHedger::run(const Task& task) {
+    Race& race = *task.race;
+
+    int version = 0;
+    std::string value;
+    time_t expiration = 0;
+    std::exception_ptr error;
+    try {
+        std::string* const outValue = race.wantValue ? &value : NULL;
+        time_t* const outExpiration = race.wantExpiration ? &expiration : NULL;
+        version = race.versioned ? task.pool->getVersioned(race.id, outValue, outExpiration, race.minVersion)
+                                 : task.pool->forceGet(race.id, outValue, outExpiration);
+    } catch (...) {
+        error = std::current_exception();
+    }
+
+    {
+        const std::lock_guard<std::mutex> lock(race.mutex);
+        --race.running;
+        if (!race.answered) {
+            if (!error) {
+                race.answered = true;
+                race.fromHedge = task.hedge;
+                race.version = version;
+                race.value.swap(value);
+                race.expiration = expiration;
+            } else if (!race.error) {
+                race.error = error;
+            }
+        }
+        race.done.notify_all();
+    }
+    release(task.race);
+}
+
+void spredis::ReadHedger::release(Race* const race) {
+    bool last;
+    {
+        const std::lock_guard<std::mutex> lock(race->mutex);
+        last = --race->refs == 0;
+    }
+    if (last) delete race;
+}
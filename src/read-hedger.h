@@ -0,0 +1,134 @@
+/**
+ * Licensed to the University Corporation for Advanced Internet
+ * Development, Inc. (UCAID) under one or more contributor license
+ * agreements. See the NOTICE file distributed with this work for
+ * additional information regarding copyright ownership.
+ *
+ * UCAID licenses this file to you under the Apache License,
+ * Version 2.0 (the "License"); you may not use this file except
+ * in compliance with the License. You may obtain a copy of the
+ * License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+ */
+
+/**
+ * read-hedger.h
+ *
+ * Provides the ReadHedger class, which sends a read to a second Redis server
+ * if the first one is slow to answer, and returns the first answer.
+ */
+
+#ifndef READ_HEDGER_H
+#define READ_HEDGER_H
+
+#include <ctime>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "storage-id.h"
+
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#include <xmltooling/util/Threads.h>
+#include <xmltooling/logging.h>
+
+namespace spredis {
+    class RedisConfig;
+    class RedisConnectionPool;
+
+    /**
+     * Hedges reads over two servers holding the same record: the read is
+     * sent to the first server, and if it has not answered after a delay, to
+     * the second server as well. The first successful answer is returned,
+     * while the slower read goes on in the background, and its answer is
+     * dropped.
+     *
+     * The reads are performed by hedgeWorkers threads, so the caller can stop
+     * waiting for the slower one. A read is not hedged if no thread is free:
+     * it is then performed by the caller, the same as without hedging.
+     */
+    class SHIBSP_HIDDEN ReadHedger SHIBSP_FINAL {
+        MAKE_NONCOPYABLE(ReadHedger);
+
+    public:
+        /**
+         * Whatever keeps the pools read from open, held until both reads are
+         * over.
+         */
+        typedef boost::shared_ptr<const void> keep_alive_type;
+
+        explicit ReadHedger(const RedisConfig& config);
+
+        /**
+         * Waits for the reads in flight, then stops the threads.
+         */
+        ~ReadHedger();
+
+        /**
+         * Reads the record from primary, and from hedge too if primary did
+         * not answer within delay microseconds, the same as getVersioned does,
+         * or as forceGet if not versioned. If both reads fail, the error of
+         * the first one failing is thrown. out_fromHedge tells whether the
+         * answer came from hedge.
+         */
+        int read(RedisConnectionPool* primary,
+                 RedisConnectionPool* hedge,
+                 unsigned long long delay,
+                 const keep_alive_type& keepAlive,
+                 const StorageId& id,
+                 std::string* out_value,
+                 time_t* out_expiration,
+                 bool versioned,
+                 int minVersion,
+                 bool* out_fromHedge);
+
+    private:
+        struct Race;
+
+        struct Task {
+            Task(Race* race, RedisConnectionPool* pool, bool hedge)
+                : race(race),
+                  pool(pool),
+                  hedge(hedge) {
+            }
+
+            Race* race;
+            RedisConnectionPool* pool;
+            bool hedge;
+        };
+
+        /**
+         * Queues the task, and returns true, if a thread is free to perform
+         * it.
+         */
+        bool submit(const Task& task);
+
+        static void* workerMain(void* self);
+
+        void work();
+
+        static void run(const Task& task);
+
+        static void release(Race* race);
+
+        xmltooling::logging::Category& m_logger;
+        boost::scoped_ptr<xmltooling::Mutex> m_mutex;
+        boost::scoped_ptr<xmltooling::CondWait> m_queued;
+        std::deque<Task> m_queue;
+        // the threads waiting for a task, less the tasks queued for them
+        unsigned int m_idle;
+        bool m_shutdown;
+        std::vector<xmltooling::Thread*> m_threads;
+    };
+}
+
+#endif //READ_HEDGER_H
@@ -40,9 +40,14 @@ namespace spredis {
         //       SO file because then the RTTI wouldn't be available to properly
         //       catch it
     public:
-        RedirectedException(const std::string& to_host, const unsigned int to_port)
+        RedirectedException(const std::string& to_host,
+                            const unsigned int to_port,
+                            const unsigned int slot,
+                            const bool asking)
             : to_host(to_host),
-              to_port(to_port) {
+              to_port(to_port),
+              slot(slot),
+              asking(asking) {
         }
 
         const char* what() const SHIBSP_NOEXCEPT {
@@ -53,6 +58,16 @@ namespace spredis {
 
         const std::string to_host;
         const unsigned int to_port;
+        /**
+         * The hash-slot of the key of the redirected operation.
+         */
+        const unsigned int slot;
+        /**
+         * Whether the redirection is an ASK: a one-shot redirection while the
+         * slot is migrated to the target, which does not change the owner of
+         * the slot, as opposed to MOVED.
+         */
+        const bool asking;
     };
 }
 
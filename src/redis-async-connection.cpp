@@ -0,0 +1,390 @@
+/**
+ * Licensed to the University Corporation for Advanced Internet
+ * Development, Inc. (UCAID) under one or more contributor license
+ * agreements. See the NOTICE file distributed with this work for
+ * additional information regarding copyright ownership.
+ *
+ * UCAID licenses this file to you under the Apache License,
+ * Version 2.0 (the "License"); you may not use this file except
+ * in compliance with the License. You may obtain a copy of the
+ * License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+ */
+
+/**
+ * redis-async-connection.cpp
+ *
+ * Implementation of the RedisAsyncConnection type.
+ */
+
+#include "redis-async-connection.h"
+
+#ifdef SPREDIS_HAVE_ASYNC_ENGINE
+#include "connection-lost-exception.h"
+#include "redis-command-group.h"
+#include "redis-tls-context.h"
+
+#include <poll.h>
+
+using namespace xmltooling;
+
+namespace {
+    std::string errorOf(const redisAsyncContext* const ac, const char* const fallback) {
+        if (ac == NULL || ac->c.err == 0) return std::string("RedisAsyncConnection: ") + fallback;
+        return std::string("RedisAsyncConnection: ") + ac->c.errstr;
+    }
+}
+
+/**
+ * A command group handed to the loop, and the caller waiting for its
+ * replies. Requests live on the stack of the caller, which waits until the
+ * loop called reply once for every command of the group.
+ */
+class spredis::RedisAsyncConnection::Request SHIBSP_FINAL {
+    MAKE_NONCOPYABLE(Request);
+
+public:
+    explicit Request(RedisCommandGroup& group)
+        : m_group(group),
+          m_mutex(Mutex::create()),
+          m_done(CondWait::create()),
+          m_pending(group.commandCount()),
+          m_error() {
+    }
+
+    const RedisCommandGroup& group() const { return m_group; }
+
+    /**
+     * Hands the next reply of the group to the caller, or marks the group as
+     * failed if reply is NULL. Once every reply was handed over, the request
+     * is done and may be gone.
+     */
+    void reply(void* const reply, const redisAsyncContext* const ac) {
+        const Lock lock(m_mutex);
+        if (m_error) {
+            // the replies after a failure are not needed anymore
+            if (reply) RedisReplyArena::freeReply(reply);
+        } else if (reply == NULL) {
+            m_error = std::make_exception_ptr(ConnectionLostException(errorOf(ac, "connection lost")));
+        } else {
+            try {
+                m_group.addReply(reply);
+            } catch (...) {
+                m_error = std::current_exception();
+            }
+        }
+        settleUnguarded(1);
+    }
+
+    /**
+     * Fails the commands of the group which could not be sent.
+     */
+    void fail(const size_t unsent, const std::string& error) {
+        const Lock lock(m_mutex);
+        if (!m_error) m_error = std::make_exception_ptr(ConnectionLostException(error));
+        settleUnguarded(unsent);
+    }
+
+    void wait() {
+        const Lock lock(m_mutex);
+        while (m_pending > 0) {
+            m_done->wait(m_mutex.get());
+        }
+    }
+
+private:
+    void settleUnguarded(const size_t replies) {
+        m_pending -= replies;
+        if (m_pending > 0) return;
+        if (m_error) m_group.fail(m_error);
+        m_group.complete();
+        m_done->signal();
+    }
+
+    RedisCommandGroup& m_group;
+    boost::scoped_ptr<Mutex> m_mutex;
+    boost::scoped_ptr<CondWait> m_done;
+    size_t m_pending;
+    std::exception_ptr m_error;
+};
+
+spredis::RedisAsyncConnection::RedisAsyncConnection(const RedisConfig& config,
+                                                    const std::string& host,
+                                                    const int port)
+    : m_engine(config.asyncEngine()),
+      m_loop(m_engine->assign()),
+      m_host(host),
+      m_port(port),
+      m_socket_path(config.socketPath),
+      m_socket_options(config),
+      m_authn_username(config.authnUsername),
+      m_authn_password(config.authnPassword),
+      m_read_only(config.clustered() && config.readFrom != RedisConfig::READ_MASTER),
+      m_connect_timeout(),
+      m_command_timeout(),
+      m_has_connect_timeout(config.connectTimeoutMillisec != 0),
+      m_has_command_timeout(config.commandTimeoutMillisec != 0),
+#ifdef SHIBSP_HAVE_HIREDIS_SSL
+      m_tls(config.tls.context()),
+#endif
+      m_logger(logging::Category::getInstance("XMLTooling.StorageService.REDIS")),
+      m_mutex(Mutex::create()),
+      m_closed_signal(CondWait::create()),
+      m_submitted(),
+      m_closing(false),
+      m_closed(false),
+      m_ac(NULL),
+      m_want_read(false),
+      m_want_write(false),
+      m_timer_set(false),
+      m_timer_due(),
+      m_reply_arena(),
+      m_next_posted(NULL),
+      m_posted(false) {
+    m_connect_timeout.tv_sec = config.connectTimeoutMillisec / 1000;
+    m_connect_timeout.tv_usec = config.connectTimeoutMillisec % 1000 * 1000;
+    m_command_timeout.tv_sec = config.commandTimeoutMillisec / 1000;
+    m_command_timeout.tv_usec = config.commandTimeoutMillisec % 1000 * 1000;
+}
+
+spredis::RedisAsyncConnection::~RedisAsyncConnection() {
+    {
+        const Lock lock(m_mutex);
+        m_closing = true;
+    }
+    m_loop.post(this);
+
+    const Lock lock(m_mutex);
+    while (!m_closed) {
+        m_closed_signal->wait(m_mutex.get());
+    }
+}
+
+void spredis::RedisAsyncConnection::execute(RedisCommandGroup& command) {
+    if (command.commandCount() == 0) {
+        command.complete();
+        return;
+    }
+
+    Request request(command);
+    {
+        const Lock lock(m_mutex);
+        m_submitted.push_back(&request);
+    }
+    m_loop.post(this);
+
+    request.wait();
+    command.rethrowIfFailed();
+}
+
+void spredis::RedisAsyncConnection::service() {
+    std::deque<Request*> submitted;
+    bool closing = false;
+    {
+        const Lock lock(m_mutex);
+        submitted.swap(m_submitted);
+        closing = m_closing;
+    }
+
+    if (closing) {
+        // fails whatever is still in flight; cleanup detaches from the loop
+        if (m_ac) redisAsyncFree(m_ac);
+        for (size_t i = 0; i < submitted.size(); ++i) {
+            submitted[i]->fail(submitted[i]->group().commandCount(), "RedisAsyncConnection: connection closed");
+        }
+
+        const Lock lock(m_mutex);
+        m_closed = true;
+        m_closed_signal->broadcast();
+        return;
+    }
+
+    if (submitted.empty()) return;
+    if (m_ac == NULL) open();
+    for (size_t i = 0; i < submitted.size(); ++i) {
+        send(submitted[i]);
+    }
+}
+
+void spredis::RedisAsyncConnection::open() {
+    redisOptions opt{};
+    if (!m_socket_path.empty()) REDIS_OPTIONS_SET_UNIX(&opt, m_socket_path.c_str());
+    else REDIS_OPTIONS_SET_TCP(&opt, m_host.c_str(), m_port);
+    if (m_has_connect_timeout) opt.connect_timeout = &m_connect_timeout;
+    if (m_has_command_timeout) opt.command_timeout = &m_command_timeout;
+    // replies are handed over to the groups, instead of being freed once
+    // their callback returns
+    opt.options |= REDIS_OPT_NOAUTOFREEREPLIES;
+
+    if (!m_socket_path.empty())
+        m_logger.info("connecting asynchronously to Redis at unix socket %s", m_socket_path.c_str());
+    else
+        m_logger.info("connecting asynchronously to Redis at %s:%d", m_host.c_str(), m_port);
+    redisAsyncContext* const ac = redisAsyncConnectWithOptions(&opt);
+    if (ac == NULL) {
+        m_logger.error("!alloc: redis async");
+        return;
+    }
+    if (ac->err) {
+        m_logger.error("error initializing asynchronous Redis connection to %s:%d: %s",
+                       m_host.c_str(), m_port, ac->errstr);
+        redisAsyncFree(ac);
+        return;
+    }
+
+    m_reply_arena.install(ac->c.reader);
+    m_socket_options.apply(&ac->c, m_logger);
+    ac->data = this;
+    ac->ev.data = this;
+    ac->ev.addRead = &RedisAsyncConnection::addRead;
+    ac->ev.delRead = &RedisAsyncConnection::delRead;
+    ac->ev.addWrite = &RedisAsyncConnection::addWrite;
+    ac->ev.delWrite = &RedisAsyncConnection::delWrite;
+    ac->ev.cleanup = &RedisAsyncConnection::cleanup;
+    ac->ev.scheduleTimer = &RedisAsyncConnection::scheduleTimer;
+    redisAsyncSetConnectCallback(ac, &RedisAsyncConnection::onConnect);
+    redisAsyncSetDisconnectCallback(ac, &RedisAsyncConnection::onDisconnect);
+    m_ac = ac;
+    m_loop.attach(this);
+
+    // the handshake is driven by the loop from here on
+#ifdef SHIBSP_HAVE_HIREDIS_SSL
+    if (m_tls && m_tls->handshake(&ac->c, m_host, m_port) != REDIS_OK) {
+        m_logger.error("TLS error during handshake with host %s:%d: %s",
+                       m_host.c_str(), m_port, ac->c.errstr);
+        redisAsyncFree(ac);
+        return;
+    }
+#endif
+
+    sendSetupCommands();
+}
+
+void spredis::RedisAsyncConnection::sendSetupCommands() {
+    // these are sent before any group, so nothing runs unauthenticated
+    if (!m_authn_password.empty()) {
+        if (m_authn_username.empty()) {
+            redisAsyncCommand(m_ac, &RedisAsyncConnection::onSetupReply, const_cast<char*>("AUTH"),
+                              "AUTH %s", m_authn_password.c_str());
+        } else {
+            redisAsyncCommand(m_ac, &RedisAsyncConnection::onSetupReply, const_cast<char*>("AUTH"),
+                              "AUTH %s %s", m_authn_username.c_str(), m_authn_password.c_str());
+        }
+    }
+    if (m_read_only)
+        redisAsyncCommand(m_ac, &RedisAsyncConnection::onSetupReply, const_cast<char*>("READONLY"), "READONLY");
+}
+
+void spredis::RedisAsyncConnection::send(Request* const request) {
+    const RedisCommandGroup& group = request->group();
+    const size_t count = group.commandCount();
+
+    // the request may be done as soon as its last command failed
+    for (size_t i = 0; i < count; ++i) {
+        size_t length = 0;
+        const char* const command = group.command(i, &length);
+        if (m_ac == NULL) {
+            request->fail(count - i, "RedisAsyncConnection: cannot connect to " + m_host);
+            return;
+        }
+        if (redisAsyncFormattedCommand(m_ac, &RedisAsyncConnection::onReply, request, command, length) != REDIS_OK) {
+            request->fail(count - i, errorOf(m_ac, "connection is closing"));
+            return;
+        }
+    }
+}
+
+short spredis::RedisAsyncConnection::events() const {
+    if (m_ac == NULL) return 0;
+    return static_cast<short>((m_want_read ? POLLIN : 0) | (m_want_write ? POLLOUT : 0));
+}
+
+void spredis::RedisAsyncConnection::handleEvents(const short revents) {
+    // errors are reported by hiredis when it tries to use the socket
+    const bool failed = (revents & (POLLERR | POLLHUP | POLLNVAL)) != 0;
+    if (m_ac && m_want_read && ((revents & POLLIN) || failed)) redisAsyncHandleRead(m_ac);
+    if (m_ac && m_want_write && ((revents & POLLOUT) || failed)) redisAsyncHandleWrite(m_ac);
+}
+
+void spredis::RedisAsyncConnection::handleTimer() {
+    m_timer_set = false;
+    if (m_ac) redisAsyncHandleTimeout(m_ac);
+}
+
+void spredis::RedisAsyncConnection::onReply(redisAsyncContext* const ac, void* const reply, void* const privdata) {
+    static_cast<Request*>(privdata)->reply(reply, ac);
+}
+
+void spredis::RedisAsyncConnection::onSetupReply(redisAsyncContext* const ac, void* const reply, void* const privdata) {
+    const RedisAsyncConnection* const self = static_cast<const RedisAsyncConnection*>(ac->data);
+    const redisReply* const r = static_cast<const redisReply*>(reply);
+    if (r && r->type == REDIS_REPLY_ERROR) {
+        self->m_logger.error("(RedisAsyncConnection) %s failed at host %s:%d: %.*s",
+                             static_cast<const char*>(privdata), self->m_host.c_str(), self->m_port,
+                             static_cast<int>(r->len), r->str);
+    }
+    if (reply) RedisReplyArena::freeReply(reply);
+}
+
+void spredis::RedisAsyncConnection::onConnect(const redisAsyncContext* const ac, const int status) {
+    const RedisAsyncConnection* const self = static_cast<const RedisAsyncConnection*>(ac->data);
+    if (status != REDIS_OK) {
+        self->m_logger.error("cannot connect asynchronously to Redis at %s:%d: %s",
+                             self->m_host.c_str(), self->m_port, ac->c.errstr);
+        return;
+    }
+    self->m_logger.debug("connected asynchronously to Redis at %s:%d", self->m_host.c_str(), self->m_port);
+}
+
+void spredis::RedisAsyncConnection::onDisconnect(const redisAsyncContext* const ac, const int status) {
+    const RedisAsyncConnection* const self = static_cast<const RedisAsyncConnection*>(ac->data);
+    if (status != REDIS_OK) {
+        // opened again when the next group is sent
+        self->m_logger.warn("asynchronous connection to Redis at %s:%d lost: %s",
+                            self->m_host.c_str(), self->m_port, ac->c.errstr);
+        return;
+    }
+    self->m_logger.debug("asynchronous connection to Redis at %s:%d closed", self->m_host.c_str(), self->m_port);
+}
+
+void spredis::RedisAsyncConnection::addRead(void* const privdata) {
+    static_cast<RedisAsyncConnection*>(privdata)->m_want_read = true;
+}
+
+void spredis::RedisAsyncConnection::delRead(void* const privdata) {
+    static_cast<RedisAsyncConnection*>(privdata)->m_want_read = false;
+}
+
+void spredis::RedisAsyncConnection::addWrite(void* const privdata) {
+    static_cast<RedisAsyncConnection*>(privdata)->m_want_write = true;
+}
+
+void spredis::RedisAsyncConnection::delWrite(void* const privdata) {
+    static_cast<RedisAsyncConnection*>(privdata)->m_want_write = false;
+}
+
+void spredis::RedisAsyncConnection::cleanup(void* const privdata) {
+    // the context is being freed by hiredis, after every callback was called
+    RedisAsyncConnection* const self = static_cast<RedisAsyncConnection*>(privdata);
+    self->m_ac = NULL;
+    self->m_want_read = false;
+    self->m_want_write = false;
+    self->m_timer_set = false;
+    self->m_loop.detach(self);
+}
+
+void spredis::RedisAsyncConnection::scheduleTimer(void* const privdata, const struct timeval tv) {
+    RedisAsyncConnection* const self = static_cast<RedisAsyncConnection*>(privdata);
+    self->m_timer_set = true;
+    self->m_timer_due = clock_type::now()
+                        + std::chrono::seconds(tv.tv_sec)
+                        + std::chrono::microseconds(tv.tv_usec);
+}
+#endif
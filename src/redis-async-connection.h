@@ -0,0 +1,184 @@
+/**
+ * Licensed to the University Corporation for Advanced Internet
+ * Development, Inc. (UCAID) under one or more contributor license
+ * agreements. See the NOTICE file distributed with this work for
+ * additional information regarding copyright ownership.
+ *
+ * UCAID licenses this file to you under the Apache License,
+ * Version 2.0 (the "License"); you may not use this file except
+ * in compliance with the License. You may obtain a copy of the
+ * License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+ */
+
+/**
+ * redis-async-connection.h
+ *
+ * Provides the RedisAsyncConnection class, a connection to a Redis server
+ * driven by an event loop, on which any number of command groups may be in
+ * flight at the same time.
+ */
+
+#ifndef REDIS_ASYNC_CONNECTION_H
+#define REDIS_ASYNC_CONNECTION_H
+
+#include <chrono>
+#include <deque>
+#include <string>
+
+#include "common.h"
+#include "redis.h"
+#include "redis-async-engine.h"
+#include "redis-reply-arena.h"
+#include "socket-options.h"
+
+// XXX Win32 - special config headers
+#include "config.h"
+
+#ifdef SPREDIS_HAVE_ASYNC_ENGINE
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#include <hiredis/async.h>
+#include <xmltooling/util/Threads.h>
+#include <xmltooling/logging.h>
+
+namespace spredis {
+    class RedisCommandGroup;
+    class RedisTlsContext;
+
+    /**
+     * A connection using the asynchronous API of hiredis, whose socket is
+     * served by one of the loops of the engine of the configuration.
+     *
+     * Callers hand their command groups to the loop and wait for the replies
+     * without holding the connection: the loop writes the groups of all
+     * callers as they arrive, and hands each group back as soon as its last
+     * reply was read, so groups of concurrent callers are pipelined on the
+     * same socket without waiting for each other.
+     *
+     * The connection is opened lazily by the loop, and opened again after it
+     * was lost, the same as blocking connections reconnect. The command
+     * timeout applies to the connection as a whole: if no reply arrives for
+     * that long while groups are in flight, the connection is dropped and all
+     * of them fail.
+     */
+    class SHIBSP_HIDDEN RedisAsyncConnection SHIBSP_FINAL {
+        MAKE_NONCOPYABLE(RedisAsyncConnection);
+
+    public:
+        RedisAsyncConnection(const RedisConfig& config, const std::string& host, int port);
+
+        /**
+         * Closes the connection on its loop, and waits until the loop is done
+         * with it. No group may be in flight anymore.
+         */
+        ~RedisAsyncConnection();
+
+        /**
+         * Sends the commands of the group and waits for all their replies, or
+         * throws a ConnectionLostException if the connection was lost before.
+         * Thread-safe.
+         */
+        void execute(RedisCommandGroup& command);
+
+    private:
+        friend class RedisAsyncLoop;
+        class Request;
+
+        typedef std::chrono::steady_clock clock_type;
+
+        // used by the loop thread only
+
+        /**
+         * Opens the connection, or closes it, or sends the posted groups, as
+         * requested by the callers.
+         */
+        void service();
+
+        redisAsyncContext* context() const { return m_ac; }
+
+        short events() const;
+
+        void handleEvents(short revents);
+
+        bool timerSet() const { return m_timer_set; }
+
+        clock_type::time_point timerDue() const { return m_timer_due; }
+
+        void handleTimer();
+
+        void open();
+
+        void send(Request* request);
+
+        void sendSetupCommands();
+
+        static void onReply(redisAsyncContext* ac, void* reply, void* privdata);
+
+        static void onSetupReply(redisAsyncContext* ac, void* reply, void* privdata);
+
+        static void onConnect(const redisAsyncContext* ac, int status);
+
+        static void onDisconnect(const redisAsyncContext* ac, int status);
+
+        static void addRead(void* privdata);
+
+        static void delRead(void* privdata);
+
+        static void addWrite(void* privdata);
+
+        static void delWrite(void* privdata);
+
+        static void cleanup(void* privdata);
+
+        static void scheduleTimer(void* privdata, struct timeval tv);
+
+        boost::shared_ptr<RedisAsyncEngine> m_engine;
+        RedisAsyncLoop& m_loop;
+        const std::string m_host;
+        const int m_port;
+        const std::string m_socket_path;
+        const SocketOptions m_socket_options;
+        const std::string m_authn_username;
+        const std::string m_authn_password;
+        const bool m_read_only;
+        struct timeval m_connect_timeout;
+        struct timeval m_command_timeout;
+        const bool m_has_connect_timeout;
+        const bool m_has_command_timeout;
+#ifdef SHIBSP_HAVE_HIREDIS_SSL
+        boost::shared_ptr<RedisTlsContext> m_tls;
+#endif
+        xmltooling::logging::Category& m_logger;
+
+        // shared with the callers, guarded by m_mutex
+        boost::scoped_ptr<xmltooling::Mutex> m_mutex;
+        boost::scoped_ptr<xmltooling::CondWait> m_closed_signal;
+        std::deque<Request*> m_submitted;
+        bool m_closing;
+        bool m_closed;
+
+        // used by the loop thread only
+        redisAsyncContext* m_ac;
+        bool m_want_read;
+        bool m_want_write;
+        bool m_timer_set;
+        clock_type::time_point m_timer_due;
+        RedisReplyArena m_reply_arena;
+
+        // the link of the connection in the posted list of the loop, guarded
+        // by the mutex of the loop
+        RedisAsyncConnection* m_next_posted;
+        bool m_posted;
+    };
+}
+#endif
+
+#endif //REDIS_ASYNC_CONNECTION_H
@@ -0,0 +1,233 @@
+/**
+ * Licensed to the University Corporation for Advanced Internet
+ * Development, Inc. (UCAID) under one or more contributor license
+ * agreements. See the NOTICE file distributed with this work for
+ * additional information regarding copyright ownership.
+ *
+ * UCAID licenses this file to you under the Apache License,
+ * Version 2.0 (the "License"); you may not use this file except
+ * in compliance with the License. You may obtain a copy of the
+ * License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+ */
+
+/**
+ * redis-async-engine.cpp
+ *
+ * Implementation of the RedisAsyncEngine and RedisAsyncLoop types.
+ */
+
+#include "redis-async-engine.h"
+#include "redis-async-connection.h"
+
+#ifdef SPREDIS_HAVE_ASYNC_ENGINE
+#include <algorithm>
+#include <cerrno>
+
+// XXX Win32 - needs WSAPoll and a socket pair
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <xmltooling/exceptions.h>
+
+using namespace xmltooling;
+
+spredis::RedisAsyncLoop::RedisAsyncLoop()
+    : m_logger(logging::Category::getInstance("XMLTooling.StorageService.REDIS")),
+      m_mutex(Mutex::create()),
+      m_posted(NULL),
+      m_shutdown(false),
+      m_servicing(),
+      m_connections(),
+      m_thread() {
+    if (pipe(m_wakeup) != 0)
+        throw XMLToolingException("Cannot create the wakeup pipe of the asynchronous Redis engine");
+    for (int i = 0; i < 2; ++i) {
+        fcntl(m_wakeup[i], F_SETFL, fcntl(m_wakeup[i], F_GETFL) | O_NONBLOCK);
+        fcntl(m_wakeup[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    try {
+        m_thread.reset(Thread::create(&RedisAsyncLoop::loopMain, this));
+    } catch (...) {
+        close(m_wakeup[0]);
+        close(m_wakeup[1]);
+        throw;
+    }
+}
+
+spredis::RedisAsyncLoop::~RedisAsyncLoop() {
+    {
+        const Lock lock(m_mutex);
+        m_shutdown = true;
+    }
+    wake();
+    if (m_thread) m_thread->join(NULL);
+
+    close(m_wakeup[0]);
+    close(m_wakeup[1]);
+}
+
+void spredis::RedisAsyncLoop::post(RedisAsyncConnection* const connection) {
+    {
+        const Lock lock(m_mutex);
+        if (connection->m_posted) return; // the loop did not get to it yet
+        connection->m_posted = true;
+        connection->m_next_posted = m_posted;
+        m_posted = connection;
+    }
+    wake();
+}
+
+void spredis::RedisAsyncLoop::wake() {
+    // a full pipe wakes up the loop just as well
+    const char byte = 0;
+    const ssize_t written = write(m_wakeup[1], &byte, 1);
+    (void) written;
+}
+
+void spredis::RedisAsyncLoop::attach(RedisAsyncConnection* const connection) {
+    m_connections.push_back(connection);
+}
+
+void spredis::RedisAsyncLoop::detach(RedisAsyncConnection* const connection) {
+    const std::vector<RedisAsyncConnection*>::iterator it =
+            std::find(m_connections.begin(), m_connections.end(), connection);
+    if (it == m_connections.end()) return;
+    *it = m_connections.back();
+    m_connections.pop_back();
+}
+
+void* spredis::RedisAsyncLoop::loopMain(void* const self) {
+    static_cast<RedisAsyncLoop*>(self)->run();
+    return NULL;
+}
+
+bool spredis::RedisAsyncLoop::servicePosted() {
+    bool shutdown = false;
+    {
+        const Lock lock(m_mutex);
+        // the links may be reused as soon as the lock is released, so the
+        // list is copied out first
+        for (RedisAsyncConnection* it = m_posted; it != NULL; it = it->m_next_posted) {
+            m_servicing.push_back(it);
+            it->m_posted = false;
+        }
+        m_posted = NULL;
+        shutdown = m_shutdown;
+    }
+
+    // a connection being closed may be destroyed as soon as it was serviced
+    for (size_t i = 0; i < m_servicing.size(); ++i) {
+        m_servicing[i]->service();
+    }
+    m_servicing.clear();
+    return shutdown;
+}
+
+void spredis::RedisAsyncLoop::run() {
+    typedef RedisAsyncConnection::clock_type clock_type;
+
+    std::vector<pollfd> fds;
+    std::vector<RedisAsyncConnection*> polled;
+    std::vector<RedisAsyncConnection*> expired;
+
+    for (;;) {
+        try {
+            if (servicePosted()) return;
+
+            fds.clear();
+            polled.clear();
+
+            const pollfd wakeup = {m_wakeup[0], POLLIN, 0};
+            fds.push_back(wakeup);
+
+            // the timeout of poll is that of the earliest timer of hiredis
+            int timeout = -1;
+            clock_type::time_point now = clock_type::now();
+            for (size_t i = 0; i < m_connections.size(); ++i) {
+                RedisAsyncConnection* const connection = m_connections[i];
+                if (connection->timerSet()) {
+                    const long long left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                        connection->timerDue() - now).count() + 1;
+                    const int clamped = static_cast<int>(std::max(0LL, std::min(left, 60000LL)));
+                    if (timeout < 0 || clamped < timeout) timeout = clamped;
+                }
+
+                const short events = connection->events();
+                if (events == 0) continue;
+                const pollfd fd = {connection->context()->c.fd, events, 0};
+                fds.push_back(fd);
+                polled.push_back(connection);
+            }
+
+            if (poll(&fds[0], static_cast<nfds_t>(fds.size()), timeout) < 0) {
+                if (errno != EINTR) m_logger.error("(RedisAsyncLoop) poll failed: errno %d", errno);
+                continue;
+            }
+
+            if (fds[0].revents != 0) {
+                char buffer[64];
+                while (read(m_wakeup[0], buffer, sizeof(buffer)) > 0) {
+                }
+            }
+
+            // handling events may free the context of the connection, but
+            // never the connection itself
+            for (size_t i = 0; i < polled.size(); ++i) {
+                if (fds[i + 1].revents != 0 && polled[i]->context() != NULL)
+                    polled[i]->handleEvents(fds[i + 1].revents);
+            }
+
+            now = clock_type::now();
+            expired.clear();
+            for (size_t i = 0; i < m_connections.size(); ++i) {
+                if (m_connections[i]->timerSet() && m_connections[i]->timerDue() <= now)
+                    expired.push_back(m_connections[i]);
+            }
+            for (size_t i = 0; i < expired.size(); ++i) {
+                expired[i]->handleTimer();
+            }
+        } catch (const std::exception& e) {
+            // nothing thrown on this thread may terminate it, or every caller
+            // waiting for its connections would wait forever
+            m_logger.error("(RedisAsyncLoop) error in event loop: %s", e.what());
+        }
+    }
+}
+
+spredis::RedisAsyncEngine::RedisAsyncEngine(const unsigned int threads)
+    : m_loops(),
+      m_next(0) {
+    try {
+        for (unsigned int i = 0; i < std::max(1U, threads); ++i) {
+            m_loops.push_back(NULL);
+            m_loops.back() = new RedisAsyncLoop();
+        }
+    } catch (...) {
+        for (size_t i = 0; i < m_loops.size(); ++i) {
+            delete m_loops[i];
+        }
+        throw;
+    }
+}
+
+spredis::RedisAsyncEngine::~RedisAsyncEngine() {
+    for (size_t i = 0; i < m_loops.size(); ++i) {
+        delete m_loops[i];
+    }
+}
+
+spredis::RedisAsyncLoop& spredis::RedisAsyncEngine::assign() {
+    const unsigned int next = m_next.fetch_add(1, boost::memory_order_relaxed);
+    return *m_loops[next % m_loops.size()];
+}
+#endif
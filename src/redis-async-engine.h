@@ -0,0 +1,134 @@
+/**
+ * Licensed to the University Corporation for Advanced Internet
+ * Development, Inc. (UCAID) under one or more contributor license
+ * agreements. See the NOTICE file distributed with this work for
+ * additional information regarding copyright ownership.
+ *
+ * UCAID licenses this file to you under the Apache License,
+ * Version 2.0 (the "License"); you may not use this file except
+ * in compliance with the License. You may obtain a copy of the
+ * License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+ */
+
+/**
+ * redis-async-engine.h
+ *
+ * Provides the RedisAsyncEngine and RedisAsyncLoop classes, the I/O threads
+ * running the event loops of the asynchronous connections.
+ */
+
+#ifndef REDIS_ASYNC_ENGINE_H
+#define REDIS_ASYNC_ENGINE_H
+
+#include <vector>
+
+#include "common.h"
+#include <hiredis/hiredis.h>
+
+#include <boost/atomic.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <xmltooling/util/Threads.h>
+#include <xmltooling/logging.h>
+
+// the asynchronous engine relies on taking the ownership of replies from
+// hiredis, which is only possible with hiredis 1.1.0 and above
+#if HIREDIS_MAJOR >= 1 && defined(REDIS_OPT_NOAUTOFREEREPLIES)
+#define SPREDIS_HAVE_ASYNC_ENGINE
+#endif
+
+namespace spredis {
+    class RedisAsyncConnection;
+
+    /**
+     * A thread running an event loop over the sockets of the asynchronous
+     * connections assigned to it. The hiredis contexts of these connections
+     * are only ever used from this thread; other threads hand their work to
+     * the loop by posting the connection, which the loop then services on its
+     * next iteration.
+     */
+    class SHIBSP_HIDDEN RedisAsyncLoop SHIBSP_FINAL {
+        MAKE_NONCOPYABLE(RedisAsyncLoop);
+
+    public:
+        RedisAsyncLoop();
+
+        /**
+         * Stops the loop and waits for its thread to exit. All connections of
+         * the loop must have been closed already.
+         */
+        ~RedisAsyncLoop();
+
+        /**
+         * Makes the loop service the connection on its next iteration, waking
+         * it up if it is waiting for I/O. Thread-safe.
+         */
+        void post(RedisAsyncConnection* connection);
+
+    private:
+        friend class RedisAsyncConnection;
+
+        static void* loopMain(void* self);
+
+        void run();
+
+        void wake();
+
+        /**
+         * Adds the connection to the ones polled by the loop once its context
+         * is open, and removes it again once the context is freed.
+         */
+        void attach(RedisAsyncConnection* connection);
+
+        void detach(RedisAsyncConnection* connection);
+
+        /**
+         * Services the posted connections; returns whether the loop is
+         * shutting down.
+         */
+        bool servicePosted();
+
+        // the read and write ends of the pipe used to wake up the loop
+        // XXX Win32 - needs a socket pair instead
+        int m_wakeup[2];
+        xmltooling::logging::Category& m_logger;
+        boost::scoped_ptr<xmltooling::Mutex> m_mutex;
+        // intrusive list of the posted connections, guarded by m_mutex
+        RedisAsyncConnection* m_posted;
+        bool m_shutdown;
+        // the posted connections being serviced, only used by the loop thread
+        std::vector<RedisAsyncConnection*> m_servicing;
+        // the connections with an open context, only used by the loop thread
+        std::vector<RedisAsyncConnection*> m_connections;
+        boost::scoped_ptr<xmltooling::Thread> m_thread;
+    };
+
+    /**
+     * The set of event loops shared by all asynchronous connections made with
+     * the same configuration. Connections are assigned to loops round-robin
+     * when they are created.
+     */
+    class SHIBSP_HIDDEN RedisAsyncEngine SHIBSP_FINAL {
+        MAKE_NONCOPYABLE(RedisAsyncEngine);
+
+    public:
+        explicit RedisAsyncEngine(unsigned int threads);
+
+        ~RedisAsyncEngine();
+
+        RedisAsyncLoop& assign();
+
+    private:
+        std::vector<RedisAsyncLoop*> m_loops;
+        boost::atomic<unsigned int> m_next;
+    };
+}
+
+#endif //REDIS_ASYNC_ENGINE_H
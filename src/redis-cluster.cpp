@@ -26,276 +26,741 @@
  */
 
 #include <algorithm>
+#include <chrono>
 
 #include "redis-cluster.h"
+#include "cluster-topology-snapshot.h"
+#include "parallel-scan.h"
 #include "redirected-exception.h"
 
 #include <boost/lambda/core.hpp>
 #include <boost/lambda/detail/bind_functions.hpp>
 #include <boost/lambda/detail/lambda_functor_base.hpp>
+#include <boost/smart_ptr/shared_ptr.hpp>
 
 using namespace xmltooling;
 using namespace boost;
 
 namespace {
     /**
-     * A lock for getting write ownership of a shared mutex (RWLock). Not usable
-     * in a general sense, as only supports our required use-case.
-     *
-     * The built-in locks only support SharedLock and the default Lock does
-     * not support uniquely locking a shared mutex...
+     * The most threads probing nodes, or connecting to them, at the same
+     * time while exploring the topology.
      */
-    class UniqueLock {
-        MAKE_NONCOPYABLE(UniqueLock);
-
-    public:
-        explicit UniqueLock(const scoped_ptr<RWLock>& shared) : shared_mutex(shared.get()) {
-            if (shared_mutex) shared_mutex->wrlock();
-        }
-
-        ~UniqueLock() {
-            if (shared_mutex) shared_mutex->unlock();
-        }
-
-    private:
-        RWLock* shared_mutex;
-    };
+    const size_t maxParallelProbes = 8;
 }
 
 spredis::RedisCluster::RedisCluster(const RedisConfig& config)
-    : Redis(config.prefix),
-      m_shared_mutex(RWLock::create()),
+    : Redis(config.prefix, config.hashTag, config.hashTagBuckets),
+      m_connection_mutex(Mutex::create()),
       m_connection_map(),
-      m_cluster_map(),
+      m_slot_table(new ClusterSlotTable()),
+      m_publish_mutex(Mutex::create()),
+      m_published(CondWait::create()),
       m_config(config),
       m_logger(log4shib::Category::getInstance("XMLTooling.StorageService.REDIS")),
-      m_force_refresh_cluster_map(false) {
-    UniqueLock ulock(m_shared_mutex);
+      m_retry_policy(config),
+      m_refresh_mutex(Mutex::create()),
+      m_refresh_wanted(CondWait::create()),
+      m_refresh_requested(false),
+      m_shutdown(false),
+      m_refresher(),
+      m_hedger(),
+      m_probe() {
+    if (m_config.readFrom != RedisConfig::READ_MASTER && m_config.hedgePercentile > 0)
+        m_hedger.reset(new ReadHedger(m_config));
+
+    // a saved topology lets operations start right away, the actual one is
+    // explored in the background
+    if (!m_config.topologySnapshot.empty() && restoreTopology()) {
+        m_refresher.reset(Thread::create(&RedisCluster::refresherMain, this));
+        requestRefresh();
+        return;
+    }
 
-    for (size_t i = 0; i < config.initialNodes.size(); ++i) {
-        const ClusterNode& node = config.initialNodes[i];
-        try {
-            // throwaway connection: this cannot be cached, because it is not in
-            // the correct node storage (m_cluster_map) so it will never be hit
-            // anyways, just wasting the cache space
-            const scoped_ptr<RedisConnection> conn(node.connect(config));
-            conn->iterateSlots(CacheSetter(this));
-            break;
-        } catch (const std::exception& ex) {
-            m_logger.error("error occured during initial cluster configuration from %s:%u -- skipping node: %s",
-                           node.host().c_str(), node.port(), ex.what());
-        } catch (...) {
-            m_logger.error("unknown error occured during initial cluster configuration from %s:%u -- skipping node",
-                           node.host().c_str(), node.port());
-        }
+    try {
+        refreshTopology();
+    } catch (const std::exception& ex) {
+        // operations will request a refresh, which keeps on trying the
+        // configured nodes once they become available
+        m_logger.error("cannot explore initial Redis cluster topology: %s", ex.what());
     }
+
+    m_refresher.reset(Thread::create(&RedisCluster::refresherMain, this));
 }
 
-void spredis::RedisCluster::rebuildRangeMappingUniqueLocked() {
-    UniqueLock ulock(m_shared_mutex);
-    resetSlotsCacheUnguarded();
+spredis::RedisCluster::~RedisCluster() {
+    {
+        const Lock lock(m_refresh_mutex);
+        m_shutdown = true;
+        m_refresh_wanted->signal();
+    }
+    if (m_refresher) m_refresher->join(NULL);
+    m_probe.reset();
 }
 
 bool spredis::RedisCluster::set(const StorageId& id, const char* value, time_t expiration) {
     // XXX boost::lambda should be replaced with C++11 lambda when possible
     using namespace boost::lambda;
-    return wrappedCall<bool>(id, bind(&RedisConnection::set, _1, id, value, expiration));
+    return wrappedCall<bool>(id, boost::lambda::bind(&Redis::set, _1, id, value, expiration));
 }
 
 int spredis::RedisCluster::getVersioned(const StorageId& id, std::string* out_value, time_t* out_expiration,
                                         const int minVersion) {
     // XXX boost::lambda should be replaced with C++11 lambda when possible
     using namespace boost::lambda;
-    return wrappedCall<int>(id, bind(&RedisConnection::getVersioned, _1, id, out_value, out_expiration, minVersion));
+    if (m_config.readFrom == RedisConfig::READ_MASTER)
+        return wrappedCall<int>(id, boost::lambda::bind(&Redis::getVersioned, _1, id, out_value, out_expiration, minVersion));
+
+    bool fromReplica = false;
+    const int version = m_hedger
+                        ? wrappedCall<int>(id, boost::lambda::bind(&RedisCluster::hedgedRead, this, _1, id, out_value,
+                                                                   out_expiration, true, minVersion),
+                                           &fromReplica)
+                        : wrappedCall<int>(id, boost::lambda::bind(&Redis::getVersioned, _1, id, out_value,
+                                                                   out_expiration, minVersion),
+                                           &fromReplica);
+    // the caller already knows of minVersion: anything older read from a
+    // replica is only lagging behind, so the master is asked instead
+    if (!fromReplica || version >= minVersion) return version;
+
+    m_logger.debug("replica is lagging behind for version %d of " SPREDIS_SID_LFMT ": reading from master",
+                   minVersion, SPREDIS_SID_LPARAM(id));
+    return wrappedCall<int>(id, boost::lambda::bind(&Redis::getVersioned, _1, id, out_value, out_expiration, minVersion));
 }
 
 int spredis::RedisCluster::forceGet(const StorageId& id, std::string* out_value, time_t* out_expiration) {
     // XXX boost::lambda should be replaced with C++11 lambda when possible
     using namespace boost::lambda;
-    return wrappedCall<int>(id, bind(&RedisConnection::forceGet, _1, id, out_value, out_expiration));
+    if (m_config.readFrom == RedisConfig::READ_MASTER)
+        return wrappedCall<int>(id, boost::lambda::bind(&Redis::forceGet, _1, id, out_value, out_expiration));
+
+    bool fromReplica = false;
+    const int version = m_hedger
+                        ? wrappedCall<int>(id, boost::lambda::bind(&RedisCluster::hedgedRead, this, _1, id, out_value,
+                                                                   out_expiration, false, 0),
+                                           &fromReplica)
+                        : wrappedCall<int>(id, boost::lambda::bind(&Redis::forceGet, _1, id, out_value, out_expiration),
+                                           &fromReplica);
+    // a record just created may not have reached the replica yet: a missing
+    // record is only reported as such by the master
+    if (!fromReplica || version != 0) return version;
+
+    return wrappedCall<int>(id, boost::lambda::bind(&Redis::forceGet, _1, id, out_value, out_expiration));
 }
 
 int spredis::RedisCluster::updateVersioned(const StorageId& id, const char* value, time_t expiration, int ifVersion) {
     // XXX boost::lambda should be replaced with C++11 lambda when possible
     using namespace boost::lambda;
-    return wrappedCall<int>(id, bind(&RedisConnection::updateVersioned, _1, id, value, expiration, ifVersion));
+    return wrappedCall<int>(id, boost::lambda::bind(&Redis::updateVersioned, _1, id, value, expiration, ifVersion));
 }
 
 int spredis::RedisCluster::forceUpdate(const StorageId& id, const char* value, time_t expiration) {
     // XXX boost::lambda should be replaced with C++11 lambda when possible
     using namespace boost::lambda;
-    return wrappedCall<int>(id, bind(&RedisConnection::forceUpdate, _1, id, value, expiration));
+    return wrappedCall<int>(id, boost::lambda::bind(&Redis::forceUpdate, _1, id, value, expiration));
 }
 
 bool spredis::RedisCluster::remove(const StorageId& id) {
     // XXX boost::lambda should be replaced with C++11 lambda when possible
     using namespace boost::lambda;
-    return wrappedCall<bool>(id, bind(&RedisConnection::remove, _1, id));
+    return wrappedCall<bool>(id, boost::lambda::bind(&Redis::remove, _1, id));
+}
+
+void spredis::RedisCluster::indexRecord(const StorageId& id, const time_t expiration) {
+    // XXX boost::lambda should be replaced with C++11 lambda when possible
+    using namespace boost::lambda;
+    wrappedCall<void>(id.contextIndex(), boost::lambda::bind(&Redis::indexRecord, _1, id, expiration));
+}
+
+void spredis::RedisCluster::unindexRecord(const StorageId& id) {
+    // XXX boost::lambda should be replaced with C++11 lambda when possible
+    using namespace boost::lambda;
+    wrappedCall<void>(id.contextIndex(), boost::lambda::bind(&Redis::unindexRecord, _1, id));
+}
+
+void spredis::RedisCluster::expireContextIndex(const char* context, const time_t expiration) {
+    // XXX boost::lambda should be replaced with C++11 lambda when possible
+    using namespace boost::lambda;
+    wrappedCall<void>(make_index_id(context),
+                      boost::lambda::bind(&Redis::expireContextIndex, _1, context, expiration));
+}
+
+void spredis::RedisCluster::deleteContextIndex(const char* context) {
+    // XXX boost::lambda should be replaced with C++11 lambda when possible
+    using namespace boost::lambda;
+    wrappedCall<void>(make_index_id(context),
+                      boost::lambda::bind(&Redis::deleteContextIndex, _1, context));
+}
+
+unsigned long long spredis::RedisCluster::scanContextIndexPage(const char* context,
+                                                               const unsigned long long cursor,
+                                                               std::vector<std::string>* out_members) {
+    // XXX boost::lambda should be replaced with C++11 lambda when possible
+    using namespace boost::lambda;
+    return wrappedCall<unsigned long long>(
+        make_index_id(context), boost::lambda::bind(&Redis::scanContextIndexPage, _1, context, cursor, out_members));
+}
+
+long long spredis::RedisCluster::touchContextEpoch(const char* context, const time_t keepUntil) {
+    // XXX boost::lambda should be replaced with C++11 lambda when possible
+    using namespace boost::lambda;
+    return wrappedCall<long long>(make_index_id(context),
+                                  boost::lambda::bind(&Redis::touchContextEpoch, _1, context, keepUntil));
+}
+
+bool spredis::RedisCluster::readContextEpoch(const char* context, ContextEpoch* out_epoch) {
+    // XXX boost::lambda should be replaced with C++11 lambda when possible
+    using namespace boost::lambda;
+    return wrappedCall<bool>(make_index_id(context),
+                             boost::lambda::bind(&Redis::readContextEpoch, _1, context, out_epoch));
+}
+
+long long spredis::RedisCluster::expireContextEpoch(const char* context, const time_t expiration,
+                                                    const time_t keepUntil, time_t* out_horizon) {
+    // XXX boost::lambda should be replaced with C++11 lambda when possible
+    using namespace boost::lambda;
+    return wrappedCall<long long>(
+        make_index_id(context),
+        boost::lambda::bind(&Redis::expireContextEpoch, _1, context, expiration, keepUntil, out_horizon));
+}
+
+long long spredis::RedisCluster::deleteContextEpoch(const char* context) {
+    // XXX boost::lambda should be replaced with C++11 lambda when possible
+    using namespace boost::lambda;
+    return wrappedCall<long long>(make_index_id(context),
+                                  boost::lambda::bind(&Redis::deleteContextEpoch, _1, context));
+}
+
+void spredis::RedisCluster::raiseContextEpochHorizon(const char* context, const long long generation,
+                                                     const time_t horizon) {
+    // XXX boost::lambda should be replaced with C++11 lambda when possible
+    using namespace boost::lambda;
+    wrappedCall<void>(make_index_id(context),
+                      boost::lambda::bind(&Redis::raiseContextEpochHorizon, _1, context, generation, horizon));
+}
+
+std::vector<spredis::ClusterNode> spredis::RedisCluster::endpoints() const {
+    // the nodes of the routing snapshot are exactly the masters serving slots
+    return currentSlotTable()->nodes();
 }
 
 size_t spredis::RedisCluster::scanContextTypeless(const char* context,
                                                   RawCallbackType callback,
                                                   void* callbackContext) {
-    const SharedLock slock(m_shared_mutex);
+    // every master is scanned exactly once, however many slot ranges it
+    // serves; the snapshot keeps the pools open until all scans are done
+    const slot_table_ptr slots = currentSlotTable();
+    std::vector<ClusterNode> nodes;
+    if (!m_config.contextsSlotted()) nodes = slots->nodes();
+    else {
+        // only the masters serving the hash-slots of the context store its
+        // records
+        const std::vector<unsigned> contextSlots = make_id(context, "").contextSlotsUsing<hash_type>();
+        for (size_t i = 0; i < contextSlots.size(); ++i) {
+            const ClusterNode* const node = slots->nodeForSlot(contextSlots[i]);
+            if (node == NULL)
+                throw ConnectionLostException("Redis cluster has no known node for the hash-slot of the context");
+            if (std::find(nodes.begin(), nodes.end(), *node) == nodes.end()) nodes.push_back(*node);
+        }
+    }
+    std::vector<pool_ptr> pools;
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        pools.push_back(dispatchConnection(nodes[i]));
+    }
+
+    std::vector<RedisConnectionPool*> targets;
+    for (size_t i = 0; i < pools.size(); ++i) {
+        targets.push_back(pools[i].get());
+    }
+    ParallelScan(context, callback, callbackContext, nodes, targets, m_logger).run(m_config.scanWorkers);
+    return 0U;
+}
 
-    // XXX lambda when possible
-    struct callback_wrap {
-        callback_wrap(const RawCallbackType callback, void* const callback_context)
-            : callback(callback),
-              callbackContext(callback_context) {
+size_t spredis::RedisCluster::scanContextIndexTypeless(const char* context,
+                                                       RawCallbackType callback,
+                                                       void* callbackContext) {
+    size_t count = 0;
+
+    std::vector<std::string> members;
+    unsigned long long cursor = 0;
+    do {
+        members.clear();
+        // the page is read with its own connection, which is returned before
+        // handing out the connections of the members: these may be served
+        // by the same pool
+        cursor = scanContextIndexPage(context, cursor, &members);
+        count += members.size();
+
+        // split the page by the nodes serving the members, so each node
+        // gets its part of the page as a single batch
+        const slot_table_ptr slots = currentSlotTable();
+        container::map<ClusterNode, std::vector<std::string> > batches;
+        for (size_t i = 0; i < members.size(); ++i) {
+            const ClusterNode* const node = slots->nodeForSlot(hash_type::keySlot(members[i]));
+            if (node == NULL)
+                throw ConnectionLostException("Redis cluster has no known node for the hash-slot of the key");
+            batches[*node].push_back(members[i]);
         }
 
-        void
-        operator()(RedisConnection* connection, const std::string& data) const {
-            callback(callbackContext, connection, data);
+        for (container::map<ClusterNode, std::vector<std::string> >::const_iterator it = batches.begin();
+             it != batches.end();
+             ++it) {
+            RedisConnectionPool* pool = slots->poolOf(it->first);
+            pool_ptr connected;
+            if (pool == NULL) {
+                connected = dispatchConnection(it->first);
+                pool = connected.get();
+            }
+            const RedisConnectionPool::Handle connection(pool);
+            callback(callbackContext, connection.get(), it->second);
         }
+    } while (cursor != 0);
 
-        RawCallbackType callback;
-        void* callbackContext;
-    };
-
-    for (cluster_map_type_cit it = m_cluster_map.cbegin();
-         it != m_cluster_map.cend();
-         ++it) {
-        RedisConnection* conn = dispatchConnectionUnguarded(&it->second);
-        // this call is tricky, we wrap our typeless callback into a typed
-        // callback, which will perform the same transformation we did, when
-        // we got the outermost callback, so when calling this callback, two
-        // layers of this type-erasure trickery will happen:
-        //   1) in the impl of conn->scanContext
-        //   2) in our callback call in callback_wrap,
-        // in this order
-        conn->scanContext(context, callback_wrap(callback, callbackContext));
+    return count;
+}
+
+int spredis::RedisCluster::hedgedRead(Redis* const target,
+                                      const StorageId& id,
+                                      std::string* const out_value,
+                                      time_t* const out_expiration,
+                                      const bool versioned,
+                                      const int minVersion) {
+    // the slower read goes on after returning, so only the pools kept open
+    // by the snapshot are hedged, and not the ones learned from redirections
+    const slot_table_ptr slots = currentSlotTable();
+    const unsigned int slot = id.hashSlotUsing<hash_type>();
+    RedisConnectionPool* const pool = slots->readPoolForSlot(slot);
+    RedisConnectionPool* const hedge = slots->hedgePoolForSlot(slot);
+    const unsigned long long delay = target == pool && hedge != NULL ? pool->hedgeDelay() : 0;
+    if (delay == 0 || hedge->breaker().open()) {
+        if (versioned) return target->getVersioned(id, out_value, out_expiration, minVersion);
+        return target->forceGet(id, out_value, out_expiration);
     }
 
-    return 0U;
+    bool fromHedge = false;
+    return m_hedger->read(pool, hedge, delay, slots, id, out_value, out_expiration, versioned, minVersion, &fromHedge);
+}
+
+spredis::RedisCluster::slot_table_ptr spredis::RedisCluster::currentSlotTable() const {
+    return boost::atomic_load(&m_slot_table);
+}
+
+void spredis::RedisCluster::applyRedirection(const RedirectedException& ex) {
+    const ClusterNode target(ex.to_host, static_cast<unsigned short>(ex.to_port));
+    // the slot is rerouted even if the target cannot be connected yet: the
+    // retry reports the failure, and the refresh fixes the pool
+    pool_ptr pool;
+    try {
+        pool = dispatchConnection(target);
+    } catch (const std::exception& connectEx) {
+        m_logger.warn("cannot connect to Redis cluster node %s:%u: %s",
+                      target.host().c_str(), target.port(), connectEx.what());
+    }
+
+    const Lock lock(m_publish_mutex);
+    const slot_table_ptr current = currentSlotTable();
+    const ClusterNode* const known = current->nodeForSlot(ex.slot);
+    // already applied by a concurrent caller redirected the same way
+    if (known != NULL && *known == target) return;
+
+    m_logger.info("Redis cluster hash-slot %u moved to %s:%u",
+                  ex.slot, target.host().c_str(), target.port());
+    ClusterSlotTable* const table = new ClusterSlotTable(*current);
+    table->reassign(ex.slot, target, pool);
+    boost::atomic_store(&m_slot_table, slot_table_ptr(table));
+    m_published->broadcast();
+}
+
+void spredis::RedisCluster::requestRefresh() {
+    const Lock lock(m_refresh_mutex);
+    if (m_refresh_requested) return;
+
+    m_refresh_requested = true;
+    m_refresh_wanted->signal();
+}
+
+void* spredis::RedisCluster::refresherMain(void* self) {
+    static_cast<RedisCluster*>(self)->refreshLoop();
+    return NULL;
+}
+
+namespace {
+    time_t nextDue(const time_t now, const unsigned int interval) {
+        if (interval == 0) return 0;
+        return now + static_cast<time_t>(interval);
+    }
+
+    time_t earliest(const time_t a, const time_t b) {
+        if (a == 0) return b;
+        if (b == 0) return a;
+        return std::min(a, b);
+    }
+}
+
+void spredis::RedisCluster::refreshLoop() {
+    time_t refreshDue = nextDue(time(NULL), m_config.refreshInterval);
+    time_t healthDue = nextDue(time(NULL), m_config.healthCheckInterval);
+
+    for (;;) {
+        bool refresh = false;
+        {
+            const Lock lock(m_refresh_mutex);
+            while (!m_refresh_requested && !m_shutdown) {
+                const time_t due = earliest(refreshDue, healthDue);
+                if (due == 0) {
+                    m_refresh_wanted->wait(m_refresh_mutex.get());
+                    continue;
+                }
+
+                const time_t now = time(NULL);
+                if (now >= due) break;
+                m_refresh_wanted->timedwait(m_refresh_mutex.get(), static_cast<int>(due - now));
+            }
+            if (m_shutdown) return;
+
+            // cleared before refreshing: failures seen while the refresh is
+            // running may be caused by a topology it does not know yet
+            refresh = m_refresh_requested || (refreshDue != 0 && time(NULL) >= refreshDue);
+            m_refresh_requested = false;
+        }
+
+        try {
+            // a refresh measures the nodes as well, so it postpones the next
+            // health check
+            if (refresh) {
+                refreshTopology();
+                refreshDue = nextDue(time(NULL), m_config.refreshInterval);
+                healthDue = nextDue(time(NULL), m_config.healthCheckInterval);
+            } else {
+                healthDue = nextDue(time(NULL), m_config.healthCheckInterval);
+                // a master which does not answer may have been failed over
+                // already: learn about its replacement as soon as possible
+                if (checkHealth()) requestRefresh();
+            }
+        } catch (const std::exception& ex) {
+            m_logger.error("cannot refresh Redis cluster topology: %s", ex.what());
+        } catch (...) {
+            m_logger.error("unknown error occured while refreshing Redis cluster topology");
+        }
+    }
+}
+
+void spredis::RedisCluster::refreshTopology() {
+    // the nodes of the current topology are the most likely to know about
+    // the current one, the configured nodes are only tried when all of them
+    // fail, e.g. when all known nodes have been replaced since
+    const slot_table_ptr current = currentSlotTable();
+    std::vector<ClusterNode> candidates(current->nodes());
+    candidates.insert(candidates.end(), current->replicas().begin(), current->replicas().end());
+    candidates.insert(candidates.end(), m_config.initialNodes.begin(), m_config.initialNodes.end());
+
+    // a node may be both known and configured, it is only probed once
+    std::sort(candidates.begin(), candidates.end());
+    candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+
+    // the threads of the previous probe are done by now, unless they are
+    // still waiting for the same unresponsive nodes
+    m_probe.reset();
+    m_probe.reset(new SeedProbe(*this, candidates));
+
+    boost::shared_ptr<ClusterSlotTable> table;
+    if (m_probe->explore(table)) {
+        attachPools(*table);
+        if (m_config.healthCheckInterval != 0 || m_config.readFrom != RedisConfig::READ_MASTER)
+            measureNodes(*table);
+
+        publish(table);
+        pruneConnections(*table);
+        if (!m_config.topologySnapshot.empty())
+            ClusterTopologySnapshot(m_config.topologySnapshot).save(*table);
+        return;
+    }
+
+    m_logger.crit("no known node configured in the redis cluster responds correctly to `CLUSTER "
+        "SLOTS': cannot explore cluster topology");
+    throw XMLToolingException("Cannot connect to any nodes in the redis cluster");
+}
+
+bool spredis::RedisCluster::restoreTopology() {
+    ClusterSlotTable* const table = new ClusterSlotTable();
+    const slot_table_ptr restored(table);
+    if (!ClusterTopologySnapshot(m_config.topologySnapshot).load(CacheSetter(*table, m_logger)))
+        return false;
+    if (table->nodes().empty()) return false;
+
+    // no node is connected yet: operations open the pools they need, and the
+    // first refresh attaches all of them
+    m_logger.info("restored Redis cluster topology from %s: %u masters",
+                  m_config.topologySnapshot.c_str(), static_cast<unsigned int>(table->nodes().size()));
+    publish(restored);
+    return true;
+}
+
+spredis::RedisCluster::SeedProbe::SeedProbe(RedisCluster& cluster, const std::vector<ClusterNode>& candidates)
+    : cluster(cluster),
+      candidates(candidates),
+      mutex(Mutex::create()),
+      answered(CondWait::create()),
+      next(0),
+      running(0),
+      found(false),
+      table(),
+      threads() {
 }
 
-const spredis::ClusterNode* spredis::RedisCluster::findNodeEntryUnguarded(const StorageId& id) const {
-    const cluster_map_type_cit it = m_cluster_map.find(id);
-    if (it == m_cluster_map.cend()) return NULL;
-    return &it->second;
+spredis::RedisCluster::SeedProbe::~SeedProbe() {
+    for (size_t i = 0; i < threads.size(); ++i) {
+        threads[i]->join(NULL);
+        delete threads[i];
+    }
+}
+
+bool spredis::RedisCluster::SeedProbe::explore(boost::shared_ptr<ClusterSlotTable>& out_table) {
+    const size_t workers = std::min(maxParallelProbes, candidates.size());
+    for (size_t i = 0; i < workers; ++i) {
+        {
+            const Lock lock(mutex);
+            ++running;
+        }
+        try {
+            threads.push_back(Thread::create(&RedisCluster::probeWorkerMain, this));
+        } catch (const std::exception& ex) {
+            // the remaining threads take over the candidates of this one
+            cluster.m_logger.warn("cannot start Redis cluster probe thread: %s", ex.what());
+            const Lock lock(mutex);
+            --running;
+            break;
+        }
+    }
+    if (threads.empty()) {
+        // probe the candidates one after the other instead
+        {
+            const Lock lock(mutex);
+            ++running;
+        }
+        run();
+    }
+
+    const Lock lock(mutex);
+    while (!found && running > 0) answered->wait(mutex.get());
+    if (!found) return false;
+
+    out_table = table;
+    return true;
+}
+
+void* spredis::RedisCluster::probeWorkerMain(void* probe) {
+    static_cast<SeedProbe*>(probe)->run();
+    return NULL;
 }
 
-const spredis::ClusterNode* spredis::RedisCluster::findNodeEntryUnguarded(const ClusterNode& node) const {
-    // This is a more expensive operation compared to finding by StorageId,
-    // because it is essentially a linear search in the values stored in a map.
-    // Nevertheless, this should matter much as this is only used when
-    // recovering from a RedirectedException as a way to fast-track the actual
-    // operation, before truly dealing with the problem
-    struct finder {
-        explicit finder(const ClusterNode& node)
-            : node(node) {
+void spredis::RedisCluster::SeedProbe::run() {
+    for (;;) {
+        size_t candidate;
+        {
+            const Lock lock(mutex);
+            if (found || next >= candidates.size()) {
+                --running;
+                answered->signal();
+                return;
+            }
+            candidate = next++;
+        }
+
+        const ClusterNode& node = candidates[candidate];
+        const boost::shared_ptr<ClusterSlotTable> probed(new ClusterSlotTable());
+        try {
+            cluster.m_logger.debug("trying reading configuration from node %s:%u", node.host().c_str(), node.port());
+            cluster.dispatchConnection(node)->iterateSlots(CacheSetter(*probed, cluster.m_logger));
+        } catch (const std::exception& ex) {
+            cluster.m_logger.error("error occured getting cluster configuration from %s:%u -- skipping node: %s",
+                                   node.host().c_str(), node.port(), ex.what());
+            continue;
+        } catch (...) {
+            cluster.m_logger.error("unknown error occured getting cluster configuration from %s:%u -- skipping node",
+                                   node.host().c_str(), node.port());
+            continue;
         }
 
-        const ClusterNode& node;
+        // the first answer wins, later ones are dropped
+        const Lock lock(mutex);
+        if (found) continue;
+        found = true;
+        table = probed;
+        answered->signal();
+    }
+}
+
+bool spredis::RedisCluster::checkHealth() {
+    const slot_table_ptr current = currentSlotTable();
+    // nothing to check before the topology is first learned
+    if (current->nodes().empty()) return true;
+
+    ClusterSlotTable* const table = new ClusterSlotTable(*current);
+    const slot_table_ptr checked(table);
+    attachPools(*table);
+    measureNodes(*table);
+    if (table->sameRoutingAs(*current)) return table->anyDown();
+
+    if (table->anyDown())
+        m_logger.warn("Redis cluster health check: some masters are unreachable, failing their operations fast");
+    publish(checked, current.get());
+    return table->anyDown();
+}
+
+void spredis::RedisCluster::measureNodes(ClusterSlotTable& table) {
+    // measure every node of the new topology once: unreachable replicas are
+    // left out, and the latencies are only used with the "nearest" preference
+    container::flat_map<ClusterNode, long> latencies;
+    const std::vector<ClusterNode>& masters = table.nodes();
+    const std::vector<ClusterNode>& replicas = table.replicas();
+
+    std::vector<ClusterNode> nodes(masters);
+    nodes.insert(nodes.end(), replicas.begin(), replicas.end());
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        RedisConnectionPool* const pool = table.poolOf(nodes[i]);
+        // no pool could be opened to the node: it is unreachable
+        if (pool == NULL) continue;
 
-        bool
-        operator()(const cluster_map_type::value_type& kv) const {
-            return kv.second == node;
+        try {
+            const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            pool->ping();
+            latencies[nodes[i]] = static_cast<long>(std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start).count());
+        } catch (const std::exception& ex) {
+            m_logger.warn("cannot reach Redis cluster node %s:%u, marking it unhealthy: %s",
+                          nodes[i].host().c_str(), nodes[i].port(), ex.what());
         }
-    };
+    }
 
-    const cluster_map_type_cit it = std::find_if(m_cluster_map.cbegin(), m_cluster_map.cend(), finder(node));
-    if (it == m_cluster_map.cend()) return NULL;
-    return &it->second;
+    table.updateHealth(latencies);
+    table.routeReads(m_config.readFrom, latencies);
 }
 
-spredis::RedisConnection* spredis::RedisCluster::dispatchConnectionUnguarded(const ClusterNode* node) {
-    connection_map_type_it it = m_connection_map.find(node);
-    if (it == m_connection_map.end()) {
-        const std::pair<connection_map_type_it, bool> insert_result =
-                m_connection_map.insert(std::make_pair(node,
-                                                       node->connect(m_config)));
-        it = insert_result.first;
+void spredis::RedisCluster::publish(const slot_table_ptr& table, const ClusterSlotTable* const expected) {
+    const Lock lock(m_publish_mutex);
+    if (expected != NULL && currentSlotTable().get() != expected) return;
+
+    boost::atomic_store(&m_slot_table, table);
+    m_published->broadcast();
+}
+
+spredis::RedisCluster::pool_ptr spredis::RedisCluster::dispatchConnection(const ClusterNode& node) {
+    {
+        const Lock lock(m_connection_mutex);
+        const connection_map_type_it it = m_connection_map.find(node);
+        if (it != m_connection_map.end()) return it->second;
     }
 
-    return it->second.get();
+    // connect outside the lock, so a node which does not answer does not
+    // hold up the operations on every other node
+    const pool_ptr pool(node.createPool(m_config));
+
+    const Lock lock(m_connection_mutex);
+    const std::pair<connection_map_type_it, bool> insert_result =
+            m_connection_map.insert(std::make_pair(node, pool));
+    // if a concurrent caller was faster, its pool is used, and ours is closed
+    return insert_result.first->second;
 }
 
-namespace {
-    const bool continueIteration = false;
-    const bool stopIteration = true;
-}
-
-void spredis::RedisCluster::resetSlotsCacheUnguarded() {
-    // flush current conneciton cache: flushing cache first ensures we _somehow_
-    // don't accidentally dereference the cached pointers that are danling after
-    // clearing m_cluster_map
-    m_connection_map.clear();
-
-    // clear current range-node mapping
-    // XXX Some clever algorithm could be devised to allow the reuse of already
-    //     existing range-node entries that do not change, but because cache is
-    //     implemented on top of the current node object's memory address, this
-    //     algorithm needs to be really clever around how to insert/remove
-    //     range-node mappings and when to invalidate cached connections. A
-    //     major potential problem seems to be ranges that overlap with previous
-    //     range entries as that requires complete manual special-casing.
-    //     -- this is not deemed worth the complex code right now, the below is
-    //        quite simple, if not the most efficient because of the cache reuse
-    //        inefficiencies, nevertheless, this code only runs when the cluster
-    //        config changes (either via manual redistribution of slots, or auto
-    //        failover) and once on startup, neither occurs *that* frequently
-    cluster_map_type previous_map = m_cluster_map;
-    m_cluster_map.clear();
-
-    // take the first successful iteration of the result of CLUSTER SLOTS
-    // and set m_cluster_map appropriately
-    const bool success = std::any_of(previous_map.begin(),
-                                     previous_map.end(),
-                                     CacheReseter(this));
-    if (!success) {
-        m_logger.crit("no known node configured in the redis cluster responds correctly to `CLUSTER "
-            "SLOTS': cannot explore cluster topology");
-        throw XMLToolingException("Cannot connect to any nodes in the redis cluster");
+void spredis::RedisCluster::attachPools(ClusterSlotTable& table) {
+    std::vector<ClusterNode> nodes(table.nodes());
+    nodes.insert(nodes.end(), table.replicas().begin(), table.replicas().end());
+
+    std::vector<ClusterNode> missing;
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        if (table.poolOf(nodes[i]) == NULL) missing.push_back(nodes[i]);
+    }
+    if (missing.empty()) return;
+
+    ParallelConnect connect(*this, missing);
+
+    // the calling thread is one of the workers
+    const size_t workers = std::min(maxParallelProbes, missing.size());
+    std::vector<Thread*> threads;
+    for (size_t i = 1; i < workers; ++i) {
+        try {
+            threads.push_back(Thread::create(&RedisCluster::connectWorkerMain, &connect));
+        } catch (const std::exception& ex) {
+            // the remaining workers take over the nodes of this one
+            m_logger.warn("cannot start Redis cluster connection thread: %s", ex.what());
+            break;
+        }
+    }
+    connect.run();
+    for (size_t i = 0; i < threads.size(); ++i) {
+        threads[i]->join(NULL);
+        delete threads[i];
+    }
+
+    for (size_t i = 0; i < missing.size(); ++i) {
+        if (connect.pools[i]) table.attachPool(missing[i], connect.pools[i]);
     }
+}
 
-    m_force_refresh_cluster_map = false;
+void* spredis::RedisCluster::connectWorkerMain(void* connect) {
+    static_cast<ParallelConnect*>(connect)->run();
+    return NULL;
 }
 
-namespace {
-    unsigned waitTime(const unsigned config) {
-        if (config == 0) return static_cast<unsigned>(-1);
-        return config;
+void spredis::RedisCluster::ParallelConnect::run() {
+    for (;;) {
+        size_t index;
+        {
+            const Lock lock(mutex);
+            if (next >= nodes.size()) return;
+            index = next++;
+        }
+
+        try {
+            pools[index] = cluster.dispatchConnection(nodes[index]);
+        } catch (const std::exception& ex) {
+            cluster.m_logger.warn("cannot connect to Redis cluster node %s:%u: %s",
+                                  nodes[index].host().c_str(), nodes[index].port(), ex.what());
+        }
     }
 }
 
-bool spredis::RedisCluster::tryWaitWithRetryNumber(const int retry) const {
-    const unsigned int retryUnsigned = static_cast<unsigned int>(retry);
-    if (retryUnsigned > m_config.maxRetries) return false;
+void spredis::RedisCluster::pruneConnections(const ClusterSlotTable& table) {
+    const std::vector<ClusterNode>& masters = table.nodes();
+    const std::vector<ClusterNode>& replicas = table.replicas();
+
+    // pools still used by an operation are only closed once the operation
+    // releases the snapshot it was routed with
+    const Lock lock(m_connection_mutex);
+    for (connection_map_type_it it = m_connection_map.begin(); it != m_connection_map.end();) {
+        if (std::find(masters.begin(), masters.end(), it->first) != masters.end()
+            || std::find(replicas.begin(), replicas.end(), it->first) != replicas.end()) {
+            ++it;
+            continue;
+        }
+
+        m_logger.info("Redis cluster node %s:%u left the cluster: closing its connections",
+                      it->first.host().c_str(), it->first.port());
+        it = m_connection_map.erase(it);
+    }
+}
 
-    const unsigned int toWait = m_config.baseWait * (1 << retryUnsigned);
-    const unsigned int usTrueWait = 1000 * std::min(toWait, waitTime(m_config.maxWait));
+bool spredis::RedisCluster::tryWaitBeforeRetry(RetryPolicy::Attempt& attempt, const slot_table_ptr& seen) const {
+    unsigned int msWait;
+    if (!attempt.nextWait(&msWait)) return false;
 
     m_logger.debug("waiting about %u milliseconds for try %u/%u",
-                   usTrueWait / 1000, retryUnsigned, m_config.maxRetries);
-    usleep(usTrueWait); // XXX Win32 - usleep
-    return true;
-}
+                   msWait, attempt.retries(), m_config.maxRetries);
+    RedisStats::getInstance().count(RedisStats::RETRIES);
 
-bool spredis::RedisCluster::CacheReseter::operator()(const cluster_map_iteration_type& entry) const
-try {
-    cluster->m_logger.debug("trying reading configuration from node %s:%u (currently known for range %d-%d)",
-                            entry.second.host().c_str(), entry.second.port(),
-                            entry.first.from(), entry.first.to());
-    RedisConnection* conn = cluster->dispatchConnectionUnguarded(&entry.second);
-    conn->iterateSlots(CacheSetter(cluster));
-    return stopIteration;
-} catch (const std::exception& ex) {
-    cluster->m_logger.error("error occured getting cluster configuration from %s:%u -- skipping node: %s",
-                            entry.second.host().c_str(), entry.second.port(),
-                            ex.what());
-    return continueIteration;
-} catch (...) {
-    cluster->m_logger.error("unknown error occured getting cluster configuration from %s:%u -- skipping node",
-                            entry.second.host().c_str(), entry.second.port());
-    return continueIteration;
+    // the refresher publishes the new topology as soon as it learns it, which
+    // is what the retry is waiting for in most cases
+    RetryPolicy::waitForChange(msWait, m_publish_mutex.get(), m_published.get(),
+                               *this, &RedisCluster::currentSlotTable, seen);
+    return true;
 }
 
 void spredis::RedisCluster::CacheSetter::operator()(const range_type& range,
-                                                    const ClusterNode& node) const {
-    cluster->m_logger.debug("Redis cluster hash-range: %d-%d to host %s:%u",
-                            range.from(), range.to(), node.host().c_str(), node.port());
-    cluster->m_cluster_map.insert_or_assign(range, node);
+                                                    const ClusterNode& node,
+                                                    const std::vector<ClusterNode>& replicas) const {
+    logger.debug("Redis cluster hash-range: %d-%d to host %s:%u (%u replicas)",
+                 range.from(), range.to(), node.host().c_str(), node.port(),
+                 static_cast<unsigned int>(replicas.size()));
+    table.assign(range, node, replicas);
 }
@@ -31,15 +31,20 @@
 #include <memory>
 
 #include "cluster-range.h"
+#include "cluster-slot-table.h"
 #include "common.h"
 #include "connection-lost-exception.h"
+#include "read-hedger.h"
 #include "redirected-exception.h"
 #include "redis.h"
 #include "redis-connection.h"
+#include "redis-connection-pool.h"
+#include "redis-stats.h"
+#include "retry-policy.h"
 
-#include <boost/container/stable_vector.hpp>
 #include <boost/container/flat_map.hpp>
 #include <boost/container/map.hpp>
+#include <boost/shared_ptr.hpp>
 
 namespace spredis {
     class SHIBSP_HIDDEN RedisCluster SHIBSP_FINAL : public Redis {
@@ -51,35 +56,31 @@ namespace spredis {
         typedef ClusterRange<hash_type> range_type;
 
         /**
-         * The stable-pointer flat-map to provide the mapping from
-         * ClusterRange objects to their appropriate ClusterNode objects which
-         * can connect to a single Redis cluster node.
-         * The given sequence container (stable_vector) ensures that the objetcs
-         * are stable in memory, and thusly their pointers can be safely taken.
+         * The map to provide the mapping between the ClusterNode objects,
+         * to cached connection pools.
+         * Nodes are stored by value, as the routing snapshots which hold the
+         * nodes a request is dispatched to may be replaced at any time.
+         * Pools are shared with the routing snapshots: operations use the
+         * pools of their snapshot, this map is only used to find the pools of
+         * nodes when building a new snapshot.
          */
-        typedef boost::container::flat_map<
-            range_type,
+        typedef ClusterSlotTable::pool_ptr pool_ptr;
+        typedef boost::container::map<
             ClusterNode,
-            ClusterCompareLess,
-            boost::container::stable_vector<std::pair<range_type, ClusterNode> > > cluster_map_type;
-        typedef cluster_map_type::iterator cluster_map_type_it;
-        typedef cluster_map_type::const_iterator cluster_map_type_cit;
-        typedef cluster_map_type::iterator::value_type cluster_map_iteration_type;
+            pool_ptr> connection_map_type;
+        typedef connection_map_type::iterator connection_map_type_it;
 
         /**
-         * The flat-map to provide the mapping between the ClusterNode objects,
-         * to cached connection objects.
-         * The objects in this map, contrary to cluster_map, are not stable in
-         * memory so DO NOT take their address in general.
+         * The routing snapshot published for readers. Replaced as a whole
+         * when the topology changes, never modified after publishing.
          */
-        typedef boost::container::map<
-            const ClusterNode*,
-            std::auto_ptr<RedisConnection> > connection_map_type;
-        typedef connection_map_type::iterator connection_map_type_it;
+        typedef boost::shared_ptr<const ClusterSlotTable> slot_table_ptr;
 
     public:
         explicit RedisCluster(const RedisConfig& config);
 
+        ~RedisCluster();
+
         bool set(const StorageId& id, const char* value, time_t expiration);
 
         int getVersioned(const StorageId& id, std::string* out_value, time_t* out_expiration, int minVersion);
@@ -92,89 +93,352 @@ namespace spredis {
 
         bool remove(const StorageId& id);
 
+        void indexRecord(const StorageId& id, time_t expiration);
+
+        void unindexRecord(const StorageId& id);
+
+        void expireContextIndex(const char* context, time_t expiration);
+
+        void deleteContextIndex(const char* context);
+
+        unsigned long long scanContextIndexPage(const char* context, unsigned long long cursor,
+                                                std::vector<std::string>* out_members);
+
+        long long touchContextEpoch(const char* context, time_t keepUntil);
+
+        bool readContextEpoch(const char* context, ContextEpoch* out_epoch);
+
+        long long expireContextEpoch(const char* context, time_t expiration, time_t keepUntil, time_t* out_horizon);
+
+        long long deleteContextEpoch(const char* context);
+
+        void raiseContextEpochHorizon(const char* context, long long generation, time_t horizon);
+
+        std::vector<ClusterNode> endpoints() const;
+
     protected:
         size_t scanContextTypeless(const char* context, RawCallbackType callback, void* callbackContext);
 
+        /**
+         * The index of a context is stored on the node of its own hash-slot,
+         * while its members are spread over the whole cluster: the members
+         * are read from the index page by page, and each is handed to the
+         * callback with a connection to the node serving the member.
+         */
+        size_t scanContextIndexTypeless(const char* context, RawCallbackType callback, void* callbackContext);
+
     private:
+        /**
+         * Calls fn with the pool of the node serving the key.
+         * If out_fromReplica is not NULL, the call is a read, which is routed
+         * according to the read preference; whether it was served by a
+         * replica is returned in out_fromReplica.
+         *
+         * A MOVED redirection reroutes only the slot of the key, and the call
+         * is retried on the new node; ASK is followed for this call only. If
+         * the node is lost, the call is retried according to the retry
+         * policy. Either way, a full refresh of the topology is requested
+         * from the refresher thread, instead of performing it here.
+         */
         template<class R, class CallFn>
-        R wrappedCall(const StorageId& id, const CallFn& fn, int recurse = 0)
-        try {
-            const xmltooling::SharedLock slock(m_shared_mutex);
-            const ClusterNode* const node = findNodeEntryUnguarded(id);
-            RedisConnection* conn = dispatchConnectionUnguarded(node);
-            return fn(conn);
-        } catch (const ConnectionLostException&) {
-            // retry connection some times recursively, and if all fails,
-            // rethrow the connection error as we cannot handle it at our level
-            // (this is needed because there may be some delay between the
-            // syncronization of the failure to all masters in the cluster such
-            // that they report the correct host:port for a range
-            if (tryWaitWithRetryNumber(recurse)) {
-                rebuildRangeMappingUniqueLocked();
-                return wrappedCall<R>(id, fn, recurse + 1);
+        R wrappedCall(const StorageId& id, const CallFn& fn, bool* const out_fromReplica = NULL) {
+            RetryPolicy::Attempt attempt(m_retry_policy);
+            return retriedCall<R>(id, fn, out_fromReplica, attempt);
+        }
+
+        template<class R, class CallFn>
+        R retriedCall(const StorageId& id, const CallFn& fn, bool* const out_fromReplica,
+                      RetryPolicy::Attempt& attempt) {
+            // the key is hashed exactly once, then the node is found by
+            // indexing into the current routing snapshot: no locking required
+            const slot_table_ptr slots = currentSlotTable();
+            try {
+                const unsigned int slot = id.hashSlotUsing<hash_type>();
+                const ClusterNode* const master = slots->nodeForSlot(slot);
+                const ClusterNode* const node = out_fromReplica ? slots->readNodeForSlot(slot) : master;
+                if (node == NULL)
+                    throw ConnectionLostException("Redis cluster has no known node for the hash-slot of the key");
+                // do not wait for the timeouts of a master the health checker
+                // could not reach, wait for the failover to be published instead
+                if (node == master && slots->slotDown(slot))
+                    throw ConnectionLostException("Redis cluster node serving the hash-slot of the key is unreachable");
+                if (out_fromReplica) *out_fromReplica = node != master;
+
+                // the pool decides whether to check out a connection, or to
+                // pipeline the operation on its shared connection; the
+                // snapshot keeps it open for the duration of the call
+                RedisConnectionPool* const pool = out_fromReplica ? slots->readPoolForSlot(slot)
+                                                                  : slots->poolForSlot(slot);
+                if (pool) return breakerCall<R>(pool->breaker(), pool, fn);
+
+                // no pool could be opened when the snapshot was built, or the
+                // node was learned from a redirection
+                const pool_ptr connected = dispatchConnection(*node);
+                return breakerCall<R>(connected->breaker(), connected.get(), fn);
+            } catch (const ConnectionLostException&) {
+                // retry connection some times recursively, and if all fails,
+                // rethrow the connection error as we cannot handle it at our level
+                // (this is needed because there may be some delay between the
+                // syncronization of the failure to all masters in the cluster such
+                // that they report the correct host:port for a range
+                requestRefresh();
+                if (tryWaitBeforeRetry(attempt, slots)) return retriedCall<R>(id, fn, out_fromReplica, attempt);
+
+                m_logger.error("Redis cluster failure: cannot find applicable host to connect to");
+                throw;
+            } catch (const RedirectedException& ex) {
+                RedisStats::getInstance().count(ex.asking ? RedisStats::ASK_REDIRECTIONS
+                                                          : RedisStats::MOVED_REDIRECTIONS);
+                if (ex.asking) return askingCall<R>(id, fn, ex, slots, out_fromReplica, attempt);
+
+                // a replica redirects reads to its master if the connection
+                // is not READONLY: the slot is not rerouted, the read is sent
+                // to the master instead of the same replica again
+                if (out_fromReplica && *out_fromReplica) {
+                    const ClusterNode* const master = slots->nodeForSlot(ex.slot);
+                    if (master != NULL && *master == ClusterNode(ex.to_host, static_cast<unsigned short>(ex.to_port))) {
+                        *out_fromReplica = false;
+                        attempt.retryAtOnce();
+                        return retriedCall<R>(id, fn, NULL, attempt);
+                    }
+                }
+
+                // MOVED is authoritative for the slot: the first one is followed at
+                // once, repeated ones (e.g. during a failover) wait between tries
+                applyRedirection(ex);
+                requestRefresh();
+                if (attempt.retries() == 0) {
+                    attempt.retryAtOnce();
+                    return retriedCall<R>(id, fn, out_fromReplica, attempt);
+                }
+                if (tryWaitBeforeRetry(attempt, currentSlotTable()))
+                    return retriedCall<R>(id, fn, out_fromReplica, attempt);
+
+                m_logger.error("Redis cluster failure: cannot connect to cluster after redirection: "
+                               "redirected to `%s:%u' but could not reach node",
+                               ex.to_host.c_str(), ex.to_port);
+                throw;
             }
+        }
+
+        /**
+         * Calls fn once on the target of an ASK redirection, on a connection
+         * which sent ASKING first. Operations using multiple round-trips
+         * (WATCH) are redirected again, as ASKING only applies to their first
+         * command: these wait for the migration to finish instead.
+         */
+        template<class R, class CallFn>
+        R askingCall(const StorageId& id, const CallFn& fn, const RedirectedException& ex,
+                     const slot_table_ptr& slots, bool* const out_fromReplica, RetryPolicy::Attempt& attempt)
+        try {
+            if (out_fromReplica) *out_fromReplica = false;
 
-            m_logger.error("Redis cluster failure: cannot find applicable host to connect to");
+            const pool_ptr pool = dispatchConnection(ClusterNode(ex.to_host, static_cast<unsigned short>(ex.to_port)));
+            const RedisConnectionPool::Handle connection(pool.get());
+            connection->asking();
+            return fn(connection.get());
+        } catch (const ConnectionLostException&) {
+            requestRefresh();
+            if (tryWaitBeforeRetry(attempt, slots)) return retriedCall<R>(id, fn, out_fromReplica, attempt);
             throw;
-        } catch (const RedirectedException& ex) {
-            // retry connection some times recursively, and if all fails,
-            // rethrow the connection error as we cannot handle it at our level
-            // (this is needed because there may be some delay between the
-            // syncronization of the failure to all masters in the cluster such
-            // that they report the correct host:port for a range
-            if (tryWaitWithRetryNumber(recurse)) {
-                rebuildRangeMappingUniqueLocked();
-                return wrappedCall<R>(id, fn, recurse + 1);
-            }
+        } catch (const RedirectedException&) {
+            if (tryWaitBeforeRetry(attempt, slots)) return retriedCall<R>(id, fn, out_fromReplica, attempt);
 
-            m_logger.error("Redis cluster failure: cannot connect to cluster after redirection: "
-                           "redirected to `%s:%u' but could not reach node",
-                           ex.to_host.c_str(), ex.to_port);
+            m_logger.error("Redis cluster failure: operation kept on being redirected while migrating slot %u",
+                           ex.slot);
             throw;
         }
 
-        void rebuildRangeMappingUniqueLocked();
+        /**
+         * Reads the record from target, the way getVersioned does or as
+         * forceGet if not versioned. If target is the pool reads of the slot
+         * are routed to, the read is hedged to another node of the slot when
+         * the pool is slow to answer.
+         */
+        int hedgedRead(Redis* target, const StorageId& id, std::string* out_value,
+                       time_t* out_expiration, bool versioned, int minVersion);
+
+        slot_table_ptr currentSlotTable() const;
 
-        const ClusterNode* findNodeEntryUnguarded(const StorageId& id) const;
+        /**
+         * Publishes a copy of the current routing snapshot, with the slot of
+         * the MOVED redirection assigned to its target.
+         */
+        void applyRedirection(const RedirectedException& ex);
 
-        const ClusterNode* findNodeEntryUnguarded(const ClusterNode& node) const;
+        /**
+         * Asks the refresher thread to explore the topology again. Requests
+         * arriving while a refresh is pending are coalesced into it.
+         */
+        void requestRefresh();
 
-        RedisConnection* dispatchConnectionUnguarded(const ClusterNode* node);
+        static void* refresherMain(void* self);
 
-        void resetSlotsCacheUnguarded();
+        void refreshLoop();
 
-        bool tryWaitWithRetryNumber(int retry) const;
+        /**
+         * Explores the topology using CLUSTER SLOTS of the first known node
+         * that answers, then publishes it as the new routing snapshot.
+         * The known nodes are probed in parallel, so unresponsive ones do not
+         * delay the exploration by their connection timeouts.
+         * Connections to nodes still part of the topology are kept, the ones
+         * to nodes which left are closed, and the topology is saved to the
+         * snapshot file if configured.
+         * Only called by the constructor and the refresher thread, never by
+         * both at the same time.
+         */
+        void refreshTopology();
 
-        struct CacheReseter {
-            RedisCluster* cluster;
+        /**
+         * Publishes the topology saved in the snapshot file as the routing
+         * snapshot, without connecting to any of its nodes. Returns false if
+         * there is no usable snapshot.
+         */
+        bool restoreTopology();
 
-            explicit CacheReseter(RedisCluster* const cluster)
-                : cluster(cluster) {
+        /**
+         * Pings every node of the current topology, then publishes which of
+         * the masters are reachable, and where reads are routed. Returns
+         * whether a master was found unreachable.
+         */
+        bool checkHealth();
+
+        /**
+         * Measures the round-trip time to every node of the table, then marks
+         * the unreachable masters of the table, and routes the reads of the
+         * table to the reachable replicas.
+         */
+        void measureNodes(ClusterSlotTable& table);
+
+        /**
+         * Publishes the table as the new routing snapshot, and wakes the
+         * callers waiting for a topology change. If expected is not NULL, the
+         * table is only published if the current snapshot is still expected,
+         * so redirections applied since are not lost.
+         */
+        void publish(const slot_table_ptr& table, const ClusterSlotTable* expected = NULL);
+
+        /**
+         * The state shared by the exploration of the topology and the threads
+         * probing the candidate nodes in parallel: each thread probes the
+         * next candidate, until one of them answers CLUSTER SLOTS. The
+         * exploration goes on with the first answer, while the threads still
+         * waiting for unresponsive candidates finish on their own; they are
+         * joined when the probe is destroyed.
+         */
+        struct SeedProbe {
+            SeedProbe(RedisCluster& cluster, const std::vector<ClusterNode>& candidates);
+
+            ~SeedProbe();
+
+            /**
+             * Probes the candidates, and returns the topology of the first
+             * one answering, or false if none does.
+             */
+            bool explore(boost::shared_ptr<ClusterSlotTable>& out_table);
+
+            void run();
+
+            RedisCluster& cluster;
+            const std::vector<ClusterNode> candidates;
+            boost::scoped_ptr<xmltooling::Mutex> mutex;
+            // signalled when a probe answers, or a thread runs out of candidates
+            boost::scoped_ptr<xmltooling::CondWait> answered;
+            size_t next;
+            size_t running;
+            bool found;
+            boost::shared_ptr<ClusterSlotTable> table;
+            std::vector<xmltooling::Thread*> threads;
+        };
+
+        static void* probeWorkerMain(void* probe);
+
+        /**
+         * The state shared by the threads opening the pools of new nodes in
+         * parallel: each thread opens the pool of the next node, until none
+         * is left. Nodes which cannot be connected are left without a pool.
+         */
+        struct ParallelConnect {
+            ParallelConnect(RedisCluster& cluster, const std::vector<ClusterNode>& nodes)
+                : cluster(cluster),
+                  nodes(nodes),
+                  pools(nodes.size()),
+                  mutex(xmltooling::Mutex::create()),
+                  next(0) {
             }
 
-            bool
-            operator()(const cluster_map_iteration_type& entry) const;
+            void run();
+
+            RedisCluster& cluster;
+            const std::vector<ClusterNode>& nodes;
+            // by index of the node, each only written by the thread opening it
+            std::vector<pool_ptr> pools;
+            boost::scoped_ptr<xmltooling::Mutex> mutex;
+            size_t next;
         };
 
+        static void* connectWorkerMain(void* connect);
+
+        /**
+         * Returns the pool of connections to the node, creating it if needed.
+         * Concurrent callers for the same node share one pool.
+         */
+        pool_ptr dispatchConnection(const ClusterNode& node);
+
+        /**
+         * Attaches the pools of all nodes of the table, opening pools to the
+         * new nodes in parallel. Nodes which do not answer are left without a
+         * pool, and are tried again by the next health check.
+         */
+        void attachPools(ClusterSlotTable& table);
+
+        void pruneConnections(const ClusterSlotTable& table);
+
+        /**
+         * Waits before the next retry of a call routed using the snapshot
+         * seen, as long as the retry policy tells. The wait ends early if a
+         * different snapshot is published meanwhile. Returns false if the
+         * call is not to be retried anymore.
+         */
+        bool tryWaitBeforeRetry(RetryPolicy::Attempt& attempt, const slot_table_ptr& seen) const;
+
         struct CacheSetter {
-            RedisCluster* cluster;
+            ClusterSlotTable& table;
+            xmltooling::logging::Category& logger;
 
-            explicit CacheSetter(RedisCluster* const cluster)
-                : cluster(cluster) {
+            CacheSetter(ClusterSlotTable& table,
+                        xmltooling::logging::Category& logger)
+                : table(table),
+                  logger(logger) {
             }
 
             void
-            operator()(const range_type& range, const ClusterNode& node) const;
+            operator()(const range_type& range, const ClusterNode& node,
+                       const std::vector<ClusterNode>& replicas) const;
         };
 
-        friend CacheSetter;
-
-        boost::scoped_ptr<xmltooling::RWLock> m_shared_mutex;
+        // guards the structure of m_connection_map
+        boost::scoped_ptr<xmltooling::Mutex> m_connection_mutex;
         connection_map_type m_connection_map;
-        cluster_map_type m_cluster_map;
+        slot_table_ptr m_slot_table;
+        // serializes the replacement of m_slot_table by redirections and refreshes
+        boost::scoped_ptr<xmltooling::Mutex> m_publish_mutex;
+        // signalled when a new snapshot is published
+        boost::scoped_ptr<xmltooling::CondWait> m_published;
         RedisConfig m_config;
         xmltooling::logging::Category& m_logger;
-        bool m_force_refresh_cluster_map;
+        RetryPolicy m_retry_policy;
+        boost::scoped_ptr<xmltooling::Mutex> m_refresh_mutex;
+        boost::scoped_ptr<xmltooling::CondWait> m_refresh_wanted;
+        bool m_refresh_requested;
+        bool m_shutdown;
+        boost::scoped_ptr<xmltooling::Thread> m_refresher;
+        // NULL unless reads from replicas are hedged
+        boost::scoped_ptr<ReadHedger> m_hedger;
+        // the probe of the last exploration, whose threads may still be
+        // waiting for unresponsive nodes; destroyed first, as they use the
+        // rest of the instance
+        boost::scoped_ptr<SeedProbe> m_probe;
     };
 }
 
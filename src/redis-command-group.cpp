@@ -0,0 +1,116 @@
+/**
+ * Licensed to the University Corporation for Advanced Internet
+ * Development, Inc. (UCAID) under one or more contributor license
+ * agreements. See the NOTICE file distributed with this work for
+ * additional information regarding copyright ownership.
+ *
+ * UCAID licenses this file to you under the Apache License,
+ * Version 2.0 (the "License"); you may not use this file except
+ * in compliance with the License. You may obtain a copy of the
+ * License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+ */
+
+/**
+ * redis-command-group.cpp
+ *
+ * Implementation of the RedisCommandGroup class.
+ */
+
+#include "redis-command-group.h"
+#include "redis-reply-arena.h"
+
+#include <cstdarg>
+#include <new>
+
+spredis::RedisCommandGroup::RedisCommandGroup()
+    : m_buffer(),
+      m_commands(0),
+      m_command_ends(),
+      m_replies(),
+      m_next_reply(0),
+      m_error(),
+      m_completed(false) {
+}
+
+spredis::RedisCommandGroup::~RedisCommandGroup() {
+    reset();
+}
+
+void spredis::RedisCommandGroup::append(const char* fmt, ...) {
+    char* command = NULL;
+    va_list va;
+    va_start(va, fmt);
+    const int length = redisvFormatCommand(&command, fmt, va);
+    va_end(va);
+
+    // formatting only fails on out of memory or an invalid format string,
+    // neither of which can be recovered from here
+    if (length < 0) throw std::bad_alloc();
+
+    try {
+        appendFormatted(command, static_cast<size_t>(length));
+    } catch (...) {
+        redisFreeCommand(command);
+        throw;
+    }
+    redisFreeCommand(command);
+}
+
+void spredis::RedisCommandGroup::appendArgv(const int argc, const char** const argv, const size_t* const argvlen) {
+    char* command = NULL;
+    const long long length = redisFormatCommandArgv(&command, argc, argv, argvlen);
+    if (length < 0) throw std::bad_alloc();
+
+    try {
+        appendFormatted(command, static_cast<size_t>(length));
+    } catch (...) {
+        redisFreeCommand(command);
+        throw;
+    }
+    redisFreeCommand(command);
+}
+
+void spredis::RedisCommandGroup::appendFormatted(const char* const command, const size_t length) {
+    m_command_ends.reserve(m_commands + 1);
+    m_buffer.append(command, length);
+    m_command_ends.push_back(m_buffer.size());
+    ++m_commands;
+}
+
+void spredis::RedisCommandGroup::addReply(void* const reply) {
+    assert(pendingReplies() > 0 && "more replies read than commands sent");
+    try {
+        m_replies.push_back(static_cast<redisReply*>(reply));
+    } catch (...) {
+        RedisReplyArena::freeReply(reply);
+        throw;
+    }
+}
+
+redisReply* spredis::RedisCommandGroup::takeReply() {
+    if (m_next_reply >= m_replies.size()) return NULL;
+    return m_replies[m_next_reply++];
+}
+
+redisReply* spredis::RedisCommandGroup::peekReply() const {
+    if (m_next_reply >= m_replies.size()) return NULL;
+    return m_replies[m_next_reply];
+}
+
+void spredis::RedisCommandGroup::reset() {
+    for (size_t i = m_next_reply; i < m_replies.size(); ++i) {
+        RedisReplyArena::freeReply(m_replies[i]);
+    }
+    m_replies.clear();
+    m_next_reply = 0;
+    m_error = std::exception_ptr();
+    m_completed = false;
+}
@@ -0,0 +1,153 @@
+/**
+ * Licensed to the University Corporation for Advanced Internet
+ * Development, Inc. (UCAID) under one or more contributor license
+ * agreements. See the NOTICE file distributed with this work for
+ * additional information regarding copyright ownership.
+ *
+ * UCAID licenses this file to you under the Apache License,
+ * Version 2.0 (the "License"); you may not use this file except
+ * in compliance with the License. You may obtain a copy of the
+ * License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+ */
+
+/**
+ * redis-command-group.h
+ *
+ * Provides the RedisCommandGroup class, a group of preformatted commands sent
+ * to Redis as a unit, along with their replies.
+ */
+
+#ifndef REDIS_COMMAND_GROUP_H
+#define REDIS_COMMAND_GROUP_H
+
+#include <cassert>
+#include <exception>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include <hiredis/hiredis.h>
+
+namespace spredis {
+    /**
+     * A group of commands formatted ahead of time, so they can be written to
+     * the connection in one go, possibly together with the groups of other
+     * callers when automatic pipelining is enabled.
+     * The replies to the commands are read by the connection and stored in the
+     * group in order; the caller that built the group then takes them one by
+     * one, the same way they would be read from the connection directly.
+     *
+     * Groups are only ever used by a single caller, except while they are
+     * executed by the connection, so they do not perform any locking.
+     */
+    class SHIBSP_HIDDEN RedisCommandGroup SHIBSP_FINAL {
+    public:
+        RedisCommandGroup();
+
+        ~RedisCommandGroup();
+
+        /**
+         * Formats a command and appends it to the group. Takes the same
+         * format strings as redisCommand and friends.
+         */
+        void append(const char* fmt, ...);
+
+        /**
+         * Appends a command given as an argument vector, like
+         * redisCommandArgv. Useful for commands with a variable number of
+         * arguments.
+         */
+        void appendArgv(int argc, const char** argv, const size_t* argvlen);
+
+        /**
+         * Appends a command already formatted in the Redis protocol.
+         */
+        void appendFormatted(const char* command, size_t length);
+
+        const std::string& buffer() const { return m_buffer; }
+
+        size_t commandCount() const { return m_commands; }
+
+        /**
+         * Returns the command at the given index within the buffer, for
+         * connections which need to send the commands one by one.
+         */
+        const char* command(size_t index, size_t* out_length) const {
+            const size_t begin = index == 0 ? 0 : m_command_ends[index - 1];
+            *out_length = m_command_ends[index] - begin;
+            return m_buffer.data() + begin;
+        }
+
+        /**
+         * The amount of replies still to be read from the connection for the
+         * commands of this group.
+         */
+        size_t pendingReplies() const { return m_commands - m_replies.size(); }
+
+        /**
+         * Stores the next reply read for the group; the group takes ownership.
+         */
+        void addReply(void* reply);
+
+        /**
+         * Takes the next reply of the group in order, or returns NULL if all
+         * have been taken already. Ownership passes to the caller.
+         */
+        redisReply* takeReply();
+
+        /**
+         * Returns the next reply of the group without taking it, or NULL if
+         * all have been taken already. Ownership stays with the group.
+         */
+        redisReply* peekReply() const;
+
+        /**
+         * Discards the replies and the result of executing the group, so
+         * the same commands can be executed again.
+         */
+        void reset();
+
+        /**
+         * Marks the group as failed: none of its replies could be read.
+         */
+        void fail(const std::exception_ptr& error) { m_error = error; }
+
+        /**
+         * Rethrows the error which occurred while executing the group, if any.
+         */
+        void rethrowIfFailed() const {
+            if (m_error) std::rethrow_exception(m_error);
+        }
+
+        bool completed() const { return m_completed; }
+
+        void complete() { m_completed = true; }
+
+    private:
+        RedisCommandGroup(const RedisCommandGroup&) { assert(false); }
+
+        RedisCommandGroup&
+        operator=(const RedisCommandGroup&) {
+            assert(false);
+            return *this;
+        }
+
+        std::string m_buffer;
+        size_t m_commands;
+        std::vector<size_t> m_command_ends;
+        std::vector<redisReply*> m_replies;
+        size_t m_next_reply;
+        std::exception_ptr m_error;
+        bool m_completed;
+    };
+}
+
+#endif //REDIS_COMMAND_GROUP_H
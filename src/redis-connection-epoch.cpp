@@ -0,0 +1,296 @@
+/**
+ * Licensed to the University Corporation for Advanced Internet
+ * Development, Inc. (UCAID) under one or more contributor license
+ * agreements. See the NOTICE file distributed with this work for
+ * additional information regarding copyright ownership.
+ *
+ * UCAID licenses this file to you under the Apache License,
+ * Version 2.0 (the "License"); you may not use this file except
+ * in compliance with the License. You may obtain a copy of the
+ * License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+ */
+
+/**
+ * redis-connection-epoch.cpp
+ *
+ * Implementation of the context epochs of RedisConnection: a hash per context
+ * stored under `epoch.of:' (e.g. `epoch.of:{context:prefix}'), holding the
+ * generation of the last write in the context, and the generations of the
+ * last context operations.
+ *
+ * Epochs are only maintained if enabled, in which case the context operations
+ * only update the epoch, and the records they affect are recognized by their
+ * stamp when read.
+ */
+
+#include "redis-connection.h"
+#include "redis-command-group.h"
+#include "redis-stats.h"
+
+#include <cstdlib>
+
+// XXX Win32 - special config headers
+#include "config.h"
+
+#include <xmltooling/logging.h>
+
+using namespace xmltooling;
+
+namespace {
+    const int optimisticConcurrencyRetryCount = 3;
+
+    // fields missing from the epoch are read as 0
+    long long epochField(const redisReply* const field) {
+        if (field->type != REDIS_REPLY_STRING) return 0;
+        return std::strtoll(field->str, NULL, 10);
+    }
+
+    long long epochField(const spredis::RedisReply& field) {
+        if (field->type != REDIS_REPLY_STRING) return 0;
+        return std::strtoll(field->str, NULL, 10);
+    }
+}
+
+long long spredis::RedisConnection::touchContextEpoch(const char* const context, const time_t keepUntil) {
+    const StorageId epoch = make_index_id(context);
+
+    // a new epoch does not have an expiration, which GT would never set:
+    // NX sets the first one, GT extends it for longer-lived records
+    RedisCommandGroup command;
+    command.append("MULTI");
+    command.append("HINCRBY epoch.of:" SPREDIS_SID_FMT " generation 1", SPREDIS_SID_FPARAM(epoch));
+    command.append("HSETNX epoch.of:" SPREDIS_SID_FMT " horizon %lld",
+                   SPREDIS_SID_FPARAM(epoch),
+                   static_cast<long long>(keepUntil));
+    command.append("EXPIREAT epoch.of:" SPREDIS_SID_FMT " %lld NX",
+                   SPREDIS_SID_FPARAM(epoch),
+                   static_cast<long long>(keepUntil));
+    command.append("EXPIREAT epoch.of:" SPREDIS_SID_FMT " %lld GT",
+                   SPREDIS_SID_FPARAM(epoch),
+                   static_cast<long long>(keepUntil));
+    command.append("HGET epoch.of:" SPREDIS_SID_FMT " horizon", SPREDIS_SID_FPARAM(epoch));
+    command.append("EXEC");
+    execute(command);
+
+    RedisReply reply(this);
+    reply.getNextFrom(command, "touchContextEpoch", "MULTI", REDIS_REPLY_STATUS);
+    reply.getNextFrom(command, "touchContextEpoch", "HINCRBY", REDIS_REPLY_STATUS);
+    reply.getNextFrom(command, "touchContextEpoch", "HSETNX", REDIS_REPLY_STATUS);
+    reply.getNextFrom(command, "touchContextEpoch", "EXPIREAT (NX)", REDIS_REPLY_STATUS);
+    reply.getNextFrom(command, "touchContextEpoch", "EXPIREAT (GT)", REDIS_REPLY_STATUS);
+    reply.getNextFrom(command, "touchContextEpoch", "HGET", REDIS_REPLY_STATUS);
+    reply.getNextFrom(command, "touchContextEpoch", "EXEC", REDIS_REPLY_ARRAY);
+
+    if (reply->elements != 5)
+        handleCommandError("touchContextEpoch", "EXEC",
+                           "incorrect amount of results from EXEC",
+                           sizeof("incorrect amount of results from EXEC") - 1);
+
+    const RedisReply generation(this, reply->element[0], RedisReply::nonOwning);
+    generation.throwIfErroneous("touchContextEpoch", "HINCRBY");
+    generation.ensureType(REDIS_REPLY_INTEGER, "touchContextEpoch");
+
+    // the record is kept for a shorter time than the others: lower the
+    // horizon, so the next updateContext extends every record again
+    if (epochField(reply->element[4]) > keepUntil) {
+        const Lock lock(m_mutex);
+        lowerContextEpochHorizonUnguarded(epoch, keepUntil);
+    }
+
+    return generation->integer;
+}
+
+bool spredis::RedisConnection::readContextEpoch(const char* const context, ContextEpoch* const out_epoch) {
+    const StorageId epoch = make_index_id(context);
+
+    RedisCommandGroup command;
+    command.append("HMGET epoch.of:" SPREDIS_SID_FMT " generation deleted expired expiration horizon",
+                   SPREDIS_SID_FPARAM(epoch));
+    execute(command);
+
+    RedisReply reply(this);
+    reply.getNextFrom(command, "readContextEpoch", "HMGET", REDIS_REPLY_ARRAY);
+
+    if (reply->elements != 5)
+        handleCommandError("readContextEpoch", "HMGET",
+                           "incorrect amount of results from HMGET",
+                           sizeof("incorrect amount of results from HMGET") - 1);
+
+    if (reply->element[0]->type == REDIS_REPLY_NIL) return false; // no epoch
+
+    out_epoch->generation = epochField(reply->element[0]);
+    out_epoch->deleted = epochField(reply->element[1]);
+    out_epoch->expired = epochField(reply->element[2]);
+    out_epoch->expiration = static_cast<time_t>(epochField(reply->element[3]));
+    out_epoch->horizon = static_cast<time_t>(epochField(reply->element[4]));
+    return true;
+}
+
+long long spredis::RedisConnection::expireContextEpoch(const char* const context,
+                                                       const time_t expiration,
+                                                       const time_t keepUntil,
+                                                       time_t* const out_horizon) {
+    const Lock lock(m_mutex);
+    return advanceContextEpochUnguarded(make_index_id(context), expiration, keepUntil, out_horizon);
+}
+
+long long spredis::RedisConnection::deleteContextEpoch(const char* const context) {
+    const Lock lock(m_mutex);
+    return advanceContextEpochUnguarded(make_index_id(context), 0, 0, NULL);
+}
+
+void spredis::RedisConnection::raiseContextEpochHorizon(const char* const context,
+                                                        const long long generation,
+                                                        const time_t horizon) {
+    const StorageId epoch = make_index_id(context);
+    const Lock lock(m_mutex);
+
+    appendCommand("WATCH epoch.of:" SPREDIS_SID_FMT, SPREDIS_SID_FPARAM(epoch));
+    RedisReply reply(this);
+    reply.getNextFromConnection("raiseContextEpochHorizon", "WATCH", REDIS_REPLY_STATUS);
+
+    const RedisReply current(this,
+                             redisCommand(m_redis, "HGET epoch.of:" SPREDIS_SID_FMT " generation",
+                                          SPREDIS_SID_FPARAM(epoch)));
+    current.throwIfErroneous("raiseContextEpochHorizon", "HGET");
+    // a record was written meanwhile, which may be kept for a shorter time:
+    // leaving the horizon low is always safe
+    if (epochField(current) != generation) {
+        unwatch("raiseContextEpochHorizon");
+        return;
+    }
+
+    appendCommand("MULTI");
+    appendCommand("HSET epoch.of:" SPREDIS_SID_FMT " horizon %lld",
+                  SPREDIS_SID_FPARAM(epoch),
+                  static_cast<long long>(horizon));
+    appendCommand("EXPIREAT epoch.of:" SPREDIS_SID_FMT " %lld GT",
+                  SPREDIS_SID_FPARAM(epoch),
+                  static_cast<long long>(horizon));
+    appendCommand("EXEC");
+
+    reply.getNextFromConnection("raiseContextEpochHorizon", "MULTI", REDIS_REPLY_STATUS);
+    reply.getNextFromConnection("raiseContextEpochHorizon", "HSET", REDIS_REPLY_STATUS);
+    reply.getNextFromConnection("raiseContextEpochHorizon", "EXPIREAT", REDIS_REPLY_STATUS);
+    reply.getNextFromConnection("raiseContextEpochHorizon", "EXEC");
+
+    if (reply->type == REDIS_REPLY_NIL) {
+        m_logger.debug("(raiseContextEpochHorizon) epoch of context %s changed: horizon left as is", context);
+        RedisStats::getInstance().count(RedisStats::CONCURRENCY_FAILURES);
+    }
+}
+
+long long spredis::RedisConnection::advanceContextEpochUnguarded(const StorageId& epoch,
+                                                                 const time_t expiration,
+                                                                 const time_t keepUntil,
+                                                                 time_t* const out_horizon) {
+    const char* const fn = expiration != 0 ? "expireContextEpoch" : "deleteContextEpoch";
+    RedisReply reply(this);
+
+    for (int tryCount = 0; tryCount < optimisticConcurrencyRetryCount; ++tryCount) {
+        appendCommand("WATCH epoch.of:" SPREDIS_SID_FMT, SPREDIS_SID_FPARAM(epoch));
+        reply.getNextFromConnection(fn, "WATCH", REDIS_REPLY_STATUS);
+
+        const RedisReply current(this,
+                                 redisCommand(m_redis, "HMGET epoch.of:" SPREDIS_SID_FMT " generation horizon",
+                                              SPREDIS_SID_FPARAM(epoch)));
+        current.throwIfErroneous(fn, "HMGET");
+        current.ensureType(REDIS_REPLY_ARRAY, fn);
+        if (current->elements != 2)
+            handleCommandError(fn, "HMGET",
+                               "incorrect amount of results from HMGET",
+                               sizeof("incorrect amount of results from HMGET") - 1);
+        if (current->element[0]->type == REDIS_REPLY_NIL) {
+            unwatch(fn);
+            return 0; // no epoch
+        }
+
+        // the generation is only advanced if nothing was written meanwhile,
+        // so concurrent context operations are ordered by their generation
+        const long long generation = epochField(current->element[0]) + 1;
+        appendCommand("MULTI");
+        if (expiration != 0) {
+            appendCommand("HSET epoch.of:" SPREDIS_SID_FMT " generation %lld expired %lld expiration %lld",
+                          SPREDIS_SID_FPARAM(epoch),
+                          generation,
+                          generation,
+                          static_cast<long long>(expiration));
+            appendCommand("EXPIREAT epoch.of:" SPREDIS_SID_FMT " %lld GT",
+                          SPREDIS_SID_FPARAM(epoch),
+                          static_cast<long long>(keepUntil));
+        } else {
+            appendCommand("HSET epoch.of:" SPREDIS_SID_FMT " generation %lld deleted %lld",
+                          SPREDIS_SID_FPARAM(epoch),
+                          generation,
+                          generation);
+        }
+        appendCommand("EXEC");
+
+        reply.getNextFromConnection(fn, "MULTI", REDIS_REPLY_STATUS);
+        reply.getNextFromConnection(fn, "HSET", REDIS_REPLY_STATUS);
+        if (expiration != 0) reply.getNextFromConnection(fn, "EXPIREAT", REDIS_REPLY_STATUS);
+        reply.getNextFromConnection(fn, "EXEC");
+
+        if (reply->type == REDIS_REPLY_NIL) {
+            m_logger.notice("(%s) concurrency failure: retrying updating epoch " SPREDIS_SID_LFMT,
+                            fn,
+                            SPREDIS_SID_LPARAM(epoch));
+            RedisStats::getInstance().count(RedisStats::CONCURRENCY_FAILURES);
+            continue;
+        }
+        reply.ensureType(REDIS_REPLY_ARRAY, fn);
+
+        if (out_horizon) *out_horizon = static_cast<time_t>(epochField(current->element[1]));
+        return generation;
+    }
+
+    m_logger.warn("(%s) concurrency failure: too-many retries while updating epoch " SPREDIS_SID_LFMT,
+                  fn,
+                  SPREDIS_SID_LPARAM(epoch));
+    throw IOException("Redis context epoch could not be updated: too many concurrent writes");
+}
+
+void spredis::RedisConnection::lowerContextEpochHorizonUnguarded(const StorageId& epoch, const time_t horizon) {
+    RedisReply reply(this);
+
+    for (int tryCount = 0; tryCount < optimisticConcurrencyRetryCount; ++tryCount) {
+        appendCommand("WATCH epoch.of:" SPREDIS_SID_FMT, SPREDIS_SID_FPARAM(epoch));
+        reply.getNextFromConnection("touchContextEpoch", "WATCH", REDIS_REPLY_STATUS);
+
+        const RedisReply current(this,
+                                 redisCommand(m_redis, "HGET epoch.of:" SPREDIS_SID_FMT " horizon",
+                                              SPREDIS_SID_FPARAM(epoch)));
+        current.throwIfErroneous("touchContextEpoch", "HGET");
+        if (epochField(current) <= horizon) {
+            unwatch("touchContextEpoch");
+            return;
+        }
+
+        appendCommand("MULTI");
+        appendCommand("HSET epoch.of:" SPREDIS_SID_FMT " horizon %lld",
+                      SPREDIS_SID_FPARAM(epoch),
+                      static_cast<long long>(horizon));
+        appendCommand("EXEC");
+
+        reply.getNextFromConnection("touchContextEpoch", "MULTI", REDIS_REPLY_STATUS);
+        reply.getNextFromConnection("touchContextEpoch", "HSET", REDIS_REPLY_STATUS);
+        reply.getNextFromConnection("touchContextEpoch", "EXEC");
+
+        if (reply->type != REDIS_REPLY_NIL) return;
+        RedisStats::getInstance().count(RedisStats::CONCURRENCY_FAILURES);
+    }
+
+    // the record must not be written with a horizon promising too much
+    m_logger.warn("(touchContextEpoch) concurrency failure: too-many retries while lowering horizon of "
+                  SPREDIS_SID_LFMT,
+                  SPREDIS_SID_LPARAM(epoch));
+    throw IOException("Redis context epoch could not be updated: too many concurrent writes");
+}
@@ -0,0 +1,251 @@
+/**
+ * Licensed to the University Corporation for Advanced Internet
+ * Development, Inc. (UCAID) under one or more contributor license
+ * agreements. See the NOTICE file distributed with this work for
+ * additional information regarding copyright ownership.
+ *
+ * UCAID licenses this file to you under the Apache License,
+ * Version 2.0 (the "License"); you may not use this file except
+ * in compliance with the License. You may obtain a copy of the
+ * License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+ */
+
+/**
+ * redis-connection-hash.cpp
+ *
+ * Implementation of the hash record layout of RedisConnection: the value and
+ * the version of a record are stored as the `value' and `version' fields of a
+ * single hash, which has a single expiration.
+ *
+ * Records written in the key layout (a string key and a separate `version.of:'
+ * key) are still understood: reading and updating them falls back to the key
+ * layout implementation.
+ */
+
+#include "redis-connection.h"
+#include "redis-command-group.h"
+#include "redis-stats.h"
+
+// XXX Win32 - special config headers
+#include "config.h"
+
+#include <xmltooling/logging.h>
+
+using namespace xmltooling;
+
+namespace {
+    const int optimisticConcurrencyRetryCount = 3;
+}
+
+bool spredis::RedisConnection::setHash(const StorageId& id, const char* value, const time_t expiration) {
+    // load tr. as pipelined commands
+    // HSETNX fails on existing fields, so it doesn't touch an existing record,
+    // and neither does EXPIREAT NX, as an existing record already expires
+    appendCommand("MULTI");
+    appendCommand("HSETNX " SPREDIS_SID_FMT " value %s",
+                  SPREDIS_SID_FPARAM(id),
+                  value);
+    appendCommand("HSETNX " SPREDIS_SID_FMT " version 1",
+                  SPREDIS_SID_FPARAM(id));
+    appendCommand("EXPIREAT " SPREDIS_SID_FMT " %lld NX",
+                  SPREDIS_SID_FPARAM(id),
+                  static_cast<long long>(expiration));
+    appendCommand("EXEC");
+
+    // get pipeline results
+    RedisReply reply(this);
+    reply.getNextFromConnection("set", "MULTI", REDIS_REPLY_STATUS);
+    reply.getNextFromConnection("set", "HSETNX (data)", REDIS_REPLY_STATUS);
+    reply.getNextFromConnection("set", "HSETNX (version)", REDIS_REPLY_STATUS);
+    reply.getNextFromConnection("set", "EXPIREAT", REDIS_REPLY_STATUS);
+    reply.getNextFromConnection("set", "EXEC", REDIS_REPLY_ARRAY); // perform tr.
+
+    if (reply->elements != 3) // incorrect amount of results is a fatal error
+        handleCommandError("set", "EXEC",
+                           "incorrect amount of results from EXEC",
+                           sizeof("incorrect amount of results from EXEC") - 1);
+
+    // the key exists, and is a record in the key layout
+    const RedisReply data(this, reply->element[0], RedisReply::nonOwning);
+    if (data.isError("WRONGTYPE")) return false;
+    data.throwIfErroneous("set", "HSETNX (data)");
+    data.ensureType(REDIS_REPLY_INTEGER, "set");
+    if (data->integer == 0) return false;
+
+    const RedisReply version(this, reply->element[1], RedisReply::nonOwning);
+    version.throwIfErroneous("set", "HSETNX (version)");
+    version.ensureType(REDIS_REPLY_INTEGER, "set");
+    if (version->integer == 0) {
+        m_logger.warn("version value exists for non-existent key " SPREDIS_SID_LFMT,
+                      SPREDIS_SID_LPARAM(id));
+        // clean up value and version
+        RedisReply tmp(this,
+                       redisCommand(m_redis, "UNLINK " SPREDIS_SID_FMT,
+                                    SPREDIS_SID_FPARAM(id)));
+        return false;
+    }
+
+    return true;
+}
+
+int spredis::RedisConnection::readHash(const StorageId& id, std::string* out_value, time_t* out_expiration,
+                                       const int minVersion) {
+    // both fields are read in one command, so there is no need to WATCH the
+    // version: the transaction itself is the consistent snapshot
+    RedisCommandGroup command;
+    command.append("MULTI");
+    if (out_value) command.append("HMGET " SPREDIS_SID_FMT " version value", SPREDIS_SID_FPARAM(id));
+    else command.append("HMGET " SPREDIS_SID_FMT " version", SPREDIS_SID_FPARAM(id));
+    if (out_expiration) command.append("EXPIRETIME " SPREDIS_SID_FMT, SPREDIS_SID_FPARAM(id));
+    command.append("EXEC");
+    execute(command);
+
+    RedisReply reply(this);
+    reply.getNextFrom(command, "readHash", "MULTI", REDIS_REPLY_STATUS);
+    reply.getNextFrom(command, "readHash", "HMGET", REDIS_REPLY_STATUS);
+    if (out_expiration) reply.getNextFrom(command, "readHash", "EXPIRETIME", REDIS_REPLY_STATUS);
+    reply.getNextFrom(command, "readHash", "EXEC", REDIS_REPLY_ARRAY);
+
+    // incorrect amount of results is a fatal error
+    if (reply->elements != 1ULL + (out_expiration != NULL))
+        handleCommandError("readHash", "EXEC",
+                           "incorrect amount of results from EXEC",
+                           sizeof("incorrect amount of results from EXEC") - 1);
+
+    const RedisReply fields(this, reply->element[0], RedisReply::nonOwning);
+    if (fields.isError("WRONGTYPE")) {
+        m_logger.debug("(readHash) key " SPREDIS_SID_LFMT " is stored in the key layout",
+                       SPREDIS_SID_LPARAM(id));
+        if (minVersion > 0) {
+            const Lock ulock(m_mutex);
+            return getVersionedKeys(id, out_value, out_expiration, minVersion);
+        }
+        return forceGetKeys(id, out_value, out_expiration);
+    }
+    fields.throwIfErroneous("readHash", "HMGET");
+    fields.ensureType(REDIS_REPLY_ARRAY, "readHash");
+
+    if (fields->elements != 1ULL + (out_value != NULL))
+        handleCommandError("readHash", "HMGET",
+                           "incorrect amount of results from HMGET",
+                           sizeof("incorrect amount of results from HMGET") - 1);
+
+    if (fields->element[0]->type == REDIS_REPLY_NIL) return 0; // key not found
+
+    RedisReply(this, fields->element[0], RedisReply::nonOwning).ensureType(REDIS_REPLY_STRING, "readHash");
+    const int version = parseNumber(id, "readHash", fields->element[0]->str, fields->element[0]->len);
+
+    if (out_value && version >= minVersion) {
+        if (fields->element[1]->type == REDIS_REPLY_NIL) return 0; // incomplete record
+
+        RedisReply(this, fields->element[1], RedisReply::nonOwning).ensureType(REDIS_REPLY_STRING, "readHash");
+        *out_value = std::string(fields->element[1]->str, fields->element[1]->len);
+    }
+    if (out_expiration) {
+        RedisReply(this, reply->element[1], RedisReply::nonOwning).ensureType(REDIS_REPLY_INTEGER, "readHash");
+        *out_expiration = reply->element[1]->integer;
+    }
+
+    return version;
+}
+
+int spredis::RedisConnection::updateHash(const StorageId& id,
+                                         const char* value,
+                                         const time_t expiration,
+                                         const int ifVersion,
+                                         const bool checkVersion) {
+    RedisReply reply(this);
+
+    for (int tryCount = 0; tryCount < optimisticConcurrencyRetryCount; ++tryCount) {
+        appendCommand("WATCH " SPREDIS_SID_FMT,
+                      SPREDIS_SID_FPARAM(id));
+        reply.getNextFromConnection("updateHash", "WATCH", REDIS_REPLY_STATUS);
+
+        const RedisReply version(this,
+                                 redisCommand(m_redis, "HGET " SPREDIS_SID_FMT " version",
+                                              SPREDIS_SID_FPARAM(id)));
+        if (version.isError("WRONGTYPE")) {
+            m_logger.debug("(updateHash) key " SPREDIS_SID_LFMT " is stored in the key layout",
+                           SPREDIS_SID_LPARAM(id));
+            unwatch("updateHash");
+            if (checkVersion) return updateVersionedKeys(id, value, expiration, ifVersion);
+            return forceUpdateKeys(id, value, expiration);
+        }
+        version.throwIfErroneous("updateHash", "HGET (version)");
+        if (version->type == REDIS_REPLY_NIL) {
+            unwatch("updateHash");
+            return 0; // key not found
+        }
+        version.ensureType(REDIS_REPLY_STRING, "updateHash");
+
+        // if version mismatch, report failure
+        const int currentVersion = parseNumber(id, "updateHash", version->str, version->len);
+        if (checkVersion && currentVersion != ifVersion) {
+            unwatch("updateHash");
+            return -1;
+        }
+
+        // update tr. as pipeline
+        appendCommand("MULTI");
+        appendCommand("HSET " SPREDIS_SID_FMT " value %s", SPREDIS_SID_FPARAM(id), value);
+        appendCommand("HINCRBY " SPREDIS_SID_FMT " version 1", SPREDIS_SID_FPARAM(id));
+        if (expiration != 0) {
+            appendCommand("EXPIREAT " SPREDIS_SID_FMT " %lld",
+                          SPREDIS_SID_FPARAM(id),
+                          static_cast<long long>(expiration));
+        }
+        appendCommand("EXEC");
+
+        reply.getNextFromConnection("updateHash", "MULTI", REDIS_REPLY_STATUS);
+        reply.getNextFromConnection("updateHash", "HSET (data)", REDIS_REPLY_STATUS);
+        reply.getNextFromConnection("updateHash", "HINCRBY (version)", REDIS_REPLY_STATUS);
+        if (expiration != 0) reply.getNextFromConnection("updateHash", "EXPIREAT", REDIS_REPLY_STATUS);
+        reply.getNextFromConnection("updateHash", "EXEC");
+
+        if (reply->type == REDIS_REPLY_NIL) {
+            m_logger.notice("(updateHash) concurrency failure: retrying accessing " SPREDIS_SID_LFMT,
+                            SPREDIS_SID_LPARAM(id));
+            RedisStats::getInstance().count(RedisStats::CONCURRENCY_FAILURES);
+            continue;
+        }
+        reply.ensureType(REDIS_REPLY_ARRAY, "updateHash");
+
+        // incorrect amount of results is a fatal error
+        // value + version + optional expiration
+        if (reply->elements != 2ULL + (expiration != 0))
+            handleCommandError("updateHash", "EXEC",
+                               "incorrect amount of results from EXEC",
+                               sizeof("incorrect amount of results from EXEC") - 1);
+
+        RedisReply(this, reply->element[0], RedisReply::nonOwning)
+                .ensureType(REDIS_REPLY_INTEGER, "updateHash");
+
+        const RedisReply incr(this, reply->element[1], RedisReply::nonOwning);
+        incr.ensureType(REDIS_REPLY_INTEGER, "updateHash");
+        if (incr->integer - 1 != currentVersion) {
+            m_logger.warn("(updateHash) severe concurrency failure: retrying accessing " SPREDIS_SID_LFMT,
+                          SPREDIS_SID_LPARAM(id));
+            RedisStats::getInstance().count(RedisStats::CONCURRENCY_FAILURES);
+            continue;
+        }
+
+        if (expiration != 0) {
+            RedisReply(this, reply->element[2], RedisReply::nonOwning)
+                    .ensureType(REDIS_REPLY_INTEGER, "updateHash");
+        }
+
+        return static_cast<int>(incr->integer);
+    }
+
+    m_logger.warn("(updateHash) concurrency failure: too-many retries while updating " SPREDIS_SID_LFMT,
+                  SPREDIS_SID_LPARAM(id));
+    return 0;
+}
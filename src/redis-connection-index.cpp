@@ -0,0 +1,195 @@
+/**
+ * Licensed to the University Corporation for Advanced Internet
+ * Development, Inc. (UCAID) under one or more contributor license
+ * agreements. See the NOTICE file distributed with this work for
+ * additional information regarding copyright ownership.
+ *
+ * UCAID licenses this file to you under the Apache License,
+ * Version 2.0 (the "License"); you may not use this file except
+ * in compliance with the License. You may obtain a copy of the
+ * License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+ */
+
+/**
+ * redis-connection-index.cpp
+ *
+ * Implementation of the context index of RedisConnection: a sorted set per
+ * context stored under `index.of:' (e.g. `index.of:{context:prefix}'), whose
+ * members are the keys of the records in the context, scored by their
+ * expiration.
+ *
+ * The index is only maintained if enabled, in which case the context
+ * operations walk its members, instead of scanning the whole keyspace.
+ */
+
+#include "redis-connection.h"
+#include "redis-command-group.h"
+
+#include <cstdlib>
+
+// XXX Win32 - special config headers
+#include "config.h"
+
+#include <xmltooling/logging.h>
+
+using namespace xmltooling;
+
+void spredis::RedisConnection::indexRecord(const StorageId& id, const time_t expiration) {
+    const StorageId index = id.contextIndex();
+
+    // a new index does not have an expiration, which GT would never set:
+    // NX sets the first one, GT extends it for longer-lived members
+    RedisCommandGroup command;
+    command.append("ZADD index.of:" SPREDIS_SID_FMT " %lld " SPREDIS_SID_FMT,
+                   SPREDIS_SID_FPARAM(index),
+                   static_cast<long long>(expiration),
+                   SPREDIS_SID_FPARAM(id));
+    command.append("EXPIREAT index.of:" SPREDIS_SID_FMT " %lld NX",
+                   SPREDIS_SID_FPARAM(index),
+                   static_cast<long long>(expiration));
+    command.append("EXPIREAT index.of:" SPREDIS_SID_FMT " %lld GT",
+                   SPREDIS_SID_FPARAM(index),
+                   static_cast<long long>(expiration));
+    command.append("ZREMRANGEBYSCORE index.of:" SPREDIS_SID_FMT " -inf (%lld",
+                   SPREDIS_SID_FPARAM(index),
+                   static_cast<long long>(time(NULL)));
+    execute(command);
+
+    RedisReply reply(this);
+    reply.getNextFrom(command, "indexRecord", "ZADD", REDIS_REPLY_INTEGER);
+    reply.getNextFrom(command, "indexRecord", "EXPIREAT (NX)", REDIS_REPLY_INTEGER);
+    reply.getNextFrom(command, "indexRecord", "EXPIREAT (GT)", REDIS_REPLY_INTEGER);
+    reply.getNextFrom(command, "indexRecord", "ZREMRANGEBYSCORE", REDIS_REPLY_INTEGER);
+}
+
+void spredis::RedisConnection::unindexRecord(const StorageId& id) {
+    const StorageId index = id.contextIndex();
+
+    RedisCommandGroup command;
+    command.append("ZREM index.of:" SPREDIS_SID_FMT " " SPREDIS_SID_FMT,
+                   SPREDIS_SID_FPARAM(index),
+                   SPREDIS_SID_FPARAM(id));
+    execute(command);
+
+    RedisReply reply(this);
+    reply.getNextFrom(command, "unindexRecord", "ZREM", REDIS_REPLY_INTEGER);
+}
+
+void spredis::RedisConnection::expireContextIndex(const char* const context, const time_t expiration) {
+    const StorageId index = make_index_id(context);
+    const Lock lock(m_mutex);
+
+    // rescore the members page by page: this is only O(context size) like
+    // the walk updating the records themselves
+    std::vector<std::string> members;
+    unsigned long long cursor = 0;
+    do {
+        members.clear();
+        cursor = scanContextIndexPageUnguarded(context, cursor, &members);
+        if (members.empty()) continue;
+
+        RedisCommandGroup command;
+        for (size_t i = 0; i < members.size(); ++i) {
+            command.append("ZADD index.of:" SPREDIS_SID_FMT " XX %lld %b",
+                           SPREDIS_SID_FPARAM(index),
+                           static_cast<long long>(expiration),
+                           members[i].data(),
+                           members[i].size());
+        }
+        executeUnguarded(command);
+
+        RedisReply reply(this);
+        for (size_t i = 0; i < members.size(); ++i) {
+            reply.getNextFrom(command, "expireContextIndex", "ZADD", REDIS_REPLY_INTEGER);
+        }
+    } while (cursor != 0);
+
+    RedisCommandGroup command;
+    command.append("EXPIREAT index.of:" SPREDIS_SID_FMT " %lld",
+                   SPREDIS_SID_FPARAM(index),
+                   static_cast<long long>(expiration));
+    executeUnguarded(command);
+
+    RedisReply reply(this);
+    reply.getNextFrom(command, "expireContextIndex", "EXPIREAT", REDIS_REPLY_INTEGER);
+}
+
+void spredis::RedisConnection::deleteContextIndex(const char* const context) {
+    const StorageId index = make_index_id(context);
+
+    RedisCommandGroup command;
+    command.append("UNLINK index.of:" SPREDIS_SID_FMT, SPREDIS_SID_FPARAM(index));
+    execute(command);
+
+    RedisReply reply(this);
+    reply.getNextFrom(command, "deleteContextIndex", "UNLINK", REDIS_REPLY_INTEGER);
+}
+
+unsigned long long spredis::RedisConnection::scanContextIndexPage(const char* const context,
+                                                                  const unsigned long long cursor,
+                                                                  std::vector<std::string>* const out_members) {
+    const Lock lock(m_mutex);
+    return scanContextIndexPageUnguarded(context, cursor, out_members);
+}
+
+unsigned long long spredis::RedisConnection::scanContextIndexPageUnguarded(const char* const context,
+                                                                           const unsigned long long cursor,
+                                                                           std::vector<std::string>* const
+                                                                           out_members) {
+    const StorageId index = make_index_id(context);
+
+    appendCommand("ZSCAN index.of:" SPREDIS_SID_FMT " %llu COUNT %u",
+                  SPREDIS_SID_FPARAM(index),
+                  cursor,
+                  m_scan_count);
+    RedisReply reply(this);
+    reply.getNextFromConnection("scanContextIndex", "ZSCAN", REDIS_REPLY_ARRAY);
+
+    if (reply->elements != 2)
+        handleCommandError("scanContextIndex", "ZSCAN",
+                           "incorrect amount of results from ZSCAN",
+                           sizeof("incorrect amount of results from ZSCAN") - 1);
+
+    RedisReply(this, reply->element[0], RedisReply::nonOwning).ensureType(REDIS_REPLY_STRING, "scanContextIndex");
+    RedisReply(this, reply->element[1], RedisReply::nonOwning).ensureType(REDIS_REPLY_ARRAY, "scanContextIndex");
+
+    // members and their scores alternate
+    const redisReply* const members = reply->element[1];
+    for (size_t i = 0; i + 1 < members->elements; i += 2) {
+        if (members->element[i]->type != REDIS_REPLY_STRING) {
+            m_logger.warn("(scanContextIndex) non-string member returned during scanning: type %d at index %zu",
+                          members->element[i]->type,
+                          i);
+            continue;
+        }
+        out_members->push_back(std::string(members->element[i]->str, members->element[i]->len));
+    }
+
+    return std::strtoull(reply->element[0]->str, NULL, 10);
+}
+
+size_t spredis::RedisConnection::scanContextIndexTypeless(const char* const context,
+                                                          RawCallbackType callback, void* callbackContext) {
+    const Lock lock(m_mutex);
+    size_t count = 0;
+
+    std::vector<std::string> members;
+    unsigned long long cursor = 0;
+    do {
+        members.clear();
+        cursor = scanContextIndexPageUnguarded(context, cursor, &members);
+        count += members.size();
+
+        if (!members.empty()) callback(callbackContext, this, members);
+    } while (cursor != 0);
+
+    return count;
+}
@@ -0,0 +1,164 @@
+/**
+ * Licensed to the University Corporation for Advanced Internet
+ * Development, Inc. (UCAID) under one or more contributor license
+ * agreements. See the NOTICE file distributed with this work for
+ * additional information regarding copyright ownership.
+ *
+ * UCAID licenses this file to you under the Apache License,
+ * Version 2.0 (the "License"); you may not use this file except
+ * in compliance with the License. You may obtain a copy of the
+ * License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+ */
+
+/**
+ * redis-connection-pipeline.cpp
+ *
+ * Implementation of executing command groups on a RedisConnection, including
+ * the automatic pipelining of groups submitted by concurrent callers.
+ *
+ * Pipelining uses a leader/follower scheme: callers queue their groups, and
+ * the first one to find no other caller communicating with the server becomes
+ * the leader. The leader writes every queued group (up to the batch size) in
+ * a single write, reads all their replies in order, then hands the groups
+ * back to their callers. Groups queued while a batch is in flight are sent in
+ * the next batch, so no timers are needed: the more concurrent the callers,
+ * the larger the batches become.
+ */
+
+#include "redis-connection.h"
+#include "redis-command-group.h"
+
+// XXX Win32 - special config headers
+#include "config.h"
+
+#include <xmltooling/logging.h>
+
+using namespace xmltooling;
+
+void spredis::RedisConnection::connectAsync(const RedisConfig& config,
+                                            const std::string& redisHost,
+                                            const int redisPort) {
+#ifdef SPREDIS_HAVE_ASYNC_ENGINE
+    if (config.asyncEngine()) m_async.reset(new RedisAsyncConnection(config, redisHost, redisPort));
+#else
+    (void) config;
+    (void) redisHost;
+    (void) redisPort;
+#endif
+}
+
+void spredis::RedisConnection::execute(RedisCommandGroup& command) {
+#ifdef SPREDIS_HAVE_ASYNC_ENGINE
+    if (m_async) {
+        m_async->execute(command);
+        return;
+    }
+#endif
+
+    if (!m_auto_pipeline) {
+        const Lock ulock(m_mutex);
+        executeUnguarded(command);
+        return;
+    }
+
+    bool lead = false;
+    {
+        const Lock qlock(m_queue_mutex);
+        m_queue.push_back(&command);
+
+        // wait until either the current leader sent our group, or it stepped
+        // down without doing so, in which case we take over its role
+        while (!command.completed() && m_pipeline_leader) {
+            m_queue_changed->wait(m_queue_mutex.get());
+        }
+        if (!command.completed()) {
+            m_pipeline_leader = true;
+            lead = true;
+        }
+    }
+
+    if (lead) leadPipeline(command);
+    command.rethrowIfFailed();
+}
+
+void spredis::RedisConnection::executeUnguarded(RedisCommandGroup& command) {
+    const std::string& buffer = command.buffer();
+    if (redisAppendFormattedCommand(m_redis, buffer.data(), buffer.size()) != REDIS_OK)
+        handleCriticalError("execute");
+    readRepliesUnguarded(command);
+}
+
+void spredis::RedisConnection::leadPipeline(const RedisCommandGroup& own) {
+    std::vector<RedisCommandGroup*> batch;
+    batch.reserve(m_pipeline_batch_size);
+
+    for (;;) {
+        {
+            const Lock qlock(m_queue_mutex);
+            for (size_t i = 0; i < batch.size(); ++i) {
+                batch[i]->complete();
+            }
+            if (!batch.empty()) m_queue_changed->broadcast();
+            batch.clear();
+
+            // step down as soon as our own group is done, so our caller is not
+            // kept waiting for the groups of other callers: one of them takes
+            // over, if any are still queued
+            if (own.completed()) {
+                m_pipeline_leader = false;
+                m_queue_changed->broadcast();
+                return;
+            }
+
+            while (!m_queue.empty() && batch.size() < m_pipeline_batch_size) {
+                batch.push_back(m_queue.front());
+                m_queue.pop_front();
+            }
+        }
+
+        m_logger.debug("pipelining %u command groups", static_cast<unsigned int>(batch.size()));
+
+        const Lock ulock(m_mutex);
+        flushBatchUnguarded(batch);
+    }
+}
+
+void spredis::RedisConnection::flushBatchUnguarded(const std::vector<RedisCommandGroup*>& batch) {
+    size_t read = 0;
+    try {
+        // hiredis only buffers appended commands, they are all written at
+        // once when the first reply is read
+        for (size_t i = 0; i < batch.size(); ++i) {
+            const std::string& buffer = batch[i]->buffer();
+            if (redisAppendFormattedCommand(m_redis, buffer.data(), buffer.size()) != REDIS_OK)
+                handleCriticalError("pipeline");
+        }
+
+        for (; read < batch.size(); ++read) {
+            readRepliesUnguarded(*batch[read]);
+        }
+    } catch (...) {
+        // the groups whose replies were read are unaffected, the others may
+        // or may not have been executed, the same as if they were sent alone
+        const std::exception_ptr error = std::current_exception();
+        for (size_t i = read; i < batch.size(); ++i) {
+            batch[i]->fail(error);
+        }
+    }
+}
+
+void spredis::RedisConnection::readRepliesUnguarded(RedisCommandGroup& command) {
+    while (command.pendingReplies() > 0) {
+        void* reply = NULL;
+        if (redisGetReply(m_redis, &reply) != REDIS_OK) handleCriticalError("execute");
+        command.addReply(reply);
+    }
+}
@@ -0,0 +1,373 @@
+/**
+ * Licensed to the University Corporation for Advanced Internet
+ * Development, Inc. (UCAID) under one or more contributor license
+ * agreements. See the NOTICE file distributed with this work for
+ * additional information regarding copyright ownership.
+ *
+ * UCAID licenses this file to you under the Apache License,
+ * Version 2.0 (the "License"); you may not use this file except
+ * in compliance with the License. You may obtain a copy of the
+ * License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+ */
+
+/**
+ * redis-connection-pool.cpp
+ *
+ * Implementation of the RedisConnectionPool type.
+ */
+
+#include "redis-connection-pool.h"
+
+#include <algorithm>
+#include <chrono>
+
+#include <xmltooling/exceptions.h>
+
+using namespace xmltooling;
+
+namespace {
+    /**
+     * The latencies recorded for a server before its reads are hedged: the
+     * percentiles of fewer would be mostly noise.
+     */
+    const unsigned long long minHedgeSamples = 1000;
+}
+
+spredis::RedisConnectionPool::RedisConnectionPool(const RedisConfig& config)
+    : RedisConnectionPool(config, config.host, config.port) {
+}
+
+spredis::RedisConnectionPool::RedisConnectionPool(const RedisConfig& config,
+                                                  const std::string& host,
+                                                  const int port)
+    : Redis(config.prefix, config.hashTag, config.hashTagBuckets),
+      m_config(config),
+      m_host(host),
+      m_port(port),
+      m_logger(logging::Category::getInstance("XMLTooling.StorageService.REDIS")),
+      m_mutex(Mutex::create()),
+      m_returned(CondWait::create()),
+      m_idle(),
+      m_open(0),
+      m_pipelined(),
+      m_stats(RedisStats::getInstance()),
+      m_latency(m_stats.node(host, port)),
+      m_breaker(config, host, port),
+      m_hedge_delay(0),
+      m_hedge_delay_due(0) {
+    // open the first connection eagerly: this way configuration and
+    // connectivity errors are reported when the plugin is loaded, and not
+    // on the first request
+    if (m_config.autoPipeline || m_config.asyncEngine()) {
+        m_pipelined.reset(new RedisConnection(m_config, m_host, m_port));
+        m_pipelined->connectAsync(m_config, m_host, m_port);
+        return;
+    }
+    m_idle.push_back(IdleEntry(new RedisConnection(m_config, m_host, m_port), time(NULL)));
+    m_open = 1;
+
+    // the other connections to warm up are a best effort: a server refusing
+    // them still gets them opened on demand
+    const unsigned int warmup = std::min(m_config.poolWarmup, m_config.poolSize);
+    try {
+        while (m_open < warmup) {
+            m_idle.push_back(IdleEntry(new RedisConnection(m_config, m_host, m_port), time(NULL)));
+            ++m_open;
+        }
+    } catch (const std::exception& ex) {
+        m_logger.warn("connection pool for %s:%d: warmed up %u of %u connections: %s",
+                      m_host.c_str(), m_port, m_open, warmup, ex.what());
+    }
+}
+
+spredis::RedisConnectionPool::~RedisConnectionPool() {
+    if (m_idle.size() != m_open)
+        m_logger.warn("connection pool for %s:%d destroyed with %u connections still checked out",
+                      m_host.c_str(), m_port, m_open - static_cast<unsigned int>(m_idle.size()));
+
+    for (idle_list_type::iterator it = m_idle.begin(); it != m_idle.end(); ++it) {
+        delete it->connection;
+    }
+}
+
+spredis::RedisConnection* spredis::RedisConnectionPool::checkout() {
+    RedisConnection* connection = NULL;
+    std::vector<RedisConnection*> reaped;
+    {
+        const Lock lock(m_mutex);
+        reapIdleUnguarded(time(NULL), reaped);
+        reserveOrTakeIdleUnguarded(&connection);
+    }
+
+    for (size_t i = 0; i < reaped.size(); ++i) {
+        delete reaped[i];
+    }
+    if (connection) return connection;
+
+    // a slot was reserved for us: connect outside the lock, so other callers
+    // can keep on using the already open connections in the meantime
+    try {
+        m_logger.debug("connection pool for %s:%d: opening new connection", m_host.c_str(), m_port);
+        return new RedisConnection(m_config, m_host, m_port);
+    } catch (...) {
+        releaseReservation();
+        throw;
+    }
+}
+
+void spredis::RedisConnectionPool::checkin(RedisConnection* const connection) {
+    if (connection == NULL) return;
+
+    if (!connection->healthy()) {
+        // the connection could not be recovered by itself, do not hand it out
+        // again: the next checkout will open a fresh one instead
+        m_logger.warn("connection pool for %s:%d: dropping broken connection", m_host.c_str(), m_port);
+        delete connection;
+        releaseReservation();
+        return;
+    }
+
+    const Lock lock(m_mutex);
+    m_idle.push_back(IdleEntry(connection, time(NULL)));
+    m_returned->signal();
+}
+
+void spredis::RedisConnectionPool::reserveOrTakeIdleUnguarded(RedisConnection** const out_connection) {
+    const unsigned int waitSeconds = m_config.poolWaitTimeout;
+    const time_t deadline = time(NULL) + waitSeconds;
+    bool waited = false;
+
+    for (;;) {
+        // most recently used connections are handed out first, this keeps the
+        // least recently used ones at the front of the list where they are
+        // eventually reaped if the load goes down
+        if (!m_idle.empty()) {
+            *out_connection = m_idle.back().connection;
+            m_idle.pop_back();
+            return;
+        }
+
+        if (m_open < m_config.poolSize) {
+            ++m_open;
+            *out_connection = NULL;
+            return;
+        }
+
+        if (!waited) {
+            m_stats.count(RedisStats::POOL_WAITS);
+            waited = true;
+        }
+        if (waitSeconds == 0) {
+            m_returned->wait(m_mutex.get());
+            continue;
+        }
+
+        const time_t now = time(NULL);
+        if (now >= deadline) {
+            m_logger.error("connection pool for %s:%d exhausted: no connection was returned in %u seconds",
+                           m_host.c_str(), m_port, waitSeconds);
+            m_stats.count(RedisStats::POOL_EXHAUSTED);
+            throw IOException("Redis connection pool exhausted while waiting for a free connection");
+        }
+        m_returned->timedwait(m_mutex.get(), static_cast<int>(deadline - now));
+    }
+}
+
+void spredis::RedisConnectionPool::reapIdleUnguarded(const time_t now,
+                                                     std::vector<RedisConnection*>& out_reaped) {
+    if (m_config.poolIdleTimeout == 0) return;
+
+    // idle entries are ordered by the time they were returned, so the ones to
+    // reap are all at the front; always keep at least one connection open
+    size_t toReap = 0;
+    while (toReap < m_idle.size()
+           && m_open - toReap > 1
+           && now - m_idle[toReap].since > static_cast<time_t>(m_config.poolIdleTimeout)) {
+        out_reaped.push_back(m_idle[toReap].connection);
+        ++toReap;
+    }
+    if (toReap == 0) return;
+
+    m_logger.debug("connection pool for %s:%d: reaping %u idle connections",
+                   m_host.c_str(), m_port, static_cast<unsigned int>(toReap));
+    m_idle.erase(m_idle.begin(), m_idle.begin() + static_cast<idle_list_type::difference_type>(toReap));
+    m_open -= static_cast<unsigned int>(toReap);
+}
+
+void spredis::RedisConnectionPool::releaseReservation() {
+    const Lock lock(m_mutex);
+    --m_open;
+    m_returned->signal();
+}
+
+bool spredis::RedisConnectionPool::set(const StorageId& id, const char* value, const time_t expiration) {
+    const RedisStats::Timer timer(m_latency);
+    const Handle connection(this);
+    return connection->set(id, value, expiration);
+}
+
+int spredis::RedisConnectionPool::getVersioned(const StorageId& id, std::string* out_value, time_t* out_expiration,
+                                               const int minVersion) {
+    const RedisStats::Timer timer(m_latency);
+    if (pipelined() && pipelined()->pipelinesGetVersioned())
+        return pipelined()->getVersioned(id, out_value, out_expiration, minVersion);
+
+    const Handle connection(this);
+    return connection->getVersioned(id, out_value, out_expiration, minVersion);
+}
+
+int spredis::RedisConnectionPool::forceGet(const StorageId& id, std::string* out_value, time_t* out_expiration) {
+    const RedisStats::Timer timer(m_latency);
+    if (pipelined()) return pipelined()->forceGet(id, out_value, out_expiration);
+
+    const Handle connection(this);
+    return connection->forceGet(id, out_value, out_expiration);
+}
+
+int spredis::RedisConnectionPool::updateVersioned(const StorageId& id, const char* value, const time_t expiration,
+                                                  const int ifVersion) {
+    const RedisStats::Timer timer(m_latency);
+    if (pipelined() && pipelined()->pipelinesUpdateVersioned())
+        return pipelined()->updateVersioned(id, value, expiration, ifVersion);
+
+    const Handle connection(this);
+    return connection->updateVersioned(id, value, expiration, ifVersion);
+}
+
+int spredis::RedisConnectionPool::forceUpdate(const StorageId& id, const char* value, const time_t expiration) {
+    const RedisStats::Timer timer(m_latency);
+    if (pipelined() && pipelined()->pipelinesForceUpdate())
+        return pipelined()->forceUpdate(id, value, expiration);
+
+    const Handle connection(this);
+    return connection->forceUpdate(id, value, expiration);
+}
+
+bool spredis::RedisConnectionPool::remove(const StorageId& id) {
+    const RedisStats::Timer timer(m_latency);
+    if (pipelined()) return pipelined()->remove(id);
+
+    const Handle connection(this);
+    return connection->remove(id);
+}
+
+void spredis::RedisConnectionPool::indexRecord(const StorageId& id, const time_t expiration) {
+    const RedisStats::Timer timer(m_latency);
+    if (pipelined()) return pipelined()->indexRecord(id, expiration);
+
+    const Handle connection(this);
+    connection->indexRecord(id, expiration);
+}
+
+void spredis::RedisConnectionPool::unindexRecord(const StorageId& id) {
+    const RedisStats::Timer timer(m_latency);
+    if (pipelined()) return pipelined()->unindexRecord(id);
+
+    const Handle connection(this);
+    connection->unindexRecord(id);
+}
+
+void spredis::RedisConnectionPool::expireContextIndex(const char* context, const time_t expiration) {
+    const RedisStats::Timer timer(m_latency);
+    const Handle connection(this);
+    connection->expireContextIndex(context, expiration);
+}
+
+void spredis::RedisConnectionPool::deleteContextIndex(const char* context) {
+    const RedisStats::Timer timer(m_latency);
+    if (pipelined()) return pipelined()->deleteContextIndex(context);
+
+    const Handle connection(this);
+    connection->deleteContextIndex(context);
+}
+
+unsigned long long spredis::RedisConnectionPool::scanContextIndexPage(const char* context,
+                                                                      const unsigned long long cursor,
+                                                                      std::vector<std::string>* out_members) {
+    const RedisStats::Timer timer(m_latency);
+    const Handle connection(this);
+    return connection->scanContextIndexPage(context, cursor, out_members);
+}
+
+long long spredis::RedisConnectionPool::touchContextEpoch(const char* const context, const time_t keepUntil) {
+    const RedisStats::Timer timer(m_latency);
+    const Handle connection(this);
+    return connection->touchContextEpoch(context, keepUntil);
+}
+
+bool spredis::RedisConnectionPool::readContextEpoch(const char* const context, ContextEpoch* const out_epoch) {
+    const RedisStats::Timer timer(m_latency);
+    if (pipelined()) return pipelined()->readContextEpoch(context, out_epoch);
+
+    const Handle connection(this);
+    return connection->readContextEpoch(context, out_epoch);
+}
+
+long long spredis::RedisConnectionPool::expireContextEpoch(const char* const context,
+                                                           const time_t expiration,
+                                                           const time_t keepUntil,
+                                                           time_t* const out_horizon) {
+    const RedisStats::Timer timer(m_latency);
+    const Handle connection(this);
+    return connection->expireContextEpoch(context, expiration, keepUntil, out_horizon);
+}
+
+long long spredis::RedisConnectionPool::deleteContextEpoch(const char* const context) {
+    const RedisStats::Timer timer(m_latency);
+    const Handle connection(this);
+    return connection->deleteContextEpoch(context);
+}
+
+void spredis::RedisConnectionPool::raiseContextEpochHorizon(const char* const context,
+                                                            const long long generation,
+                                                            const time_t horizon) {
+    const RedisStats::Timer timer(m_latency);
+    const Handle connection(this);
+    connection->raiseContextEpochHorizon(context, generation, horizon);
+}
+
+void spredis::RedisConnectionPool::ping() {
+    const Handle connection(this);
+    connection->ping();
+}
+
+unsigned long long spredis::RedisConnectionPool::hedgeDelay() {
+    const long long now = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+
+    // a single caller a second takes the snapshot, which sums every stripe
+    // of the histogram, the others use the last delay
+    long long due = m_hedge_delay_due.load(boost::memory_order_relaxed);
+    if (now >= due && m_hedge_delay_due.compare_exchange_strong(due, now + 1000, boost::memory_order_relaxed)) {
+        const LatencyHistogram::Snapshot snapshot = m_latency.snapshot();
+        m_hedge_delay.store(snapshot.count < minHedgeSamples ? 0 : snapshot.quantile(m_config.hedgePercentile / 100),
+                            boost::memory_order_relaxed);
+    }
+    return m_hedge_delay.load(boost::memory_order_relaxed);
+}
+
+std::vector<spredis::ClusterNode> spredis::RedisConnectionPool::endpoints() const {
+    return std::vector<ClusterNode>(1, ClusterNode(m_host, static_cast<unsigned short>(m_port)));
+}
+
+size_t spredis::RedisConnectionPool::scanContextTypeless(const char* context,
+                                                         RawCallbackType callback,
+                                                         void* callbackContext) {
+    const Handle connection(this);
+    return connection->scanContextTypeless(context, callback, callbackContext);
+}
+
+size_t spredis::RedisConnectionPool::scanContextIndexTypeless(const char* context,
+                                                              RawCallbackType callback,
+                                                              void* callbackContext) {
+    const Handle connection(this);
+    return connection->scanContextIndexTypeless(context, callback, callbackContext);
+}
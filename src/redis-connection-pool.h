@@ -0,0 +1,231 @@
+/**
+ * Licensed to the University Corporation for Advanced Internet
+ * Development, Inc. (UCAID) under one or more contributor license
+ * agreements. See the NOTICE file distributed with this work for
+ * additional information regarding copyright ownership.
+ *
+ * UCAID licenses this file to you under the Apache License,
+ * Version 2.0 (the "License"); you may not use this file except
+ * in compliance with the License. You may obtain a copy of the
+ * License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+ */
+
+/**
+ * redis-connection-pool.h
+ *
+ * Provides the RedisConnectionPool class, which manages multiple connections
+ * to the same Redis server, so concurrent callers do not serialize on a single
+ * socket.
+ */
+
+#ifndef REDIS_CONNECTION_POOL_H
+#define REDIS_CONNECTION_POOL_H
+
+#include <ctime>
+#include <string>
+#include <vector>
+
+#include "circuit-breaker.h"
+#include "common.h"
+#include "redis.h"
+#include "redis-connection.h"
+#include "redis-stats.h"
+
+#include <boost/atomic.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <xmltooling/util/Threads.h>
+#include <xmltooling/logging.h>
+
+namespace spredis {
+    /**
+     * A pool of RedisConnection objects all connected to the same Redis
+     * endpoint.
+     * Connections are opened lazily up to the configured pool size, handed
+     * out exclusively to one caller at a time, and closed again when they sit
+     * idle for longer than the configured idle timeout.
+     *
+     * The pool itself is a Redis implementation that checks out a connection
+     * for the duration of each operation, so it can be used anywhere a single
+     * RedisConnection was used before.
+     *
+     * With automatic pipelining enabled, operations which are sent as a single
+     * group of commands do not check out a connection, but all share one
+     * dedicated connection, on which the commands of concurrent callers are
+     * pipelined. Operations which need the connection for themselves over
+     * multiple round-trips (WATCH) are still served by the pooled ones.
+     * With non-blocking connections, the groups of that shared connection go
+     * through an asynchronous connection instead, on which the groups of all
+     * callers are in flight at the same time.
+     */
+    class SHIBSP_HIDDEN RedisConnectionPool SHIBSP_FINAL : public Redis {
+    public:
+        /**
+         * RAII handle for a connection checked out of a pool. The connection
+         * is returned to the pool when the handle goes out of scope.
+         */
+        class SHIBSP_HIDDEN Handle SHIBSP_FINAL {
+            MAKE_NONCOPYABLE(Handle);
+
+        public:
+            explicit Handle(RedisConnectionPool* pool)
+                : m_pool(pool),
+                  m_connection(pool->checkout()) {
+            }
+
+            ~Handle() {
+                m_pool->checkin(m_connection);
+            }
+
+            RedisConnection* get() const { return m_connection; }
+            RedisConnection* operator->() const { return m_connection; }
+
+        private:
+            RedisConnectionPool* m_pool;
+            RedisConnection* m_connection;
+        };
+
+        explicit RedisConnectionPool(const RedisConfig& config);
+
+        RedisConnectionPool(const RedisConfig& config,
+                            const std::string& host,
+                            int port);
+
+        ~RedisConnectionPool();
+
+        /**
+         * Takes an idle connection from the pool, or opens a new one if the
+         * pool is not yet at capacity. If neither is possible, waits for
+         * another caller to return its connection, up to the configured wait
+         * timeout, after which an IOException is thrown.
+         *
+         * Every checked out connection must be returned using checkin; prefer
+         * using the Handle class instead of calling these directly.
+         */
+        RedisConnection* checkout();
+
+        /**
+         * Returns a connection to the pool. Connections in an erroneous state
+         * are closed instead of being made available again.
+         */
+        void checkin(RedisConnection* connection);
+
+        const std::string& host() const { return m_host; }
+        int port() const { return m_port; }
+
+        /**
+         * The circuit breaker of the server, for the callers which retry
+         * operations to fail fast while the server is unreachable.
+         */
+        CircuitBreaker& breaker() { return m_breaker; }
+
+        /**
+         * The delay after which reads sent to the server are hedged, in
+         * microseconds: the hedgePercentile of the latencies of the server,
+         * computed again at most once a second. 0 until enough latencies are
+         * known.
+         */
+        unsigned long long hedgeDelay();
+
+        bool set(const StorageId& id, const char* value, time_t expiration);
+
+        int getVersioned(const StorageId& id, std::string* out_value, time_t* out_expiration, int minVersion);
+
+        int forceGet(const StorageId& id, std::string* out_value, time_t* out_expiration);
+
+        int updateVersioned(const StorageId& id, const char* value, time_t expiration, int ifVersion);
+
+        int forceUpdate(const StorageId& id, const char* value, time_t expiration);
+
+        bool remove(const StorageId& id);
+
+        void indexRecord(const StorageId& id, time_t expiration);
+
+        void unindexRecord(const StorageId& id);
+
+        void expireContextIndex(const char* context, time_t expiration);
+
+        void deleteContextIndex(const char* context);
+
+        unsigned long long scanContextIndexPage(const char* context, unsigned long long cursor,
+                                                std::vector<std::string>* out_members);
+
+        long long touchContextEpoch(const char* context, time_t keepUntil);
+
+        bool readContextEpoch(const char* context, ContextEpoch* out_epoch);
+
+        long long expireContextEpoch(const char* context, time_t expiration, time_t keepUntil, time_t* out_horizon);
+
+        long long deleteContextEpoch(const char* context);
+
+        void raiseContextEpochHorizon(const char* context, long long generation, time_t horizon);
+
+        void ping();
+
+        std::vector<ClusterNode> endpoints() const;
+
+        template<class Fn>
+        void iterateSlots(Fn callback) {
+            const RedisStats::Timer timer(m_latency);
+            const Handle connection(this);
+            connection->iterateSlots(callback);
+        }
+
+    protected:
+        size_t scanContextTypeless(const char* context, RawCallbackType callback, void* callbackContext);
+
+        size_t scanContextIndexTypeless(const char* context, RawCallbackType callback, void* callbackContext);
+
+    private:
+        struct IdleEntry {
+            IdleEntry(RedisConnection* connection, const time_t since)
+                : connection(connection),
+                  since(since) {
+            }
+
+            RedisConnection* connection;
+            time_t since;
+        };
+
+        typedef std::vector<IdleEntry> idle_list_type;
+
+        void reserveOrTakeIdleUnguarded(RedisConnection** out_connection);
+
+        void reapIdleUnguarded(time_t now, std::vector<RedisConnection*>& out_reaped);
+
+        void releaseReservation();
+
+        /**
+         * Returns the connection shared by all pipelined operations, or NULL
+         * if neither automatic pipelining nor non-blocking connections are
+         * enabled.
+         */
+        RedisConnection* pipelined() const { return m_pipelined.get(); }
+
+        const RedisConfig m_config;
+        const std::string m_host;
+        const int m_port;
+        xmltooling::logging::Category& m_logger;
+        boost::scoped_ptr<xmltooling::Mutex> m_mutex;
+        boost::scoped_ptr<xmltooling::CondWait> m_returned;
+        idle_list_type m_idle;
+        unsigned int m_open;
+        boost::scoped_ptr<RedisConnection> m_pipelined;
+        RedisStats& m_stats;
+        // latencies of the operations sent to this server
+        LatencyHistogram& m_latency;
+        CircuitBreaker m_breaker;
+        boost::atomic<unsigned long long> m_hedge_delay;
+        // the steady clock in milliseconds, when m_hedge_delay is due again
+        boost::atomic<long long> m_hedge_delay_due;
+    };
+}
+
+#endif //REDIS_CONNECTION_POOL_H
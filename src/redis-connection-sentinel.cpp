@@ -0,0 +1,185 @@
+/**
+ * Licensed to the University Corporation for Advanced Internet
+ * Development, Inc. (UCAID) under one or more contributor license
+ * agreements. See the NOTICE file distributed with this work for
+ * additional information regarding copyright ownership.
+ *
+ * UCAID licenses this file to you under the Apache License,
+ * Version 2.0 (the "License"); you may not use this file except
+ * in compliance with the License. You may obtain a copy of the
+ * License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+ */
+
+/**
+ * redis-connection-sentinel.cpp
+ *
+ * Implementation of the Sentinel operations of RedisConnection: discovering
+ * the primary and the replicas of a monitored master, and following its
+ * failovers using the `+switch-master' events.
+ */
+
+#include "redis-connection.h"
+#include "connection-lost-exception.h"
+
+// XXX Win32 - special config headers
+#include "config.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+
+#include <xmltooling/logging.h>
+
+using namespace xmltooling;
+
+namespace {
+    bool replyIs(const redisReply* const reply, const char* const str) {
+        return reply->type == REDIS_REPLY_STRING
+               && reply->len == std::strlen(str)
+               && std::memcmp(reply->str, str, reply->len) == 0;
+    }
+
+    std::string replyString(const redisReply* const reply) {
+        if (reply->type != REDIS_REPLY_STRING) return std::string();
+        return std::string(reply->str, reply->len);
+    }
+}
+
+spredis::RedisConnection* spredis::RedisConnection::connectSentinel(const RedisConfig& config,
+                                                                    const ClusterNode& sentinel) {
+    RedisConnection* const connection = new RedisConnection(config, private_tag_t());
+    try {
+        connection->open(config, sentinel.host(), sentinel.port());
+
+        // Sentinels have their own password, the one of the servers may
+        // not be known to them; it is sent again after each reconnection
+        connection->m_authn_username.clear();
+        connection->m_authn_password = config.sentinelPassword;
+        connection->sendSetupCommands();
+    } catch (...) {
+        delete connection;
+        throw;
+    }
+    return connection;
+}
+
+bool spredis::RedisConnection::sentinelPrimary(const std::string& name, ClusterNode& out_primary) {
+    const Lock ulock(m_mutex);
+    const RedisReply reply(this,
+                           redisCommand(m_redis, "SENTINEL get-master-addr-by-name %s", name.c_str()));
+    reply.throwIfErroneous("sentinelPrimary", "SENTINEL get-master-addr-by-name");
+    if (reply->type == REDIS_REPLY_NIL) return false;
+    reply.ensureType(REDIS_REPLY_ARRAY, "sentinelPrimary");
+
+    if (reply->elements != 2
+        || reply->element[0]->type != REDIS_REPLY_STRING
+        || reply->element[1]->type != REDIS_REPLY_STRING)
+        handleCommandError("sentinelPrimary", "SENTINEL get-master-addr-by-name",
+                           "malformed address of the primary",
+                           sizeof("malformed address of the primary") - 1);
+
+    // narrowing is fine, ports fit into 2 bytes
+    out_primary = ClusterNode(replyString(reply->element[0]),
+                              static_cast<unsigned short>(std::atoi(replyString(reply->element[1]).c_str())));
+    return true;
+}
+
+std::vector<spredis::ClusterNode> spredis::RedisConnection::sentinelReplicas(const std::string& name) {
+    const Lock ulock(m_mutex);
+    const RedisReply reply(this, redisCommand(m_redis, "SENTINEL replicas %s", name.c_str()));
+    reply.throwIfErroneous("sentinelReplicas", "SENTINEL replicas");
+    reply.ensureType(REDIS_REPLY_ARRAY, "sentinelReplicas");
+
+    // every replica is a flat list of field names and values
+    std::vector<ClusterNode> replicas;
+    for (size_t i = 0; i < reply->elements; ++i) {
+        const redisReply* const replica = reply->element[i];
+        if (replica->type != REDIS_REPLY_ARRAY) continue;
+
+        std::string ip;
+        std::string port;
+        std::string flags;
+        std::string linkStatus;
+        for (size_t j = 0; j + 1 < replica->elements; j += 2) {
+            const redisReply* const field = replica->element[j];
+            const redisReply* const value = replica->element[j + 1];
+            if (replyIs(field, "ip")) ip = replyString(value);
+            else if (replyIs(field, "port")) port = replyString(value);
+            else if (replyIs(field, "flags")) flags = replyString(value);
+            else if (replyIs(field, "master-link-status")) linkStatus = replyString(value);
+        }
+
+        if (ip.empty() || port.empty()) continue;
+        if (flags.find("s_down") != std::string::npos
+            || flags.find("o_down") != std::string::npos
+            || flags.find("disconnected") != std::string::npos
+            || (!linkStatus.empty() && linkStatus != "ok")) {
+            m_logger.debug("(sentinelReplicas) skipping replica %s:%s of %s: %s",
+                           ip.c_str(), port.c_str(), name.c_str(), flags.c_str());
+            continue;
+        }
+
+        replicas.push_back(ClusterNode(ip, static_cast<unsigned short>(std::atoi(port.c_str()))));
+    }
+    return replicas;
+}
+
+void spredis::RedisConnection::subscribeSwitchMaster() {
+    const Lock ulock(m_mutex);
+    const RedisReply reply(this, redisCommand(m_redis, "SUBSCRIBE +switch-master"));
+    reply.throwIfErroneous("subscribeSwitchMaster", "SUBSCRIBE");
+    reply.ensureType(REDIS_REPLY_ARRAY, "subscribeSwitchMaster");
+}
+
+bool spredis::RedisConnection::readSwitchMaster(const std::string& name, ClusterNode& out_primary,
+                                                bool& out_switched) {
+    const Lock ulock(m_mutex);
+    if (redisBufferRead(m_redis) != REDIS_OK) {
+        m_logger.warn("(readSwitchMaster) Sentinel connection lost: %s", m_redis->errstr);
+        return false;
+    }
+
+    for (;;) {
+        void* buffer = NULL;
+        if (redisGetReplyFromReader(m_redis, &buffer) != REDIS_OK) {
+            m_logger.warn("(readSwitchMaster) Sentinel connection lost: %s", m_redis->errstr);
+            return false;
+        }
+        if (buffer == NULL) return true; // no more complete messages
+
+        // events are: message +switch-master "<name> <old-ip> <old-port>
+        // <new-ip> <new-port>"
+        const RedisReply reply(this, buffer);
+        if (reply->type != REDIS_REPLY_ARRAY
+            || reply->elements != 3
+            || !replyIs(reply->element[0], "message")
+            || reply->element[2]->type != REDIS_REPLY_STRING)
+            continue;
+
+        std::istringstream event(replyString(reply->element[2]));
+        std::string master;
+        std::string oldHost;
+        unsigned short oldPort = 0;
+        std::string newHost;
+        unsigned short newPort = 0;
+        if (!(event >> master >> oldHost >> oldPort >> newHost >> newPort)) {
+            m_logger.warn("(readSwitchMaster) malformed +switch-master event: %s",
+                          reply->element[2]->str);
+            continue;
+        }
+        if (master != name) continue;
+
+        m_logger.notice("(readSwitchMaster) Sentinel reports failover of %s from %s:%u to %s:%u",
+                        name.c_str(), oldHost.c_str(), oldPort, newHost.c_str(), newPort);
+        out_primary = ClusterNode(newHost, newPort);
+        out_switched = true;
+    }
+}
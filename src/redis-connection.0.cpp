@@ -27,6 +27,7 @@
  *   - no redisOptions struct, only address-port connection possible
  *   - no TLS
  *   - only one timeout value can be configured, after
+ *   - no RESP3, therefore no client-side caching
  */
 
 #include "redis-connection.h"
@@ -41,13 +42,14 @@
 
 using namespace xmltooling;
 
-void spredis::RedisConnection::connect(const RedisConfig& config,
-                                       const std::string& redisHost,
-                                       const int redisPort) {
-    m_logger.info("connecting to Redis at %s:%d", redisHost.c_str(), redisPort);
-    if (config.nonBlocking) {
-        m_redis = redisConnectNonBlock(redisHost.c_str(), redisPort);
+void spredis::RedisConnection::open(const RedisConfig& config,
+                                    const std::string& redisHost,
+                                    const int redisPort) {
+    if (!config.socketPath.empty()) {
+        m_logger.info("connecting to Redis at unix socket %s", config.socketPath.c_str());
+        m_redis = redisConnectUnix(config.socketPath.c_str());
     } else {
+        m_logger.info("connecting to Redis at %s:%d", redisHost.c_str(), redisPort);
         m_redis = redisConnect(redisHost.c_str(), redisPort);
     }
 
@@ -66,32 +68,32 @@ void spredis::RedisConnection::connect(const RedisConfig& config,
         throw ConnectionLostException(errorString);
     }
 
+    // replies are allocated from the arena of the connection from now on
+    m_reply_arena.install(m_redis);
+    m_socket_options.apply(m_redis, m_logger);
+
     if (config.commandTimeoutMillisec != 0) {
         m_command_timeout.tv_sec = config.commandTimeoutMillisec / 1000;
         m_command_timeout.tv_usec = config.commandTimeoutMillisec % 1000 * 1000;
         redisSetTimeout(m_redis, m_command_timeout);
     }
+}
 
-    // authentication
-    switch (config.authScheme()) {
-        case RedisConfig::AUTH_DISABLED:
-            break;
-        case RedisConfig::AUTH_DEFAULT_STYLE:
-            m_logger.info("Performing default authentication at host %s:%u",
-                          redisHost.c_str(), redisPort);
-            RedisReply(this,
-                       redisCommand(m_redis, "AUTH %s",
-                                    config.authnPassword.c_str()))
-                    .throwIfErroneous("ctor", "AUTH");
-            break;
-        case RedisConfig::AUTH_ACL_STYLE:
-            m_logger.info("Performing ACL-style authentication at host %s:%u: user %s",
-                          redisHost.c_str(), redisPort, config.authnUsername.c_str());
-            RedisReply(this,
-                       redisCommand(m_redis, "AUTH %s %s",
-                                    config.authnUsername.c_str(),
-                                    config.authnPassword.c_str()))
-                    .throwIfErroneous("ctor", "AUTH");
-            break;
-    }
+void spredis::RedisConnection::connect(const RedisConfig& config,
+                                       const std::string& redisHost,
+                                       const int redisPort) {
+    open(config, redisHost, redisPort);
+
+    sendSetupCommands();
+
+    loadScripts(config);
+}
+
+void spredis::RedisConnection::startTracking(const std::vector<std::string>&) {
+    throw XMLToolingException("Client-side caching requires RESP3 support, which is only available with "
+                              "hiredis version 1.0.0 and above");
+}
+
+bool spredis::RedisConnection::readInvalidations(std::vector<std::string>&, bool&) {
+    return false;
 }
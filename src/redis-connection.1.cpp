@@ -32,16 +32,19 @@
 // XXX Win32 - special config headers
 #include "config.h"
 
+#include <cstring>
+
 #include <xmltooling/util/XMLHelper.h>
 #include <xmltooling/logging.h>
 
 using namespace xmltooling;
 
-void spredis::RedisConnection::connect(const RedisConfig& config,
-                                       const std::string& redisHost,
-                                       const int redisPort) {
+void spredis::RedisConnection::open(const RedisConfig& config,
+                                    const std::string& redisHost,
+                                    const int redisPort) {
     redisOptions opt{};
-    REDIS_OPTIONS_SET_TCP(&opt, redisHost.c_str(), redisPort);
+    if (!config.socketPath.empty()) REDIS_OPTIONS_SET_UNIX(&opt, config.socketPath.c_str());
+    else REDIS_OPTIONS_SET_TCP(&opt, redisHost.c_str(), redisPort);
     if (config.commandTimeoutMillisec != 0) {
         m_command_timeout.tv_sec = config.commandTimeoutMillisec / 1000;
         m_command_timeout.tv_usec = config.commandTimeoutMillisec % 1000 * 1000;
@@ -53,9 +56,10 @@ void spredis::RedisConnection::connect(const RedisConfig& config,
         opt.connect_timeout = &m_connect_timeout;
     }
 
-    if (config.nonBlocking) opt.options |= REDIS_OPT_NONBLOCK;
-
-    m_logger.info("connecting to Redis at %s:%d", redisHost.c_str(), redisPort);
+    if (!config.socketPath.empty())
+        m_logger.info("connecting to Redis at unix socket %s", config.socketPath.c_str());
+    else
+        m_logger.info("connecting to Redis at %s:%d", redisHost.c_str(), redisPort);
     m_redis = redisConnectWithOptions(&opt);
     if (m_redis == NULL)
         // allocation error occured, so we are probably in a really constrainted
@@ -72,27 +76,18 @@ void spredis::RedisConnection::connect(const RedisConfig& config,
         throw ConnectionLostException(errorString);
     }
 
+    // replies are allocated from the arena of the connection from now on
+    m_reply_arena.install(m_redis);
+    m_socket_options.apply(m_redis, m_logger);
+
     // perform TLS handshake if configured
 #ifdef SHIBSP_HAVE_HIREDIS_SSL
     if (config.tls) {
         m_logger.info("Performing TLS handshake with host %s:%u",
                       redisHost.c_str(), redisPort);
-        redisSSLContextError sslError = REDIS_SSL_CTX_NONE;
-        m_ssl = redisCreateSSLContext(
-            config.tls.caBundleOrNull(),
-            config.tls.caDirectoryOrNull(),
-            config.tls.clientCertOrNull(),
-            config.tls.clientKeyOrNull(),
-            NULL,
-            &sslError);
-        if (m_ssl == NULL || sslError != REDIS_SSL_CTX_NONE) {
-            m_logger.error("Cannot create TLS context while connecting to %s:%u: %s",
-                           redisHost.c_str(), redisPort,
-                           redisSSLContextGetError(sslError));
-            throw XMLToolingException("Cannot create TLS context");
-        }
-
-        const int handshook = redisInitiateSSLWithContext(m_redis, m_ssl);
+        m_tls = config.tls.context();
+        bool resumed = false;
+        const int handshook = m_tls->handshake(m_redis, redisHost, redisPort, &resumed);
         if (handshook != REDIS_OK) {
             m_logger.error("TLS error during handshake with host %s:%u: %s",
                            redisHost.c_str(), redisPort,
@@ -100,29 +95,81 @@ void spredis::RedisConnection::connect(const RedisConfig& config,
             throw XMLToolingException("Cannot establish TLS connection to host "
                                       + redisHost + ":" + std::to_string(redisPort));
         }
+        if (resumed) m_logger.debug("TLS session with host %s:%u resumed", redisHost.c_str(), redisPort);
     }
 #endif
+}
+
+void spredis::RedisConnection::connect(const RedisConfig& config,
+                                       const std::string& redisHost,
+                                       const int redisPort) {
+    open(config, redisHost, redisPort);
+
+    sendSetupCommands();
+
+    loadScripts(config);
+}
+
+void spredis::RedisConnection::startTracking(const std::vector<std::string>& prefixes) {
+    const Lock ulock(m_mutex);
+
+    // invalidation messages are push messages, which only exist in RESP3
+    RedisReply(this, redisCommand(m_redis, "HELLO 3")).throwIfErroneous("startTracking", "HELLO");
+
+    std::vector<const char*> argv;
+    std::vector<size_t> argvlen;
+    const char* const tracking[] = {"CLIENT", "TRACKING", "on", "BCAST"};
+    for (size_t i = 0; i < sizeof(tracking) / sizeof(tracking[0]); ++i) {
+        argv.push_back(tracking[i]);
+        argvlen.push_back(std::strlen(tracking[i]));
+    }
+    for (size_t i = 0; i < prefixes.size(); ++i) {
+        argv.push_back("PREFIX");
+        argvlen.push_back(sizeof("PREFIX") - 1);
+        argv.push_back(prefixes[i].data());
+        argvlen.push_back(prefixes[i].size());
+    }
+
+    RedisReply(this,
+               redisCommandArgv(m_redis, static_cast<int>(argv.size()), &argv[0], &argvlen[0]))
+            .throwIfErroneous("startTracking", "CLIENT TRACKING");
+}
 
-    // authentication
-    switch (config.authScheme()) {
-        case RedisConfig::AUTH_DISABLED:
-            break;
-        case RedisConfig::AUTH_DEFAULT_STYLE:
-            m_logger.info("Performing default authentication at host %s:%u",
-                          redisHost.c_str(), redisPort);
-            RedisReply(this,
-                       redisCommand(m_redis, "AUTH %s",
-                                    config.authnPassword.c_str()))
-                    .throwIfErroneous("ctor", "AUTH");
-            break;
-        case RedisConfig::AUTH_ACL_STYLE:
-            m_logger.info("Performing ACL-style authentication at host %s:%u: user %s",
-                          redisHost.c_str(), redisPort, config.authnUsername.c_str());
-            RedisReply(this,
-                       redisCommand(m_redis, "AUTH %s %s",
-                                    config.authnUsername.c_str(),
-                                    config.authnPassword.c_str()))
-                    .throwIfErroneous("ctor", "AUTH");
-            break;
+bool spredis::RedisConnection::readInvalidations(std::vector<std::string>& out_keys, bool& out_flushAll) {
+    const Lock ulock(m_mutex);
+    if (redisBufferRead(m_redis) != REDIS_OK) {
+        m_logger.warn("(readInvalidations) tracking connection lost: %s", m_redis->errstr);
+        return false;
+    }
+
+    for (;;) {
+        void* buffer = NULL;
+        if (redisGetReplyFromReader(m_redis, &buffer) != REDIS_OK) {
+            m_logger.warn("(readInvalidations) tracking connection lost: %s", m_redis->errstr);
+            return false;
+        }
+        if (buffer == NULL) return true; // no more complete messages
+
+        // invalidation messages are: > invalidate [key...], or > invalidate
+        // nil if all keys are invalidated
+        const RedisReply reply(this, buffer);
+        if (reply->type != REDIS_REPLY_PUSH
+            || reply->elements < 2
+            || reply->element[0]->type != REDIS_REPLY_STRING
+            || reply->element[0]->len != sizeof("invalidate") - 1
+            || std::memcmp(reply->element[0]->str, "invalidate", sizeof("invalidate") - 1) != 0)
+            continue;
+
+        const redisReply* const keys = reply->element[1];
+        if (keys->type == REDIS_REPLY_NIL) {
+            out_flushAll = true;
+            continue;
+        }
+        if (keys->type != REDIS_REPLY_ARRAY) continue;
+
+        for (size_t i = 0; i < keys->elements; ++i) {
+            if (keys->element[i]->type != REDIS_REPLY_STRING) continue;
+            out_keys.push_back(std::string(keys->element[i]->str, keys->element[i]->len));
+        }
     }
 }
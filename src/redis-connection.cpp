@@ -25,12 +25,19 @@
  */
 
 #include "redis-connection.h"
+#include "redis-command-group.h"
+#include "redis-stats.h"
 #include "connection-lost-exception.h"
 #include "redirected-exception.h"
 
 // XXX Win32 - special config headers
 #include "config.h"
 
+#include <cstdarg>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
 #include <xmltooling/util/XMLHelper.h>
 #include <xmltooling/logging.h>
 
@@ -39,6 +46,19 @@ using namespace xmltooling;
 namespace {
     const int optimisticConcurrencyRetryCount = 3;
     const int connectionRetryCount = 3;
+
+    /**
+     * Escapes the characters of str that have a special meaning in the glob
+     * patterns of SCAN MATCH.
+     */
+    std::string escapeGlob(const char* str) {
+        std::string escaped;
+        for (; *str != '\0'; ++str) {
+            if (std::strchr("*?[]\\", *str) != NULL) escaped += '\\';
+            escaped += *str;
+        }
+        return escaped;
+    }
 }
 
 spredis::RedisConnection::RedisConnection(const RedisConfig& config) : RedisConnection(config, private_tag_t()) {
@@ -49,14 +69,33 @@ spredis::RedisConnection::RedisConnection(const RedisConfig& config) : RedisConn
 }
 
 spredis::RedisConnection::RedisConnection(const RedisConfig& config, private_tag_t dispatcher)
-    : Redis(config.prefix),
+    : Redis(config.prefix, config.hashTag, config.hashTagBuckets),
       m_redis(NULL),
+      m_reply_arena(),
       m_command_timeout(),
       m_connect_timeout(),
+      m_socket_options(config),
+      m_authn_username(config.authnUsername),
+      m_authn_password(config.authnPassword),
+      m_read_only(config.clustered() && config.readFrom != RedisConfig::READ_MASTER),
       m_logger(logging::Category::getInstance("XMLTooling.StorageService.REDIS")),
-      m_mutex(Mutex::create())
+      m_mutex(Mutex::create()),
+      m_layout(config.layout),
+      m_use_scripts(false),
+      m_get_versioned_sha(),
+      m_update_versioned_sha(),
+      m_auto_pipeline(config.autoPipeline),
+      m_pipeline_batch_size(config.pipelineBatchSize),
+      m_scan_count(config.scanCount),
+      m_queue_mutex(Mutex::create()),
+      m_queue_changed(CondWait::create()),
+      m_queue(),
+      m_pipeline_leader(false)
+#ifdef SPREDIS_HAVE_ASYNC_ENGINE
+    , m_async()
+#endif
 #ifdef SHIBSP_HAVE_HIREDIS_SSL
-    , m_ssl(NULL)
+    , m_tls()
 #endif
 {
     (void) dispatcher;
@@ -83,34 +122,49 @@ void spredis::RedisConnection::handleCriticalError(const char* fn, int recurse)
 }
 
 void spredis::RedisConnection::handlePotentialMovedError(const std::string& err_str) const {
-    if (err_str.substr(0, 6) != "MOVED ") return;
+    // MOVED <slot> <host>:<port> or ASK <slot> <host>:<port>
+    const bool asking = err_str.compare(0, sizeof("ASK ") - 1, "ASK ") == 0;
+    if (!asking && err_str.compare(0, sizeof("MOVED ") - 1, "MOVED ") != 0) return;
 
-    m_logger.warn("Redis cluster configuration changed: reconfiguring caused by error: " + err_str);
+    if (asking) m_logger.debug("Redis cluster slot is being migrated: redirected by error: " + err_str);
+    else m_logger.warn("Redis cluster configuration changed: reconfiguring caused by error: " + err_str);
 
     // WARNING! The following code is heavy with string indexing and prone to
     //          off-by-one errors, proceed with caution and a debugger
-    const size_t spaceBeforeLocation = err_str.find(' ', 7);
-    const size_t portColonLocation = err_str.find(':', spaceBeforeLocation);
+    const size_t spaceBeforeSlot = err_str.find(' ');
+    const size_t spaceBeforeLocation = err_str.find(' ', spaceBeforeSlot + 1);
+    // the host may be an IPv6 address: the port is after the last colon
+    const size_t portColonLocation = err_str.rfind(':');
+    if (spaceBeforeLocation == std::string::npos
+        || portColonLocation == std::string::npos
+        || portColonLocation < spaceBeforeLocation) {
+        m_logger.crit("(handleCommandError) catastrophic cascading error: malformed redirection: " + err_str);
+        throw ConnectionLostException("malformed redirection received from Redis cluster: " + err_str);
+    }
 
-    // parse number
+    // parse numbers
+    unsigned int slot = 0;
     unsigned int port = 6379;
     try {
         // need to parse into unsigned long because stoui doesn't exist,
         // and if sizeof(int) == 2 (which is completely possible), a normal int
         // cannot hold all port values properly and inadvertedly trigger the
         // overflow error branch below
+        slot = std::stoul(err_str.substr(spaceBeforeSlot + 1, spaceBeforeLocation - spaceBeforeSlot - 1));
         port = std::stoul(err_str.substr(portColonLocation + 1));
     } catch (const std::invalid_argument&) {
         m_logger.crit("(handleCommandError) catastrophic cascading error: "
-            "value sent as port value is not an integer, trying 6379");
+            "value sent as slot or port value is not an integer, trying 6379");
     } catch (const std::out_of_range&) {
         m_logger.crit("(handleCommandError) catastrophic cascading error: "
-            "value sent as port value exceeds integer limit of unsigned long, trying 6379");
+            "value sent as slot or port value exceeds integer limit of unsigned long, trying 6379");
     }
 
     throw RedirectedException(err_str.substr(spaceBeforeLocation + 1,
                                              portColonLocation - spaceBeforeLocation - 1),
-                              port);
+                              port,
+                              slot,
+                              asking);
 }
 
 void spredis::RedisConnection::handleCommandError(const char* fn, const char* command, const char* errorBuf,
@@ -118,15 +172,24 @@ void spredis::RedisConnection::handleCommandError(const char* fn, const char* co
     const std::string err_str(errorBuf, errorLen);
     m_logger.error("execution of Redis command failed: %s: %.*s", command, errorLen, errorBuf);
 
-    if (err_str.length() > sizeof("CLUSTERDO")) {
+    if (err_str.compare(0, sizeof("CLUSTERDOWN") - 1, "CLUSTERDOWN") == 0) {
         // the cluster is currently down, notify things via losing the connection
         // maybe it fixes itself and the failure is not fatal
         throw ConnectionLostException("CLUSTERDOWN received: Redis cluster is unavailable at the moment");
     }
+    if (err_str.compare(0, sizeof("TRYAGAIN") - 1, "TRYAGAIN") == 0) {
+        // the keys of the operation are split by a slot migration in progress
+        throw ConnectionLostException("TRYAGAIN received: Redis cluster slot is being migrated");
+    }
+    if (err_str.compare(0, sizeof("READONLY") - 1, "READONLY") == 0) {
+        // a write reached a replica, e.g. a primary demoted by a failover on
+        // a connection that survived it: the primary is lost for this caller
+        throw ConnectionLostException("READONLY received: Redis server is a replica");
+    }
 
     // jump to redirection handling if error has the potential to actually be a
     // redirection and not a "true error"
-    if (err_str.length() > sizeof("MOVED")) handlePotentialMovedError(err_str);
+    if (err_str.length() > sizeof("ASK")) handlePotentialMovedError(err_str);
 
     // generic error that the plugin doesn't know how to handle
     const std::string msg = std::string("RedisConnection::") + fn + ": " + command + ": " + err_str;
@@ -138,24 +201,30 @@ size_t spredis::RedisConnection::scanContextTypeless(const char* context,
     const Lock lck(m_mutex);
     size_t count = 0;
     RedisReply reply(this, NULL);
-    int nextScanState = 0;
+    unsigned long long nextScanState = 0;
+
+    // records are stored as `{context:prefixkey}', `{context:prefix}key' or
+    // `{context:prefix#bucket}key', depending on the hash tag strategy: only
+    // the keys of the context with the prefix of this instance are matched,
+    // whichever strategy wrote them
+    const std::string pattern = "{" + escapeGlob(context) + ":" + escapeGlob(getPrefix().c_str()) + "*";
+    std::vector<std::string> keys;
 
-    for (;;) {
-        appendCommand("SCAN %d MATCH %s:*", nextScanState, context);
+    do {
+        appendCommand("SCAN %llu MATCH %b COUNT %u", nextScanState, pattern.data(), pattern.size(), m_scan_count);
         reply.getNextFromConnection("scanContext", "SCAN", REDIS_REPLY_ARRAY);
 
         if (reply->elements != 2)
             return count;
 
         if (reply->element[0]->type != REDIS_REPLY_STRING
-            && reply->element[1]->type != REDIS_REPLY_ARRAY)
+            || reply->element[1]->type != REDIS_REPLY_ARRAY)
             return count;
 
-
         redisReply** const elems = reply->element[1]->element;
         const size_t elems_sz = reply->element[1]->elements;
-        count += elems_sz;
 
+        keys.clear();
         for (size_t i = 0; i < elems_sz; ++i) {
             if (elems[i]->type != REDIS_REPLY_STRING) {
                 m_logger.warn("(scanContext) non-string element returned during scanning: type %d at index %zu",
@@ -163,25 +232,30 @@ size_t spredis::RedisConnection::scanContextTypeless(const char* context,
                               i);
                 continue;
             }
-            callback(callbackContext, this, std::string(elems[i]->str, elems[i]->len));
+            keys.push_back(std::string(elems[i]->str, elems[i]->len));
         }
+        count += keys.size();
 
-        try {
-            nextScanState = stoi(std::string(reply->element[0]->str, reply->element[0]->len));
-            if (nextScanState == 0) break;
-        } catch (const std::invalid_argument&) { break; }
-        catch (const std::out_of_range&) { break; }
-    }
+        // the whole page is handed to the callback at once, so it can process
+        // it as a single pipeline instead of a round-trip per key
+        if (!keys.empty()) callback(callbackContext, this, keys);
+
+        nextScanState = std::strtoull(reply->element[0]->str, NULL, 10);
+    } while (nextScanState != 0);
 
     return count;
 }
 
 bool spredis::RedisConnection::set(const StorageId& id, const char* value, const time_t expiration) {
-    m_logger.debug("(set) setting key " SPREDIS_SID_FMT "@1 (exp: %lld)", SPREDIS_SID_FPARAM(id),
+    m_logger.debug("(set) setting key " SPREDIS_SID_LFMT "@1 (exp: %lld)", SPREDIS_SID_LPARAM(id),
                    static_cast<long long>(expiration));
 
     const Lock ulock(m_mutex);
+    if (m_layout == RedisConfig::LAYOUT_HASH) return setHash(id, value, expiration);
+    return setKeys(id, value, expiration);
+}
 
+bool spredis::RedisConnection::setKeys(const StorageId& id, const char* value, const time_t expiration) {
     // load tr. as pipelined commands
     appendCommand("MULTI");
     appendCommand("SET " SPREDIS_SID_FMT " %s NX EXAT %lld",
@@ -214,8 +288,8 @@ bool spredis::RedisConnection::set(const StorageId& id, const char* value, const
     if (reply->element[1]->type != REDIS_REPLY_STATUS) {
         // nil if NX caused a failure in insertion i.e. the key already exists
         if (reply->element[1]->type == REDIS_REPLY_NIL) {
-            m_logger.warn("version value exists for non-existent key " SPREDIS_SID_FMT,
-                          SPREDIS_SID_FPARAM(id));
+            m_logger.warn("version value exists for non-existent key " SPREDIS_SID_LFMT,
+                          SPREDIS_SID_LPARAM(id));
             // clean up value and version
             RedisReply tmp(this,
                            redisCommand(m_redis, "UNLINK " SPREDIS_SID_FMT " version.of:" SPREDIS_SID_FMT,
@@ -233,10 +307,23 @@ bool spredis::RedisConnection::set(const StorageId& id, const char* value, const
 
 int spredis::RedisConnection::getVersioned(const StorageId& id, std::string* out_value, time_t* out_expiration,
                                            int minVersion) {
-    m_logger.debug("(getVersioned) getting key " SPREDIS_SID_FMT "@%d+", SPREDIS_SID_FPARAM(id),
+    m_logger.debug("(getVersioned) getting key " SPREDIS_SID_LFMT "@%d+", SPREDIS_SID_LPARAM(id),
                    minVersion);
-    RedisReply reply(this);
+
+    // the scripts understand both layouts, so they take precedence
+    // both these and the hash layout are single command groups, which lock
+    // the connection themselves
+    if (m_use_scripts && (out_value != NULL || out_expiration != NULL))
+        return getVersionedScripted(id, out_value, out_expiration, minVersion);
+    if (m_layout == RedisConfig::LAYOUT_HASH) return readHash(id, out_value, out_expiration, minVersion);
+
     const Lock ulock(m_mutex);
+    return getVersionedKeys(id, out_value, out_expiration, minVersion);
+}
+
+int spredis::RedisConnection::getVersionedKeys(const StorageId& id, std::string* out_value,
+                                               time_t* out_expiration, const int minVersion) {
+    RedisReply reply(this);
 
     // if no out parameter is present, don't actually perform any lookups
     if (out_value == NULL && out_expiration == NULL) return getOnlyVersion(id);
@@ -271,8 +358,9 @@ int spredis::RedisConnection::getVersioned(const StorageId& id, std::string* out
         reply.getNextFromConnection("getVersioned", "EXEC");
 
         if (reply->type == REDIS_REPLY_NIL) {
-            m_logger.notice("(getVersioned) concurrency failure: retrying accessing " SPREDIS_SID_FMT,
-                            SPREDIS_SID_FPARAM(id));
+            m_logger.notice("(getVersioned) concurrency failure: retrying accessing " SPREDIS_SID_LFMT,
+                            SPREDIS_SID_LPARAM(id));
+            RedisStats::getInstance().count(RedisStats::CONCURRENCY_FAILURES);
             continue;
         }
         reply.ensureType(REDIS_REPLY_ARRAY, "getVersioned");
@@ -301,14 +389,59 @@ int spredis::RedisConnection::getVersioned(const StorageId& id, std::string* out
         return currentVersion;
     }
 
-    m_logger.warn("(getVersioned) concurrency failure: too-many retries while reading " SPREDIS_SID_FMT,
-                  SPREDIS_SID_FPARAM(id));
+    m_logger.warn("(getVersioned) concurrency failure: too-many retries while reading " SPREDIS_SID_LFMT,
+                  SPREDIS_SID_LPARAM(id));
     return 0;
 }
 
+int spredis::RedisConnection::getVersionedScripted(const StorageId& id, std::string* out_value,
+                                                   time_t* out_expiration, const int minVersion) {
+    RedisCommandGroup command;
+    appendScript(command, m_get_versioned_sha,
+                 "2 " SPREDIS_SID_FMT " version.of:" SPREDIS_SID_FMT " %d %d %d",
+                 SPREDIS_SID_FPARAM(id),
+                 SPREDIS_SID_FPARAM(id),
+                 minVersion,
+                 out_value != NULL,
+                 out_expiration != NULL);
+    executeScript(command, RedisScript::GetVersioned, m_get_versioned_sha);
+
+    RedisReply reply(this);
+    reply.getNextFrom(command, "getVersioned", "EVALSHA", REDIS_REPLY_ARRAY);
+
+    if (reply->elements == 0)
+        handleCommandError("getVersioned", "EVALSHA",
+                           "incorrect amount of results from EVALSHA",
+                           sizeof("incorrect amount of results from EVALSHA") - 1);
+
+    RedisReply(this, reply->element[0], RedisReply::nonOwning).ensureType(REDIS_REPLY_INTEGER, "getVersioned");
+    const int currentVersion = static_cast<int>(reply->element[0]->integer);
+    if (currentVersion == 0) return 0; // key not found
+
+    // version, value and expiration
+    if (reply->elements != 3)
+        handleCommandError("getVersioned", "EVALSHA",
+                           "incorrect amount of results from EVALSHA",
+                           sizeof("incorrect amount of results from EVALSHA") - 1);
+
+    if (out_value && currentVersion >= minVersion) {
+        // the version survived, but the value expired in the meantime
+        if (reply->element[1]->type == REDIS_REPLY_NIL) return 0;
+
+        RedisReply(this, reply->element[1], RedisReply::nonOwning).ensureType(REDIS_REPLY_STRING, "getVersioned");
+        *out_value = std::string(reply->element[1]->str, reply->element[1]->len);
+    }
+    if (out_expiration) {
+        RedisReply(this, reply->element[2], RedisReply::nonOwning).ensureType(REDIS_REPLY_INTEGER, "getVersioned");
+        *out_expiration = reply->element[2]->integer;
+    }
+
+    return currentVersion;
+}
+
 int spredis::RedisConnection::getOnlyVersion(const StorageId& id) {
-    m_logger.debug("(getOnlyVersion) short-circuiting to only reading version for key " SPREDIS_SID_FMT "@?",
-                   SPREDIS_SID_FPARAM(id));
+    m_logger.debug("(getOnlyVersion) short-circuiting to only reading version for key " SPREDIS_SID_LFMT "@?",
+                   SPREDIS_SID_LPARAM(id));
 
     appendCommand("GET version.of:" SPREDIS_SID_FMT, SPREDIS_SID_FPARAM(id));
     RedisReply reply(this);
@@ -322,35 +455,40 @@ int spredis::RedisConnection::parseNumber(const StorageId& id, const char* fn, c
 try {
     return stoi(std::string(str, len));
 } catch (const std::invalid_argument&) {
-    m_logger.error("(%s) non-integer value in version key `version.of:" SPREDIS_SID_FMT "'",
+    m_logger.error("(%s) non-integer value in version key `version.of:" SPREDIS_SID_LFMT "'",
                    fn,
-                   SPREDIS_SID_FPARAM(id));
+                   SPREDIS_SID_LPARAM(id));
     return 0;
 } catch (const std::out_of_range&) {
-    m_logger.error("(%s) value in version key `version.of:" SPREDIS_SID_FMT "' exceeds integer limit",
+    m_logger.error("(%s) value in version key `version.of:" SPREDIS_SID_LFMT "' exceeds integer limit",
                    fn,
-                   SPREDIS_SID_FPARAM(id));
+                   SPREDIS_SID_LPARAM(id));
     return 0;
 }
 
 int spredis::RedisConnection::forceGet(const StorageId& id, std::string* out_value, time_t* out_expiration) {
-    m_logger.debug("(forceGet) getting key " SPREDIS_SID_FMT "@?", SPREDIS_SID_FPARAM(id));
-    RedisReply reply(this);
-    const Lock ulock(m_mutex);
+    m_logger.debug("(forceGet) getting key " SPREDIS_SID_LFMT "@?", SPREDIS_SID_LPARAM(id));
+    if (m_layout == RedisConfig::LAYOUT_HASH) return readHash(id, out_value, out_expiration, 0);
+    return forceGetKeys(id, out_value, out_expiration);
+}
 
+int spredis::RedisConnection::forceGetKeys(const StorageId& id, std::string* out_value, time_t* out_expiration) {
     // read tr. as pipeline
-    appendCommand("MULTI");
-    appendCommand("GET version.of:" SPREDIS_SID_FMT, SPREDIS_SID_FPARAM(id));
-    if (out_value) appendCommand("GET " SPREDIS_SID_FMT, SPREDIS_SID_FPARAM(id));
-    if (out_expiration) appendCommand("EXPIRETIME " SPREDIS_SID_FMT, SPREDIS_SID_FPARAM(id));
-    appendCommand("EXEC");
+    RedisCommandGroup command;
+    command.append("MULTI");
+    command.append("GET version.of:" SPREDIS_SID_FMT, SPREDIS_SID_FPARAM(id));
+    if (out_value) command.append("GET " SPREDIS_SID_FMT, SPREDIS_SID_FPARAM(id));
+    if (out_expiration) command.append("EXPIRETIME " SPREDIS_SID_FMT, SPREDIS_SID_FPARAM(id));
+    command.append("EXEC");
+    execute(command);
 
     // exec transaction
-    reply.getNextFromConnection("forceGet", "MULTI", REDIS_REPLY_STATUS);
-    reply.getNextFromConnection("forceGet", "GET (version)", REDIS_REPLY_STATUS);
-    if (out_value) reply.getNextFromConnection("forceGet", "GET (data)", REDIS_REPLY_STATUS);
-    if (out_expiration) reply.getNextFromConnection("forceGet", "EXPIRETIME", REDIS_REPLY_STATUS);
-    reply.getNextFromConnection("forceGet", "EXEC", REDIS_REPLY_ARRAY);
+    RedisReply reply(this);
+    reply.getNextFrom(command, "forceGet", "MULTI", REDIS_REPLY_STATUS);
+    reply.getNextFrom(command, "forceGet", "GET (version)", REDIS_REPLY_STATUS);
+    if (out_value) reply.getNextFrom(command, "forceGet", "GET (data)", REDIS_REPLY_STATUS);
+    if (out_expiration) reply.getNextFrom(command, "forceGet", "EXPIRETIME", REDIS_REPLY_STATUS);
+    reply.getNextFrom(command, "forceGet", "EXEC", REDIS_REPLY_ARRAY);
 
     // incorrect amount of results is a fatal error
     // version + optional outputs
@@ -388,11 +526,23 @@ int spredis::RedisConnection::updateVersioned(const StorageId& id,
                                               const char* value,
                                               const time_t expiration,
                                               const int ifVersion) {
-    m_logger.debug("(upateVersioned) updating key " SPREDIS_SID_FMT "@%d+ (exp: %lld)", SPREDIS_SID_FPARAM(id),
+    m_logger.debug("(upateVersioned) updating key " SPREDIS_SID_LFMT "@%d+ (exp: %lld)", SPREDIS_SID_LPARAM(id),
                    ifVersion,
                    static_cast<long long>(expiration));
-    RedisReply reply(this);
+
+    // the scripts understand both layouts, so they take precedence
+    if (m_use_scripts) return updateVersionedScripted(id, value, expiration, ifVersion);
+
     const Lock ulock(m_mutex);
+    if (m_layout == RedisConfig::LAYOUT_HASH) return updateHash(id, value, expiration, ifVersion, true);
+    return updateVersionedKeys(id, value, expiration, ifVersion);
+}
+
+int spredis::RedisConnection::updateVersionedKeys(const StorageId& id,
+                                                  const char* value,
+                                                  const time_t expiration,
+                                                  const int ifVersion) {
+    RedisReply reply(this);
 
     for (int tryCount = 0; tryCount < optimisticConcurrencyRetryCount; ++tryCount) {
         appendCommand("WATCH version.of:" SPREDIS_SID_FMT,
@@ -401,7 +551,10 @@ int spredis::RedisConnection::updateVersioned(const StorageId& id,
 
         // if version mismatch, report failure
         const int currentVersion = getOnlyVersion(id);
-        if (currentVersion != ifVersion) return -1;
+        if (currentVersion != ifVersion) {
+            unwatch("updateVersioned");
+            return -1;
+        }
 
         // read tr. as pipeline
         appendCommand("MULTI");
@@ -425,8 +578,9 @@ int spredis::RedisConnection::updateVersioned(const StorageId& id,
         reply.getNextFromConnection("updateVersioned", "EXEC");
 
         if (reply->type == REDIS_REPLY_NIL) {
-            m_logger.notice("(updateVersioned) concurrency failure: retrying accessing " SPREDIS_SID_FMT,
-                            SPREDIS_SID_FPARAM(id));
+            m_logger.notice("(updateVersioned) concurrency failure: retrying accessing " SPREDIS_SID_LFMT,
+                            SPREDIS_SID_LPARAM(id));
+            RedisStats::getInstance().count(RedisStats::CONCURRENCY_FAILURES);
             continue;
         }
         reply.ensureType(REDIS_REPLY_ARRAY, "getVersioned");
@@ -444,8 +598,9 @@ int spredis::RedisConnection::updateVersioned(const StorageId& id,
         const RedisReply incr(this, reply->element[1], RedisReply::nonOwning);
         incr.ensureType(REDIS_REPLY_INTEGER, "updateVersioned");
         if (incr->integer - 1 != currentVersion) {
-            m_logger.warn("(updateVersioned) severe concurrency failure: retrying accessing " SPREDIS_SID_FMT,
-                          SPREDIS_SID_FPARAM(id));
+            m_logger.warn("(updateVersioned) severe concurrency failure: retrying accessing " SPREDIS_SID_LFMT,
+                          SPREDIS_SID_LPARAM(id));
+            RedisStats::getInstance().count(RedisStats::CONCURRENCY_FAILURES);
             continue;
         }
 
@@ -459,39 +614,82 @@ int spredis::RedisConnection::updateVersioned(const StorageId& id,
         return static_cast<int>(incr->integer);
     }
 
-    m_logger.warn("(updateVersioned) concurrency failure: too-many retries while reading " SPREDIS_SID_FMT,
-                  SPREDIS_SID_FPARAM(id));
+    m_logger.warn("(updateVersioned) concurrency failure: too-many retries while reading " SPREDIS_SID_LFMT,
+                  SPREDIS_SID_LPARAM(id));
     return 0;
 }
 
+int spredis::RedisConnection::updateVersionedScripted(const StorageId& id,
+                                                      const char* value,
+                                                      const time_t expiration,
+                                                      const int ifVersion) {
+    RedisCommandGroup command;
+    appendScript(command, m_update_versioned_sha,
+                 "2 " SPREDIS_SID_FMT " version.of:" SPREDIS_SID_FMT " %s %lld %d",
+                 SPREDIS_SID_FPARAM(id),
+                 SPREDIS_SID_FPARAM(id),
+                 value,
+                 static_cast<long long>(expiration),
+                 ifVersion);
+    executeScript(command, RedisScript::UpdateVersioned, m_update_versioned_sha);
+
+    RedisReply reply(this);
+    reply.getNextFrom(command, "updateVersioned", "EVALSHA", REDIS_REPLY_INTEGER);
+
+    return static_cast<int>(reply->integer);
+}
+
 int spredis::RedisConnection::forceUpdate(const StorageId& id, const char* value, const time_t expiration) {
-    m_logger.debug("(forceUpdate) updating key " SPREDIS_SID_FMT "@? (exp: %lld)",
-                   SPREDIS_SID_FPARAM(id),
+    m_logger.debug("(forceUpdate) updating key " SPREDIS_SID_LFMT "@? (exp: %lld)",
+                   SPREDIS_SID_LPARAM(id),
                    static_cast<long long>(expiration));
-    RedisReply reply(this);
-    const Lock ulock(m_mutex);
+    if (m_layout == RedisConfig::LAYOUT_HASH) {
+        const Lock ulock(m_mutex);
+        return updateHash(id, value, expiration, 0, false);
+    }
+
+    RedisCommandGroup command;
+    appendForceUpdateKeys(command, id, value, expiration);
+    execute(command);
+    return parseForceUpdateKeys(command, expiration);
+}
+
+int spredis::RedisConnection::forceUpdateKeys(const StorageId& id, const char* value, const time_t expiration) {
+    RedisCommandGroup command;
+    appendForceUpdateKeys(command, id, value, expiration);
+    executeUnguarded(command);
+    return parseForceUpdateKeys(command, expiration);
+}
 
+void spredis::RedisConnection::appendForceUpdateKeys(RedisCommandGroup& command,
+                                                     const StorageId& id,
+                                                     const char* value,
+                                                     const time_t expiration) const {
     // read tr. as pipeline
-    appendCommand("MULTI");
-    appendCommand("SET " SPREDIS_SID_FMT " %s XX KEEPTTL", SPREDIS_SID_FPARAM(id), value);
-    appendCommand("INCR version.of:" SPREDIS_SID_FMT, SPREDIS_SID_FPARAM(id));
+    command.append("MULTI");
+    command.append("SET " SPREDIS_SID_FMT " %s XX KEEPTTL", SPREDIS_SID_FPARAM(id), value);
+    command.append("INCR version.of:" SPREDIS_SID_FMT, SPREDIS_SID_FPARAM(id));
     if (expiration != 0) {
-        appendCommand("EXPIREAT " SPREDIS_SID_FMT " %lld",
-                      SPREDIS_SID_FPARAM(id),
-                      static_cast<long long>(expiration));
-        appendCommand("EXPIREAT version.of:" SPREDIS_SID_FMT " %lld",
-                      SPREDIS_SID_FPARAM(id),
-                      static_cast<long long>(expiration));
+        command.append("EXPIREAT " SPREDIS_SID_FMT " %lld",
+                       SPREDIS_SID_FPARAM(id),
+                       static_cast<long long>(expiration));
+        command.append("EXPIREAT version.of:" SPREDIS_SID_FMT " %lld",
+                       SPREDIS_SID_FPARAM(id),
+                       static_cast<long long>(expiration));
     }
-    appendCommand("EXEC");
+    command.append("EXEC");
+}
+
+int spredis::RedisConnection::parseForceUpdateKeys(RedisCommandGroup& command, const time_t expiration) {
+    RedisReply reply(this);
 
     // exec transaction
-    reply.getNextFromConnection("forceUpdate", "MULTI", REDIS_REPLY_STATUS);
-    reply.getNextFromConnection("forceUpdate", "SET (data)", REDIS_REPLY_STATUS);
-    reply.getNextFromConnection("forceUpdate", "INCR (version)", REDIS_REPLY_STATUS);
-    if (expiration != 0) reply.getNextFromConnection("forceUpdate", "EXPIREAT (data)", REDIS_REPLY_STATUS);
-    if (expiration != 0) reply.getNextFromConnection("forceUpdate", "EXPIREAT (version)", REDIS_REPLY_STATUS);
-    reply.getNextFromConnection("forceUpdate", "EXEC", REDIS_REPLY_ARRAY);
+    reply.getNextFrom(command, "forceUpdate", "MULTI", REDIS_REPLY_STATUS);
+    reply.getNextFrom(command, "forceUpdate", "SET (data)", REDIS_REPLY_STATUS);
+    reply.getNextFrom(command, "forceUpdate", "INCR (version)", REDIS_REPLY_STATUS);
+    if (expiration != 0) reply.getNextFrom(command, "forceUpdate", "EXPIREAT (data)", REDIS_REPLY_STATUS);
+    if (expiration != 0) reply.getNextFrom(command, "forceUpdate", "EXPIREAT (version)", REDIS_REPLY_STATUS);
+    reply.getNextFrom(command, "forceUpdate", "EXEC", REDIS_REPLY_ARRAY);
 
     // incorrect amount of results is a fatal error
     // value + version + 2 * optional expiration
@@ -517,18 +715,32 @@ int spredis::RedisConnection::forceUpdate(const StorageId& id, const char* value
 }
 
 bool spredis::RedisConnection::remove(const StorageId& id) {
-    m_logger.debug("(remove) deleting key " SPREDIS_SID_FMT "@?", SPREDIS_SID_FPARAM(id));
-    const Lock ulock(m_mutex);
+    m_logger.debug("(remove) deleting key " SPREDIS_SID_LFMT "@?", SPREDIS_SID_LPARAM(id));
+
+    RedisCommandGroup command;
+    command.append("UNLINK " SPREDIS_SID_FMT " version.of:" SPREDIS_SID_FMT,
+                   SPREDIS_SID_FPARAM(id),
+                   SPREDIS_SID_FPARAM(id));
+    execute(command);
 
-    RedisReply reply(this,
-                     redisCommand(m_redis,
-                                  "UNLINK " SPREDIS_SID_FMT " version.of:" SPREDIS_SID_FMT,
-                                  SPREDIS_SID_FPARAM(id),
-                                  SPREDIS_SID_FPARAM(id)));
+    const RedisReply reply(this, command.takeReply());
     if (reply->type != REDIS_REPLY_INTEGER) return false;
     return reply->integer != 0;
 }
 
+void spredis::RedisConnection::asking() {
+    const Lock lock(m_mutex);
+    const RedisReply reply(this, redisCommand(m_redis, "ASKING"));
+    reply.throwIfErroneous("asking", "ASKING");
+}
+
+void spredis::RedisConnection::ping() {
+    const Lock lock(m_mutex);
+    const RedisReply reply(this, redisCommand(m_redis, "PING"));
+    reply.throwIfErroneous("ping", "PING");
+    reply.ensureType(REDIS_REPLY_STATUS, "ping");
+}
+
 void spredis::RedisConnection::appendCommand(const char* fmt, ...) const {
     va_list va;
     try {
@@ -541,7 +753,129 @@ void spredis::RedisConnection::appendCommand(const char* fmt, ...) const {
     }
 }
 
+void spredis::RedisConnection::unwatch(const char* fn) {
+    appendCommand("UNWATCH");
+    RedisReply reply(this);
+    reply.getNextFromConnection(fn, "UNWATCH", REDIS_REPLY_STATUS);
+}
+
+void spredis::RedisConnection::loadScripts(const RedisConfig& config) {
+    m_use_scripts = false;
+    if (!config.useScripts) return;
+
+    try {
+        loadScript(RedisScript::GetVersioned, m_get_versioned_sha);
+        loadScript(RedisScript::UpdateVersioned, m_update_versioned_sha);
+        m_use_scripts = true;
+    } catch (const std::exception& ex) {
+        // the connection itself may be fine, e.g. scripting is not allowed by
+        // an ACL, so keep on using it with WATCH-based versioning instead
+        if (!healthy()) throw;
+        m_logger.warn("cannot load server-side scripts, falling back to WATCH-based versioning: %s", ex.what());
+    }
+}
+
+void spredis::RedisConnection::loadScript(const RedisScript& script, std::string& out_sha) {
+    m_logger.debug("loading server-side script %s", script.name);
+
+    const RedisReply reply(this, redisCommand(m_redis, "SCRIPT LOAD %s", script.source));
+    reply.throwIfErroneous("loadScript", "SCRIPT LOAD");
+    reply.ensureType(REDIS_REPLY_STRING, "loadScript");
+    out_sha.assign(reply->str, reply->len);
+}
+
+void spredis::RedisConnection::appendScript(RedisCommandGroup& command, const std::string& sha,
+                                            const char* argsFmt, ...) const {
+    // the digest is hexadecimal, so it's safe to be part of the format
+    const std::string fmt = "EVALSHA " + sha + " " + argsFmt;
+
+    va_list va;
+    va_start(va, argsFmt);
+    char* formatted = NULL;
+    const int length = redisvFormatCommand(&formatted, fmt.c_str(), va);
+    va_end(va);
+    if (length < 0) throw std::bad_alloc();
+
+    try {
+        command.appendFormatted(formatted, static_cast<size_t>(length));
+    } catch (...) {
+        redisFreeCommand(formatted);
+        throw;
+    }
+    redisFreeCommand(formatted);
+}
+
+void spredis::RedisConnection::executeScript(RedisCommandGroup& command, const RedisScript& script,
+                                             std::string& sha) {
+    execute(command);
+    if (!RedisReply(this, command.peekReply(), RedisReply::nonOwning).isError("NOSCRIPT")) return;
+
+    // the digest only depends on the source of the script, so after loading
+    // it again the very same command can be sent once more
+    m_logger.info("server-side script %s unknown to server: reloading", script.name);
+    {
+        const Lock ulock(m_mutex);
+        std::string reloadedSha;
+        loadScript(script, reloadedSha);
+        if (reloadedSha != sha)
+            m_logger.warn("server-side script %s reloaded with a different digest: %s",
+                          script.name, reloadedSha.c_str());
+    }
+
+    command.reset();
+    execute(command);
+}
+
+void spredis::RedisConnection::sendSetupCommands(const int recurse) {
+    // the replies are checked here, as a lost connection has to count
+    // towards the reconnections of recreateContext
+    redisReply* reply = NULL;
+    if (!m_authn_password.empty()) {
+        if (m_authn_username.empty()) {
+            m_logger.info("Performing default authentication");
+            reply = static_cast<redisReply*>(redisCommand(m_redis, "AUTH %s", m_authn_password.c_str()));
+        } else {
+            m_logger.info("Performing ACL-style authentication: user %s", m_authn_username.c_str());
+            reply = static_cast<redisReply*>(redisCommand(m_redis, "AUTH %s %s",
+                                                           m_authn_username.c_str(),
+                                                           m_authn_password.c_str()));
+        }
+        if (reply == NULL) handleCriticalError("setup", recurse);
+        RedisReply(this, reply).throwIfErroneous("setup", "AUTH");
+    }
+
+    // cluster replicas only serve reads to connections which ask for it;
+    // masters ignore the request, so every node of the cluster gets it
+    if (m_read_only) {
+        reply = static_cast<redisReply*>(redisCommand(m_redis, "READONLY"));
+        if (reply == NULL) handleCriticalError("setup", recurse);
+        RedisReply(this, reply).throwIfErroneous("setup", "READONLY");
+    }
+}
+
 void spredis::RedisConnection::recreateContext(int recurse) {
+    RedisStats::getInstance().count(RedisStats::RECONNECTS);
     const int result = redisReconnect(m_redis);
+    // the reader is recreated with the default reply functions, even if
+    // reconnecting failed
+    if (m_redis->reader) m_reply_arena.install(m_redis);
     if (result == REDIS_ERR) handleCriticalError("recreateContext", recurse);
+    // the socket is new, so it is tuned again
+    m_socket_options.apply(m_redis, m_logger);
+
+#ifdef SHIBSP_HAVE_HIREDIS_SSL
+    // hiredis drops TLS when reconnecting: the handshake is done again, which
+    // resumes the session of the lost connection
+    if (m_tls) {
+        bool resumed = false;
+        if (m_tls->handshake(m_redis, m_redis->tcp.host, m_redis->tcp.port, &resumed) != REDIS_OK)
+            handleCriticalError("recreateContext", recurse);
+        m_logger.debug("TLS session with host %s:%d %s", m_redis->tcp.host, m_redis->tcp.port,
+                       resumed ? "resumed" : "negotiated again");
+    }
+#endif
+
+    // the server forgets the authentication and READONLY of the lost
+    // connection, a replica would redirect every read to its master
+    sendSetupCommands(recurse);
 }
@@ -29,12 +29,18 @@
 #define REDIS_CONNECTION_H
 
 #include <cassert>
+#include <deque>
 #include <string>
+#include <vector>
 
 #include "common.h"
 #include "cluster-range.h"
 #include "redis.h"
+#include "redis-async-connection.h"
 #include "redis-reply.h"
+#include "redis-reply-arena.h"
+#include "redis-scripts.h"
+#include "socket-options.h"
 
 // XXX Win32 - special config headers
 #include "config.h"
@@ -44,10 +50,13 @@
 #include <xmltooling/logging.h>
 
 #ifdef SHIBSP_HAVE_HIREDIS_SSL
-#include <hiredis/hiredis_ssl.h>
+#include <boost/shared_ptr.hpp>
+#include "redis-tls-context.h"
 #endif
 
 namespace spredis {
+    class RedisCommandGroup;
+
     class SHIBSP_HIDDEN RedisConnection SHIBSP_FINAL : public Redis {
     public:
         void connect(const RedisConfig& config, const std::string& redisHost, int redisPort);
@@ -59,15 +68,96 @@ namespace spredis {
                         int ovPort);
 
         ~RedisConnection() {
-#ifdef SHIBSP_HAVE_HIREDIS_SSL
-            redisFreeSSLContext(m_ssl);
-#endif
             redisFree(m_redis);
         }
 
         redisContext& getRedisContext() { return *m_redis; }
         const redisContext& getRedisContext() const { return *m_redis; }
 
+        /**
+         * Checks whether the connection is usable for further commands, i.e.
+         * it is not in an error state it could not recover from.
+         */
+        bool healthy() const { return m_redis != NULL && m_redis->err == 0; }
+
+        /**
+         * Whether the operation is sent as a single group of commands, in
+         * which case it can share the connection with other callers when
+         * automatic pipelining is enabled. Other operations keep the
+         * connection for themselves over multiple round-trips.
+         */
+        bool pipelinesGetVersioned() const { return m_use_scripts || m_layout == RedisConfig::LAYOUT_HASH; }
+        bool pipelinesUpdateVersioned() const { return m_use_scripts; }
+        bool pipelinesForceUpdate() const { return m_layout == RedisConfig::LAYOUT_KEYS; }
+
+        /**
+         * Sends the groups of commands of the connection over an asynchronous
+         * connection to the same server from now on, so concurrent callers
+         * share its socket without waiting for each other. Operations which
+         * need multiple round-trips keep using the blocking connection.
+         * Does nothing if the asynchronous engine is not available.
+         */
+        void connectAsync(const RedisConfig& config, const std::string& redisHost, int redisPort);
+
+        /**
+         * Switches the connection to RESP3, and subscribes to invalidation
+         * messages for every key starting with one of the prefixes, using
+         * `CLIENT TRACKING on BCAST'. The connection must not be used to
+         * execute other commands afterwards.
+         * Requires hiredis 1.0.0 and Redis 6 or above; throws otherwise.
+         */
+        void startTracking(const std::vector<std::string>& prefixes);
+
+        /**
+         * Reads the invalidation messages available on a tracking connection,
+         * without waiting for more to arrive: only call it when the socket is
+         * readable. An invalidation of all keys (e.g. after FLUSHALL) is
+         * reported by setting out_flushAll.
+         *
+         * @return false if the connection is lost, true otherwise.
+         */
+        bool readInvalidations(std::vector<std::string>& out_keys, bool& out_flushAll);
+
+        int socket() const { return m_redis->fd; }
+
+        /**
+         * Connects to a Sentinel instead of a Redis server: only the timeouts,
+         * TLS and the Sentinel password of the configuration apply. The
+         * connection can only be used for the Sentinel operations below.
+         */
+        static RedisConnection* connectSentinel(const RedisConfig& config, const ClusterNode& sentinel);
+
+        /**
+         * Asks a Sentinel for the address of the current primary of the
+         * monitored master called name.
+         *
+         * @return false if the Sentinel does not know of such a master.
+         */
+        bool sentinelPrimary(const std::string& name, ClusterNode& out_primary);
+
+        /**
+         * Asks a Sentinel for the replicas of the monitored master called
+         * name which can serve reads: replicas it considers down or
+         * disconnected from the primary are left out.
+         */
+        std::vector<ClusterNode> sentinelReplicas(const std::string& name);
+
+        /**
+         * Subscribes to the `+switch-master' events of a Sentinel. The
+         * connection must not be used to execute other commands afterwards.
+         */
+        void subscribeSwitchMaster();
+
+        /**
+         * Reads the `+switch-master' events available on a subscribed
+         * connection, without waiting for more to arrive: only call it when
+         * the socket is readable. If the primary of name switched,
+         * out_primary is set to its latest address, and out_switched is set.
+         *
+         * @return false if the connection is lost, true otherwise.
+         */
+        bool readSwitchMaster(const std::string& name, ClusterNode& out_primary, bool& out_switched);
+
         bool set(const StorageId& id, const char* value, time_t expiration);
 
         int getVersioned(const StorageId& id, std::string* out_value, time_t* out_expiration, int minVersion);
@@ -80,17 +170,64 @@ namespace spredis {
 
         bool remove(const StorageId& id);
 
+        void indexRecord(const StorageId& id, time_t expiration);
+
+        void unindexRecord(const StorageId& id);
+
+        void expireContextIndex(const char* context, time_t expiration);
+
+        void deleteContextIndex(const char* context);
+
+        unsigned long long scanContextIndexPage(const char* context, unsigned long long cursor,
+                                                std::vector<std::string>* out_members);
+
+        long long touchContextEpoch(const char* context, time_t keepUntil);
+
+        bool readContextEpoch(const char* context, ContextEpoch* out_epoch);
+
+        long long expireContextEpoch(const char* context, time_t expiration, time_t keepUntil, time_t* out_horizon);
+
+        long long deleteContextEpoch(const char* context);
+
+        void raiseContextEpochHorizon(const char* context, long long generation, time_t horizon);
+
+        /**
+         * Sends ASKING: the next command is executed even if its key is being
+         * migrated to this node, following an ASK redirection. Only used on
+         * connections checked out for the redirected operation.
+         */
+        void asking();
+
+        /**
+         * Sends a PING, and waits for its reply: the round-trip time to the
+         * server can be measured by timing it.
+         */
+        void ping();
+
+        /**
+         * Same as execute, but expects the connection's mutex to be held by
+         * the caller, and never pipelines the group with others.
+         * Callbacks of the context scans run with the mutex held, so they use
+         * this to send their commands.
+         */
+        void executeUnguarded(RedisCommandGroup& command);
+
         void handleCriticalError(const char* fn, int recurse = 0);
 
         void handlePotentialMovedError(const std::string& err_str) const;
 
         void handleCommandError(const char* fn, const char* command, const char* errorBuf, size_t errorLen) const;
 
+        /**
+         * Calls callback with every slot range of the cluster, the master
+         * serving it, and the replicas of the master (which may be empty).
+         */
         template<class Fn>
         void iterateSlots(Fn callback) {
             const RedisReply reply(this, redisCommand(m_redis, "CLUSTER SLOTS"));
             reply.ensureType(REDIS_REPLY_ARRAY, "iterateSlots");
 
+            std::vector<ClusterNode> replicas;
             for (size_t i = 0; i < reply->elements; ++i) {
                 const RedisReply rangeEntry(this, reply->element[i], RedisReply::nonOwning);
                 rangeEntry.ensureType(REDIS_REPLY_ARRAY, "iterateSlots");
@@ -112,7 +249,7 @@ namespace spredis {
                 const RedisReply nodeReply(this, rangeEntry->element[2], RedisReply::nonOwning);
                 nodeReply.ensureType(REDIS_REPLY_ARRAY, "iterateSlots");
 
-                if (rangeEntry->elements < 2) {
+                if (nodeReply->elements < 2) {
                     m_logger.error(
                         "Invalid slots configuration returned from redis: "
                         "slot-range's node is missing ip and port data");
@@ -124,14 +261,35 @@ namespace spredis {
                 const ClusterNode node(std::string(nodeReply->element[0]->str, nodeReply->element[0]->len),
                                        static_cast<unsigned short>(nodeReply->element[1]->integer));
 
-                callback(range, node);
+                // replicas are optional: malformed or unaddressable entries
+                // (empty host, e.g. while the replica is starting) are skipped
+                replicas.clear();
+                for (size_t j = 3; j < rangeEntry->elements; ++j) {
+                    const redisReply* const replica = rangeEntry->element[j];
+                    if (replica->type != REDIS_REPLY_ARRAY
+                        || replica->elements < 2
+                        || replica->element[0]->type != REDIS_REPLY_STRING
+                        || replica->element[0]->len == 0
+                        || replica->element[1]->type != REDIS_REPLY_INTEGER)
+                        continue;
+
+                    replicas.push_back(ClusterNode(std::string(replica->element[0]->str, replica->element[0]->len),
+                                                   static_cast<unsigned short>(replica->element[1]->integer)));
+                }
+
+                callback(range, node, replicas);
             }
         }
 
     protected:
         size_t scanContextTypeless(const char* context, RawCallbackType callback, void* callbackContext) override;
 
+        size_t scanContextIndexTypeless(const char* context, RawCallbackType callback,
+                                        void* callbackContext) override;
+
     private:
+        friend class RedisConnectionPool;
+
         struct private_tag_t {
         };
 
@@ -141,16 +299,132 @@ namespace spredis {
         // -> all other constructors should direct to this, then call connect
         RedisConnection(const RedisConfig& config, private_tag_t /* disambiguate */);
 
+        /**
+         * Opens the connection to the server, performing the TLS handshake if
+         * configured, but sends no commands. Called by connect, which then
+         * sets up the connection for the operations.
+         */
+        void open(const RedisConfig& config, const std::string& redisHost, int redisPort);
+
+        /**
+         * Authenticates the connection and sends READONLY to cluster nodes if
+         * reads may be routed to replicas. Called after each open, and again
+         * after each reconnection.
+         */
+        void sendSetupCommands(int recurse = 0);
+
+        // implementations of the operations for the two record layouts: these
+        // expect the connection's mutex to be held by the caller, except the
+        // ones sent as a single command group (forceGetKeys, readHash and the
+        // scripted ones), which lock the connection when executing the group
+        bool setKeys(const StorageId& id, const char* value, time_t expiration);
+
+        int getVersionedKeys(const StorageId& id, std::string* out_value, time_t* out_expiration, int minVersion);
+
+        int forceGetKeys(const StorageId& id, std::string* out_value, time_t* out_expiration);
+
+        int updateVersionedKeys(const StorageId& id, const char* value, time_t expiration, int ifVersion);
+
+        int forceUpdateKeys(const StorageId& id, const char* value, time_t expiration);
+
+        void appendForceUpdateKeys(RedisCommandGroup& command, const StorageId& id, const char* value,
+                                   time_t expiration) const;
+
+        int parseForceUpdateKeys(RedisCommandGroup& command, time_t expiration);
+
+        bool setHash(const StorageId& id, const char* value, time_t expiration);
+
+        /**
+         * Reads a record in the hash layout. The value is only returned if the
+         * version is at least minVersion; for an unconditional read pass 0.
+         * Records still stored in the key layout are read using the
+         * corresponding key layout implementation.
+         */
+        int readHash(const StorageId& id, std::string* out_value, time_t* out_expiration, int minVersion);
+
+        /**
+         * Updates a record in the hash layout. If checkVersion is set, the
+         * update only happens if the current version is equal to ifVersion.
+         * Records still stored in the key layout are updated in place using
+         * the corresponding key layout implementation.
+         */
+        int updateHash(const StorageId& id, const char* value, time_t expiration, int ifVersion, bool checkVersion);
+
+        unsigned long long scanContextIndexPageUnguarded(const char* context, unsigned long long cursor,
+                                                         std::vector<std::string>* out_members);
+
+        /**
+         * Advances the generation of the epoch for a context operation: an
+         * updateContext to expiration, or a deleteContext if expiration is 0.
+         */
+        long long advanceContextEpochUnguarded(const StorageId& epoch, time_t expiration, time_t keepUntil,
+                                               time_t* out_horizon);
+
+        void lowerContextEpochHorizonUnguarded(const StorageId& epoch, time_t horizon);
+
         int getOnlyVersion(const StorageId& id);
 
+        void unwatch(const char* fn);
+
+        int getVersionedScripted(const StorageId& id, std::string* out_value, time_t* out_expiration,
+                                 int minVersion);
+
+        int updateVersionedScripted(const StorageId& id, const char* value, time_t expiration, int ifVersion);
+
+        /**
+         * Loads the server-side scripts if configured, falling back to the
+         * WATCH-based implementation of versioned operations if the server
+         * refuses them. Called after each successful connect.
+         */
+        void loadScripts(const RedisConfig& config);
+
+        void loadScript(const RedisScript& script, std::string& out_sha);
+
+        /**
+         * Appends an EVALSHA of the script to the group. The format string and
+         * arguments describe the parameters after the SHA1 digest (numkeys,
+         * keys and args).
+         */
+        void appendScript(RedisCommandGroup& command, const std::string& sha, const char* argsFmt, ...) const;
+
+        /**
+         * Executes a group consisting of a single EVALSHA. If the server does
+         * not know the script (NOSCRIPT), e.g. because it was restarted or
+         * failed over, the script is loaded again and executed once more.
+         */
+        void executeScript(RedisCommandGroup& command, const RedisScript& script, std::string& sha);
+
+        /**
+         * Sends the commands of the group and reads all their replies into the
+         * group. Locks the connection for the time of the round-trip; with
+         * automatic pipelining enabled, the group is sent together with the
+         * groups of other callers waiting at the same time, and with an
+         * asynchronous connection, it is handed to its loop instead.
+         * Errors of the connection itself are thrown, errors replied to the
+         * commands are left in the group for the caller to handle.
+         */
+        void execute(RedisCommandGroup& command);
+
+        /**
+         * Sends the queued groups of the callers waiting for the pipeline, in
+         * batches, until the group of the current caller is completed.
+         */
+        void leadPipeline(const RedisCommandGroup& own);
+
+        void flushBatchUnguarded(const std::vector<RedisCommandGroup*>& batch);
+
+        void readRepliesUnguarded(RedisCommandGroup& command);
+
         int parseNumber(const StorageId& id, const char* fn, const char* str, size_t len) const;;
 
         void appendCommand(const char* fmt, ...) const;
 
         void recreateContext(int recurse = 0);
 
-        RedisConnection(const RedisConnection&)
+        RedisConnection(const RedisConnection& other)
             : Redis("disable copy"),
+              m_socket_options(other.m_socket_options),
+              m_read_only(false),
               m_logger(log4shib::Category::getInstance("")) { assert(false); }
 
         RedisConnection&
@@ -160,12 +434,37 @@ namespace spredis {
         }
 
         redisContext* m_redis;
+        RedisReplyArena m_reply_arena;
         timeval m_command_timeout;
         timeval m_connect_timeout;
+        const SocketOptions m_socket_options;
+        // the credentials sent by sendSetupCommands, those of the Sentinel
+        // for connections to a Sentinel
+        std::string m_authn_username;
+        std::string m_authn_password;
+        const bool m_read_only;
         xmltooling::logging::Category& m_logger;
         boost::scoped_ptr<xmltooling::Mutex> m_mutex;
+        RedisConfig::RecordLayout m_layout;
+        bool m_use_scripts;
+        std::string m_get_versioned_sha;
+        std::string m_update_versioned_sha;
+        bool m_auto_pipeline;
+        unsigned int m_pipeline_batch_size;
+        unsigned int m_scan_count;
+        // guards the pipeline queue and leader; is never held while
+        // communicating with the server, contrary to m_mutex
+        boost::scoped_ptr<xmltooling::Mutex> m_queue_mutex;
+        boost::scoped_ptr<xmltooling::CondWait> m_queue_changed;
+        std::deque<RedisCommandGroup*> m_queue;
+        bool m_pipeline_leader;
+#ifdef SPREDIS_HAVE_ASYNC_ENGINE
+        boost::scoped_ptr<RedisAsyncConnection> m_async;
+#endif
 #ifdef SHIBSP_HAVE_HIREDIS_SSL
-        redisSSLContext* m_ssl;
+        // the context the TLS connection was made with, NULL if TLS is not
+        // used; kept alive for as long as the connection is open
+        boost::shared_ptr<RedisTlsContext> m_tls;
 #endif
     };
 }
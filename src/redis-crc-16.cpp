@@ -26,6 +26,8 @@
 
 #include "redis-crc-16.h"
 
+#include <numeric>
+
 const unsigned int spredis::RedisCrc16::Initial = 0;
 const unsigned int spredis::RedisCrc16::HashSlotCount = 16384;
 const unsigned int spredis::RedisCrc16::Crc16Constants[32 * 8] = {
@@ -62,3 +64,73 @@ const unsigned int spredis::RedisCrc16::Crc16Constants[32 * 8] = {
     0xef1f, 0xff3e, 0xcf5d, 0xdf7c, 0xaf9b, 0xbfba, 0x8fd9, 0x9ff8,
     0x6e17, 0x7e36, 0x4e55, 0x5e74, 0x2e93, 0x3eb2, 0x0ed1, 0x1ef0,
 };
+
+namespace {
+    /**
+     * Lookup tables to process eight bytes of input in a single step.
+     * Table k contains the CRC of each byte value followed by k zero bytes,
+     * so table 0 is the byte-wise table itself, and the CRC of eight bytes is
+     * the XOR of looking up each byte in the table for its distance from the
+     * end of the block. Entries are stored in 16 bits so that all eight tables
+     * take up only 4 KiB of cache.
+     */
+    struct SliceTables {
+        explicit SliceTables(const unsigned int* const byteTable) {
+            for (unsigned int i = 0; i < 256; ++i) {
+                t[0][i] = static_cast<unsigned short>(byteTable[i]);
+            }
+            for (unsigned int k = 1; k < 8; ++k) {
+                for (unsigned int i = 0; i < 256; ++i) {
+                    const unsigned int prev = t[k - 1][i];
+                    t[k][i] = static_cast<unsigned short>((prev << 8U & 0xFFFF) ^ t[0][prev >> 8U]);
+                }
+            }
+        }
+
+        unsigned short t[8][256];
+    };
+
+    const unsigned char* asBytes(const char* const ptr) {
+        return reinterpret_cast<const unsigned char*>(ptr);
+    }
+}
+
+unsigned int spredis::RedisCrc16::calculate(const char* const begin,
+                                            const char* const end,
+                                            const unsigned int initial) {
+    // constructed on first use, so it does not depend on the initialization
+    // order of statics across translation units
+    static const SliceTables slices(Crc16Constants);
+    const unsigned short (&t)[8][256] = slices.t;
+
+    const unsigned char* it = asBytes(begin);
+    const unsigned char* const last = asBytes(end);
+    unsigned int crc = initial & 0xFFFF;
+
+    // the current CRC value is folded into the first two bytes of the block,
+    // after which each byte contributes independently of all others
+    while (last - it >= 8) {
+        crc = t[7][(crc >> 8U ^ it[0]) & 0xFF]
+              ^ t[6][(crc ^ it[1]) & 0xFF]
+              ^ t[5][it[2]]
+              ^ t[4][it[3]]
+              ^ t[3][it[4]]
+              ^ t[2][it[5]]
+              ^ t[1][it[6]]
+              ^ t[0][it[7]];
+        it += 8;
+    }
+
+    return std::accumulate(reinterpret_cast<const char*>(it), end, crc, RedisCrc16());
+}
+
+unsigned int spredis::RedisCrc16::keySlot(const std::string& key) {
+    const std::string::size_type open = key.find('{');
+    if (open != std::string::npos) {
+        const std::string::size_type close = key.find('}', open + 1);
+        // an empty tag, `{}', does not count as a tag
+        if (close != std::string::npos && close != open + 1)
+            return calculate(key.data() + open + 1, key.data() + close) % HashSlotCount;
+    }
+    return calculate(key.data(), key.data() + key.size()) % HashSlotCount;
+}
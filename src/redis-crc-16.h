@@ -29,6 +29,7 @@
 #define REDIS_CRC_16_H
 
 #include <numeric>
+#include <string>
 
 #include "common.h"
 
@@ -55,12 +56,20 @@ namespace spredis {
          * Shorthand for calculating the CRC16 hash of a range
          * given by begin and end character pointers.
          * Can be chained, by supplying an appropriate initial value.
+         *
+         * The range is processed eight bytes at a time using slice-by-8
+         * tables derived from the byte-wise table, so the result is the same
+         * as that of accumulating the range using operator().
          */
-        static unsigned int calculate(const char* const begin,
-                                      const char* const end,
-                                      const unsigned int initial = Initial) {
-            return std::accumulate(begin, end, initial, RedisCrc16{});
-        }
+        static unsigned int calculate(const char* begin,
+                                      const char* end,
+                                      unsigned int initial = Initial);
+
+        /**
+         * Returns the hash-slot of a formatted key, as calculated by Redis:
+         * only the part between the first pair of braces is hashed, if any.
+         */
+        static unsigned int keySlot(const std::string& key);
 
     private:
         static const unsigned int Crc16Constants[32 * 8];
@@ -0,0 +1,375 @@
+/**
+ * Licensed to the University Corporation for Advanced Internet
+ * Development, Inc. (UCAID) under one or more contributor license
+ * agreements. See the NOTICE file distributed with this work for
+ * additional information regarding copyright ownership.
+ *
+ * UCAID licenses this file to you under the Apache License,
+ * Version 2.0 (the "License"); you may not use this file except
+ * in compliance with the License. You may obtain a copy of the
+ * License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+ */
+
+/**
+ * redis-read-cache.cpp
+ *
+ * Implementation of the RedisReadCache type.
+ */
+
+#include "redis-read-cache.h"
+
+#include <algorithm>
+
+// XXX Win32 - poll
+#include <poll.h>
+
+#include <xmltooling/exceptions.h>
+
+using namespace xmltooling;
+
+namespace {
+    // how often the endpoints are checked for changes in cluster topology
+    const time_t endpointCheckInterval = 5;
+    const int pollTimeoutMillisec = 1000;
+    // approximation of the allocation and bookkeeping overhead of an entry
+    const size_t entryOverhead = 128;
+
+    const char versionKeyPrefix[] = "version.of:";
+
+    std::string cacheKey(const spredis::StorageId& id) {
+        // the key as stored, so invalidated keys can be matched
+        return std::string(id.wire(), id.wireLength());
+    }
+
+    std::vector<spredis::ClusterNode> sorted(std::vector<spredis::ClusterNode> nodes) {
+        std::sort(nodes.begin(), nodes.end());
+        return nodes;
+    }
+
+    // XXX lambda when possible
+    struct callback_wrap {
+        callback_wrap(void (*const callback)(void*, spredis::RedisConnection*, const std::vector<std::string>&),
+                      void* const callback_context)
+            : callback(callback),
+              callbackContext(callback_context) {
+        }
+
+        void
+        operator()(spredis::RedisConnection* connection, const std::vector<std::string>& keys) const {
+            callback(callbackContext, connection, keys);
+        }
+
+        void (*callback)(void*, spredis::RedisConnection*, const std::vector<std::string>&);
+        void* callbackContext;
+    };
+}
+
+spredis::RedisReadCache::RedisReadCache(const RedisConfig& config, Redis* const inner)
+    : Redis(inner->getPrefix(), inner->getHashTag(), inner->getHashTagBuckets()),
+      m_inner(inner),
+      m_config(config),
+      m_logger(logging::Category::getInstance("XMLTooling.StorageService.REDIS")),
+      m_mutex(Mutex::create()),
+      m_lru(),
+      m_index(),
+      m_size(0),
+      m_max_size(static_cast<size_t>(config.clientCacheSize) * 1024U),
+      m_generation(0),
+      m_coherent(false),
+      m_shutdown(false),
+      m_trackers(),
+      m_tracked(),
+      m_tracker() {
+    // connect eagerly, so configuration errors (e.g. hiredis or Redis being
+    // too old for tracking) are reported when the plugin is loaded
+    connectTrackers(sorted(m_inner->endpoints()));
+    m_coherent = true;
+    m_tracker.reset(Thread::create(&RedisReadCache::trackerMain, this));
+}
+
+spredis::RedisReadCache::~RedisReadCache() {
+    {
+        const Lock lock(m_mutex);
+        m_shutdown = true;
+    }
+    if (m_tracker) m_tracker->join(NULL);
+}
+
+bool spredis::RedisReadCache::set(const StorageId& id, const char* value, const time_t expiration) {
+    const bool result = m_inner->set(id, value, expiration);
+    invalidate(cacheKey(id));
+    return result;
+}
+
+int spredis::RedisReadCache::getVersioned(const StorageId& id, std::string* out_value, time_t* out_expiration,
+                                          const int minVersion) {
+    return read(id, out_value, out_expiration, minVersion);
+}
+
+int spredis::RedisReadCache::forceGet(const StorageId& id, std::string* out_value, time_t* out_expiration) {
+    return read(id, out_value, out_expiration, 0);
+}
+
+int spredis::RedisReadCache::updateVersioned(const StorageId& id, const char* value, const time_t expiration,
+                                             const int ifVersion) {
+    const int result = m_inner->updateVersioned(id, value, expiration, ifVersion);
+    invalidate(cacheKey(id));
+    return result;
+}
+
+int spredis::RedisReadCache::forceUpdate(const StorageId& id, const char* value, const time_t expiration) {
+    const int result = m_inner->forceUpdate(id, value, expiration);
+    invalidate(cacheKey(id));
+    return result;
+}
+
+bool spredis::RedisReadCache::remove(const StorageId& id) {
+    const bool result = m_inner->remove(id);
+    invalidate(cacheKey(id));
+    return result;
+}
+
+size_t spredis::RedisReadCache::scanContextTypeless(const char* context,
+                                                    RawCallbackType callback,
+                                                    void* callbackContext) {
+    m_inner->scanContext(context, callback_wrap(callback, callbackContext));
+    invalidateContext(context);
+    return 0U;
+}
+
+size_t spredis::RedisReadCache::scanContextIndexTypeless(const char* context,
+                                                         RawCallbackType callback,
+                                                         void* callbackContext) {
+    m_inner->scanContextIndex(context, callback_wrap(callback, callbackContext));
+    invalidateContext(context);
+    return 0U;
+}
+
+int spredis::RedisReadCache::read(const StorageId& id, std::string* out_value, time_t* out_expiration,
+                                  const int minVersion) {
+    const std::string key = cacheKey(id);
+
+    int version = 0;
+    if (lookup(key, minVersion, out_value, out_expiration, version)) return version;
+
+    // always read the whole record, so later reads wanting more than this
+    // one can be answered from the cache as well; a versioned read is read
+    // as such, so a replica lagging behind the version is not trusted, and
+    // is only cached if its value was read
+    const unsigned long generation = currentGeneration();
+    std::string value;
+    time_t expiration = 0;
+    version = minVersion > 0
+                  ? m_inner->getVersioned(id, &value, &expiration, minVersion)
+                  : m_inner->forceGet(id, &value, &expiration);
+    if (version == 0 || version >= minVersion) fill(key, generation, version, value, expiration);
+
+    if (version == 0) return 0;
+    if (out_value && version >= minVersion) *out_value = value;
+    if (out_expiration) *out_expiration = expiration;
+    return version;
+}
+
+bool spredis::RedisReadCache::lookup(const std::string& key, const int minVersion, std::string* out_value,
+                                     time_t* out_expiration, int& out_version) {
+    const time_t now = time(NULL);
+
+    const Lock lock(m_mutex);
+    const index_type::iterator found = m_index.find(key);
+    if (found == m_index.end()) return false;
+
+    const lru_list_type::iterator it = found->second;
+    // EXPIRETIME is negative for records without expiration
+    if ((m_config.clientCacheTtl > 0 && now >= it->cachedUntil)
+        || (it->expiration > 0 && now >= it->expiration)) {
+        eraseUnguarded(it);
+        return false;
+    }
+
+    // the caller already knows of a later version: the invalidation of the
+    // cached one may still be on its way, so the record is read again
+    if (minVersion > 0 && it->version < minVersion) return false;
+
+    m_lru.splice(m_lru.begin(), m_lru, it);
+    out_version = it->version;
+    if (it->version == 0) return true; // cached absence of the record
+
+    if (out_value && it->version >= minVersion) *out_value = it->value;
+    if (out_expiration) *out_expiration = it->expiration;
+    return true;
+}
+
+void spredis::RedisReadCache::fill(const std::string& key, const unsigned long generation, const int version,
+                                   const std::string& value, const time_t expiration) {
+    const size_t cost = 2 * key.size() + value.size() + entryOverhead;
+    if (cost > m_max_size) return;
+
+    // only consulted if a time-to-live is configured
+    const time_t cachedUntil = time(NULL) + static_cast<time_t>(m_config.clientCacheTtl);
+
+    const Lock lock(m_mutex);
+    // the record may have changed since it was read: its (possibly stale)
+    // value must not be cached
+    if (!m_coherent || generation != m_generation) return;
+
+    const index_type::iterator found = m_index.find(key);
+    if (found != m_index.end()) eraseUnguarded(found->second);
+
+    Entry entry;
+    entry.key = key;
+    entry.version = version;
+    entry.value = value;
+    entry.expiration = expiration;
+    entry.cachedUntil = cachedUntil;
+    entry.cost = cost;
+    m_lru.push_front(entry);
+    m_index.insert(std::make_pair(key, m_lru.begin()));
+    m_size += cost;
+
+    while (m_size > m_max_size && !m_lru.empty()) {
+        eraseUnguarded(--m_lru.end());
+    }
+}
+
+unsigned long spredis::RedisReadCache::currentGeneration() const {
+    const Lock lock(m_mutex);
+    return m_generation;
+}
+
+void spredis::RedisReadCache::invalidate(const std::string& key) {
+    const Lock lock(m_mutex);
+    ++m_generation;
+
+    const index_type::iterator found = m_index.find(key);
+    if (found != m_index.end()) eraseUnguarded(found->second);
+}
+
+void spredis::RedisReadCache::invalidateContext(const char* const context) {
+    const std::string keyPrefix = std::string("{") + context + ":";
+
+    const Lock lock(m_mutex);
+    ++m_generation;
+
+    for (lru_list_type::iterator it = m_lru.begin(); it != m_lru.end();) {
+        const lru_list_type::iterator current = it++;
+        if (current->key.compare(0, keyPrefix.size(), keyPrefix) == 0) eraseUnguarded(current);
+    }
+}
+
+void spredis::RedisReadCache::invalidateTracked(const std::vector<std::string>& keys) {
+    const Lock lock(m_mutex);
+    ++m_generation;
+
+    for (size_t i = 0; i < keys.size(); ++i) {
+        // the version key of the key layout invalidates the record as well
+        const std::string& key = keys[i];
+        const size_t offset = key.compare(0, sizeof(versionKeyPrefix) - 1, versionKeyPrefix) == 0
+                                  ? sizeof(versionKeyPrefix) - 1
+                                  : 0;
+
+        const index_type::iterator found = m_index.find(key.substr(offset));
+        if (found != m_index.end()) eraseUnguarded(found->second);
+    }
+}
+
+void spredis::RedisReadCache::flush(const bool coherent) {
+    const Lock lock(m_mutex);
+    ++m_generation;
+    m_coherent = coherent;
+    m_index.clear();
+    m_lru.clear();
+    m_size = 0;
+}
+
+void spredis::RedisReadCache::eraseUnguarded(const lru_list_type::iterator it) {
+    m_size -= it->cost;
+    m_index.erase(it->key);
+    m_lru.erase(it);
+}
+
+void* spredis::RedisReadCache::trackerMain(void* const self) {
+    static_cast<RedisReadCache*>(self)->track();
+    return NULL;
+}
+
+void spredis::RedisReadCache::track() {
+    time_t lastCheck = time(NULL);
+    std::vector<std::string> keys;
+
+    while (!shuttingDown()) {
+        const time_t now = time(NULL);
+        if (m_trackers.empty() || now - lastCheck >= endpointCheckInterval) {
+            lastCheck = now;
+            const std::vector<ClusterNode> endpoints = sorted(m_inner->endpoints());
+            if (m_trackers.empty() || endpoints != m_tracked) {
+                m_logger.info("(RedisReadCache) (re)establishing tracking connections for client-side caching");
+                // invalidations may be missed until the connections are set up
+                flush(false);
+                try {
+                    connectTrackers(endpoints);
+                    flush(true);
+                } catch (const std::exception& ex) {
+                    m_logger.error("(RedisReadCache) cannot establish tracking connection, client-side cache "
+                                   "disabled until it can be: %s", ex.what());
+                    m_trackers.clear();
+                    Thread::sleep(1);
+                    continue;
+                }
+            }
+        }
+
+        std::vector<pollfd> fds(m_trackers.size());
+        for (size_t i = 0; i < m_trackers.size(); ++i) {
+            fds[i].fd = m_trackers[i].socket();
+            fds[i].events = POLLIN;
+            fds[i].revents = 0;
+        }
+        if (poll(&fds[0], static_cast<nfds_t>(fds.size()), pollTimeoutMillisec) <= 0) continue;
+
+        for (size_t i = 0; i < fds.size(); ++i) {
+            if (fds[i].revents == 0) continue;
+
+            keys.clear();
+            bool flushAll = false;
+            if (!m_trackers[i].readInvalidations(keys, flushAll)) {
+                // reconnected on the next iteration
+                flush(false);
+                m_trackers.clear();
+                break;
+            }
+
+            if (flushAll) flush(true);
+            else if (!keys.empty()) invalidateTracked(keys);
+        }
+    }
+}
+
+void spredis::RedisReadCache::connectTrackers(const std::vector<ClusterNode>& endpoints) {
+    if (endpoints.empty())
+        throw XMLToolingException("Client-side caching: no Redis servers are known to track");
+
+    std::vector<std::string> prefixes;
+    prefixes.push_back("{");
+    prefixes.push_back(std::string(versionKeyPrefix) + "{");
+
+    m_trackers.clear();
+    m_tracked.clear();
+    for (size_t i = 0; i < endpoints.size(); ++i) {
+        m_trackers.push_back(endpoints[i].connect(m_config));
+        m_trackers.back().startTracking(prefixes);
+    }
+    m_tracked = endpoints;
+}
+
+bool spredis::RedisReadCache::shuttingDown() const {
+    const Lock lock(m_mutex);
+    return m_shutdown;
+}
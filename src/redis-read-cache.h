@@ -0,0 +1,204 @@
+/**
+ * Licensed to the University Corporation for Advanced Internet
+ * Development, Inc. (UCAID) under one or more contributor license
+ * agreements. See the NOTICE file distributed with this work for
+ * additional information regarding copyright ownership.
+ *
+ * UCAID licenses this file to you under the Apache License,
+ * Version 2.0 (the "License"); you may not use this file except
+ * in compliance with the License. You may obtain a copy of the
+ * License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+ */
+
+/**
+ * redis-read-cache.h
+ *
+ * Provides the RedisReadCache class, an in-process cache of records read from
+ * Redis, kept coherent using server-assisted client-side caching.
+ */
+
+#ifndef REDIS_READ_CACHE_H
+#define REDIS_READ_CACHE_H
+
+#include <ctime>
+#include <list>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "cluster-node.h"
+#include "redis.h"
+#include "redis-connection.h"
+
+#include <boost/ptr_container/ptr_vector.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/unordered_map.hpp>
+#include <xmltooling/util/Threads.h>
+#include <xmltooling/logging.h>
+
+namespace spredis {
+    /**
+     * A Redis implementation caching the records read through another one.
+     * Reads of cached records are answered without any communication with
+     * the server.
+     *
+     * Coherence is maintained by Redis itself: a tracking connection to every
+     * server subscribes to invalidation messages of all record keys
+     * (`CLIENT TRACKING on BCAST'), which are then dropped from the cache. As
+     * long as a tracking connection is not established, nothing is cached.
+     * Records are additionally dropped after the configured time-to-live, or
+     * when they expire in Redis, whichever is sooner.
+     *
+     * The cache is bounded in size; the least recently used records are
+     * evicted first.
+     */
+    class SHIBSP_HIDDEN RedisReadCache SHIBSP_FINAL : public Redis {
+    public:
+        /**
+         * Creates the cache in front of inner, and connects the tracking
+         * connections to its endpoints. Takes ownership of inner, even if the
+         * constructor throws.
+         */
+        RedisReadCache(const RedisConfig& config, Redis* inner);
+
+        ~RedisReadCache();
+
+        bool set(const StorageId& id, const char* value, time_t expiration);
+
+        int getVersioned(const StorageId& id, std::string* out_value, time_t* out_expiration, int minVersion);
+
+        int forceGet(const StorageId& id, std::string* out_value, time_t* out_expiration);
+
+        int updateVersioned(const StorageId& id, const char* value, time_t expiration, int ifVersion);
+
+        int forceUpdate(const StorageId& id, const char* value, time_t expiration);
+
+        bool remove(const StorageId& id);
+
+        // the index does not hold records, so it is not cached
+        void indexRecord(const StorageId& id, time_t expiration) { m_inner->indexRecord(id, expiration); }
+
+        void unindexRecord(const StorageId& id) { m_inner->unindexRecord(id); }
+
+        void expireContextIndex(const char* context, time_t expiration) {
+            m_inner->expireContextIndex(context, expiration);
+        }
+
+        void deleteContextIndex(const char* context) { m_inner->deleteContextIndex(context); }
+
+        unsigned long long scanContextIndexPage(const char* context, unsigned long long cursor,
+                                                std::vector<std::string>* out_members) {
+            return m_inner->scanContextIndexPage(context, cursor, out_members);
+        }
+
+        // neither is the epoch, which must be read fresh for every record
+        long long touchContextEpoch(const char* context, time_t keepUntil) {
+            return m_inner->touchContextEpoch(context, keepUntil);
+        }
+
+        bool readContextEpoch(const char* context, ContextEpoch* out_epoch) {
+            return m_inner->readContextEpoch(context, out_epoch);
+        }
+
+        long long expireContextEpoch(const char* context, time_t expiration, time_t keepUntil, time_t* out_horizon) {
+            return m_inner->expireContextEpoch(context, expiration, keepUntil, out_horizon);
+        }
+
+        long long deleteContextEpoch(const char* context) { return m_inner->deleteContextEpoch(context); }
+
+        void raiseContextEpochHorizon(const char* context, long long generation, time_t horizon) {
+            m_inner->raiseContextEpochHorizon(context, generation, horizon);
+        }
+
+        std::vector<ClusterNode> endpoints() const { return m_inner->endpoints(); }
+
+    protected:
+        size_t scanContextTypeless(const char* context, RawCallbackType callback, void* callbackContext);
+
+        size_t scanContextIndexTypeless(const char* context, RawCallbackType callback, void* callbackContext);
+
+    private:
+        struct Entry {
+            std::string key;
+            int version;
+            std::string value;
+            time_t expiration;
+            time_t cachedUntil;
+            size_t cost;
+        };
+
+        typedef std::list<Entry> lru_list_type;
+        typedef boost::unordered_map<std::string, lru_list_type::iterator> index_type;
+
+        /**
+         * Reads the record through the cache: answers from the cache if
+         * possible, otherwise reads the whole record from the inner instance
+         * and caches it. Versioned reads are answered the same way as Redis
+         * would, based on the cached version.
+         */
+        int read(const StorageId& id, std::string* out_value, time_t* out_expiration, int minVersion);
+
+        bool lookup(const std::string& key, int minVersion, std::string* out_value, time_t* out_expiration,
+                    int& out_version);
+
+        void fill(const std::string& key, unsigned long generation, int version, const std::string& value,
+                  time_t expiration);
+
+        unsigned long currentGeneration() const;
+
+        void invalidate(const std::string& key);
+
+        void invalidateContext(const char* context);
+
+        void invalidateTracked(const std::vector<std::string>& keys);
+
+        /**
+         * Drops every cached record. If coherent is false, nothing is cached
+         * until called again with coherent set.
+         */
+        void flush(bool coherent);
+
+        void eraseUnguarded(lru_list_type::iterator it);
+
+        static void* trackerMain(void* self);
+
+        /**
+         * The main loop of the tracker thread: reads invalidation messages,
+         * and re-establishes the tracking connections if they are lost or the
+         * endpoints change.
+         */
+        void track();
+
+        void connectTrackers(const std::vector<ClusterNode>& endpoints);
+
+        bool shuttingDown() const;
+
+        boost::scoped_ptr<Redis> m_inner;
+        const RedisConfig m_config;
+        xmltooling::logging::Category& m_logger;
+        boost::scoped_ptr<xmltooling::Mutex> m_mutex;
+        lru_list_type m_lru;
+        index_type m_index;
+        size_t m_size;
+        const size_t m_max_size;
+        // incremented on every invalidation, so fills racing with an
+        // invalidation of the record can be detected and discarded
+        unsigned long m_generation;
+        bool m_coherent;
+        bool m_shutdown;
+        // only used by the tracker thread after construction
+        boost::ptr_vector<RedisConnection> m_trackers;
+        std::vector<ClusterNode> m_tracked;
+        boost::scoped_ptr<xmltooling::Thread> m_tracker;
+    };
+}
+
+#endif //REDIS_READ_CACHE_H
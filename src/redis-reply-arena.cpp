@@ -0,0 +1,307 @@
+/**
+ * Licensed to the University Corporation for Advanced Internet
+ * Development, Inc. (UCAID) under one or more contributor license
+ * agreements. See the NOTICE file distributed with this work for
+ * additional information regarding copyright ownership.
+ *
+ * UCAID licenses this file to you under the Apache License,
+ * Version 2.0 (the "License"); you may not use this file except
+ * in compliance with the License. You may obtain a copy of the
+ * License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+ */
+
+/**
+ * redis-reply-arena.cpp
+ *
+ * Implementation of the RedisReplyArena type.
+ */
+
+#include "redis-reply-arena.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <new>
+
+#include <boost/atomic.hpp>
+
+namespace {
+    /**
+     * Unit of allocation: every allocation is aligned to, and starts with one
+     * of these, pointing to the chunk it was allocated from, or NULL if it is
+     * too large for a chunk and was allocated on the heap instead.
+     */
+    union Granule {
+        void* pointer;
+        long long integer;
+        double real;
+    };
+
+    const size_t granule = sizeof(Granule);
+    const size_t chunkGranules = 16 * 1024 / granule;
+    // larger allocations would waste most of a chunk, and are rare enough
+    // (large values) that the heap does just fine with them
+    const size_t maxChunkedSize = chunkGranules * granule / 4;
+
+    size_t roundUp(const size_t size) {
+        return (size + granule - 1) / granule * granule;
+    }
+
+    bool isAggregate(const int type) {
+        switch (type) {
+            case REDIS_REPLY_ARRAY:
+#if HIREDIS_MAJOR >= 1
+            case REDIS_REPLY_MAP:
+            case REDIS_REPLY_SET:
+            case REDIS_REPLY_ATTR:
+            case REDIS_REPLY_PUSH:
+#endif
+                return true;
+            default:
+                return false;
+        }
+    }
+}
+
+struct spredis::RedisReplyArena::Chunk {
+    Chunk() : refs(1), used(0) {
+    }
+
+    // allocations not yet freed, plus one while this is the current chunk of
+    // the arena
+    boost::atomic<unsigned long> refs;
+    size_t used;
+    Granule data[chunkGranules];
+};
+
+spredis::RedisReplyArena::RedisReplyArena() : m_current(NULL) {
+}
+
+spredis::RedisReplyArena::~RedisReplyArena() {
+    if (m_current) release(m_current);
+}
+
+void spredis::RedisReplyArena::install(redisContext* const redis) {
+    install(redis->reader);
+#if HIREDIS_MAJOR >= 1
+    // the default handler of push messages frees them with freeReplyObject
+    redisSetPushCallback(redis, &RedisReplyArena::freePush);
+#endif
+}
+
+void spredis::RedisReplyArena::install(redisReader* const reader) {
+    reader->fn = functions();
+    reader->privdata = this;
+}
+
+void spredis::RedisReplyArena::freeReply(void* const reply) {
+    if (reply == NULL) return;
+
+    redisReply* const r = static_cast<redisReply*>(reply);
+    // strings and element arrays are part of the allocation of the node
+    if (isAggregate(r->type)) {
+        for (size_t i = 0; i < r->elements; ++i) {
+            freeReply(r->element[i]);
+        }
+    }
+
+    Granule* const block = static_cast<Granule*>(reply) - 1;
+    Chunk* const chunk = static_cast<Chunk*>(block->pointer);
+    if (chunk) release(chunk);
+    else std::free(block);
+}
+
+void* spredis::RedisReplyArena::allocate(const size_t size) {
+    const size_t total = granule + roundUp(size);
+    if (total > maxChunkedSize) {
+        Granule* const block = static_cast<Granule*>(std::malloc(total));
+        if (block == NULL) return NULL;
+        block->pointer = NULL;
+        return block + 1;
+    }
+
+    if (m_current == NULL || m_current->used + total > sizeof(m_current->data)) {
+        if (m_current && m_current->refs.load(boost::memory_order_acquire) == 1) {
+            // nothing allocated from it is alive anymore, start it over
+            m_current->used = 0;
+        } else {
+            if (m_current) release(m_current);
+            m_current = new(std::nothrow) Chunk();
+            if (m_current == NULL) return NULL;
+        }
+    }
+
+    Granule* const block = m_current->data + m_current->used / granule;
+    m_current->used += total;
+    m_current->refs.fetch_add(1, boost::memory_order_relaxed);
+    block->pointer = m_current;
+    return block + 1;
+}
+
+void spredis::RedisReplyArena::beginReply() {
+    // allocations are only ever added by the thread reading replies, which is
+    // us, so once we see no allocations alive, none can appear concurrently
+    if (m_current && m_current->used != 0 && m_current->refs.load(boost::memory_order_acquire) == 1)
+        m_current->used = 0;
+}
+
+redisReply* spredis::RedisReplyArena::createReply(const redisReadTask* const task,
+                                                  const size_t payload,
+                                                  void** const out_payload) {
+    if (task->parent == NULL) beginReply();
+
+    const size_t node = roundUp(sizeof(redisReply));
+    if (payload > std::numeric_limits<size_t>::max() - node - granule) return NULL;
+
+    void* const memory = allocate(node + payload);
+    if (memory == NULL) return NULL;
+
+    redisReply* const r = static_cast<redisReply*>(memory);
+    std::memset(r, 0, sizeof(redisReply));
+    r->type = task->type;
+    if (out_payload) *out_payload = static_cast<char*>(memory) + node;
+
+    if (task->parent) {
+        redisReply* const parent = static_cast<redisReply*>(task->parent->obj);
+        parent->element[task->idx] = r;
+    }
+    return r;
+}
+
+void spredis::RedisReplyArena::release(Chunk* const chunk) {
+    if (chunk->refs.fetch_sub(1, boost::memory_order_release) != 1) return;
+
+    boost::atomic_thread_fence(boost::memory_order_acquire);
+    delete chunk;
+}
+
+void* spredis::RedisReplyArena::createString(const redisReadTask* const task, char* str, size_t len) {
+    RedisReplyArena* const arena = static_cast<RedisReplyArena*>(task->privdata);
+
+#if HIREDIS_MAJOR >= 1
+    // verbatim strings start with their 3 character type, then a colon; the
+    // reader has validated this already
+    char vtype[3] = {0, 0, 0};
+    if (task->type == REDIS_REPLY_VERB) {
+        std::memcpy(vtype, str, sizeof(vtype));
+        str += 4;
+        len -= 4;
+    }
+#endif
+
+    void* payload = NULL;
+    redisReply* const r = arena->createReply(task, len + 1, &payload);
+    if (r == NULL) return NULL;
+
+    r->str = static_cast<char*>(payload);
+    std::memcpy(r->str, str, len);
+    r->str[len] = '\0';
+    r->len = len;
+#if HIREDIS_MAJOR >= 1
+    if (task->type == REDIS_REPLY_VERB) std::memcpy(r->vtype, vtype, sizeof(vtype));
+#endif
+    return r;
+}
+
+#if HIREDIS_MAJOR >= 1
+void* spredis::RedisReplyArena::createArray(const redisReadTask* const task, const size_t elements) {
+#else
+void* spredis::RedisReplyArena::createArray(const redisReadTask* const task, const int elements) {
+#endif
+    RedisReplyArena* const arena = static_cast<RedisReplyArena*>(task->privdata);
+
+    const size_t count = static_cast<size_t>(elements);
+    if (count > std::numeric_limits<size_t>::max() / sizeof(redisReply*)) return NULL;
+
+    void* payload = NULL;
+    redisReply* const r = arena->createReply(task, count * sizeof(redisReply*), &payload);
+    if (r == NULL) return NULL;
+
+    // elements are only filled in as they are read, so a reply freed halfway
+    // through must see the missing ones as NULL
+    if (count > 0) {
+        r->element = static_cast<redisReply**>(payload);
+        std::memset(r->element, 0, count * sizeof(redisReply*));
+    }
+    r->elements = count;
+    return r;
+}
+
+#if HIREDIS_MAJOR >= 1
+void* spredis::RedisReplyArena::createDouble(const redisReadTask* const task,
+                                             const double value,
+                                             char* const str,
+                                             const size_t len) {
+    RedisReplyArena* const arena = static_cast<RedisReplyArena*>(task->privdata);
+
+    void* payload = NULL;
+    redisReply* const r = arena->createReply(task, len + 1, &payload);
+    if (r == NULL) return NULL;
+
+    r->dval = value;
+    r->str = static_cast<char*>(payload);
+    std::memcpy(r->str, str, len);
+    r->str[len] = '\0';
+    r->len = len;
+    return r;
+}
+
+void* spredis::RedisReplyArena::createBool(const redisReadTask* const task, const int value) {
+    RedisReplyArena* const arena = static_cast<RedisReplyArena*>(task->privdata);
+
+    redisReply* const r = arena->createReply(task, 0, NULL);
+    if (r == NULL) return NULL;
+
+    r->integer = value != 0;
+    return r;
+}
+
+void spredis::RedisReplyArena::freePush(void* const privdata, void* const reply) {
+    (void) privdata;
+    freeReply(reply);
+}
+#endif
+
+void* spredis::RedisReplyArena::createInteger(const redisReadTask* const task, const long long value) {
+    RedisReplyArena* const arena = static_cast<RedisReplyArena*>(task->privdata);
+
+    redisReply* const r = arena->createReply(task, 0, NULL);
+    if (r == NULL) return NULL;
+
+    r->integer = value;
+    return r;
+}
+
+void* spredis::RedisReplyArena::createNil(const redisReadTask* const task) {
+    RedisReplyArena* const arena = static_cast<RedisReplyArena*>(task->privdata);
+    return arena->createReply(task, 0, NULL);
+}
+
+redisReplyObjectFunctions* spredis::RedisReplyArena::functions() {
+    // the members are not in the same order across hiredis versions
+    struct Init {
+        Init() : fn() {
+            fn.createString = &RedisReplyArena::createString;
+            fn.createArray = &RedisReplyArena::createArray;
+            fn.createInteger = &RedisReplyArena::createInteger;
+            fn.createNil = &RedisReplyArena::createNil;
+#if HIREDIS_MAJOR >= 1
+            fn.createDouble = &RedisReplyArena::createDouble;
+            fn.createBool = &RedisReplyArena::createBool;
+#endif
+            fn.freeObject = &RedisReplyArena::freeReply;
+        }
+
+        redisReplyObjectFunctions fn;
+    };
+    static Init init;
+    return &init.fn;
+}
@@ -0,0 +1,116 @@
+/**
+ * Licensed to the University Corporation for Advanced Internet
+ * Development, Inc. (UCAID) under one or more contributor license
+ * agreements. See the NOTICE file distributed with this work for
+ * additional information regarding copyright ownership.
+ *
+ * UCAID licenses this file to you under the Apache License,
+ * Version 2.0 (the "License"); you may not use this file except
+ * in compliance with the License. You may obtain a copy of the
+ * License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+ */
+
+/**
+ * redis-reply-arena.h
+ *
+ * Provides the RedisReplyArena class, which allocates the reply objects read
+ * by a connection from larger chunks of memory.
+ */
+
+#ifndef REDIS_REPLY_ARENA_H
+#define REDIS_REPLY_ARENA_H
+
+#include <cstddef>
+
+#include "common.h"
+#include <hiredis/hiredis.h>
+#include <xmltooling/base.h>
+
+namespace spredis {
+    /**
+     * Allocator for the reply objects of a single connection, installed into
+     * the reader of the hiredis context instead of the default functions,
+     * which allocate every node of a reply separately.
+     *
+     * Each node of a reply is allocated together with its payload (its string
+     * or element array) from the current chunk of the arena. Chunks count the
+     * nodes allocated from them, and are freed when the last of those is
+     * freed, so replies may outlive the command that read them, or the
+     * connection itself, and may be freed from any thread. When a new reply
+     * is started and all nodes of the current chunk were freed already, the
+     * chunk is reused from its beginning, so a connection that serves one
+     * command at a time keeps on reusing the same memory.
+     *
+     * Reading replies is not thread-safe, the same as the hiredis context
+     * itself, but freeing them is.
+     */
+    class SHIBSP_HIDDEN RedisReplyArena SHIBSP_FINAL {
+        MAKE_NONCOPYABLE(RedisReplyArena);
+
+    public:
+        RedisReplyArena();
+
+        ~RedisReplyArena();
+
+        /**
+         * Makes the reader of the context allocate its replies from the arena.
+         * hiredis creates a new reader when reconnecting, so this needs to be
+         * done again after each reconnection, before any reply is read.
+         */
+        void install(redisContext* redis);
+
+        /**
+         * Makes a standalone reader allocate its replies from the arena.
+         */
+        void install(redisReader* reader);
+
+        /**
+         * Frees a reply allocated by any arena; replaces freeReplyObject for
+         * replies read from a context the arena is installed into.
+         */
+        static void freeReply(void* reply);
+
+    private:
+        struct Chunk;
+
+        void* allocate(size_t size);
+
+        void beginReply();
+
+        redisReply* createReply(const redisReadTask* task, size_t payload, void** out_payload);
+
+        static void release(Chunk* chunk);
+
+        static void* createString(const redisReadTask* task, char* str, size_t len);
+
+#if HIREDIS_MAJOR >= 1
+        static void* createArray(const redisReadTask* task, size_t elements);
+
+        static void* createDouble(const redisReadTask* task, double value, char* str, size_t len);
+
+        static void* createBool(const redisReadTask* task, int value);
+
+        static void freePush(void* privdata, void* reply);
+#else
+        static void* createArray(const redisReadTask* task, int elements);
+#endif
+
+        static void* createInteger(const redisReadTask* task, long long value);
+
+        static void* createNil(const redisReadTask* task);
+
+        static redisReplyObjectFunctions* functions();
+
+        Chunk* m_current;
+    };
+}
+
+#endif //REDIS_REPLY_ARENA_H
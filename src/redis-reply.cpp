@@ -25,8 +25,11 @@
  */
 
 #include "redis-reply.h"
+#include "redis-command-group.h"
 #include "redis-connection.h"
 
+#include <cstring>
+
 const bool spredis::RedisReply::nonOwning = false;
 
 spredis::RedisReply::RedisReply(RedisConnection* connection, void* buffer, bool owning)
@@ -53,6 +56,19 @@ void spredis::RedisReply::getNextFromConnection(const char* fn, const char* comm
     if (type != 0) ensureType(type, fn);
 }
 
+void spredis::RedisReply::getNextFrom(RedisCommandGroup& group, const char* fn, const char* command, int type) {
+    if (m_reply) resetReply();
+    m_reply = group.takeReply();
+    // the connection reads every reply of a group before handing it back, so
+    // this is an error in the caller, not in the connection
+    if (m_reply == NULL)
+        throw xmltooling::IOException("(" + std::string(fn) + ") no more replies in command group for `"
+                                      + command + "'");
+
+    throwIfErroneous(fn, command);
+    if (type != 0) ensureType(type, fn);
+}
+
 void spredis::RedisReply::ensureType(int type, const char* fn) const {
     assert(m_reply && "ensureType called on incomplete reply");
 
@@ -60,3 +76,12 @@ void spredis::RedisReply::ensureType(int type, const char* fn) const {
     throw xmltooling::IOException("(" + std::string(fn) + ") incorrect response from Redis server: expected type `" +
                                   std::to_string(type) + "' but got `" + std::to_string(m_reply->type) + "'");
 }
+
+bool spredis::RedisReply::isError(const char* code) const {
+    if (m_reply == NULL || m_reply->type != REDIS_REPLY_ERROR) return false;
+
+    const size_t codeLen = std::strlen(code);
+    return m_reply->len >= codeLen
+           && std::strncmp(m_reply->str, code, codeLen) == 0
+           && (m_reply->len == codeLen || m_reply->str[codeLen] == ' ');
+}
@@ -30,9 +30,11 @@
 #include <cassert>
 
 #include "common.h"
+#include "redis-reply-arena.h"
 #include <hiredis/hiredis.h>
 
 namespace spredis {
+    class RedisCommandGroup;
     class RedisConnection;
 
     class SHIBSP_HIDDEN RedisReply SHIBSP_FINAL {
@@ -49,14 +51,26 @@ namespace spredis {
 
         void getNextFromConnection(const char* fn, const char* command, int type = 0);
 
+        /**
+         * Same as getNextFromConnection, but takes the next reply already read
+         * for the command group instead of reading it from the connection.
+         */
+        void getNextFrom(RedisCommandGroup& group, const char* fn, const char* command, int type = 0);
+
         const redisReply* operator->() const { return m_reply; }
         redisReply* operator->() { return m_reply; }
 
         void ensureType(int type, const char* fn) const;
 
+        /**
+         * Checks whether the reply is an error reply with the given error code
+         * (the first word of the error message), e.g. WRONGTYPE.
+         */
+        bool isError(const char* code) const;
+
     private:
         void resetReply() {
-            if (m_owning && m_reply) freeReplyObject(m_reply);
+            if (m_owning && m_reply) RedisReplyArena::freeReply(m_reply);
             m_reply = NULL;
         }
 
@@ -0,0 +1,80 @@
+/**
+ * Licensed to the University Corporation for Advanced Internet
+ * Development, Inc. (UCAID) under one or more contributor license
+ * agreements. See the NOTICE file distributed with this work for
+ * additional information regarding copyright ownership.
+ *
+ * UCAID licenses this file to you under the Apache License,
+ * Version 2.0 (the "License"); you may not use this file except
+ * in compliance with the License. You may obtain a copy of the
+ * License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+ */
+
+/**
+ * redis-scripts.cpp
+ *
+ * Sources of the server-side Lua scripts described by RedisScript.
+ */
+
+#include "redis-scripts.h"
+
+const spredis::RedisScript spredis::RedisScript::GetVersioned = {
+    "getVersioned",
+    "local kind = redis.call('TYPE', KEYS[1]).ok\n"
+    "local version\n"
+    "if kind == 'hash' then\n"
+    "  version = redis.call('HGET', KEYS[1], 'version')\n"
+    "elseif kind == 'string' then\n"
+    "  version = redis.call('GET', KEYS[2])\n"
+    "end\n"
+    "if not version then return {0} end\n"
+    "version = tonumber(version)\n"
+    "if not version then return redis.error_reply('ERR non-integer value in version key') end\n"
+    "local result = {version, false, false}\n"
+    "if ARGV[2] == '1' and version >= tonumber(ARGV[1]) then\n"
+    "  if kind == 'hash' then\n"
+    "    result[2] = redis.call('HGET', KEYS[1], 'value')\n"
+    "  else\n"
+    "    result[2] = redis.call('GET', KEYS[1])\n"
+    "  end\n"
+    "end\n"
+    "if ARGV[3] == '1' then\n"
+    "  result[3] = redis.call('EXPIRETIME', KEYS[1])\n"
+    "end\n"
+    "return result\n"
+};
+
+const spredis::RedisScript spredis::RedisScript::UpdateVersioned = {
+    "updateVersioned",
+    "local kind = redis.call('TYPE', KEYS[1]).ok\n"
+    "if kind == 'hash' then\n"
+    "  local version = tonumber(redis.call('HGET', KEYS[1], 'version'))\n"
+    "  if not version then return 0 end\n"
+    "  if version ~= tonumber(ARGV[3]) then return -1 end\n"
+    "  redis.call('HSET', KEYS[1], 'value', ARGV[1])\n"
+    "  local next = redis.call('HINCRBY', KEYS[1], 'version', 1)\n"
+    "  if ARGV[2] ~= '0' then\n"
+    "    redis.call('EXPIREAT', KEYS[1], ARGV[2])\n"
+    "  end\n"
+    "  return next\n"
+    "end\n"
+    "if kind ~= 'string' then return 0 end\n"
+    "local version = tonumber(redis.call('GET', KEYS[2]))\n"
+    "if not version then return 0 end\n"
+    "if version ~= tonumber(ARGV[3]) then return -1 end\n"
+    "redis.call('SET', KEYS[1], ARGV[1], 'KEEPTTL')\n"
+    "local next = redis.call('INCR', KEYS[2])\n"
+    "if ARGV[2] ~= '0' then\n"
+    "  redis.call('EXPIREAT', KEYS[1], ARGV[2])\n"
+    "  redis.call('EXPIREAT', KEYS[2], ARGV[2])\n"
+    "end\n"
+    "return next\n"
+};
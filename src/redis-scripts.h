@@ -0,0 +1,69 @@
+/**
+ * Licensed to the University Corporation for Advanced Internet
+ * Development, Inc. (UCAID) under one or more contributor license
+ * agreements. See the NOTICE file distributed with this work for
+ * additional information regarding copyright ownership.
+ *
+ * UCAID licenses this file to you under the Apache License,
+ * Version 2.0 (the "License"); you may not use this file except
+ * in compliance with the License. You may obtain a copy of the
+ * License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+ */
+
+/**
+ * redis-scripts.h
+ *
+ * Provides the RedisScript type, describing the server-side Lua scripts used
+ * to perform versioned operations in a single round trip.
+ */
+
+#ifndef REDIS_SCRIPTS_H
+#define REDIS_SCRIPTS_H
+
+#include "common.h"
+
+namespace spredis {
+    /**
+     * A Lua script to be loaded into the script cache of the Redis server
+     * using SCRIPT LOAD, and later executed by its SHA1 digest using EVALSHA.
+     *
+     * All scripts take the data key as KEYS[1] and the version key as KEYS[2].
+     * Both keys share the same hash-tag, so the scripts are cluster-safe.
+     * The scripts check the type of the data key, and so work with records in
+     * both the key and the hash layout (where KEYS[2] is unused).
+     */
+    struct SHIBSP_HIDDEN RedisScript SHIBSP_FINAL {
+        const char* const name;
+        const char* const source;
+
+        /**
+         * Reads the version and optionally the value and expiration of a key.
+         *
+         * ARGV: minimum version, whether to read the value (0/1), whether to
+         *       read the expiration (0/1)
+         * Returns: {0} if the key does not exist, otherwise
+         *          {version, value or nil, expiration or nil}, where value is
+         *          only read if version is at least the minimum version
+         */
+        static const RedisScript GetVersioned;
+
+        /**
+         * Updates the value of a key if its version matches the expected one.
+         *
+         * ARGV: new value, new expiration (0 to keep), expected version
+         * Returns: 0 if the key does not exist, -1 if the version does not
+         *          match, otherwise the new version
+         */
+        static const RedisScript UpdateVersioned;
+    };
+}
+
+#endif //REDIS_SCRIPTS_H
@@ -0,0 +1,471 @@
+/**
+ * Licensed to the University Corporation for Advanced Internet
+ * Development, Inc. (UCAID) under one or more contributor license
+ * agreements. See the NOTICE file distributed with this work for
+ * additional information regarding copyright ownership.
+ *
+ * UCAID licenses this file to you under the Apache License,
+ * Version 2.0 (the "License"); you may not use this file except
+ * in compliance with the License. You may obtain a copy of the
+ * License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+ */
+
+/**
+ * redis-sentinel.cpp
+ *
+ * Implementation of the RedisSentinel type.
+ */
+
+#include "redis-sentinel.h"
+#include "redis-stats.h"
+
+// XXX Win32 - poll
+#include <poll.h>
+
+#include <boost/lambda/core.hpp>
+#include <boost/lambda/detail/bind_functions.hpp>
+#include <boost/lambda/detail/lambda_functor_base.hpp>
+#include <boost/smart_ptr/shared_ptr.hpp>
+#include <xmltooling/exceptions.h>
+
+using namespace xmltooling;
+
+namespace {
+    const int pollTimeoutMillisec = 1000;
+
+    time_t nextDue(const time_t now, const unsigned int interval) {
+        if (interval == 0) return 0;
+        return now + static_cast<time_t>(interval);
+    }
+
+    // XXX lambda when possible
+    struct callback_wrap {
+        callback_wrap(void (*const callback)(void*, spredis::RedisConnection*, const std::vector<std::string>&),
+                      void* const callback_context)
+            : callback(callback),
+              callbackContext(callback_context) {
+        }
+
+        void
+        operator()(spredis::RedisConnection* connection, const std::vector<std::string>& keys) const {
+            callback(callbackContext, connection, keys);
+        }
+
+        void (*callback)(void*, spredis::RedisConnection*, const std::vector<std::string>&);
+        void* callbackContext;
+    };
+
+    // XXX lambda when possible
+    struct scan_call {
+        scan_call(const char* const context, const callback_wrap& callback, const bool index)
+            : context(context),
+              callback(callback),
+              index(index) {
+        }
+
+        size_t operator()(spredis::Redis* const redis) const {
+            if (index) redis->scanContextIndex(context, callback);
+            else redis->scanContext(context, callback);
+            return 0U;
+        }
+
+        const char* context;
+        callback_wrap callback;
+        bool index;
+    };
+}
+
+spredis::RedisSentinel::RedisSentinel(const RedisConfig& config)
+    : Redis(config.prefix, config.hashTag, config.hashTagBuckets),
+      m_config(config),
+      m_logger(logging::Category::getInstance("XMLTooling.StorageService.REDIS")),
+      m_retry_policy(config),
+      m_topology(),
+      m_publish_mutex(Mutex::create()),
+      m_published(CondWait::create()),
+      m_monitor_mutex(Mutex::create()),
+      m_discovery_requested(false),
+      m_shutdown(false),
+      m_sentinel(),
+      m_subscriber(),
+      m_next_sentinel(0),
+      m_monitor() {
+    // operations will request a discovery, which keeps on trying the
+    // Sentinels once they become available
+    if (!discover())
+        m_logger.error("cannot discover initial Redis primary of %s", m_config.sentinelMaster.c_str());
+
+    m_monitor.reset(Thread::create(&RedisSentinel::monitorMain, this));
+}
+
+spredis::RedisSentinel::~RedisSentinel() {
+    {
+        const Lock lock(m_monitor_mutex);
+        m_shutdown = true;
+    }
+    if (m_monitor) m_monitor->join(NULL);
+}
+
+bool spredis::RedisSentinel::set(const StorageId& id, const char* value, time_t expiration) {
+    // XXX boost::lambda should be replaced with C++11 lambda when possible
+    using namespace boost::lambda;
+    return wrappedCall<bool>(boost::lambda::bind(&Redis::set, _1, id, value, expiration));
+}
+
+int spredis::RedisSentinel::getVersioned(const StorageId& id, std::string* out_value, time_t* out_expiration,
+                                         const int minVersion) {
+    // XXX boost::lambda should be replaced with C++11 lambda when possible
+    using namespace boost::lambda;
+    if (m_config.readFrom == RedisConfig::READ_MASTER)
+        return wrappedCall<int>(boost::lambda::bind(&Redis::getVersioned, _1, id, out_value, out_expiration, minVersion));
+
+    bool fromReplica = false;
+    const int version = replicaCall<int>(id, boost::lambda::bind(&Redis::getVersioned, _1, id, out_value, out_expiration, minVersion),
+                                         fromReplica);
+    // the caller already knows of minVersion: anything older read from a
+    // replica is only lagging behind, so the primary is asked instead
+    if (!fromReplica || version >= minVersion) return version;
+
+    m_logger.debug("replica is lagging behind for version %d of " SPREDIS_SID_LFMT ": reading from primary",
+                   minVersion, SPREDIS_SID_LPARAM(id));
+    return wrappedCall<int>(boost::lambda::bind(&Redis::getVersioned, _1, id, out_value, out_expiration, minVersion));
+}
+
+int spredis::RedisSentinel::forceGet(const StorageId& id, std::string* out_value, time_t* out_expiration) {
+    // XXX boost::lambda should be replaced with C++11 lambda when possible
+    using namespace boost::lambda;
+    if (m_config.readFrom == RedisConfig::READ_MASTER)
+        return wrappedCall<int>(boost::lambda::bind(&Redis::forceGet, _1, id, out_value, out_expiration));
+
+    bool fromReplica = false;
+    const int version = replicaCall<int>(id, boost::lambda::bind(&Redis::forceGet, _1, id, out_value, out_expiration),
+                                         fromReplica);
+    // a record just created may not have reached the replica yet: a missing
+    // record is only reported as such by the primary
+    if (!fromReplica || version != 0) return version;
+
+    return wrappedCall<int>(boost::lambda::bind(&Redis::forceGet, _1, id, out_value, out_expiration));
+}
+
+int spredis::RedisSentinel::updateVersioned(const StorageId& id, const char* value, time_t expiration, int ifVersion) {
+    // XXX boost::lambda should be replaced with C++11 lambda when possible
+    using namespace boost::lambda;
+    return wrappedCall<int>(boost::lambda::bind(&Redis::updateVersioned, _1, id, value, expiration, ifVersion));
+}
+
+int spredis::RedisSentinel::forceUpdate(const StorageId& id, const char* value, time_t expiration) {
+    // XXX boost::lambda should be replaced with C++11 lambda when possible
+    using namespace boost::lambda;
+    return wrappedCall<int>(boost::lambda::bind(&Redis::forceUpdate, _1, id, value, expiration));
+}
+
+bool spredis::RedisSentinel::remove(const StorageId& id) {
+    // XXX boost::lambda should be replaced with C++11 lambda when possible
+    using namespace boost::lambda;
+    return wrappedCall<bool>(boost::lambda::bind(&Redis::remove, _1, id));
+}
+
+void spredis::RedisSentinel::indexRecord(const StorageId& id, const time_t expiration) {
+    // XXX boost::lambda should be replaced with C++11 lambda when possible
+    using namespace boost::lambda;
+    wrappedCall<void>(boost::lambda::bind(&Redis::indexRecord, _1, id, expiration));
+}
+
+void spredis::RedisSentinel::unindexRecord(const StorageId& id) {
+    // XXX boost::lambda should be replaced with C++11 lambda when possible
+    using namespace boost::lambda;
+    wrappedCall<void>(boost::lambda::bind(&Redis::unindexRecord, _1, id));
+}
+
+void spredis::RedisSentinel::expireContextIndex(const char* context, const time_t expiration) {
+    // XXX boost::lambda should be replaced with C++11 lambda when possible
+    using namespace boost::lambda;
+    wrappedCall<void>(boost::lambda::bind(&Redis::expireContextIndex, _1, context, expiration));
+}
+
+void spredis::RedisSentinel::deleteContextIndex(const char* context) {
+    // XXX boost::lambda should be replaced with C++11 lambda when possible
+    using namespace boost::lambda;
+    wrappedCall<void>(boost::lambda::bind(&Redis::deleteContextIndex, _1, context));
+}
+
+unsigned long long spredis::RedisSentinel::scanContextIndexPage(const char* context,
+                                                                const unsigned long long cursor,
+                                                                std::vector<std::string>* out_members) {
+    // XXX boost::lambda should be replaced with C++11 lambda when possible
+    using namespace boost::lambda;
+    return wrappedCall<unsigned long long>(
+        boost::lambda::bind(&Redis::scanContextIndexPage, _1, context, cursor, out_members));
+}
+
+long long spredis::RedisSentinel::touchContextEpoch(const char* context, const time_t keepUntil) {
+    // XXX boost::lambda should be replaced with C++11 lambda when possible
+    using namespace boost::lambda;
+    return wrappedCall<long long>(boost::lambda::bind(&Redis::touchContextEpoch, _1, context, keepUntil));
+}
+
+bool spredis::RedisSentinel::readContextEpoch(const char* context, ContextEpoch* out_epoch) {
+    // XXX boost::lambda should be replaced with C++11 lambda when possible
+    using namespace boost::lambda;
+    // always from the primary: a lagging epoch would resurrect deleted records
+    return wrappedCall<bool>(boost::lambda::bind(&Redis::readContextEpoch, _1, context, out_epoch));
+}
+
+long long spredis::RedisSentinel::expireContextEpoch(const char* context, const time_t expiration,
+                                                     const time_t keepUntil, time_t* out_horizon) {
+    // XXX boost::lambda should be replaced with C++11 lambda when possible
+    using namespace boost::lambda;
+    return wrappedCall<long long>(
+        boost::lambda::bind(&Redis::expireContextEpoch, _1, context, expiration, keepUntil, out_horizon));
+}
+
+long long spredis::RedisSentinel::deleteContextEpoch(const char* context) {
+    // XXX boost::lambda should be replaced with C++11 lambda when possible
+    using namespace boost::lambda;
+    return wrappedCall<long long>(boost::lambda::bind(&Redis::deleteContextEpoch, _1, context));
+}
+
+void spredis::RedisSentinel::raiseContextEpochHorizon(const char* context, const long long generation,
+                                                      const time_t horizon) {
+    // XXX boost::lambda should be replaced with C++11 lambda when possible
+    using namespace boost::lambda;
+    wrappedCall<void>(boost::lambda::bind(&Redis::raiseContextEpochHorizon, _1, context, generation, horizon));
+}
+
+std::vector<spredis::ClusterNode> spredis::RedisSentinel::endpoints() const {
+    // replicas apply the writes of the primary, which is the only endpoint
+    // to be tracked
+    std::vector<ClusterNode> nodes;
+    const topology_ptr topology = currentTopology();
+    if (topology) nodes.push_back(topology->primary);
+    return nodes;
+}
+
+size_t spredis::RedisSentinel::scanContextTypeless(const char* context,
+                                                   RawCallbackType callback,
+                                                   void* callbackContext) {
+    // a scan interrupted by a failover is started over on the new primary:
+    // the callbacks may see the same keys again
+    return wrappedCall<size_t>(scan_call(context, callback_wrap(callback, callbackContext), false));
+}
+
+size_t spredis::RedisSentinel::scanContextIndexTypeless(const char* context,
+                                                        RawCallbackType callback,
+                                                        void* callbackContext) {
+    return wrappedCall<size_t>(scan_call(context, callback_wrap(callback, callbackContext), true));
+}
+
+spredis::RedisSentinel::topology_ptr spredis::RedisSentinel::currentTopology() const {
+    return boost::atomic_load(&m_topology);
+}
+
+void spredis::RedisSentinel::publish(const topology_ptr& topology) {
+    const Lock lock(m_publish_mutex);
+    boost::atomic_store(&m_topology, topology);
+    m_published->broadcast();
+}
+
+bool spredis::RedisSentinel::tryWaitBeforeRetry(RetryPolicy::Attempt& attempt, const topology_ptr& seen) const {
+    unsigned int msWait;
+    if (!attempt.nextWait(&msWait)) return false;
+
+    m_logger.debug("waiting about %u milliseconds for try %u/%u",
+                   msWait, attempt.retries(), m_config.maxRetries);
+    RedisStats::getInstance().count(RedisStats::RETRIES);
+
+    // the monitor publishes the new primary as soon as a Sentinel announces
+    // it, which is what the retry is waiting for in most cases
+    RetryPolicy::waitForChange(msWait, m_publish_mutex.get(), m_published.get(),
+                               *this, &RedisSentinel::currentTopology, seen);
+    return true;
+}
+
+void spredis::RedisSentinel::requestDiscovery() {
+    const Lock lock(m_monitor_mutex);
+    m_discovery_requested = true;
+}
+
+void* spredis::RedisSentinel::monitorMain(void* self) {
+    static_cast<RedisSentinel*>(self)->monitor();
+    return NULL;
+}
+
+void spredis::RedisSentinel::monitor() {
+    time_t discoveryDue = nextDue(time(NULL), m_config.refreshInterval);
+
+    while (!shuttingDown()) {
+        try {
+            if (!m_subscriber) {
+                subscribe();
+                // failovers may have been missed while not subscribed
+                discover();
+                discoveryDue = nextDue(time(NULL), m_config.refreshInterval);
+            }
+
+            bool requested = false;
+            {
+                const Lock lock(m_monitor_mutex);
+                requested = m_discovery_requested;
+                m_discovery_requested = false;
+            }
+            if (requested || (discoveryDue != 0 && time(NULL) >= discoveryDue)) {
+                discover();
+                discoveryDue = nextDue(time(NULL), m_config.refreshInterval);
+            }
+
+            pollfd fd;
+            fd.fd = m_subscriber->socket();
+            fd.events = POLLIN;
+            fd.revents = 0;
+            if (poll(&fd, 1, pollTimeoutMillisec) <= 0) continue;
+
+            ClusterNode primary("", 0);
+            bool switched = false;
+            if (!m_subscriber->readSwitchMaster(m_config.sentinelMaster, primary, switched)) {
+                // re-subscribed on the next iteration
+                m_subscriber.reset();
+                continue;
+            }
+            if (!switched) continue;
+
+            // the old primary becomes a replica, but cannot serve reads before
+            // it is resynchronized: only the known replicas are kept at first,
+            // then the Sentinels are asked for the whole picture
+            const topology_ptr current = currentTopology();
+            std::vector<ClusterNode> replicas;
+            if (current) {
+                for (size_t i = 0; i < current->replicas.size(); ++i) {
+                    if (current->replicas[i] != primary) replicas.push_back(current->replicas[i]);
+                }
+            }
+            switchTo(primary, replicas);
+            discover();
+            discoveryDue = nextDue(time(NULL), m_config.refreshInterval);
+        } catch (const std::exception& ex) {
+            m_logger.error("cannot follow Redis primary of %s: %s", m_config.sentinelMaster.c_str(), ex.what());
+            m_subscriber.reset();
+            Thread::sleep(1);
+        } catch (...) {
+            m_logger.error("unknown error occured while following Redis primary of %s",
+                           m_config.sentinelMaster.c_str());
+            m_subscriber.reset();
+            Thread::sleep(1);
+        }
+    }
+}
+
+bool spredis::RedisSentinel::discover() {
+    const std::vector<ClusterNode>& sentinels = m_config.sentinelNodes;
+
+    // the Sentinel which answered last is asked first
+    for (size_t tried = 0; tried < sentinels.size(); ++tried) {
+        const ClusterNode& sentinel = sentinels[m_next_sentinel];
+        try {
+            if (!m_sentinel) m_sentinel.reset(RedisConnection::connectSentinel(m_config, sentinel));
+
+            ClusterNode primary("", 0);
+            if (m_sentinel->sentinelPrimary(m_config.sentinelMaster, primary)) {
+                std::vector<ClusterNode> replicas;
+                if (m_config.readFrom != RedisConfig::READ_MASTER)
+                    replicas = m_sentinel->sentinelReplicas(m_config.sentinelMaster);
+                switchTo(primary, replicas);
+                return true;
+            }
+
+            m_logger.error("Sentinel %s:%u does not monitor a master called %s -- skipping Sentinel",
+                           sentinel.host().c_str(), sentinel.port(), m_config.sentinelMaster.c_str());
+        } catch (const std::exception& ex) {
+            m_logger.error("error occured asking Sentinel %s:%u for the primary -- skipping Sentinel: %s",
+                           sentinel.host().c_str(), sentinel.port(), ex.what());
+        }
+        m_sentinel.reset();
+        m_next_sentinel = (m_next_sentinel + 1) % sentinels.size();
+    }
+
+    m_logger.crit("no configured Sentinel responds correctly to `SENTINEL get-master-addr-by-name %s': "
+                  "cannot discover Redis primary", m_config.sentinelMaster.c_str());
+    return false;
+}
+
+void spredis::RedisSentinel::subscribe() {
+    const std::vector<ClusterNode>& sentinels = m_config.sentinelNodes;
+
+    for (size_t tried = 0; tried < sentinels.size(); ++tried) {
+        const ClusterNode& sentinel = sentinels[(m_next_sentinel + tried) % sentinels.size()];
+        try {
+            m_subscriber.reset(RedisConnection::connectSentinel(m_config, sentinel));
+            m_subscriber->subscribeSwitchMaster();
+            m_logger.info("following failovers of %s announced by Sentinel %s:%u",
+                          m_config.sentinelMaster.c_str(), sentinel.host().c_str(), sentinel.port());
+            return;
+        } catch (const std::exception& ex) {
+            m_logger.error("cannot subscribe to Sentinel %s:%u -- skipping Sentinel: %s",
+                           sentinel.host().c_str(), sentinel.port(), ex.what());
+            m_subscriber.reset();
+        }
+    }
+
+    throw XMLToolingException("Cannot subscribe to any configured Sentinel");
+}
+
+void spredis::RedisSentinel::switchTo(const ClusterNode& primary, const std::vector<ClusterNode>& replicas) {
+    const topology_ptr current = currentTopology();
+    if (current && current->primary == primary && current->primaryPool && current->replicas == replicas) return;
+
+    if (!current || current->primary != primary) {
+        if (current) {
+            m_logger.notice("Redis primary of %s switched from %s:%u to %s:%u", m_config.sentinelMaster.c_str(),
+                            current->primary.host().c_str(), current->primary.port(),
+                            primary.host().c_str(), primary.port());
+            RedisStats::getInstance().count(RedisStats::FAILOVERS);
+        } else {
+            m_logger.info("Redis primary of %s is %s:%u", m_config.sentinelMaster.c_str(),
+                          primary.host().c_str(), primary.port());
+        }
+    }
+
+    Topology* const topology = new Topology(primary);
+    const topology_ptr published(topology);
+    try {
+        topology->primaryPool = poolOf(current, primary);
+    } catch (const std::exception& ex) {
+        // operations wait for the next discovery
+        m_logger.error("cannot connect to Redis primary %s:%u: %s", primary.host().c_str(), primary.port(),
+                       ex.what());
+    }
+    for (size_t i = 0; i < replicas.size(); ++i) {
+        try {
+            topology->replicaPools.push_back(poolOf(current, replicas[i]));
+            topology->replicas.push_back(replicas[i]);
+        } catch (const std::exception& ex) {
+            m_logger.warn("cannot connect to Redis replica %s:%u: %s", replicas[i].host().c_str(),
+                          replicas[i].port(), ex.what());
+        }
+    }
+
+    publish(published);
+}
+
+spredis::RedisSentinel::pool_ptr spredis::RedisSentinel::poolOf(const topology_ptr& current,
+                                                                const ClusterNode& node) const {
+    if (current) {
+        if (current->primary == node && current->primaryPool) return current->primaryPool;
+        for (size_t i = 0; i < current->replicas.size(); ++i) {
+            if (current->replicas[i] == node) return current->replicaPools[i];
+        }
+    }
+    return pool_ptr(node.createPool(m_config));
+}
+
+bool spredis::RedisSentinel::shuttingDown() const {
+    const Lock lock(m_monitor_mutex);
+    return m_shutdown;
+}
@@ -0,0 +1,259 @@
+/**
+ * Licensed to the University Corporation for Advanced Internet
+ * Development, Inc. (UCAID) under one or more contributor license
+ * agreements. See the NOTICE file distributed with this work for
+ * additional information regarding copyright ownership.
+ *
+ * UCAID licenses this file to you under the Apache License,
+ * Version 2.0 (the "License"); you may not use this file except
+ * in compliance with the License. You may obtain a copy of the
+ * License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+ */
+
+/**
+ * redis-sentinel.h
+ *
+ * Provides the RedisSentinel class, which serves as a connection layer to a
+ * Redis primary managed by Sentinel, following its failovers.
+ */
+
+#ifndef REDIS_SENTINEL_H
+#define REDIS_SENTINEL_H
+
+#include <ctime>
+#include <string>
+#include <vector>
+
+#include "cluster-node.h"
+#include "common.h"
+#include "connection-lost-exception.h"
+#include "redis.h"
+#include "redis-connection.h"
+#include "redis-connection-pool.h"
+#include "redis-crc-16.h"
+#include "retry-policy.h"
+
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#include <xmltooling/util/Threads.h>
+#include <xmltooling/logging.h>
+
+namespace spredis {
+    /**
+     * A Redis implementation sending operations to the current primary of a
+     * master monitored by Sentinel, and optionally reads to its replicas.
+     *
+     * The primary is discovered by asking the configured Sentinels in turn.
+     * A background thread stays subscribed to the `+switch-master' events of
+     * one of them, so a failover is published as soon as the Sentinels agree
+     * on it, without waiting for operations against the old primary to time
+     * out. Operations which lose their connection ask for the primary to be
+     * discovered again, and are retried according to the retry policy,
+     * resuming as soon as a new primary is published.
+     */
+    class SHIBSP_HIDDEN RedisSentinel SHIBSP_FINAL : public Redis {
+    public:
+        explicit RedisSentinel(const RedisConfig& config);
+
+        ~RedisSentinel();
+
+        bool set(const StorageId& id, const char* value, time_t expiration);
+
+        int getVersioned(const StorageId& id, std::string* out_value, time_t* out_expiration, int minVersion);
+
+        int forceGet(const StorageId& id, std::string* out_value, time_t* out_expiration);
+
+        int updateVersioned(const StorageId& id, const char* value, time_t expiration, int ifVersion);
+
+        int forceUpdate(const StorageId& id, const char* value, time_t expiration);
+
+        bool remove(const StorageId& id);
+
+        void indexRecord(const StorageId& id, time_t expiration);
+
+        void unindexRecord(const StorageId& id);
+
+        void expireContextIndex(const char* context, time_t expiration);
+
+        void deleteContextIndex(const char* context);
+
+        unsigned long long scanContextIndexPage(const char* context, unsigned long long cursor,
+                                                std::vector<std::string>* out_members);
+
+        long long touchContextEpoch(const char* context, time_t keepUntil);
+
+        bool readContextEpoch(const char* context, ContextEpoch* out_epoch);
+
+        long long expireContextEpoch(const char* context, time_t expiration, time_t keepUntil, time_t* out_horizon);
+
+        long long deleteContextEpoch(const char* context);
+
+        void raiseContextEpochHorizon(const char* context, long long generation, time_t horizon);
+
+        std::vector<ClusterNode> endpoints() const;
+
+    protected:
+        size_t scanContextTypeless(const char* context, RawCallbackType callback, void* callbackContext);
+
+        size_t scanContextIndexTypeless(const char* context, RawCallbackType callback, void* callbackContext);
+
+    private:
+        typedef boost::shared_ptr<RedisConnectionPool> pool_ptr;
+
+        /**
+         * The servers operations are sent to. Published as a whole, and never
+         * changed afterwards: operations keep the pools open for as long as
+         * they use them.
+         */
+        struct Topology {
+            explicit Topology(const ClusterNode& primary)
+                : primary(primary),
+                  primaryPool(),
+                  replicas(),
+                  replicaPools() {
+            }
+
+            ClusterNode primary;
+            // NULL if the primary could not be connected to
+            pool_ptr primaryPool;
+            // only the replicas which could be connected to, in the same order
+            std::vector<ClusterNode> replicas;
+            std::vector<pool_ptr> replicaPools;
+        };
+
+        typedef boost::shared_ptr<const Topology> topology_ptr;
+
+        /**
+         * Calls fn on the pool of the current primary. If the connection is
+         * lost, a new discovery is requested, and fn is called again once it
+         * is published, or after the wait of the retry policy.
+         */
+        template<class R, class CallFn>
+        R wrappedCall(const CallFn& fn) {
+            RetryPolicy::Attempt attempt(m_retry_policy);
+            return retriedCall<R>(fn, attempt);
+        }
+
+        template<class R, class CallFn>
+        R retriedCall(const CallFn& fn, RetryPolicy::Attempt& attempt) {
+            const topology_ptr topology = currentTopology();
+            try {
+                if (!topology || !topology->primaryPool)
+                    throw ConnectionLostException("Redis primary managed by Sentinel is not reachable");
+                RedisConnectionPool* const pool = topology->primaryPool.get();
+                return breakerCall<R>(pool->breaker(), pool, fn);
+            } catch (const ConnectionLostException&) {
+                requestDiscovery();
+                if (tryWaitBeforeRetry(attempt, topology)) return retriedCall<R>(fn, attempt);
+
+                m_logger.error("Redis Sentinel failure: cannot reach the primary of %s", m_config.sentinelMaster.c_str());
+                throw;
+            }
+        }
+
+        /**
+         * Calls fn on the replica chosen for the key, or on the primary if
+         * there is none. A replica which cannot be reached is not retried,
+         * the primary answers instead. out_fromReplica tells which one
+         * answered.
+         */
+        template<class R, class CallFn>
+        R replicaCall(const StorageId& id, const CallFn& fn, bool& out_fromReplica) {
+            const topology_ptr topology = currentTopology();
+            out_fromReplica = false;
+            if (!topology || topology->replicaPools.empty()) return wrappedCall<R>(fn);
+
+            try {
+                // the same key is always read from the same replica, as long
+                // as the replicas do not change
+                const pool_ptr& pool = topology->replicaPools[id.hashSlotUsing<RedisCrc16>()
+                                                              % topology->replicaPools.size()];
+                const R result = breakerCall<R>(pool->breaker(), pool.get(), fn);
+                out_fromReplica = true;
+                return result;
+            } catch (const ConnectionLostException&) {
+                m_logger.warn("Redis replica managed by Sentinel is not reachable: reading from primary");
+                requestDiscovery();
+                return wrappedCall<R>(fn);
+            }
+        }
+
+        topology_ptr currentTopology() const;
+
+        void publish(const topology_ptr& topology);
+
+        /**
+         * Waits before the next retry as long as the retry policy tells, or
+         * until a topology other than seen is published. Returns false if the
+         * operation is not to be retried anymore.
+         */
+        bool tryWaitBeforeRetry(RetryPolicy::Attempt& attempt, const topology_ptr& seen) const;
+
+        /**
+         * Asks the monitor thread to discover the primary again. Requests
+         * arriving while a discovery is pending are coalesced into it.
+         */
+        void requestDiscovery();
+
+        static void* monitorMain(void* self);
+
+        /**
+         * The main loop of the monitor thread: reads the `+switch-master'
+         * events, re-subscribes if the Sentinel is lost, and discovers the
+         * primary again when requested or every refreshInterval seconds.
+         */
+        void monitor();
+
+        /**
+         * Asks the Sentinels in turn for the primary and the replicas of the
+         * monitored master, then publishes them. Returns false if no Sentinel
+         * answered. Only called by the constructor and the monitor thread,
+         * never by both at the same time.
+         */
+        bool discover();
+
+        /**
+         * Subscribes to the `+switch-master' events of the first Sentinel
+         * answering, trying them in turn.
+         */
+        void subscribe();
+
+        /**
+         * Publishes the primary and the replicas as the new topology. The
+         * pools of the servers already known are kept, the ones to new
+         * servers are opened.
+         */
+        void switchTo(const ClusterNode& primary, const std::vector<ClusterNode>& replicas);
+
+        pool_ptr poolOf(const topology_ptr& current, const ClusterNode& node) const;
+
+        bool shuttingDown() const;
+
+        const RedisConfig m_config;
+        xmltooling::logging::Category& m_logger;
+        RetryPolicy m_retry_policy;
+        topology_ptr m_topology;
+        // serializes publishing, and is used to wait for new topologies
+        boost::scoped_ptr<xmltooling::Mutex> m_publish_mutex;
+        boost::scoped_ptr<xmltooling::CondWait> m_published;
+        // guards the discovery requests and the shutdown flag
+        boost::scoped_ptr<xmltooling::Mutex> m_monitor_mutex;
+        bool m_discovery_requested;
+        bool m_shutdown;
+        // only used by the monitor thread after construction
+        boost::scoped_ptr<RedisConnection> m_sentinel;
+        boost::scoped_ptr<RedisConnection> m_subscriber;
+        size_t m_next_sentinel;
+        boost::scoped_ptr<xmltooling::Thread> m_monitor;
+    };
+}
+
+#endif //REDIS_SENTINEL_H
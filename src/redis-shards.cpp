@@ -0,0 +1,127 @@
+/**
+ * Licensed to the University Corporation for Advanced Internet
+ * Development, Inc. (UCAID) under one or more contributor license
+ * agreements. See the NOTICE file distributed with this work for
+ * additional information regarding copyright ownership.
+ *
+ * UCAID licenses this file to you under the Apache License,
+ * Version 2.0 (the "License"); you may not use this file except
+ * in compliance with the License. You may obtain a copy of the
+ * License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+ */
+
+/**
+ * redis-shards.cpp
+ *
+ * Implementation of the RedisShards type.
+ */
+
+#include <algorithm>
+
+#include "redis-shards.h"
+#include "parallel-scan.h"
+
+#include <boost/container/map.hpp>
+#include <xmltooling/exceptions.h>
+
+using namespace xmltooling;
+
+spredis::RedisShards::RedisShards(const RedisConfig& config)
+    : Redis(config.prefix, config.hashTag, config.hashTagBuckets),
+      m_config(config),
+      m_logger(logging::Category::getInstance("XMLTooling.StorageService.REDIS")),
+      m_nodes(config.shardNodes),
+      m_pools(),
+      m_slot_shards(RedisCrc16::HashSlotCount) {
+    // the shard index is stored in 16 bits
+    if (m_nodes.size() > 0xFFFFU) throw XMLToolingException("Too many Redis shards configured");
+
+    for (size_t i = 0; i < m_nodes.size(); ++i) {
+        m_pools.push_back(m_nodes[i].createPool(m_config));
+    }
+    for (unsigned int slot = 0; slot < RedisCrc16::HashSlotCount; ++slot) {
+        m_slot_shards[slot] = static_cast<unsigned short>(jumpHash(slot, static_cast<unsigned int>(m_nodes.size())));
+    }
+    m_logger.info("spreading records over %u Redis shards", static_cast<unsigned int>(m_nodes.size()));
+}
+
+unsigned int spredis::RedisShards::jumpHash(unsigned long long key, const unsigned int buckets) {
+    long long b = -1;
+    long long j = 0;
+    while (j < static_cast<long long>(buckets)) {
+        b = j;
+        key = key * 2862933555777941757ULL + 1;
+        j = static_cast<long long>(static_cast<double>(b + 1)
+                                   * (static_cast<double>(1LL << 31) / static_cast<double>((key >> 33) + 1)));
+    }
+    return static_cast<unsigned int>(b);
+}
+
+size_t spredis::RedisShards::scanContextTypeless(const char* context,
+                                                 RawCallbackType callback,
+                                                 void* callbackContext) {
+    // the records of a context may be on any of the shards, unless they are
+    // known to be in the hash-slots of the context
+    if (!m_config.contextsSlotted()) {
+        std::vector<RedisConnectionPool*> pools;
+        for (size_t i = 0; i < m_pools.size(); ++i) {
+            pools.push_back(&m_pools[i]);
+        }
+        ParallelScan(context, callback, callbackContext, m_nodes, pools, m_logger).run(m_config.scanWorkers);
+        return 0U;
+    }
+
+    const std::vector<unsigned> contextSlots = make_id(context, "").contextSlotsUsing<RedisCrc16>();
+    std::vector<ClusterNode> nodes;
+    std::vector<RedisConnectionPool*> pools;
+    for (size_t i = 0; i < contextSlots.size(); ++i) {
+        const unsigned int shard = m_slot_shards[contextSlots[i]];
+        if (std::find(pools.begin(), pools.end(), &m_pools[shard]) != pools.end()) continue;
+        nodes.push_back(m_nodes[shard]);
+        pools.push_back(&m_pools[shard]);
+    }
+    ParallelScan(context, callback, callbackContext, nodes, pools, m_logger).run(m_config.scanWorkers);
+    return 0U;
+}
+
+size_t spredis::RedisShards::scanContextIndexTypeless(const char* context,
+                                                      RawCallbackType callback,
+                                                      void* callbackContext) {
+    size_t count = 0;
+
+    std::vector<std::string> members;
+    unsigned long long cursor = 0;
+    do {
+        members.clear();
+        // the page is read with its own connection, which is returned before
+        // handing out the connections of the members: these may be served
+        // by the same pool
+        cursor = scanContextIndexPage(context, cursor, &members);
+        count += members.size();
+
+        // split the page by the shards storing the members, so each shard
+        // gets its part of the page as a single batch
+        boost::container::map<RedisConnectionPool*, std::vector<std::string> > batches;
+        for (size_t i = 0; i < members.size(); ++i) {
+            batches[&shardOfKey(members[i])].push_back(members[i]);
+        }
+
+        for (boost::container::map<RedisConnectionPool*, std::vector<std::string> >::const_iterator it =
+                 batches.begin();
+             it != batches.end();
+             ++it) {
+            const RedisConnectionPool::Handle connection(it->first);
+            callback(callbackContext, connection.get(), it->second);
+        }
+    } while (cursor != 0);
+
+    return count;
+}
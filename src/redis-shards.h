@@ -0,0 +1,157 @@
+/**
+ * Licensed to the University Corporation for Advanced Internet
+ * Development, Inc. (UCAID) under one or more contributor license
+ * agreements. See the NOTICE file distributed with this work for
+ * additional information regarding copyright ownership.
+ *
+ * UCAID licenses this file to you under the Apache License,
+ * Version 2.0 (the "License"); you may not use this file except
+ * in compliance with the License. You may obtain a copy of the
+ * License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+ */
+
+/**
+ * redis-shards.h
+ *
+ * Provides the RedisShards class, which spreads the records over multiple
+ * independent Redis servers.
+ */
+
+#ifndef REDIS_SHARDS_H
+#define REDIS_SHARDS_H
+
+#include <string>
+#include <vector>
+
+#include "cluster-node.h"
+#include "common.h"
+#include "redis.h"
+#include "redis-connection-pool.h"
+#include "redis-crc-16.h"
+
+#include <boost/ptr_container/ptr_vector.hpp>
+#include <xmltooling/logging.h>
+
+namespace spredis {
+    /**
+     * A Redis implementation spreading the records over a list of standalone
+     * Redis servers, the shards, without requiring cluster mode.
+     *
+     * Keys are placed the same way as in a cluster: the hash-slot of the key
+     * (the CRC16 of its hash tag) is mapped to a shard using a jump consistent
+     * hash, so the version key and the index of a record are always stored
+     * next to it, and adding a shard to the end of the list only moves the
+     * records of about 1/n of the hash-slots to it. The shard of every
+     * hash-slot is computed once.
+     *
+     * Context scans are sent to every shard, in parallel.
+     */
+    class SHIBSP_HIDDEN RedisShards SHIBSP_FINAL : public Redis {
+    public:
+        /**
+         * Connects to every shard; throws if one of them cannot be reached,
+         * the same way as the single-instance mode does.
+         */
+        explicit RedisShards(const RedisConfig& config);
+
+        bool set(const StorageId& id, const char* value, time_t expiration) {
+            return shardOf(id).set(id, value, expiration);
+        }
+
+        int getVersioned(const StorageId& id, std::string* out_value, time_t* out_expiration, int minVersion) {
+            return shardOf(id).getVersioned(id, out_value, out_expiration, minVersion);
+        }
+
+        int forceGet(const StorageId& id, std::string* out_value, time_t* out_expiration) {
+            return shardOf(id).forceGet(id, out_value, out_expiration);
+        }
+
+        int updateVersioned(const StorageId& id, const char* value, time_t expiration, int ifVersion) {
+            return shardOf(id).updateVersioned(id, value, expiration, ifVersion);
+        }
+
+        int forceUpdate(const StorageId& id, const char* value, time_t expiration) {
+            return shardOf(id).forceUpdate(id, value, expiration);
+        }
+
+        bool remove(const StorageId& id) { return shardOf(id).remove(id); }
+
+        // the index and the epoch of a context are stored on the shard of the
+        // index key, whichever shards the records are stored on
+        void indexRecord(const StorageId& id, time_t expiration) {
+            shardOf(id.contextIndex()).indexRecord(id, expiration);
+        }
+
+        void unindexRecord(const StorageId& id) { shardOf(id.contextIndex()).unindexRecord(id); }
+
+        void expireContextIndex(const char* context, time_t expiration) {
+            shardOf(make_index_id(context)).expireContextIndex(context, expiration);
+        }
+
+        void deleteContextIndex(const char* context) { shardOf(make_index_id(context)).deleteContextIndex(context); }
+
+        unsigned long long scanContextIndexPage(const char* context, unsigned long long cursor,
+                                                std::vector<std::string>* out_members) {
+            return shardOf(make_index_id(context)).scanContextIndexPage(context, cursor, out_members);
+        }
+
+        long long touchContextEpoch(const char* context, time_t keepUntil) {
+            return shardOf(make_index_id(context)).touchContextEpoch(context, keepUntil);
+        }
+
+        bool readContextEpoch(const char* context, ContextEpoch* out_epoch) {
+            return shardOf(make_index_id(context)).readContextEpoch(context, out_epoch);
+        }
+
+        long long expireContextEpoch(const char* context, time_t expiration, time_t keepUntil, time_t* out_horizon) {
+            return shardOf(make_index_id(context)).expireContextEpoch(context, expiration, keepUntil, out_horizon);
+        }
+
+        long long deleteContextEpoch(const char* context) {
+            return shardOf(make_index_id(context)).deleteContextEpoch(context);
+        }
+
+        void raiseContextEpochHorizon(const char* context, long long generation, time_t horizon) {
+            shardOf(make_index_id(context)).raiseContextEpochHorizon(context, generation, horizon);
+        }
+
+        std::vector<ClusterNode> endpoints() const { return m_nodes; }
+
+        /**
+         * Jump consistent hash (Lamping and Veach): maps key to one of
+         * buckets, moving only 1/buckets of the keys when a bucket is added.
+         */
+        static unsigned int jumpHash(unsigned long long key, unsigned int buckets);
+
+    protected:
+        size_t scanContextTypeless(const char* context, RawCallbackType callback, void* callbackContext);
+
+        size_t scanContextIndexTypeless(const char* context, RawCallbackType callback, void* callbackContext);
+
+    private:
+        RedisConnectionPool& shardOf(const StorageId& id) {
+            return m_pools[m_slot_shards[id.hashSlotUsing<RedisCrc16>()]];
+        }
+
+        RedisConnectionPool& shardOfKey(const std::string& key) {
+            return m_pools[m_slot_shards[RedisCrc16::keySlot(key)]];
+        }
+
+        const RedisConfig m_config;
+        xmltooling::logging::Category& m_logger;
+        const std::vector<ClusterNode> m_nodes;
+        boost::ptr_vector<RedisConnectionPool> m_pools;
+        // the index of the shard of every hash-slot
+        std::vector<unsigned short> m_slot_shards;
+    };
+}
+
+#endif //REDIS_SHARDS_H
@@ -0,0 +1,236 @@
+/**
+ * Licensed to the University Corporation for Advanced Internet
+ * Development, Inc. (UCAID) under one or more contributor license
+ * agreements. See the NOTICE file distributed with this work for
+ * additional information regarding copyright ownership.
+ *
+ * UCAID licenses this file to you under the Apache License,
+ * Version 2.0 (the "License"); you may not use this file except
+ * in compliance with the License. You may obtain a copy of the
+ * License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+ */
+
+/**
+ * redis-single-flight.cpp
+ *
+ * Implementation of the RedisSingleFlight type.
+ */
+
+#include "redis-single-flight.h"
+#include "redis-stats.h"
+
+using namespace xmltooling;
+
+namespace {
+    // versioned reads only share a flight with reads of the same version, so
+    // each one goes through the replica lag guard of the inner instance; the
+    // key never contains NUL, which separates the version
+    std::string flightPrefix(const spredis::StorageId& id) {
+        std::string prefix(id.wire(), id.wireLength());
+        prefix.push_back('\0');
+        return prefix;
+    }
+
+    std::string flightKey(const spredis::StorageId& id, const int minVersion) {
+        return flightPrefix(id).append(std::to_string(minVersion));
+    }
+
+    // XXX lambda when possible
+    struct callback_wrap {
+        callback_wrap(void (*const callback)(void*, spredis::RedisConnection*, const std::vector<std::string>&),
+                      void* const callback_context)
+            : callback(callback),
+              callbackContext(callback_context) {
+        }
+
+        void
+        operator()(spredis::RedisConnection* connection, const std::vector<std::string>& keys) const {
+            callback(callbackContext, connection, keys);
+        }
+
+        void (*callback)(void*, spredis::RedisConnection*, const std::vector<std::string>&);
+        void* callbackContext;
+    };
+}
+
+spredis::RedisSingleFlight::Flight::Flight()
+    : refs(1),
+      landed(false),
+      failed(false),
+      landedSignal(),
+      version(0),
+      value(),
+      expiration(0) {
+}
+
+spredis::RedisSingleFlight::RedisSingleFlight(Redis* const inner)
+    : Redis(inner->getPrefix(), inner->getHashTag(), inner->getHashTagBuckets()),
+      m_inner(inner),
+      m_mutex(Mutex::create()),
+      m_flights() {
+}
+
+spredis::RedisSingleFlight::~RedisSingleFlight() {
+    // no read can be in flight anymore, so every flight landed and was freed
+}
+
+bool spredis::RedisSingleFlight::set(const StorageId& id, const char* value, const time_t expiration) {
+    const bool result = m_inner->set(id, value, expiration);
+    detach(id);
+    return result;
+}
+
+int spredis::RedisSingleFlight::getVersioned(const StorageId& id, std::string* out_value, time_t* out_expiration,
+                                             const int minVersion) {
+    return read(id, out_value, out_expiration, minVersion);
+}
+
+int spredis::RedisSingleFlight::forceGet(const StorageId& id, std::string* out_value, time_t* out_expiration) {
+    return read(id, out_value, out_expiration, 0);
+}
+
+int spredis::RedisSingleFlight::updateVersioned(const StorageId& id, const char* value, const time_t expiration,
+                                                const int ifVersion) {
+    const int result = m_inner->updateVersioned(id, value, expiration, ifVersion);
+    detach(id);
+    return result;
+}
+
+int spredis::RedisSingleFlight::forceUpdate(const StorageId& id, const char* value, const time_t expiration) {
+    const int result = m_inner->forceUpdate(id, value, expiration);
+    detach(id);
+    return result;
+}
+
+bool spredis::RedisSingleFlight::remove(const StorageId& id) {
+    const bool result = m_inner->remove(id);
+    detach(id);
+    return result;
+}
+
+size_t spredis::RedisSingleFlight::scanContextTypeless(const char* context,
+                                                       RawCallbackType callback,
+                                                       void* callbackContext) {
+    m_inner->scanContext(context, callback_wrap(callback, callbackContext));
+    detachAll();
+    return 0U;
+}
+
+size_t spredis::RedisSingleFlight::scanContextIndexTypeless(const char* context,
+                                                            RawCallbackType callback,
+                                                            void* callbackContext) {
+    m_inner->scanContextIndex(context, callback_wrap(callback, callbackContext));
+    detachAll();
+    return 0U;
+}
+
+int spredis::RedisSingleFlight::read(const StorageId& id, std::string* out_value, time_t* out_expiration,
+                                     const int minVersion) {
+    const std::string key = flightKey(id, minVersion);
+
+    Flight* flight = NULL;
+    bool lead = false;
+    {
+        const Lock lock(m_mutex);
+        const flight_map_type::iterator found = m_flights.find(key);
+        if (found != m_flights.end()) {
+            flight = found->second;
+            if (!flight->landedSignal) flight->landedSignal.reset(CondWait::create());
+            ++flight->refs;
+            RedisStats::getInstance().count(RedisStats::COALESCED_READS);
+        } else {
+            flight = new Flight();
+            try {
+                m_flights.insert(std::make_pair(key, flight));
+            } catch (...) {
+                delete flight;
+                throw;
+            }
+            lead = true;
+        }
+    }
+
+    std::exception_ptr error;
+    if (lead) {
+        // always read the whole record, so every caller joining can be
+        // answered, whatever it asked for
+        try {
+            flight->version = minVersion > 0
+                                  ? m_inner->getVersioned(id, &flight->value, &flight->expiration, minVersion)
+                                  : m_inner->forceGet(id, &flight->value, &flight->expiration);
+        } catch (...) {
+            error = std::current_exception();
+            flight->failed = true;
+        }
+    }
+
+    bool failed = false;
+    {
+        const Lock lock(m_mutex);
+        if (lead) {
+            const flight_map_type::iterator found = m_flights.find(key);
+            if (found != m_flights.end() && found->second == flight) m_flights.erase(found);
+            flight->landed = true;
+            if (flight->landedSignal) flight->landedSignal->broadcast();
+        } else {
+            while (!flight->landed) {
+                flight->landedSignal->wait(m_mutex.get());
+            }
+        }
+
+        failed = flight->failed;
+        if (failed) releaseUnguarded(flight);
+    }
+
+    // the callers which joined read again, so each one gets its own error
+    if (error) std::rethrow_exception(error);
+    if (failed) {
+        return minVersion > 0 ? m_inner->getVersioned(id, out_value, out_expiration, minVersion)
+                              : m_inner->forceGet(id, out_value, out_expiration);
+    }
+
+    // the result is not written anymore once landed
+    const int version = flight->version;
+    try {
+        if (version != 0) {
+            if (out_value && version >= minVersion) *out_value = flight->value;
+            if (out_expiration) *out_expiration = flight->expiration;
+        }
+    } catch (...) {
+        const Lock lock(m_mutex);
+        releaseUnguarded(flight);
+        throw;
+    }
+
+    const Lock lock(m_mutex);
+    releaseUnguarded(flight);
+    return version;
+}
+
+void spredis::RedisSingleFlight::detach(const StorageId& id) {
+    const std::string prefix = flightPrefix(id);
+
+    // the flights are still landed by their readers, and freed by the last
+    // of their callers, they only stop being joined
+    const Lock lock(m_mutex);
+    flight_map_type::iterator it = m_flights.lower_bound(prefix);
+    while (it != m_flights.end() && it->first.compare(0, prefix.size(), prefix) == 0)
+        it = m_flights.erase(it);
+}
+
+void spredis::RedisSingleFlight::detachAll() {
+    const Lock lock(m_mutex);
+    m_flights.clear();
+}
+
+void spredis::RedisSingleFlight::releaseUnguarded(Flight* const flight) {
+    if (--flight->refs == 0) delete flight;
+}
@@ -0,0 +1,165 @@
+/**
+ * Licensed to the University Corporation for Advanced Internet
+ * Development, Inc. (UCAID) under one or more contributor license
+ * agreements. See the NOTICE file distributed with this work for
+ * additional information regarding copyright ownership.
+ *
+ * UCAID licenses this file to you under the Apache License,
+ * Version 2.0 (the "License"); you may not use this file except
+ * in compliance with the License. You may obtain a copy of the
+ * License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+ */
+
+/**
+ * redis-single-flight.h
+ *
+ * Provides the RedisSingleFlight class, which coalesces concurrent reads of
+ * the same record into a single read from Redis.
+ */
+
+#ifndef REDIS_SINGLE_FLIGHT_H
+#define REDIS_SINGLE_FLIGHT_H
+
+#include <ctime>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "cluster-node.h"
+#include "redis.h"
+
+#include <boost/container/map.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <xmltooling/util/Threads.h>
+
+namespace spredis {
+    /**
+     * A Redis implementation coalescing the reads made through another one:
+     * while a record is being read, callers reading the same record do not
+     * send reads of their own, but wait for the one in flight and share its
+     * result.
+     *
+     * The record is always read as a whole, and every caller then gets what
+     * it asked for from it, the same way Redis would answer. Versioned reads
+     * only join reads of the same minimal version, which are read as such
+     * from the inner instance, so a replica lagging behind that version is
+     * not trusted. A caller only
+     * joins a read which started after the last write of the record through
+     * this instance completed, so it never gets a value older than its own
+     * writes. If the shared read fails, every caller waiting for it reads the
+     * record on its own, so errors are reported (and retried) per caller.
+     */
+    class SHIBSP_HIDDEN RedisSingleFlight SHIBSP_FINAL : public Redis {
+    public:
+        /**
+         * Creates the instance in front of inner. Takes ownership of inner.
+         */
+        explicit RedisSingleFlight(Redis* inner);
+
+        ~RedisSingleFlight();
+
+        bool set(const StorageId& id, const char* value, time_t expiration);
+
+        int getVersioned(const StorageId& id, std::string* out_value, time_t* out_expiration, int minVersion);
+
+        int forceGet(const StorageId& id, std::string* out_value, time_t* out_expiration);
+
+        int updateVersioned(const StorageId& id, const char* value, time_t expiration, int ifVersion);
+
+        int forceUpdate(const StorageId& id, const char* value, time_t expiration);
+
+        bool remove(const StorageId& id);
+
+        // the index does not hold records, so it is not coalesced
+        void indexRecord(const StorageId& id, time_t expiration) { m_inner->indexRecord(id, expiration); }
+
+        void unindexRecord(const StorageId& id) { m_inner->unindexRecord(id); }
+
+        void expireContextIndex(const char* context, time_t expiration) {
+            m_inner->expireContextIndex(context, expiration);
+        }
+
+        void deleteContextIndex(const char* context) { m_inner->deleteContextIndex(context); }
+
+        unsigned long long scanContextIndexPage(const char* context, unsigned long long cursor,
+                                                std::vector<std::string>* out_members) {
+            return m_inner->scanContextIndexPage(context, cursor, out_members);
+        }
+
+        // neither is the epoch, which must be read fresh for every record
+        long long touchContextEpoch(const char* context, time_t keepUntil) {
+            return m_inner->touchContextEpoch(context, keepUntil);
+        }
+
+        bool readContextEpoch(const char* context, ContextEpoch* out_epoch) {
+            return m_inner->readContextEpoch(context, out_epoch);
+        }
+
+        long long expireContextEpoch(const char* context, time_t expiration, time_t keepUntil, time_t* out_horizon) {
+            return m_inner->expireContextEpoch(context, expiration, keepUntil, out_horizon);
+        }
+
+        long long deleteContextEpoch(const char* context) { return m_inner->deleteContextEpoch(context); }
+
+        void raiseContextEpochHorizon(const char* context, long long generation, time_t horizon) {
+            m_inner->raiseContextEpochHorizon(context, generation, horizon);
+        }
+
+        std::vector<ClusterNode> endpoints() const { return m_inner->endpoints(); }
+
+    protected:
+        size_t scanContextTypeless(const char* context, RawCallbackType callback, void* callbackContext);
+
+        size_t scanContextIndexTypeless(const char* context, RawCallbackType callback, void* callbackContext);
+
+    private:
+        /**
+         * A read in flight, shared by the caller performing it and the callers
+         * waiting for it. Guarded by the mutex of the instance, except for the
+         * result, which is only written by the reading caller before landing,
+         * and only read by the others after.
+         */
+        struct Flight {
+            Flight();
+
+            unsigned int refs;
+            bool landed;
+            bool failed;
+            // only created once a second caller joins
+            boost::scoped_ptr<xmltooling::CondWait> landedSignal;
+            int version;
+            std::string value;
+            time_t expiration;
+        };
+
+        // ordered, so that the flights of all versions of one record, which
+        // share the record's key as a prefix, are adjacent
+        typedef boost::container::map<std::string, Flight*> flight_map_type;
+
+        int read(const StorageId& id, std::string* out_value, time_t* out_expiration, int minVersion);
+
+        /**
+         * Makes callers arriving from now on start a new read of the record,
+         * instead of joining one in flight, for any minVersion.
+         */
+        void detach(const StorageId& id);
+
+        void detachAll();
+
+        void releaseUnguarded(Flight* flight);
+
+        boost::scoped_ptr<Redis> m_inner;
+        boost::scoped_ptr<xmltooling::Mutex> m_mutex;
+        flight_map_type m_flights;
+    };
+}
+
+#endif //REDIS_SINGLE_FLIGHT_H
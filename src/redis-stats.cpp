@@ -0,0 +1,271 @@
+/**
+ * Licensed to the University Corporation for Advanced Internet
+ * Development, Inc. (UCAID) under one or more contributor license
+ * agreements. See the NOTICE file distributed with this work for
+ * additional information regarding copyright ownership.
+ *
+ * UCAID licenses this file to you under the Apache License,
+ * Version 2.0 (the "License"); you may not use this file except
+ * in compliance with the License. You may obtain a copy of the
+ * License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+ */
+
+/**
+ * redis-stats.cpp
+ *
+ * Implementation of the LatencyHistogram, RedisStats and RedisStatsReporter
+ * types.
+ */
+
+#include "redis-stats.h"
+
+#include <algorithm>
+#include <cmath>
+#include <ctime>
+
+#include <boost/cstdint.hpp>
+
+using namespace xmltooling;
+
+namespace {
+    const char* const operationNames[] = {"set", "get", "update", "remove", "scan"};
+
+    const char* const counterNames[] = {
+        "retries",
+        "moved",
+        "ask",
+        "reconnects",
+        "concurrency_failures",
+        "pool_waits",
+        "pool_exhausted",
+        "coalesced_reads",
+        "stale_records",
+        "failovers",
+        "deadlines_exceeded",
+        "retry_budget_exhausted",
+        "breaker_rejections",
+        "hedged_reads",
+        "hedge_wins"
+    };
+
+    // the largest exponent of 2 with buckets of its own: larger latencies,
+    // which are over 19 hours, all fall into the last bucket
+    const unsigned int maxExponent = 35;
+
+    /**
+     * Returns the stripe of histograms used by the calling thread. Threads
+     * get their stripes in a round-robin fashion, the first time they record.
+     */
+    unsigned int stripeOfCurrentThread(const unsigned int stripeCount) {
+        // never freed: threads may record until the plugin is unloaded
+        static ThreadKey* const key = ThreadKey::create(NULL);
+        static boost::atomic<unsigned int> next(0);
+
+        const boost::uintptr_t data = reinterpret_cast<boost::uintptr_t>(key->getData());
+        if (data != 0) return static_cast<unsigned int>(data - 1);
+
+        const unsigned int stripe = next.fetch_add(1, boost::memory_order_relaxed) % stripeCount;
+        key->setData(reinterpret_cast<void*>(static_cast<boost::uintptr_t>(stripe) + 1));
+        return stripe;
+    }
+
+    void appendHistogram(std::string& out, const std::string& name, const spredis::LatencyHistogram& histogram) {
+        const spredis::LatencyHistogram::Snapshot snapshot = histogram.snapshot();
+        out += name;
+        out += " count=" + std::to_string(snapshot.count);
+        out += " mean_us=" + std::to_string(snapshot.count == 0 ? 0 : snapshot.sum / snapshot.count);
+        out += " p50_us=" + std::to_string(snapshot.quantile(0.5));
+        out += " p90_us=" + std::to_string(snapshot.quantile(0.9));
+        out += " p99_us=" + std::to_string(snapshot.quantile(0.99));
+        out += " p999_us=" + std::to_string(snapshot.quantile(0.999));
+        out += " max_us=" + std::to_string(snapshot.max);
+        out += '\n';
+    }
+}
+
+spredis::LatencyHistogram::Snapshot::Snapshot()
+    : count(0),
+      sum(0),
+      max(0),
+      buckets(bucketCount, 0) {
+}
+
+unsigned long long spredis::LatencyHistogram::Snapshot::quantile(const double q) const {
+    if (count == 0) return 0;
+
+    const unsigned long long rank = std::max(1ULL, static_cast<unsigned long long>(std::ceil(q * count)));
+    unsigned long long seen = 0;
+    for (unsigned int i = 0; i < bucketCount; ++i) {
+        seen += buckets[i];
+        // the bound of the bucket may be above any value actually recorded
+        if (seen >= rank) return std::min(bucketUpperBound(i), max);
+    }
+    return max;
+}
+
+spredis::LatencyHistogram::LatencyHistogram() {
+    for (unsigned int s = 0; s < stripeCount; ++s) {
+        for (unsigned int i = 0; i < bucketCount; ++i) {
+            m_stripes[s].buckets[i].store(0, boost::memory_order_relaxed);
+        }
+        m_stripes[s].sum.store(0, boost::memory_order_relaxed);
+        m_stripes[s].max.store(0, boost::memory_order_relaxed);
+    }
+}
+
+void spredis::LatencyHistogram::record(const unsigned long long micros) {
+    Stripe& stripe = m_stripes[stripeOfCurrentThread(stripeCount)];
+    stripe.buckets[bucketOf(micros)].fetch_add(1, boost::memory_order_relaxed);
+    stripe.sum.fetch_add(micros, boost::memory_order_relaxed);
+
+    unsigned long long max = stripe.max.load(boost::memory_order_relaxed);
+    while (micros > max && !stripe.max.compare_exchange_weak(max, micros, boost::memory_order_relaxed)) {
+    }
+}
+
+spredis::LatencyHistogram::Snapshot spredis::LatencyHistogram::snapshot() const {
+    // stripes are read while still being recorded into, so the snapshot is
+    // only consistent up to the operations in flight
+    Snapshot snapshot;
+    for (unsigned int s = 0; s < stripeCount; ++s) {
+        for (unsigned int i = 0; i < bucketCount; ++i) {
+            const unsigned long long n = m_stripes[s].buckets[i].load(boost::memory_order_relaxed);
+            snapshot.buckets[i] += n;
+            snapshot.count += n;
+        }
+        snapshot.sum += m_stripes[s].sum.load(boost::memory_order_relaxed);
+        snapshot.max = std::max(snapshot.max, m_stripes[s].max.load(boost::memory_order_relaxed));
+    }
+    return snapshot;
+}
+
+unsigned int spredis::LatencyHistogram::bucketOf(const unsigned long long micros) {
+    if (micros < 8) return static_cast<unsigned int>(micros);
+
+    unsigned int exponent = 3;
+    while (exponent < 63 && (micros >> (exponent + 1)) != 0) ++exponent;
+    if (exponent > maxExponent) return bucketCount - 1;
+
+    const unsigned int sub = static_cast<unsigned int>(micros >> (exponent - 3)) - 8;
+    return 8 + (exponent - 3) * 8 + sub;
+}
+
+unsigned long long spredis::LatencyHistogram::bucketUpperBound(const unsigned int bucket) {
+    if (bucket < 8) return bucket;
+
+    const unsigned int exponent = (bucket - 8) / 8 + 3;
+    const unsigned long long sub = (bucket - 8) % 8;
+    return ((8 + sub + 1) << (exponent - 3)) - 1;
+}
+
+spredis::RedisStats& spredis::RedisStats::getInstance() {
+    static RedisStats instance;
+    return instance;
+}
+
+spredis::RedisStats::RedisStats()
+    : m_node_mutex(Mutex::create()),
+      m_nodes() {
+    for (unsigned int i = 0; i < COUNTER_COUNT; ++i) {
+        m_counters[i].store(0, boost::memory_order_relaxed);
+    }
+}
+
+spredis::RedisStats::~RedisStats() {
+    for (node_map_type::iterator it = m_nodes.begin(); it != m_nodes.end(); ++it) {
+        delete it->second;
+    }
+}
+
+spredis::LatencyHistogram& spredis::RedisStats::node(const std::string& host, const int port) {
+    const std::string name = host + ":" + std::to_string(port);
+
+    const Lock lock(m_node_mutex);
+    const node_map_type::iterator it = m_nodes.find(name);
+    if (it != m_nodes.end()) return *it->second;
+
+    LatencyHistogram* const histogram = new LatencyHistogram();
+    try {
+        m_nodes.insert(std::make_pair(name, histogram));
+    } catch (...) {
+        delete histogram;
+        throw;
+    }
+    return *histogram;
+}
+
+std::string spredis::RedisStats::report() const {
+    std::string out;
+    for (unsigned int i = 0; i < OPERATION_COUNT; ++i) {
+        appendHistogram(out, std::string("op.") + operationNames[i], m_operations[i]);
+    }
+    {
+        const Lock lock(m_node_mutex);
+        for (node_map_type::const_iterator it = m_nodes.begin(); it != m_nodes.end(); ++it) {
+            appendHistogram(out, "node." + it->first, *it->second);
+        }
+    }
+    for (unsigned int i = 0; i < COUNTER_COUNT; ++i) {
+        out += std::string("counter.") + counterNames[i] + " " + std::to_string(counter(static_cast<Counter>(i)));
+        out += '\n';
+    }
+    return out;
+}
+
+spredis::RedisStatsReporter::RedisStatsReporter(const unsigned int interval)
+    : m_interval(interval),
+      m_logger(logging::Category::getInstance("XMLTooling.StorageService.REDIS.Stats")),
+      m_mutex(Mutex::create()),
+      m_wakeup(CondWait::create()),
+      m_shutdown(false),
+      m_reporter() {
+    m_reporter.reset(Thread::create(&RedisStatsReporter::reporterMain, this));
+}
+
+spredis::RedisStatsReporter::~RedisStatsReporter() {
+    {
+        const Lock lock(m_mutex);
+        m_shutdown = true;
+        m_wakeup->signal();
+    }
+    if (m_reporter) m_reporter->join(NULL);
+}
+
+void* spredis::RedisStatsReporter::reporterMain(void* self) {
+    static_cast<RedisStatsReporter*>(self)->reportLoop();
+    return NULL;
+}
+
+void spredis::RedisStatsReporter::reportLoop() {
+    const time_t start = time(NULL);
+    time_t due = start + static_cast<time_t>(m_interval);
+
+    for (;;) {
+        {
+            const Lock lock(m_mutex);
+            while (!m_shutdown) {
+                const time_t now = time(NULL);
+                if (now >= due) break;
+                m_wakeup->timedwait(m_mutex.get(), static_cast<int>(due - now));
+            }
+            if (m_shutdown) return;
+        }
+        due += static_cast<time_t>(m_interval);
+
+        // one line per entry, so the log can be grepped for a single one
+        const std::string report = RedisStats::getInstance().report();
+        size_t begin = 0;
+        for (size_t end = report.find('\n'); end != std::string::npos; end = report.find('\n', begin)) {
+            m_logger.info("%.*s", static_cast<int>(end - begin), report.c_str() + begin);
+            begin = end + 1;
+        }
+    }
+}
@@ -0,0 +1,236 @@
+/**
+ * Licensed to the University Corporation for Advanced Internet
+ * Development, Inc. (UCAID) under one or more contributor license
+ * agreements. See the NOTICE file distributed with this work for
+ * additional information regarding copyright ownership.
+ *
+ * UCAID licenses this file to you under the Apache License,
+ * Version 2.0 (the "License"); you may not use this file except
+ * in compliance with the License. You may obtain a copy of the
+ * License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+ */
+
+/**
+ * redis-stats.h
+ *
+ * Provides the LatencyHistogram and RedisStats classes, collecting the
+ * latencies of operations and the counts of notable events, and the
+ * RedisStatsReporter class, periodically logging them.
+ */
+
+#ifndef REDIS_STATS_H
+#define REDIS_STATS_H
+
+#include <chrono>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "common.h"
+
+#include <boost/atomic.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <xmltooling/util/Threads.h>
+#include <xmltooling/logging.h>
+
+namespace spredis {
+    /**
+     * Histogram of latencies in microseconds, with logarithmic buckets each
+     * split into 8 linear sub-buckets, the same way as HDR histograms with a
+     * precision of a single significant octal digit: every recorded value is
+     * within 12.5% of the reported one.
+     *
+     * Recording is lock-free: every thread increments the counters of its own
+     * stripe, which are only summed when a snapshot is taken, so threads
+     * recording concurrently do not contend on the same cache lines.
+     */
+    class SHIBSP_HIDDEN LatencyHistogram SHIBSP_FINAL {
+        MAKE_NONCOPYABLE(LatencyHistogram);
+
+    public:
+        static const unsigned int bucketCount = 8 + 33 * 8;
+
+        struct Snapshot {
+            Snapshot();
+
+            /**
+             * Returns the largest latency of the bucket holding the quantile
+             * (0 to 1) of the recorded latencies, or 0 if nothing was
+             * recorded.
+             */
+            unsigned long long quantile(double q) const;
+
+            unsigned long long count;
+            unsigned long long sum;
+            unsigned long long max;
+            std::vector<unsigned long long> buckets;
+        };
+
+        LatencyHistogram();
+
+        void record(unsigned long long micros);
+
+        Snapshot snapshot() const;
+
+        static unsigned int bucketOf(unsigned long long micros);
+
+        static unsigned long long bucketUpperBound(unsigned int bucket);
+
+    private:
+        static const unsigned int stripeCount = 8;
+
+        struct Stripe {
+            boost::atomic<unsigned long long> buckets[bucketCount];
+            boost::atomic<unsigned long long> sum;
+            boost::atomic<unsigned long long> max;
+        };
+
+        Stripe m_stripes[stripeCount];
+    };
+
+    /**
+     * The statistics of the plugin, shared by every storage service of the
+     * process: latencies of the storage operations and of the operations
+     * sent to each Redis server, and counters of the events which usually
+     * explain slow operations.
+     * Everything is cumulative since the plugin was loaded.
+     */
+    class SHIBSP_HIDDEN RedisStats SHIBSP_FINAL {
+        MAKE_NONCOPYABLE(RedisStats);
+
+    public:
+        enum Operation {
+            OP_SET,
+            OP_GET,
+            OP_UPDATE,
+            OP_REMOVE,
+            OP_SCAN,
+            OPERATION_COUNT
+        };
+
+        enum Counter {
+            // operations retried after waiting, in cluster mode
+            RETRIES,
+            MOVED_REDIRECTIONS,
+            ASK_REDIRECTIONS,
+            RECONNECTS,
+            // WATCH-ed transactions aborted by a concurrent modification
+            CONCURRENCY_FAILURES,
+            // checkouts which had to wait for a connection to be returned
+            POOL_WAITS,
+            POOL_EXHAUSTED,
+            // reads answered by joining a read of the same record in flight
+            COALESCED_READS,
+            // records found deleted or expired by a context epoch, and removed
+            STALE_RECORDS,
+            // switches to a new primary announced by Sentinel
+            FAILOVERS,
+            // retries given up on, as the operation ran out of time, or the
+            // retry budget of the storage service was spent
+            DEADLINES_EXCEEDED,
+            RETRY_BUDGET_EXHAUSTED,
+            // operations failed fast by the circuit breaker of a server
+            BREAKER_REJECTIONS,
+            // reads sent to a second node after the first one was slow, and
+            // the ones the second node answered first
+            HEDGED_READS,
+            HEDGE_WINS,
+            COUNTER_COUNT
+        };
+
+        /**
+         * Records the time elapsed between its construction and destruction
+         * into a histogram.
+         */
+        class SHIBSP_HIDDEN Timer SHIBSP_FINAL {
+            MAKE_NONCOPYABLE(Timer);
+
+        public:
+            explicit Timer(LatencyHistogram& histogram)
+                : m_histogram(histogram),
+                  m_start(std::chrono::steady_clock::now()) {
+            }
+
+            ~Timer() {
+                m_histogram.record(static_cast<unsigned long long>(
+                    std::chrono::duration_cast<std::chrono::microseconds>(
+                        std::chrono::steady_clock::now() - m_start).count()));
+            }
+
+        private:
+            LatencyHistogram& m_histogram;
+            const std::chrono::steady_clock::time_point m_start;
+        };
+
+        static RedisStats& getInstance();
+
+        ~RedisStats();
+
+        LatencyHistogram& operation(Operation op) { return m_operations[op]; }
+
+        /**
+         * Returns the histogram of the operations sent to the server, created
+         * the first time the server is seen. Histograms are never removed,
+         * so the result can be kept for as long as the plugin is loaded.
+         */
+        LatencyHistogram& node(const std::string& host, int port);
+
+        void count(Counter counter) { m_counters[counter].fetch_add(1, boost::memory_order_relaxed); }
+
+        unsigned long long counter(Counter counter) const {
+            return m_counters[counter].load(boost::memory_order_relaxed);
+        }
+
+        /**
+         * Formats every statistic, one per line, as the name of the statistic
+         * followed by space separated name=value pairs, or by the value of
+         * counters.
+         */
+        std::string report() const;
+
+    private:
+        typedef std::map<std::string, LatencyHistogram*> node_map_type;
+
+        RedisStats();
+
+        LatencyHistogram m_operations[OPERATION_COUNT];
+        boost::atomic<unsigned long long> m_counters[COUNTER_COUNT];
+        boost::scoped_ptr<xmltooling::Mutex> m_node_mutex;
+        node_map_type m_nodes;
+    };
+
+    /**
+     * Logs the report of the statistics every interval seconds on a thread
+     * of its own, until destroyed.
+     */
+    class SHIBSP_HIDDEN RedisStatsReporter SHIBSP_FINAL {
+        MAKE_NONCOPYABLE(RedisStatsReporter);
+
+    public:
+        explicit RedisStatsReporter(unsigned int interval);
+
+        ~RedisStatsReporter();
+
+    private:
+        static void* reporterMain(void* self);
+
+        void reportLoop();
+
+        const unsigned int m_interval;
+        xmltooling::logging::Category& m_logger;
+        boost::scoped_ptr<xmltooling::Mutex> m_mutex;
+        boost::scoped_ptr<xmltooling::CondWait> m_wakeup;
+        bool m_shutdown;
+        boost::scoped_ptr<xmltooling::Thread> m_reporter;
+    };
+}
+
+#endif //REDIS_STATS_H
@@ -38,11 +38,25 @@
 # define MCEXT_EXPORTS
 #endif
 
+#include <algorithm>
+#include <cstring>
+
 #include "common.h"
+#include "context-epoch.h"
 #include "redis-reply.h"
+#include "redis-command-group.h"
 #include "redis-connection.h"
+#include "redis-connection-pool.h"
+#include "redis-crc-16.h"
 #include "redis-cluster.h"
-
+#include "redis-sentinel.h"
+#include "redis-shards.h"
+#include "redis-read-cache.h"
+#include "redis-single-flight.h"
+#include "redis-stats.h"
+#include "value-codec.h"
+
+#include <boost/container/map.hpp>
 #include <hiredis/hiredis.h>
 
 #include <xmltooling/logging.h>
@@ -64,9 +78,15 @@ namespace {
     // https://redis.io/docs/latest/develop/data-types/strings -> 512 MB
     const unsigned int redisMaxValueSize = 512U * 1000 * 1000;
 
+    // EXPIREAT to a time in the past deletes the key
+    const time_t alreadyExpired = 1;
+
+    const int optimisticConcurrencyRetryCount = 3;
+
     class RedisStorageService SHIBSP_FINAL : public StorageService {
     public:
-        explicit RedisStorageService(Redis* conn);
+        RedisStorageService(Redis* conn, bool contextIndex, bool contextEpochs, unsigned int contextEpochGrace,
+                            bool perKeyFallback, const ValueCodec& codec, unsigned int statsInterval);
 
         const Capabilities& getCapabilities() const {
             return m_capabilities;
@@ -109,94 +129,398 @@ namespace {
     private:
         Redis* m_connection;
         Capabilities m_capabilities;
-
+        // whether records are added to the index of their context, which is
+        // then walked by the context operations instead of scanning
+        const bool m_context_index;
+        // whether context operations only advance the epoch of the context,
+        // and for how long records are kept after their expiration for them
+        const bool m_context_epochs;
+        const time_t m_context_epoch_grace;
+        // whether records are also looked for under the per-key hash tag,
+        // when they are missing under the configured one
+        const bool m_per_key_fallback;
+        const ValueCodec m_codec;
+        RedisStats& m_stats;
+        // logs the statistics periodically if enabled, NULL otherwise
+        boost::scoped_ptr<RedisStatsReporter> m_reporter;
+
+        bool createStamped(const StorageId& id, const char* value, time_t expiration);
+
+        int readRecord(const StorageId& id, std::string* pvalue, time_t* pexpiration, int version);
+
+        int updateRecord(const StorageId& id, const char* value, time_t expiration, int version);
+
+        bool deleteRecord(const StorageId& id);
+
+        /**
+         * Reads a record written with context epochs enabled, with its stamp
+         * removed from the value, and reports in out_stale whether a context
+         * operation deleted it or made it expire since. Its expiration is
+         * only read if out_expiration is not NULL, and is then the one set
+         * by the context operation if any.
+         */
+        int readStamped(const StorageId& id, std::string& out_value, time_t* out_expiration, EpochStamp& out_stamp,
+                        bool& out_stale);
+
+        /**
+         * Removes a stale record, unless it was written since it was read at
+         * version.
+         */
+        void purgeStale(const StorageId& id, int version);
+
+        int updateStamped(const StorageId& id, const char* value, time_t expiration, int version);
+
+        /**
+         * Sets the expiration of each record of a page, by pipelining the
+         * commands of the whole page, or only extends it if onlyExtend is
+         * set. Keys which expired in the meantime are silently skipped.
+         */
         class SetExpirationTo {
         public:
-            explicit SetExpirationTo(time_t expirationTo)
-                : m_expiration(expirationTo) {
+            explicit SetExpirationTo(time_t expirationTo, bool onlyExtend = false)
+                : m_expiration(expirationTo),
+                  m_only_extend(onlyExtend) {
             }
 
             void
-            operator()(RedisConnection* connection, const string& fullKey) const {
-                RedisReply reply(connection,
-                                 redisCommand(&connection->getRedisContext(),
-                                              "EXPIREAT %b %lld",
-                                              fullKey.c_str(),
-                                              fullKey.size(),
-                                              static_cast<long long>(m_expiration)));
-                RedisReply reply_version(connection,
-                                         redisCommand(&connection->getRedisContext(),
-                                                      "EXPIREAT version.of:%b %lld",
-                                                      fullKey.c_str(),
-                                                      fullKey.size(),
-                                                      static_cast<long long>(m_expiration)));
+            operator()(RedisConnection* connection, const std::vector<std::string>& fullKeys) const {
+                // the version key is only present in the key layout, a second
+                // EXPIREAT is needed as EXPIREAT only takes a single key; GT
+                // only extends the expiration of the records
+                const char* const keyFormat = m_only_extend ? "EXPIREAT %b %lld GT" : "EXPIREAT %b %lld";
+                const char* const versionFormat = m_only_extend
+                                                      ? "EXPIREAT version.of:%b %lld GT"
+                                                      : "EXPIREAT version.of:%b %lld";
+                RedisCommandGroup command;
+                for (size_t i = 0; i < fullKeys.size(); ++i) {
+                    command.append(keyFormat,
+                                   fullKeys[i].c_str(),
+                                   fullKeys[i].size(),
+                                   static_cast<long long>(m_expiration));
+                    command.append(versionFormat,
+                                   fullKeys[i].c_str(),
+                                   fullKeys[i].size(),
+                                   static_cast<long long>(m_expiration));
+                }
+                connection->executeUnguarded(command);
+
+                RedisReply reply(connection);
+                for (size_t i = 0; i < fullKeys.size(); ++i) {
+                    reply.getNextFrom(command, "updateContext", "EXPIREAT (data)", REDIS_REPLY_INTEGER);
+                    reply.getNextFrom(command, "updateContext", "EXPIREAT (version)", REDIS_REPLY_INTEGER);
+                }
             }
 
         private:
             time_t m_expiration;
+            bool m_only_extend;
         };
 
-
+        /**
+         * Deletes each record of a page, with a single UNLINK for the records
+         * of each hash-slot of the page, as a cluster refuses commands whose
+         * keys span hash-slots.
+         */
         class Delete {
         public:
             void
-            operator()(RedisConnection* connection, const string& fullKey) const {
-                RedisReply reply(connection,
-                                 redisCommand(&connection->getRedisContext(),
-                                              "UNLINK %b version.of:%b",
-                                              fullKey.c_str(),
-                                              fullKey.size(),
-                                              fullKey.c_str(),
-                                              fullKey.size()));
+            operator()(RedisConnection* connection, const std::vector<std::string>& fullKeys) const {
+                // a record and its version key share the hash tag
+                boost::container::map<unsigned int, std::vector<std::string> > slots;
+                for (size_t i = 0; i < fullKeys.size(); ++i) {
+                    std::vector<std::string>& keys = slots[RedisCrc16::keySlot(fullKeys[i])];
+                    keys.push_back(fullKeys[i]);
+                    keys.push_back("version.of:" + fullKeys[i]);
+                }
+
+                RedisCommandGroup command;
+                for (boost::container::map<unsigned int, std::vector<std::string> >::const_iterator it =
+                         slots.begin();
+                     it != slots.end();
+                     ++it) {
+                    const std::vector<std::string>& keys = it->second;
+                    std::vector<const char*> argv(1, "UNLINK");
+                    std::vector<size_t> argvlen(1, sizeof("UNLINK") - 1);
+                    for (size_t i = 0; i < keys.size(); ++i) {
+                        argv.push_back(keys[i].c_str());
+                        argvlen.push_back(keys[i].size());
+                    }
+                    command.appendArgv(static_cast<int>(argv.size()), &argv[0], &argvlen[0]);
+                }
+                connection->executeUnguarded(command);
+
+                RedisReply reply(connection);
+                for (size_t i = 0; i < slots.size(); ++i) {
+                    reply.getNextFrom(command, "deleteContext", "UNLINK", REDIS_REPLY_INTEGER);
+                }
             }
         };
     };
 
 
-    RedisStorageService::RedisStorageService(Redis* conn)
+    RedisStorageService::RedisStorageService(Redis* conn,
+                                             const bool contextIndex,
+                                             const bool contextEpochs,
+                                             const unsigned int contextEpochGrace,
+                                             const bool perKeyFallback,
+                                             const ValueCodec& codec,
+                                             const unsigned int statsInterval)
         : m_connection(conn),
           m_capabilities(redisShibMaxContextSize,
                          redisShibMaxKeySize - m_connection->getPrefix().size(),
-                         redisMaxValueSize) {
+                         redisMaxValueSize),
+          m_context_index(contextIndex),
+          m_context_epochs(contextEpochs),
+          m_context_epoch_grace(static_cast<time_t>(contextEpochGrace)),
+          m_per_key_fallback(perKeyFallback),
+          m_codec(codec),
+          m_stats(RedisStats::getInstance()),
+          m_reporter(statsInterval != 0 ? new RedisStatsReporter(statsInterval) : NULL) {
     }
 
     bool RedisStorageService::createString(const char* context, const char* key, const char* value, time_t expiration) {
+        const RedisStats::Timer timer(m_stats.operation(RedisStats::OP_SET));
         const StorageId id = m_connection->make_id(context, key);
-        return m_connection->set(id, value, expiration);
+        // a record under the per-key hash tag exists all the same
+        if (m_per_key_fallback && readRecord(id.perKeyTagged(), NULL, NULL, 0) > 0) return false;
+
+        std::string encoded;
+        if (m_codec.encode(value, encoded)) value = encoded.c_str();
+        if (m_context_epochs) return createStamped(id, value, expiration);
+        if (!m_connection->set(id, value, expiration)) return false;
+
+        if (m_context_index) m_connection->indexRecord(id, expiration);
+        return true;
     }
 
     int RedisStorageService::readString(const char* context, const char* key, std::string* pvalue, time_t* pexpiration,
                                         int version) {
+        const RedisStats::Timer timer(m_stats.operation(RedisStats::OP_GET));
         const StorageId id = m_connection->make_id(context, key);
-        if (version > 0) return m_connection->getVersioned(id, pvalue, pexpiration, version);
-        return m_connection->forceGet(id, pvalue, pexpiration);
+        const int found = readRecord(id, pvalue, pexpiration, version);
+        if (found != 0 || !m_per_key_fallback) return found;
+        return readRecord(id.perKeyTagged(), pvalue, pexpiration, version);
+    }
+
+    int RedisStorageService::readRecord(const StorageId& id, std::string* pvalue, time_t* pexpiration,
+                                        const int version) {
+        if (m_context_epochs) {
+            std::string value;
+            EpochStamp stamp;
+            bool stale = false;
+            const int found = readStamped(id, value, pexpiration, stamp, stale);
+            if (found <= 0) return found;
+            if (stale) {
+                purgeStale(id, found);
+                return 0;
+            }
+
+            if (pvalue && found >= version) {
+                m_codec.decode(value);
+                pvalue->swap(value);
+            }
+            return found;
+        }
+
+        const int found = version > 0
+                              ? m_connection->getVersioned(id, pvalue, pexpiration, version)
+                              : m_connection->forceGet(id, pvalue, pexpiration);
+        // the value is only read if the record is at least of the version
+        if (pvalue && found > 0 && found >= version) m_codec.decode(*pvalue);
+        return found;
     }
 
     int RedisStorageService::updateString(const char* context, const char* key, const char* value, time_t expiration,
                                           int version) {
+        const RedisStats::Timer timer(m_stats.operation(RedisStats::OP_UPDATE));
         const StorageId id = m_connection->make_id(context, key);
-        if (version > 0) return m_connection->updateVersioned(id, value, expiration, version);
-        return m_connection->forceUpdate(id, value, expiration);
+        std::string encoded;
+        if (value && m_codec.encode(value, encoded)) value = encoded.c_str();
+        // a record under the per-key hash tag is updated in place, and keeps
+        // its key until it expires
+        const int newVersion = updateRecord(id, value, expiration, version);
+        if (newVersion != 0 || !m_per_key_fallback) return newVersion;
+        return updateRecord(id.perKeyTagged(), value, expiration, version);
+    }
+
+    int RedisStorageService::updateRecord(const StorageId& id, const char* value, const time_t expiration,
+                                          const int version) {
+        if (m_context_epochs) return updateStamped(id, value, expiration, version);
+
+        const int newVersion = version > 0
+                                   ? m_connection->updateVersioned(id, value, expiration, version)
+                                   : m_connection->forceUpdate(id, value, expiration);
+
+        // the member's score follows the expiration of the record
+        if (m_context_index && newVersion > 0 && expiration != 0) m_connection->indexRecord(id, expiration);
+        return newVersion;
     }
 
     bool RedisStorageService::deleteString(const char* context, const char* key) {
+        const RedisStats::Timer timer(m_stats.operation(RedisStats::OP_REMOVE));
         const StorageId id = m_connection->make_id(context, key);
-        return m_connection->remove(id);
+        const bool removed = deleteRecord(id);
+        if (removed || !m_per_key_fallback) return removed;
+        return deleteRecord(id.perKeyTagged());
+    }
+
+    bool RedisStorageService::deleteRecord(const StorageId& id) {
+        const bool removed = m_connection->remove(id);
+
+        if (m_context_index) m_connection->unindexRecord(id);
+        return removed;
     }
 
     void RedisStorageService::updateContext(const char* context, time_t expiration) {
-        m_connection->scanContext(context, SetExpirationTo(expiration));
+        const RedisStats::Timer timer(m_stats.operation(RedisStats::OP_SCAN));
+        if (m_context_epochs) {
+            const time_t keepUntil = expiration + m_context_epoch_grace;
+            time_t horizon = 0;
+            const long long generation = m_connection->expireContextEpoch(context, expiration, keepUntil, &horizon);
+            // the records are all kept by Redis for long enough
+            if (generation != 0 && expiration <= horizon) return;
+
+            // otherwise some may be removed by Redis before the new
+            // expiration: extend them to keep them, once for the whole grace
+            // period; without an epoch (records written before enabling
+            // epochs), the records are updated as usual
+            if (generation != 0) {
+                if (!m_context_index) m_connection->scanContext(context, SetExpirationTo(keepUntil, true));
+                else {
+                    m_connection->scanContextIndex(context, SetExpirationTo(keepUntil, true));
+                    m_connection->expireContextIndex(context, keepUntil);
+                }
+                m_connection->raiseContextEpochHorizon(context, generation, keepUntil);
+                return;
+            }
+        }
+        if (!m_context_index) return m_connection->scanContext(context, SetExpirationTo(expiration));
+
+        m_connection->scanContextIndex(context, SetExpirationTo(expiration));
+        m_connection->expireContextIndex(context, expiration);
     }
 
     void RedisStorageService::deleteContext(const char* context) {
-        m_connection->scanContext(context, Delete());
+        const RedisStats::Timer timer(m_stats.operation(RedisStats::OP_SCAN));
+        // the records are left in place, and expire on their own; without an
+        // epoch, the records are deleted as usual
+        if (m_context_epochs && m_connection->deleteContextEpoch(context) != 0) return;
+        if (!m_context_index) return m_connection->scanContext(context, Delete());
+
+        // records created while the context is being deleted may be dropped
+        // from the index along with it, but they still expire on their own
+        m_connection->scanContextIndex(context, Delete());
+        m_connection->deleteContextIndex(context);
+    }
+
+    bool RedisStorageService::createStamped(const StorageId& id, const char* value, const time_t expiration) {
+        const time_t keepUntil = expiration + m_context_epoch_grace;
+        std::string stamped;
+        EpochStamp(m_connection->touchContextEpoch(id.context(), keepUntil), expiration).apply(value, stamped);
+
+        bool created = m_connection->set(id, stamped.c_str(), keepUntil);
+        if (!created) {
+            // a stale record is overwritten in place, unless a concurrent
+            // write replaced it in the meantime
+            std::string existing;
+            EpochStamp stamp;
+            bool stale = false;
+            const int found = readStamped(id, existing, NULL, stamp, stale);
+            if (found <= 0) created = m_connection->set(id, stamped.c_str(), keepUntil);
+            else if (stale) created = m_connection->updateVersioned(id, stamped.c_str(), keepUntil, found) > 0;
+        }
+
+        if (created && m_context_index) m_connection->indexRecord(id, keepUntil);
+        return created;
+    }
+
+    int RedisStorageService::readStamped(const StorageId& id, std::string& out_value, time_t* out_expiration,
+                                         EpochStamp& out_stamp, bool& out_stale) {
+        // the whole value is read, as the stamp is a part of it
+        time_t stored = 0;
+        const int found = m_connection->forceGet(id, &out_value, out_expiration ? &stored : NULL);
+        if (found <= 0) return found;
+
+        // an epoch read after the record includes every context operation
+        // which happened before the record was read
+        ContextEpoch epoch;
+        m_connection->readContextEpoch(id.context(), &epoch);
+
+        out_stamp = EpochStamp::strip(out_value, stored);
+        const time_t expiration = out_stamp.expirationIn(epoch);
+        out_stale = out_stamp.deletedIn(epoch) || (expiration != 0 && expiration <= time(NULL));
+        if (out_expiration) *out_expiration = expiration;
+        return found;
+    }
+
+    void RedisStorageService::purgeStale(const StorageId& id, const int version) {
+        m_stats.count(RedisStats::STALE_RECORDS);
+        // a versioned update to a past expiration only removes the record if
+        // it is still the stale one
+        if (m_connection->updateVersioned(id, "", alreadyExpired, version) > 0 && m_context_index)
+            m_connection->unindexRecord(id);
+    }
+
+    int RedisStorageService::updateStamped(const StorageId& id, const char* value, const time_t expiration,
+                                           const int version) {
+        for (int tryCount = 0; tryCount < optimisticConcurrencyRetryCount; ++tryCount) {
+            std::string current;
+            EpochStamp stamp;
+            bool stale = false;
+            const int found = readStamped(id, current, NULL, stamp, stale);
+            if (found <= 0) return 0;
+            if (stale) {
+                purgeStale(id, found);
+                return 0;
+            }
+            if (version > 0 && found != version) return -1;
+
+            // a record keeping its expiration keeps its stamp as well, so the
+            // context operations since it was written still apply to it
+            time_t keepUntil = 0;
+            if (expiration != 0) {
+                keepUntil = expiration + m_context_epoch_grace;
+                stamp = EpochStamp(m_connection->touchContextEpoch(id.context(), keepUntil), expiration);
+            }
+            std::string stamped;
+            stamp.apply(value ? value : current.c_str(), stamped);
+
+            const int newVersion = m_connection->updateVersioned(id, stamped.c_str(), keepUntil, found);
+            if (newVersion > 0 && m_context_index && keepUntil != 0) m_connection->indexRecord(id, keepUntil);
+            // an unversioned update is retried if the record changed since
+            // it was read
+            if (newVersion != -1 || version > 0) return newVersion;
+            m_stats.count(RedisStats::CONCURRENCY_FAILURES);
+        }
+
+        return 0;
+    }
+
+    /**
+     * Creates the Redis implementation for the deployment the configuration
+     * describes: a cluster, a primary managed by Sentinel, independent shards
+     * or a single instance.
+     */
+    Redis* createRedis(const RedisConfig& config) {
+        if (config.clustered()) return new RedisCluster(config);
+        if (config.sentinelManaged()) return new RedisSentinel(config);
+        if (config.sharded()) return new RedisShards(config);
+        return new RedisConnectionPool(config);
     }
 
     StorageService* RedisStorageServiceFactory(const DOMElement* const & e, bool) {
         const RedisConfig config(e);
-        return config.clustered()
-                   ? new RedisStorageService(new RedisCluster(config))
-                   : new RedisStorageService(new RedisConnection(config));
+        Redis* redis = createRedis(config);
+        // below the cache, so its misses are coalesced as well
+        if (config.coalesceReads) redis = new RedisSingleFlight(redis);
+        const ValueCodec codec(config.compression, config.compressionThreshold);
+        return config.clientCache
+                   ? new RedisStorageService(new RedisReadCache(config, redis), config.contextIndex,
+                                             config.contextEpochs, config.contextEpochGrace,
+                                             config.perKeyFallback(), codec, config.statsInterval)
+                   : new RedisStorageService(redis, config.contextIndex, config.contextEpochs,
+                                             config.contextEpochGrace, config.perKeyFallback(), codec,
+                                             config.statsInterval);
     }
 }
 
@@ -209,3 +533,25 @@ extern "C" int MCEXT_EXPORTS xmltooling_extension_init(void*) {
 extern "C" void MCEXT_EXPORTS xmltooling_extension_term() {
     XMLToolingConfig::getConfig().StorageServiceManager.deregisterFactory("REDIS");
 }
+
+/**
+ * Pull API of the statistics of the plugin, for monitoring: copies the report
+ * of RedisStats into buffer, truncated to size - 1 characters and always NUL
+ * terminated, and returns the length of the whole report, like snprintf. A
+ * size of 0 only returns the length.
+ */
+extern "C" size_t MCEXT_EXPORTS spredis_stats_report(char* buffer, size_t size) {
+    try {
+        const std::string report = RedisStats::getInstance().report();
+        if (size != 0) {
+            const size_t copied = std::min(report.size(), size - 1);
+            std::memcpy(buffer, report.data(), copied);
+            buffer[copied] = '\0';
+        }
+        return report.size();
+    } catch (...) {
+        // exceptions must not leave a C function
+        if (size != 0) buffer[0] = '\0';
+        return 0;
+    }
+}
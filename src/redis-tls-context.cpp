@@ -0,0 +1,144 @@
+/**
+ * Licensed to the University Corporation for Advanced Internet
+ * Development, Inc. (UCAID) under one or more contributor license
+ * agreements. See the NOTICE file distributed with this work for
+ * additional information regarding copyright ownership.
+ *
+ * UCAID licenses this file to you under the Apache License,
+ * Version 2.0 (the "License"); you may not use this file except
+ * in compliance with the License. You may obtain a copy of the
+ * License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+ */
+
+/**
+ * redis-tls-context.cpp
+ *
+ * Implementation of the RedisTlsContext type.
+ */
+
+#include "redis-tls-context.h"
+
+#ifdef SHIBSP_HAVE_HIREDIS_SSL
+#include "redis.h"
+
+#include <hiredis/hiredis_ssl.h>
+#include <openssl/err.h>
+#include <xmltooling/exceptions.h>
+
+using namespace xmltooling;
+
+namespace {
+    /**
+     * Returns the description of the last OpenSSL error of the thread, and
+     * clears the error queue.
+     */
+    std::string lastSslError() {
+        const unsigned long code = ERR_get_error();
+        ERR_clear_error();
+        if (code == 0) return "unknown error";
+
+        char buffer[256];
+        ERR_error_string_n(code, buffer, sizeof(buffer));
+        return buffer;
+    }
+}
+
+spredis::RedisTlsContext::RedisTlsContext(const RedisTlsConfig& config)
+    : m_ctx(SSL_CTX_new(TLS_client_method())),
+      m_session_mutex(Mutex::create()),
+      m_sessions() {
+    if (m_ctx == NULL)
+        throw XMLToolingException("Cannot create TLS context: " + lastSslError());
+
+    // the same verification hiredis performs with its own contexts
+    SSL_CTX_set_verify(m_ctx, SSL_VERIFY_PEER, NULL);
+
+    const int loaded = config.caBundleOrNull() || config.caDirectoryOrNull()
+                           ? SSL_CTX_load_verify_locations(m_ctx, config.caBundleOrNull(), config.caDirectoryOrNull())
+                           : SSL_CTX_set_default_verify_paths(m_ctx);
+    if (loaded != 1) {
+        const std::string error = lastSslError();
+        SSL_CTX_free(m_ctx);
+        throw XMLToolingException("Cannot load the trusted CA certificates of the TLS context: " + error);
+    }
+
+    if (config.clientCertOrNull() && config.clientKeyOrNull()) {
+        if (SSL_CTX_use_certificate_chain_file(m_ctx, config.clientCertOrNull()) != 1) {
+            const std::string error = lastSslError();
+            SSL_CTX_free(m_ctx);
+            throw XMLToolingException("Cannot load the client certificate of the TLS context: " + error);
+        }
+        if (SSL_CTX_use_PrivateKey_file(m_ctx, config.clientKeyOrNull(), SSL_FILETYPE_PEM) != 1) {
+            const std::string error = lastSslError();
+            SSL_CTX_free(m_ctx);
+            throw XMLToolingException("Cannot load the client key of the TLS context: " + error);
+        }
+    }
+
+    // sessions are kept by endpoint here instead of the internal cache of
+    // OpenSSL, which is only used by servers for lookups
+    SSL_CTX_set_session_cache_mode(m_ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(m_ctx, &RedisTlsContext::sessionCreated);
+    SSL_CTX_set_app_data(m_ctx, this);
+}
+
+spredis::RedisTlsContext::~RedisTlsContext() {
+    for (session_map_type::iterator it = m_sessions.begin(); it != m_sessions.end(); ++it) {
+        if (it->second) SSL_SESSION_free(it->second);
+    }
+    SSL_CTX_free(m_ctx);
+}
+
+int spredis::RedisTlsContext::handshake(redisContext* const redis,
+                                        const std::string& host,
+                                        const int port,
+                                        bool* const out_resumed) {
+    SSL* const ssl = SSL_new(m_ctx);
+    if (ssl == NULL) {
+        const std::string error = "cannot create TLS connection: " + lastSslError();
+        redis->err = REDIS_ERR_OTHER;
+        snprintf(redis->errstr, sizeof(redis->errstr), "%s", error.c_str());
+        return REDIS_ERR;
+    }
+
+    {
+        const Lock lock(m_session_mutex);
+        session_map_type::iterator entry =
+                m_sessions.insert(std::make_pair(host + ":" + std::to_string(port),
+                                                 static_cast<SSL_SESSION*>(NULL))).first;
+        // a failed resumption falls back to a full handshake by itself
+        if (entry->second) SSL_set_session(ssl, entry->second);
+        // sessions may be issued at any time during the connection (TLS 1.3
+        // sends them after the handshake), see sessionCreated
+        SSL_set_app_data(ssl, &*entry);
+    }
+
+    // the connection owns the SSL object once the handshake succeeded
+    if (redisInitiateSSL(redis, ssl) != REDIS_OK) {
+        SSL_free(ssl);
+        return REDIS_ERR;
+    }
+
+    if (out_resumed) *out_resumed = SSL_session_reused(ssl) == 1;
+    return REDIS_OK;
+}
+
+int spredis::RedisTlsContext::sessionCreated(SSL* const ssl, SSL_SESSION* const session) {
+    RedisTlsContext* const self = static_cast<RedisTlsContext*>(SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl)));
+    session_map_type::value_type* const entry = static_cast<session_map_type::value_type*>(SSL_get_app_data(ssl));
+    if (self == NULL || entry == NULL) return 0;
+
+    const Lock lock(self->m_session_mutex);
+    if (entry->second) SSL_SESSION_free(entry->second);
+    entry->second = session;
+    return 1; // the reference to the session is kept
+}
+#endif
@@ -0,0 +1,94 @@
+/**
+ * Licensed to the University Corporation for Advanced Internet
+ * Development, Inc. (UCAID) under one or more contributor license
+ * agreements. See the NOTICE file distributed with this work for
+ * additional information regarding copyright ownership.
+ *
+ * UCAID licenses this file to you under the Apache License,
+ * Version 2.0 (the "License"); you may not use this file except
+ * in compliance with the License. You may obtain a copy of the
+ * License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+ */
+
+/**
+ * redis-tls-context.h
+ *
+ * Provides the RedisTlsContext class, the TLS client context shared by every
+ * connection made with the same TLS configuration.
+ */
+
+#ifndef REDIS_TLS_CONTEXT_H
+#define REDIS_TLS_CONTEXT_H
+
+#include <map>
+#include <string>
+
+#include "common.h"
+
+// XXX Win32 - special config headers
+#include "config.h"
+
+#ifdef SHIBSP_HAVE_HIREDIS_SSL
+#include <boost/scoped_ptr.hpp>
+#include <hiredis/hiredis.h>
+#include <openssl/ssl.h>
+#include <xmltooling/util/Threads.h>
+
+namespace spredis {
+    class RedisTlsConfig;
+
+    /**
+     * An OpenSSL client context built once from a TLS configuration: the CA
+     * certificates and the client certificate and key are loaded from disk
+     * when the configuration is read, not for every connection.
+     *
+     * The context also remembers the last TLS session established with each
+     * endpoint, and offers it for resumption on the next handshake with the
+     * same endpoint, so new pooled connections and reconnects after a lost
+     * connection skip the full handshake whenever the server still accepts
+     * the session.
+     */
+    class SHIBSP_HIDDEN RedisTlsContext SHIBSP_FINAL {
+        MAKE_NONCOPYABLE(RedisTlsContext);
+
+    public:
+        /**
+         * Creates the context, or throws an XMLToolingException if the
+         * certificates or the key cannot be loaded.
+         */
+        explicit RedisTlsContext(const RedisTlsConfig& config);
+
+        ~RedisTlsContext();
+
+        /**
+         * Performs the TLS handshake on the connected context, and makes the
+         * context use TLS from now on. If out_resumed is not NULL, it is set
+         * to whether a previous session was resumed.
+         *
+         * @return REDIS_OK, or REDIS_ERR with the error set on the context.
+         */
+        int handshake(redisContext* redis, const std::string& host, int port, bool* out_resumed = NULL);
+
+    private:
+        typedef std::map<std::string, SSL_SESSION*> session_map_type;
+
+        static int sessionCreated(SSL* ssl, SSL_SESSION* session);
+
+        SSL_CTX* m_ctx;
+        boost::scoped_ptr<xmltooling::Mutex> m_session_mutex;
+        // the last session of each endpoint; entries are never removed, so
+        // connections can refer to their own while they are open
+        session_map_type m_sessions;
+    };
+}
+#endif
+
+#endif //REDIS_TLS_CONTEXT_H
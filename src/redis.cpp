@@ -26,13 +26,17 @@
 
 
 #include "redis.h"
+#include "redis-async-engine.h"
+#include "redis-tls-context.h"
 
 // XXX Win32 - special config headers
 #include "config.h"
 
 #include <algorithm>
+#include <cstdlib>
 #include <hiredis/hiredis.h>
 #include <xmltooling/exceptions.h>
+#include <xmltooling/logging.h>
 
 #ifdef SHIBSP_HAVE_HIREDIS_SSL
 #include <hiredis/hiredis_ssl.h>
@@ -44,18 +48,63 @@ using namespace xmltooling;
 namespace {
     const XMLCh host[] = UNICODE_LITERAL_4(h, o, s, t);
     const XMLCh port[] = UNICODE_LITERAL_4(p, o, r, t);
+    const XMLCh socketPath[] = UNICODE_LITERAL_10(s, o, c, k, e, t, P, a, t, h);
     const XMLCh prefix[] = UNICODE_LITERAL_6(p, r, e, f, i, x);
+    const XMLCh hashTag[] = UNICODE_LITERAL_7(h, a, s, h, T, a, g);
+    const XMLCh hashTagBuckets[] = UNICODE_LITERAL_14(h, a, s, h, T, a, g, B, u, c, k, e, t, s);
+    const XMLCh hashTagFallback[] = UNICODE_LITERAL_15(h, a, s, h, T, a, g, F, a, l, l, b, a, c, k);
     const XMLCh connectTimeout[] = UNICODE_LITERAL_14(c, o, n, n, e, c, t, T, i, m, e, o, u, t);
     const XMLCh commandTimeout[] = UNICODE_LITERAL_14(c, o, m, m, a, n, d, T, i, m, e, o, u, t);
+    const XMLCh tcpKeepAlive[] = UNICODE_LITERAL_12(t, c, p, K, e, e, p, A, l, i, v, e);
+    const XMLCh tcpNoDelay[] = UNICODE_LITERAL_10(t, c, p, N, o, D, e, l, a, y);
+    const XMLCh socketSendBuffer[] = UNICODE_LITERAL_16(s, o, c, k, e, t, S, e, n, d, B, u, f, f, e, r);
+    const XMLCh socketReceiveBuffer[] = UNICODE_LITERAL_19(s, o, c, k, e, t, R, e, c, e, i, v, e, B, u, f, f, e, r);
     const XMLCh nonBlocking[] = UNICODE_LITERAL_11(n, o, n, B, l, o, c, k, i, n, g);
+    const XMLCh ioThreads[] = UNICODE_LITERAL_9(i, o, T, h, r, e, a, d, s);
     const XMLCh authUser[] = UNICODE_LITERAL_8(a, u, t, h, U, s, e, r);
     const XMLCh authPassword[] = UNICODE_LITERAL_12(a, u, t, h, P, a, s, s, w, o, r, d);
     const XMLCh retryAmount[] = UNICODE_LITERAL_11(r, e, t, r, y, A, m, o, u, n, t);
     const XMLCh retryBaseTime[] = UNICODE_LITERAL_13(r, e, t, r, y, B, a, s, e, t, i, m, e);
     const XMLCh retryMaxTime[] = UNICODE_LITERAL_12(r, e, t, r, y, M, a, x, t, i, m, e);
+    const XMLCh operationTimeout[] = UNICODE_LITERAL_16(o, p, e, r, a, t, i, o, n, T, i, m, e, o, u, t);
+    const XMLCh retryBudget[] = UNICODE_LITERAL_11(r, e, t, r, y, B, u, d, g, e, t);
+    const XMLCh breakerThreshold[] = UNICODE_LITERAL_16(b, r, e, a, k, e, r, T, h, r, e, s, h, o, l, d);
+    const XMLCh breakerCooldown[] = UNICODE_LITERAL_15(b, r, e, a, k, e, r, C, o, o, l, d, o, w, n);
+    const XMLCh poolSize[] = UNICODE_LITERAL_8(p, o, o, l, S, i, z, e);
+    const XMLCh poolIdleTimeout[] = UNICODE_LITERAL_15(p, o, o, l, I, d, l, e, T, i, m, e, o, u, t);
+    const XMLCh poolWaitTimeout[] = UNICODE_LITERAL_15(p, o, o, l, W, a, i, t, T, i, m, e, o, u, t);
+    const XMLCh poolWarmup[] = UNICODE_LITERAL_10(p, o, o, l, W, a, r, m, u, p);
+    const XMLCh useScripts[] = UNICODE_LITERAL_10(u, s, e, S, c, r, i, p, t, s);
+    const XMLCh layout[] = UNICODE_LITERAL_6(l, a, y, o, u, t);
+    const XMLCh autoPipeline[] = UNICODE_LITERAL_12(a, u, t, o, P, i, p, e, l, i, n, e);
+    const XMLCh pipelineBatchSize[] = UNICODE_LITERAL_17(p, i, p, e, l, i, n, e, B, a, t, c, h, S, i, z, e);
+    const XMLCh clientCache[] = UNICODE_LITERAL_11(c, l, i, e, n, t, C, a, c, h, e);
+    const XMLCh clientCacheSize[] = UNICODE_LITERAL_15(c, l, i, e, n, t, C, a, c, h, e, S, i, z, e);
+    const XMLCh clientCacheTtl[] = UNICODE_LITERAL_14(c, l, i, e, n, t, C, a, c, h, e, T, t, l);
+    const XMLCh coalesceReads[] = UNICODE_LITERAL_13(c, o, a, l, e, s, c, e, R, e, a, d, s);
+    const XMLCh contextIndex[] = UNICODE_LITERAL_12(c, o, n, t, e, x, t, I, n, d, e, x);
+    const XMLCh contextEpochs[] = UNICODE_LITERAL_13(c, o, n, t, e, x, t, E, p, o, c, h, s);
+    const XMLCh contextEpochGrace[] = UNICODE_LITERAL_17(c, o, n, t, e, x, t, E, p, o, c, h, G, r, a, c, e);
+    const XMLCh scanCount[] = UNICODE_LITERAL_9(s, c, a, n, C, o, u, n, t);
+    const XMLCh readFrom[] = UNICODE_LITERAL_8(r, e, a, d, F, r, o, m);
+    const XMLCh hedgePercentile[] = UNICODE_LITERAL_15(h, e, d, g, e, P, e, r, c, e, n, t, i, l, e);
+    const XMLCh hedgeWorkers[] = UNICODE_LITERAL_12(h, e, d, g, e, W, o, r, k, e, r, s);
+    const XMLCh refreshInterval[] = UNICODE_LITERAL_15(r, e, f, r, e, s, h, I, n, t, e, r, v, a, l);
+    const XMLCh scanWorkers[] = UNICODE_LITERAL_11(s, c, a, n, W, o, r, k, e, r, s);
+    const XMLCh topologySnapshot[] = UNICODE_LITERAL_16(t, o, p, o, l, o, g, y, S, n, a, p, s, h, o, t);
+    const XMLCh compression[] = UNICODE_LITERAL_11(c, o, m, p, r, e, s, s, i, o, n);
+    const XMLCh compressionThreshold[] = UNICODE_LITERAL_20(c, o, m, p, r, e, s, s, i, o, n, T, h, r, e, s, h, o, l, d);
+    const XMLCh healthCheckInterval[] = UNICODE_LITERAL_19(h, e, a, l, t, h, C, h, e, c, k, I, n, t, e, r, v, a, l);
+    const XMLCh statsInterval[] = UNICODE_LITERAL_13(s, t, a, t, s, I, n, t, e, r, v, a, l);
 
     const XMLCh Cluster[] = UNICODE_LITERAL_7(C, l, u, s, t, e, r);
 
+    const XMLCh Shards[] = UNICODE_LITERAL_6(S, h, a, r, d, s);
+
+    const XMLCh Sentinel[] = UNICODE_LITERAL_8(S, e, n, t, i, n, e, l);
+    const XMLCh masterName[] = UNICODE_LITERAL_10(m, a, s, t, e, r, N, a, m, e);
+    const XMLCh password[] = UNICODE_LITERAL_8(p, a, s, s, w, o, r, d);
+
     const XMLCh Host[] = UNICODE_LITERAL_4(H, o, s, t);
 
     const XMLCh Tls[] = UNICODE_LITERAL_3(T, l, s);
@@ -64,18 +113,20 @@ namespace {
     const XMLCh caBundle[] = UNICODE_LITERAL_8(c, a, B, u, n, d, l, e);
     const XMLCh caDirectory[] = UNICODE_LITERAL_11(c, a, D, i, r, e, c, t, o, r, y);
 
-    std::vector<spredis::ClusterNode> readClusterConfig(const DOMElement* const e,
-                                                        const unsigned short defaultPort) {
+    /**
+     * Reads the Host children of a Cluster, Sentinel or Shards element, the
+     * parent being named by parentName in error messages.
+     */
+    std::vector<spredis::ClusterNode> readHosts(const DOMElement* const parent,
+                                                const char* const parentName,
+                                                const unsigned short defaultPort) {
         std::vector<spredis::ClusterNode> nodes;
 
-        // check if cluster config, otherwise return empty array
-        const DOMElement* cluster = XMLHelper::getFirstChildElement(e, Cluster);
-        if (cluster == NULL) return nodes;
-
-        // check Cluster children; ensure at least one is present
-        const DOMNodeList* const hosts = cluster->getChildNodes();
+        // check children; ensure at least one is present
+        const DOMNodeList* const hosts = parent->getChildNodes();
         if (hosts->getLength() == 0)
-            throw XMLToolingException("At least one Host node must be specified in Cluster configuration");
+            throw XMLToolingException("At least one Host node must be specified in " + std::string(parentName)
+                                      + " configuration");
 
         for (XMLSize_t i = 0; i < hosts->getLength(); ++i) {
             const DOMNode* host = hosts->item(i);
@@ -93,7 +144,7 @@ namespace {
                 if (isWhitespace) continue;
             }
 
-            // ensure only Host nodes are present as children of Cluster
+            // ensure only Host nodes are present as children
             if (host->getNodeType() != DOMNode::ELEMENT_NODE
                 || XMLString::compareString(host->getLocalName(), Host) != 0) {
                 char* buf = XMLString::transcode(host->getNodeName());
@@ -101,7 +152,8 @@ namespace {
                 XMLString::release(&buf);
 
                 throw XMLToolingException(
-                    "Only Host nodes may be present as children of Cluster: found `" + hostName + "'");
+                    "Only Host nodes may be present as children of " + std::string(parentName) + ": found `"
+                    + hostName + "'");
             }
 
             const DOMElement* const element = dynamic_cast<const DOMElement*>(host);
@@ -119,6 +171,112 @@ namespace {
         return nodes;
     }
 
+    std::vector<spredis::ClusterNode> readClusterConfig(const DOMElement* const e,
+                                                        const unsigned short defaultPort) {
+        // check if cluster config, otherwise return empty array
+        const DOMElement* cluster = XMLHelper::getFirstChildElement(e, Cluster);
+        if (cluster == NULL) return std::vector<spredis::ClusterNode>();
+
+        if (XMLHelper::getFirstChildElement(e, Sentinel) != NULL)
+            throw XMLToolingException("Cluster and Sentinel configurations are mutually exclusive");
+        return readHosts(cluster, "Cluster", defaultPort);
+    }
+
+    std::vector<spredis::ClusterNode> readShardConfig(const DOMElement* const e,
+                                                      const unsigned short defaultPort) {
+        // check if sharded config, otherwise return empty array
+        const DOMElement* shards = XMLHelper::getFirstChildElement(e, Shards);
+        if (shards == NULL) return std::vector<spredis::ClusterNode>();
+
+        if (XMLHelper::getFirstChildElement(e, Cluster) != NULL
+            || XMLHelper::getFirstChildElement(e, Sentinel) != NULL)
+            throw XMLToolingException("Shards cannot be combined with Cluster or Sentinel configurations");
+        return readHosts(shards, "Shards", defaultPort);
+    }
+
+    std::string readSocketPath(const DOMElement* const e) {
+        const std::string path = XMLHelper::getAttrString(e, "", ::socketPath);
+        if (path.empty()) return path;
+
+        if (XMLHelper::getFirstChildElement(e, Cluster) != NULL
+            || XMLHelper::getFirstChildElement(e, Sentinel) != NULL
+            || XMLHelper::getFirstChildElement(e, Shards) != NULL)
+            throw XMLToolingException("socketPath cannot be combined with Cluster, Sentinel or Shards configurations");
+        if (XMLHelper::getFirstChildElement(e, Tls) != NULL)
+            throw XMLToolingException("socketPath cannot be combined with TLS: Unix domain sockets are not encrypted");
+        return path;
+    }
+
+    std::vector<spredis::ClusterNode> readSentinelConfig(const DOMElement* const e) {
+        // check if sentinel config, otherwise return empty array
+        const DOMElement* sentinel = XMLHelper::getFirstChildElement(e, Sentinel);
+        if (sentinel == NULL) return std::vector<spredis::ClusterNode>();
+
+        if (XMLHelper::getAttrString(sentinel, "", ::masterName).empty())
+            throw XMLToolingException("The masterName of the Sentinel configuration must be set");
+        return readHosts(sentinel, "Sentinel",
+                         static_cast<unsigned short>(XMLHelper::getAttrInt(sentinel, 26379, ::port)));
+    }
+
+    spredis::RedisConfig::RecordLayout readLayout(const DOMElement* const e) {
+        const std::string value = XMLHelper::getAttrString(e, "keys", ::layout);
+        if (value == "keys") return spredis::RedisConfig::LAYOUT_KEYS;
+        if (value == "hash") return spredis::RedisConfig::LAYOUT_HASH;
+
+        throw XMLToolingException("Unknown record layout `" + value + "': must be either `keys' or `hash'");
+    }
+
+    spredis::HashTagStrategy readHashTag(const DOMElement* const e) {
+        const std::string value = XMLHelper::getAttrString(e, "key", ::hashTag);
+        if (value == "key") return spredis::HASH_TAG_KEY;
+        if (value == "context") return spredis::HASH_TAG_CONTEXT;
+        if (value == "bucketed") return spredis::HASH_TAG_BUCKETED;
+
+        throw XMLToolingException("Unknown hash tag strategy `" + value
+                                  + "': must be one of `key', `context' or `bucketed'");
+    }
+
+    spredis::RedisConfig::ReadPreference readReadPreference(const DOMElement* const e) {
+        const std::string value = XMLHelper::getAttrString(e, "master", ::readFrom);
+        if (value == "master") return spredis::RedisConfig::READ_MASTER;
+        if (value == "replica") return spredis::RedisConfig::READ_PREFER_REPLICA;
+        if (value == "nearest") return spredis::RedisConfig::READ_NEAREST;
+
+        throw XMLToolingException("Unknown read preference `" + value
+                                  + "': must be one of `master', `replica' or `nearest'");
+    }
+
+    double readHedgePercentile(const DOMElement* const e) {
+        const std::string value = XMLHelper::getAttrString(e, "0", ::hedgePercentile);
+        char* end = NULL;
+        const double percentile = std::strtod(value.c_str(), &end);
+        if (end == value.c_str() || *end != '\0' || percentile < 0 || percentile >= 100)
+            throw XMLToolingException("Invalid hedge percentile `" + value
+                                      + "': must be a number from 0 (disabled) up to, but not including, 100");
+
+        return percentile;
+    }
+
+    spredis::RedisConfig::Compression readCompression(const DOMElement* const e) {
+        const std::string value = XMLHelper::getAttrString(e, "none", ::compression);
+        if (value == "none") return spredis::RedisConfig::COMPRESS_NONE;
+        if (value == "lz4") {
+#ifndef SHIBSP_HAVE_LZ4
+            throw XMLToolingException("LZ4 compression is configured but LZ4 support was not compiled in this daemon.");
+#endif
+            return spredis::RedisConfig::COMPRESS_LZ4;
+        }
+        if (value == "zstd") {
+#ifndef SHIBSP_HAVE_ZSTD
+            throw XMLToolingException("zstd compression is configured but zstd support was not compiled in this daemon.");
+#endif
+            return spredis::RedisConfig::COMPRESS_ZSTD;
+        }
+
+        throw XMLToolingException("Unknown compression `" + value
+                                  + "': must be one of `none', `lz4' or `zstd'");
+    }
+
     std::string attributeIfElementExists(const DOMElement* e,
                                          const char* def, const XMLCh* name) {
         if (!e) return def;
@@ -146,6 +304,7 @@ spredis::RedisTlsConfig::RedisTlsConfig(const DOMElement* e)
             "If you don't want to use mTLS, explicitly set them to the empty string.");
 
     redisInitOpenSSL();
+    m_context.reset(new RedisTlsContext(*this));
 #endif
 }
 
@@ -154,11 +313,34 @@ spredis::RedisConfig::RedisConfig(const DOMElement* const e)
       port(static_cast<unsigned short>(
           XMLHelper::getAttrInt(e, 6379, ::port)
       )),
+      socketPath(readSocketPath(e)),
       prefix(XMLHelper::getAttrString(e, "", ::prefix)),
+      hashTag(readHashTag(e)),
+      hashTagBuckets(static_cast<unsigned int>(
+          std::max(1, XMLHelper::getAttrInt(e, 16, ::hashTagBuckets))
+      )),
+      hashTagFallback(XMLHelper::getAttrBool(e, true, ::hashTagFallback)),
       initialNodes(readClusterConfig(e, port)),
+      sentinelNodes(readSentinelConfig(e)),
+      sentinelMaster(attributeIfElementExists(XMLHelper::getFirstChildElement(e, Sentinel), "", ::masterName)),
+      sentinelPassword(attributeIfElementExists(XMLHelper::getFirstChildElement(e, Sentinel), "", ::password)),
+      shardNodes(readShardConfig(e, port)),
       connectTimeoutMillisec(XMLHelper::getAttrInt(e, 0, connectTimeout)),
       commandTimeoutMillisec(XMLHelper::getAttrInt(e, 0, commandTimeout)),
+      tcpKeepAlive(static_cast<unsigned int>(
+          std::max(0, XMLHelper::getAttrInt(e, 0, ::tcpKeepAlive))
+      )),
+      tcpNoDelay(XMLHelper::getAttrBool(e, true, ::tcpNoDelay)),
+      socketSendBuffer(static_cast<unsigned int>(
+          std::max(0, XMLHelper::getAttrInt(e, 0, ::socketSendBuffer))
+      )),
+      socketReceiveBuffer(static_cast<unsigned int>(
+          std::max(0, XMLHelper::getAttrInt(e, 0, ::socketReceiveBuffer))
+      )),
       nonBlocking(XMLHelper::getAttrBool(e, false, ::nonBlocking)),
+      ioThreads(static_cast<unsigned int>(
+          std::max(1, XMLHelper::getAttrInt(e, 1, ::ioThreads))
+      )),
       authnUsername(XMLHelper::getAttrString(e, "", authUser)),
       authnPassword(XMLHelper::getAttrString(e, "", authPassword)),
       maxRetries(static_cast<unsigned int>(
@@ -170,5 +352,81 @@ spredis::RedisConfig::RedisConfig(const DOMElement* const e)
       maxWait(static_cast<unsigned int>(
           XMLHelper::getAttrInt(e, 0, retryMaxTime)
       )),
-      tls(XMLHelper::getFirstChildElement(e, Tls)) {
+      operationTimeout(static_cast<unsigned int>(
+          std::max(0, XMLHelper::getAttrInt(e, 10000, ::operationTimeout))
+      )),
+      retryBudget(static_cast<unsigned int>(
+          std::max(0, XMLHelper::getAttrInt(e, 20, ::retryBudget))
+      )),
+      breakerThreshold(static_cast<unsigned int>(
+          std::max(0, XMLHelper::getAttrInt(e, 5, ::breakerThreshold))
+      )),
+      breakerCooldown(static_cast<unsigned int>(
+          std::max(0, XMLHelper::getAttrInt(e, 2000, ::breakerCooldown))
+      )),
+      poolSize(static_cast<unsigned int>(
+          std::max(1, XMLHelper::getAttrInt(e, 4, ::poolSize))
+      )),
+      poolIdleTimeout(static_cast<unsigned int>(
+          std::max(0, XMLHelper::getAttrInt(e, 300, ::poolIdleTimeout))
+      )),
+      poolWaitTimeout(static_cast<unsigned int>(
+          std::max(0, XMLHelper::getAttrInt(e, 5, ::poolWaitTimeout))
+      )),
+      poolWarmup(static_cast<unsigned int>(
+          std::max(1, XMLHelper::getAttrInt(e, 1, ::poolWarmup))
+      )),
+      useScripts(XMLHelper::getAttrBool(e, true, ::useScripts)),
+      layout(readLayout(e)),
+      autoPipeline(XMLHelper::getAttrBool(e, false, ::autoPipeline)),
+      pipelineBatchSize(static_cast<unsigned int>(
+          std::max(1, XMLHelper::getAttrInt(e, 64, ::pipelineBatchSize))
+      )),
+      clientCache(XMLHelper::getAttrBool(e, false, ::clientCache)),
+      clientCacheSize(static_cast<unsigned int>(
+          std::max(1, XMLHelper::getAttrInt(e, 16384, ::clientCacheSize))
+      )),
+      clientCacheTtl(static_cast<unsigned int>(
+          std::max(0, XMLHelper::getAttrInt(e, 60, ::clientCacheTtl))
+      )),
+      coalesceReads(XMLHelper::getAttrBool(e, false, ::coalesceReads)),
+      contextIndex(XMLHelper::getAttrBool(e, false, ::contextIndex)),
+      contextEpochs(XMLHelper::getAttrBool(e, false, ::contextEpochs)),
+      contextEpochGrace(static_cast<unsigned int>(
+          std::max(0, XMLHelper::getAttrInt(e, 86400, ::contextEpochGrace))
+      )),
+      scanCount(static_cast<unsigned int>(
+          std::max(1, XMLHelper::getAttrInt(e, 1000, ::scanCount))
+      )),
+      readFrom(readReadPreference(e)),
+      hedgePercentile(readHedgePercentile(e)),
+      hedgeWorkers(static_cast<unsigned int>(
+          std::max(1, XMLHelper::getAttrInt(e, 4, ::hedgeWorkers))
+      )),
+      refreshInterval(static_cast<unsigned int>(
+          std::max(0, XMLHelper::getAttrInt(e, 60, ::refreshInterval))
+      )),
+      healthCheckInterval(static_cast<unsigned int>(
+          std::max(0, XMLHelper::getAttrInt(e, 5, ::healthCheckInterval))
+      )),
+      scanWorkers(static_cast<unsigned int>(
+          std::max(1, XMLHelper::getAttrInt(e, 4, ::scanWorkers))
+      )),
+      topologySnapshot(XMLHelper::getAttrString(e, "", ::topologySnapshot)),
+      compression(readCompression(e)),
+      compressionThreshold(static_cast<unsigned int>(
+          std::max(0, XMLHelper::getAttrInt(e, 1024, ::compressionThreshold))
+      )),
+      statsInterval(static_cast<unsigned int>(
+          std::max(0, XMLHelper::getAttrInt(e, 0, ::statsInterval))
+      )),
+      tls(XMLHelper::getFirstChildElement(e, Tls)),
+      m_async_engine() {
+#ifdef SPREDIS_HAVE_ASYNC_ENGINE
+    if (nonBlocking) m_async_engine.reset(new RedisAsyncEngine(ioThreads));
+#else
+    if (nonBlocking)
+        logging::Category::getInstance("XMLTooling.StorageService.REDIS")
+                .warn("nonBlocking requires hiredis version 1.1.0 and above, connections stay blocking");
+#endif
 }
@@ -31,6 +31,7 @@
 #include <string>
 #include <vector>
 
+#include <boost/shared_ptr.hpp>
 #include <xercesc/dom/DOMElement.hpp>
 #include <xmltooling/util/XMLHelper.h>
 
@@ -40,6 +41,8 @@
 
 namespace spredis {
     class RedisConnection;
+    class RedisTlsContext;
+    class RedisAsyncEngine;
 
     class SHIBSP_HIDDEN RedisTlsConfig SHIBSP_FINAL {
     public:
@@ -72,6 +75,15 @@ namespace spredis {
         }
 
         explicit operator bool() const { return enabled; }
+
+        /**
+         * The TLS context built from this configuration, shared by every copy
+         * of it, or NULL if TLS is not enabled.
+         */
+        const boost::shared_ptr<RedisTlsContext>& context() const { return m_context; }
+
+    private:
+        boost::shared_ptr<RedisTlsContext> m_context;
     };
 
     class SHIBSP_HIDDEN RedisConfig SHIBSP_FINAL {
@@ -82,29 +94,143 @@ namespace spredis {
             AUTH_ACL_STYLE
         };
 
+        enum RecordLayout {
+            LAYOUT_KEYS,
+            LAYOUT_HASH
+        };
+
+        enum ReadPreference {
+            READ_MASTER,
+            READ_PREFER_REPLICA,
+            READ_NEAREST
+        };
+
+        enum Compression {
+            COMPRESS_NONE,
+            COMPRESS_LZ4,
+            COMPRESS_ZSTD
+        };
+
         const std::string host;
         const unsigned short port;
+        const std::string socketPath;
         const std::string prefix;
+        const HashTagStrategy hashTag;
+        const unsigned int hashTagBuckets;
+        const bool hashTagFallback;
         const std::vector<ClusterNode> initialNodes;
+        const std::vector<ClusterNode> sentinelNodes;
+        const std::string sentinelMaster;
+        const std::string sentinelPassword;
+        const std::vector<ClusterNode> shardNodes;
         const int connectTimeoutMillisec;
         const int commandTimeoutMillisec;
+        const unsigned int tcpKeepAlive;
+        const bool tcpNoDelay;
+        const unsigned int socketSendBuffer;
+        const unsigned int socketReceiveBuffer;
         const bool nonBlocking;
+        const unsigned int ioThreads;
         const std::string authnUsername;
         const std::string authnPassword;
         const unsigned int maxRetries;
         const unsigned int baseWait;
         const unsigned int maxWait;
+        const unsigned int operationTimeout;
+        const unsigned int retryBudget;
+        const unsigned int breakerThreshold;
+        const unsigned int breakerCooldown;
+        const unsigned int poolSize;
+        const unsigned int poolIdleTimeout;
+        const unsigned int poolWaitTimeout;
+        const unsigned int poolWarmup;
+        const bool useScripts;
+        const RecordLayout layout;
+        const bool autoPipeline;
+        const unsigned int pipelineBatchSize;
+        const bool clientCache;
+        const unsigned int clientCacheSize;
+        const unsigned int clientCacheTtl;
+        const bool coalesceReads;
+        const bool contextIndex;
+        const bool contextEpochs;
+        const unsigned int contextEpochGrace;
+        const unsigned int scanCount;
+        const ReadPreference readFrom;
+        const double hedgePercentile;
+        const unsigned int hedgeWorkers;
+        const unsigned int refreshInterval;
+        const unsigned int healthCheckInterval;
+        const unsigned int scanWorkers;
+        const std::string topologySnapshot;
+        const Compression compression;
+        const unsigned int compressionThreshold;
+        const unsigned int statsInterval;
         const RedisTlsConfig tls;
 
         explicit RedisConfig(const xercesc::DOMElement* e);
 
+        /**
+         * The I/O threads of the asynchronous connections made with this
+         * configuration, shared by every copy of it, or NULL if nonBlocking is
+         * not set or not supported.
+         */
+        const boost::shared_ptr<RedisAsyncEngine>& asyncEngine() const { return m_async_engine; }
+
         bool clustered() const { return !initialNodes.empty(); }
 
+        bool sentinelManaged() const { return !sentinelNodes.empty(); }
+
+        bool sharded() const { return !shardNodes.empty(); }
+
+        /**
+         * Whether records missing under the configured hash tag are looked
+         * for under the per-key hash tag, which they were written with before
+         * it was configurable.
+         */
+        bool perKeyFallback() const { return hashTag != HASH_TAG_KEY && hashTagFallback; }
+
+        /**
+         * Whether every record of a context is known to be in the hash-slots
+         * of the context, so the context is only scanned on the nodes serving
+         * these.
+         */
+        bool contextsSlotted() const { return hashTag != HASH_TAG_KEY && !hashTagFallback; }
+
         AuthStyle authScheme() const {
             if (authnPassword.empty()) return AUTH_DISABLED;
             if (authnUsername.empty()) return AUTH_DEFAULT_STYLE;
             return AUTH_ACL_STYLE;
         }
+
+    private:
+        boost::shared_ptr<RedisAsyncEngine> m_async_engine;
+    };
+
+    /**
+     * The epoch of a context, stored as a hash under `epoch.of:' (e.g.
+     * `epoch.of:{context:prefix}'). The generation is incremented by every
+     * write of a record of the context and by every context operation, so
+     * records stamped with an older generation than the last context
+     * operation are known to predate it.
+     */
+    struct SHIBSP_HIDDEN ContextEpoch {
+        ContextEpoch()
+            : generation(0),
+              deleted(0),
+              expired(0),
+              expiration(0),
+              horizon(0) {
+        }
+
+        long long generation;
+        // the generation of the last deleteContext, 0 if none
+        long long deleted;
+        // the generation of the last updateContext, and its expiration
+        long long expired;
+        time_t expiration;
+        // no record of the context is kept by Redis for a shorter time
+        time_t horizon;
     };
 
     /**
@@ -113,17 +239,27 @@ namespace spredis {
      */
     class SHIBSP_HIDDEN Redis {
         const std::string m_prefix;
+        const HashTagStrategy m_hash_tag;
+        const unsigned int m_hash_tag_buckets;
 
     public:
-        explicit Redis(const std::string& m_prefix)
-            : m_prefix(m_prefix) {
+        explicit Redis(const std::string& m_prefix,
+                       const HashTagStrategy hashTag = HASH_TAG_KEY,
+                       const unsigned int hashTagBuckets = 0)
+            : m_prefix(m_prefix),
+              m_hash_tag(hashTag),
+              m_hash_tag_buckets(hashTagBuckets) {
         }
 
         const std::string& getPrefix() const { return m_prefix; }
 
+        HashTagStrategy getHashTag() const { return m_hash_tag; }
+
+        unsigned int getHashTagBuckets() const { return m_hash_tag_buckets; }
+
         StorageId make_id(const char* const context,
                           const char* const key) const {
-            return StorageId(context, key, m_prefix.c_str());
+            return StorageId(context, key, m_prefix.c_str(), m_hash_tag, m_hash_tag_buckets);
         }
 
         virtual bool set(const StorageId& id, const char* value, time_t expiration) = 0;
@@ -139,24 +275,129 @@ namespace spredis {
 
         virtual bool remove(const StorageId& id) = 0;
 
+        StorageId make_index_id(const char* const context) const {
+            return make_id(context, "").contextIndex();
+        }
+
+        /**
+         * Adds the record to the index of its context, or updates its
+         * expiration in the index. Members of the index which have expired
+         * are dropped at the same time, and the index itself expires with its
+         * last member.
+         */
+        virtual void indexRecord(const StorageId& id, time_t expiration) = 0;
+
+        virtual void unindexRecord(const StorageId& id) = 0;
+
+        /**
+         * Sets the expiration of every member of the context's index, and of
+         * the index itself, after updateContext changed the expiration of
+         * the records.
+         */
+        virtual void expireContextIndex(const char* context, time_t expiration) = 0;
+
+        virtual void deleteContextIndex(const char* context) = 0;
+
+        /**
+         * Reads the next page of the members of the context's index, starting
+         * at cursor, which is 0 for the first page.
+         *
+         * @return The cursor of the next page, or 0 if this was the last one.
+         */
+        virtual unsigned long long scanContextIndexPage(const char* context, unsigned long long cursor,
+                                                        std::vector<std::string>* out_members) = 0;
+
+        /**
+         * Increments the generation of the context's epoch before a record of
+         * the context is written, which Redis keeps until keepUntil, creating
+         * the epoch if needed. The epoch expires with the last record written,
+         * and its horizon is lowered to keepUntil if needed.
+         *
+         * @return The new generation, to stamp the record with.
+         */
+        virtual long long touchContextEpoch(const char* context, time_t keepUntil) = 0;
+
+        /**
+         * Reads the epoch of the context.
+         *
+         * @return false if the context has no epoch, in which case out_epoch
+         *         is left untouched.
+         */
+        virtual bool readContextEpoch(const char* context, ContextEpoch* out_epoch) = 0;
+
+        /**
+         * Records in the context's epoch that the records written so far
+         * expire at expiration, and keeps the epoch until at least keepUntil.
+         * The horizon of the epoch is returned in out_horizon. Does nothing
+         * if the context has no epoch.
+         *
+         * @return The new generation, or 0 if the context has no epoch.
+         */
+        virtual long long expireContextEpoch(const char* context, time_t expiration, time_t keepUntil,
+                                             time_t* out_horizon) = 0;
+
+        /**
+         * Records in the context's epoch that the records written so far are
+         * deleted. Does nothing if the context has no epoch.
+         *
+         * @return The new generation, or 0 if the context has no epoch.
+         */
+        virtual long long deleteContextEpoch(const char* context) = 0;
+
+        /**
+         * Raises the horizon of the context's epoch after the expiration of
+         * its records was extended, unless a record was written since the
+         * epoch was at generation, in which case the horizon is left as is.
+         */
+        virtual void raiseContextEpochHorizon(const char* context, long long generation, time_t horizon) = 0;
+
+        /**
+         * Returns the servers this instance communicates with: the single
+         * server, or the masters currently known in the cluster.
+         * Empty if not known.
+         */
+        virtual std::vector<ClusterNode> endpoints() const {
+            return std::vector<ClusterNode>();
+        }
+
+        /**
+         * Finds the keys of the records in the context, and calls callback
+         * with each page of them found, together with a connection to the
+         * server storing them. The connection is locked for the time of the
+         * call, so the callback can pipeline its commands for the whole page.
+         * In cluster mode, the masters are scanned in parallel, so the
+         * callback may be called concurrently from multiple threads.
+         */
         template<class Fn>
         void scanContext(const char* context, Fn callback) {
             scanContextTypeless(context, RawCallback<Fn>, static_cast<void*>(&callback));
         }
 
+        /**
+         * Same as scanContext, but only walks the members of the context's
+         * index instead of scanning every key of the servers.
+         */
+        template<class Fn>
+        void scanContextIndex(const char* context, Fn callback) {
+            scanContextIndexTypeless(context, RawCallback<Fn>, static_cast<void*>(&callback));
+        }
+
         virtual ~Redis() {
         }
 
     private:
         template<class Fn>
-        static void RawCallback(void* fn, RedisConnection* connection, const std::string& data) {
-            (*static_cast<Fn*>(fn))(connection, data);
+        static void RawCallback(void* fn, RedisConnection* connection, const std::vector<std::string>& keys) {
+            (*static_cast<Fn*>(fn))(connection, keys);
         }
 
     protected:
-        typedef void (*RawCallbackType)(void*, RedisConnection*, const std::string&);
+        typedef void (*RawCallbackType)(void*, RedisConnection*, const std::vector<std::string>&);
 
         virtual size_t scanContextTypeless(const char* context, RawCallbackType callback, void* callbackContext) = 0;
+
+        virtual size_t scanContextIndexTypeless(const char* context, RawCallbackType callback,
+                                                void* callbackContext) = 0;
     };
 }
 
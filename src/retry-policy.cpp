@@ -0,0 +1,120 @@
+/**
+ * Licensed to the University Corporation for Advanced Internet
+ * Development, Inc. (UCAID) under one or more contributor license
+ * agreements. See the NOTICE file distributed with this work for
+ * additional information regarding copyright ownership.
+ *
+ * UCAID licenses this file to you under the Apache License,
+ * Version 2.0 (the "License"); you may not use this file except
+ * in compliance with the License. You may obtain a copy of the
+ * License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+ */
+
+/**
+ * retry-policy.cpp
+ *
+ * Implementation of the RetryPolicy type.
+ */
+
+#include <algorithm>
+#include <thread>
+
+#include "retry-policy.h"
+#include "redis.h"
+#include "redis-stats.h"
+
+namespace {
+    /**
+     * The most retries the budget saves up, in hundredths of a retry: a
+     * burst of failures can be retried this many times before the budget
+     * only allows retryBudget percent of the operations to be retried.
+     */
+    const long budgetCapacity = 100 * 100;
+
+    unsigned int seedOf(const void* const attempt, const std::chrono::steady_clock::time_point& start) {
+        return static_cast<unsigned int>(start.time_since_epoch().count())
+               ^ static_cast<unsigned int>(reinterpret_cast<std::size_t>(attempt));
+    }
+}
+
+spredis::RetryPolicy::Attempt::Attempt(RetryPolicy& policy)
+    : m_policy(policy),
+      m_start(std::chrono::steady_clock::now()),
+      m_retries(0),
+      m_last_wait(policy.m_base_wait),
+      m_random(seedOf(this, m_start)) {
+    m_policy.deposit();
+}
+
+bool spredis::RetryPolicy::Attempt::nextWait(unsigned int* const out_wait) {
+    if (m_retries >= m_policy.m_max_retries) return false;
+
+    // decorrelated jitter: the waits grow about threefold on average, but
+    // each is spread over the whole range since the base wait
+    const unsigned long long low = m_policy.m_base_wait;
+    const unsigned long long high = std::max(low, m_last_wait * 3);
+    unsigned long long wait = std::uniform_int_distribution<unsigned long long>(low, high)(m_random);
+    if (m_policy.m_max_wait != 0) wait = std::min(wait, static_cast<unsigned long long>(m_policy.m_max_wait));
+
+    if (m_policy.m_timeout != 0) {
+        const long long msLeft = static_cast<long long>(m_policy.m_timeout)
+                                 - std::chrono::duration_cast<std::chrono::milliseconds>(
+                                     std::chrono::steady_clock::now() - m_start).count();
+        if (msLeft <= 0) {
+            RedisStats::getInstance().count(RedisStats::DEADLINES_EXCEEDED);
+            return false;
+        }
+        wait = std::min(wait, static_cast<unsigned long long>(msLeft));
+    }
+
+    if (!m_policy.withdraw()) {
+        RedisStats::getInstance().count(RedisStats::RETRY_BUDGET_EXHAUSTED);
+        return false;
+    }
+
+    ++m_retries;
+    m_last_wait = wait;
+    *out_wait = static_cast<unsigned int>(wait);
+    return true;
+}
+
+spredis::RetryPolicy::RetryPolicy(const RedisConfig& config)
+    : m_max_retries(config.maxRetries),
+      m_base_wait(config.baseWait),
+      m_max_wait(config.maxWait),
+      m_timeout(config.operationTimeout),
+      m_budget(config.retryBudget),
+      m_tokens(budgetCapacity) {
+}
+
+void spredis::RetryPolicy::sleepUnlocked(xmltooling::Mutex* const mutex, const long long milliseconds) {
+    mutex->unlock();
+    std::this_thread::sleep_for(std::chrono::milliseconds(milliseconds));
+    mutex->lock();
+}
+
+void spredis::RetryPolicy::deposit() {
+    if (m_budget == 0) return;
+
+    // the capacity may be overshot by concurrent deposits, which is harmless
+    if (m_tokens.load(boost::memory_order_relaxed) < budgetCapacity)
+        m_tokens.fetch_add(static_cast<long>(m_budget), boost::memory_order_relaxed);
+}
+
+bool spredis::RetryPolicy::withdraw() {
+    if (m_budget == 0) return true;
+
+    long tokens = m_tokens.load(boost::memory_order_relaxed);
+    while (tokens >= 100) {
+        if (m_tokens.compare_exchange_weak(tokens, tokens - 100, boost::memory_order_relaxed)) return true;
+    }
+    return false;
+}
@@ -0,0 +1,141 @@
+/**
+ * Licensed to the University Corporation for Advanced Internet
+ * Development, Inc. (UCAID) under one or more contributor license
+ * agreements. See the NOTICE file distributed with this work for
+ * additional information regarding copyright ownership.
+ *
+ * UCAID licenses this file to you under the Apache License,
+ * Version 2.0 (the "License"); you may not use this file except
+ * in compliance with the License. You may obtain a copy of the
+ * License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+ */
+
+/**
+ * retry-policy.h
+ *
+ * Provides the RetryPolicy class, which decides whether and when operations
+ * which lost their connection are retried.
+ */
+
+#ifndef RETRY_POLICY_H
+#define RETRY_POLICY_H
+
+#include <chrono>
+#include <random>
+
+#include "common.h"
+
+#include <boost/atomic.hpp>
+#include <xmltooling/util/Threads.h>
+
+namespace spredis {
+    class RedisConfig;
+
+    /**
+     * The retry policy shared by every operation of a storage service.
+     *
+     * Each operation is retried at most retryAmount times, and no retry is
+     * started after the operationTimeout of the operation passed. The waits
+     * before the retries use decorrelated jitter: each is picked at random
+     * between retryBaseTime and three times the previous one (capped by
+     * retryMaxTime), so the callers which failed together do not retry
+     * together.
+     *
+     * The retries of all operations are also limited by a budget: every
+     * operation earns retryBudget percent of a retry, and every retry spends
+     * a whole one, so an unavailable server is not sent more than about that
+     * share of retries on top of the load.
+     */
+    class SHIBSP_HIDDEN RetryPolicy SHIBSP_FINAL {
+        MAKE_NONCOPYABLE(RetryPolicy);
+
+    public:
+        /**
+         * The retries of a single operation. Created before the operation is
+         * first tried.
+         */
+        class SHIBSP_HIDDEN Attempt SHIBSP_FINAL {
+            MAKE_NONCOPYABLE(Attempt);
+
+        public:
+            explicit Attempt(RetryPolicy& policy);
+
+            unsigned int retries() const { return m_retries; }
+
+            /**
+             * Counts a retry performed at once, without waiting or spending
+             * the budget, such as following a redirection.
+             */
+            void retryAtOnce() { ++m_retries; }
+
+            /**
+             * Picks the wait before the next retry, in milliseconds. Returns
+             * false if the operation is not to be retried anymore.
+             */
+            bool nextWait(unsigned int* out_wait);
+
+        private:
+            RetryPolicy& m_policy;
+            const std::chrono::steady_clock::time_point m_start;
+            unsigned int m_retries;
+            unsigned long long m_last_wait;
+            std::minstd_rand m_random;
+        };
+
+        explicit RetryPolicy(const RedisConfig& config);
+
+        /**
+         * Waits for the given milliseconds while the snapshot current returns
+         * is still seen, the snapshots being published under mutex and
+         * published broadcast on every publish.
+         */
+        template<class Owner, class Snapshot>
+        static void waitForChange(const unsigned int milliseconds,
+                                  xmltooling::Mutex* const mutex,
+                                  xmltooling::CondWait* const published,
+                                  const Owner& owner,
+                                  Snapshot (Owner::*const current)() const,
+                                  const Snapshot& seen) {
+            const std::chrono::steady_clock::time_point deadline =
+                    std::chrono::steady_clock::now() + std::chrono::milliseconds(milliseconds);
+            const xmltooling::Lock lock(mutex);
+            while ((owner.*current)() == seen) {
+                const long long msLeft = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    deadline - std::chrono::steady_clock::now()).count();
+                if (msLeft <= 0) return;
+                if (msLeft >= 1000) {
+                    published->timedwait(mutex, static_cast<int>(msLeft / 1000));
+                    continue;
+                }
+                // XXX CondWait only waits whole seconds: the rest of the wait
+                // is slept, and is not ended early by a publish
+                sleepUnlocked(mutex, msLeft);
+            }
+        }
+
+    private:
+        static void sleepUnlocked(xmltooling::Mutex* mutex, long long milliseconds);
+
+        void deposit();
+
+        bool withdraw();
+
+        const unsigned int m_max_retries;
+        const unsigned int m_base_wait;
+        const unsigned int m_max_wait;
+        const unsigned int m_timeout;
+        const unsigned int m_budget;
+        // in hundredths of a retry
+        boost::atomic<long> m_tokens;
+    };
+}
+
+#endif //RETRY_POLICY_H
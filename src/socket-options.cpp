@@ -0,0 +1,87 @@
+/**
+ * Licensed to the University Corporation for Advanced Internet
+ * Development, Inc. (UCAID) under one or more contributor license
+ * agreements. See the NOTICE file distributed with this work for
+ * additional information regarding copyright ownership.
+ *
+ * UCAID licenses this file to you under the Apache License,
+ * Version 2.0 (the "License"); you may not use this file except
+ * in compliance with the License. You may obtain a copy of the
+ * License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+ */
+
+/**
+ * socket-options.cpp
+ *
+ * Implementation of the SocketOptions type.
+ */
+
+#include "socket-options.h"
+#include "redis.h"
+
+#include <cerrno>
+#include <cstring>
+
+// XXX Win32 - winsock
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+namespace {
+    bool setOption(const int fd, const int level, const int name, const int value) {
+        return setsockopt(fd, level, name, &value, sizeof(value)) == 0;
+    }
+
+    /**
+     * Enables TCP keepalive on the socket, probing an idle connection every
+     * interval seconds, and dropping it after 3 unanswered probes, the same
+     * way as redisEnableKeepAliveWithInterval, which is missing from older
+     * hiredis versions.
+     */
+    bool enableKeepAlive(const int fd, const int interval) {
+        if (!setOption(fd, SOL_SOCKET, SO_KEEPALIVE, 1)) return false;
+#if defined(TCP_KEEPIDLE)
+        if (!setOption(fd, IPPROTO_TCP, TCP_KEEPIDLE, interval)) return false;
+#elif defined(TCP_KEEPALIVE)
+        if (!setOption(fd, IPPROTO_TCP, TCP_KEEPALIVE, interval)) return false;
+#endif
+#if defined(TCP_KEEPINTVL)
+        if (!setOption(fd, IPPROTO_TCP, TCP_KEEPINTVL, interval / 3 > 0 ? interval / 3 : 1)) return false;
+#endif
+#if defined(TCP_KEEPCNT)
+        if (!setOption(fd, IPPROTO_TCP, TCP_KEEPCNT, 3)) return false;
+#endif
+        return true;
+    }
+}
+
+spredis::SocketOptions::SocketOptions(const RedisConfig& config)
+    : m_keep_alive_interval(config.tcpKeepAlive),
+      m_no_delay(config.tcpNoDelay),
+      m_send_buffer(config.socketSendBuffer),
+      m_receive_buffer(config.socketReceiveBuffer) {
+}
+
+void spredis::SocketOptions::apply(const redisContext* const context,
+                                   xmltooling::logging::Category& logger) const {
+    if (context == NULL || context->connection_type != REDIS_CONN_TCP) return;
+    const int fd = context->fd;
+
+    if (m_keep_alive_interval != 0 && !enableKeepAlive(fd, static_cast<int>(m_keep_alive_interval)))
+        logger.warn("cannot enable TCP keepalive on Redis connection: %s", std::strerror(errno));
+    // hiredis enables TCP_NODELAY itself, so it is only ever turned off
+    if (!m_no_delay && !setOption(fd, IPPROTO_TCP, TCP_NODELAY, 0))
+        logger.warn("cannot disable TCP_NODELAY on Redis connection: %s", std::strerror(errno));
+    if (m_send_buffer != 0 && !setOption(fd, SOL_SOCKET, SO_SNDBUF, static_cast<int>(m_send_buffer)))
+        logger.warn("cannot set the send buffer size of Redis connection: %s", std::strerror(errno));
+    if (m_receive_buffer != 0 && !setOption(fd, SOL_SOCKET, SO_RCVBUF, static_cast<int>(m_receive_buffer)))
+        logger.warn("cannot set the receive buffer size of Redis connection: %s", std::strerror(errno));
+}
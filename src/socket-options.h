@@ -0,0 +1,63 @@
+/**
+ * Licensed to the University Corporation for Advanced Internet
+ * Development, Inc. (UCAID) under one or more contributor license
+ * agreements. See the NOTICE file distributed with this work for
+ * additional information regarding copyright ownership.
+ *
+ * UCAID licenses this file to you under the Apache License,
+ * Version 2.0 (the "License"); you may not use this file except
+ * in compliance with the License. You may obtain a copy of the
+ * License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+ */
+
+/**
+ * socket-options.h
+ *
+ * Provides the SocketOptions class, which tunes the TCP sockets of the
+ * connections to Redis.
+ */
+
+#ifndef SOCKET_OPTIONS_H
+#define SOCKET_OPTIONS_H
+
+#include "common.h"
+
+#include <hiredis/hiredis.h>
+#include <xmltooling/logging.h>
+
+namespace spredis {
+    class RedisConfig;
+
+    /**
+     * The options set on the socket of every TCP connection to Redis, once
+     * connected, and again after reconnecting: TCP keepalive, TCP_NODELAY
+     * and the sizes of the socket buffers. Unix domain sockets are left
+     * as they are.
+     */
+    class SHIBSP_HIDDEN SocketOptions SHIBSP_FINAL {
+    public:
+        explicit SocketOptions(const RedisConfig& config);
+
+        /**
+         * Sets the options on the socket of the context. Options which cannot
+         * be set are logged, but do not fail the connection.
+         */
+        void apply(const redisContext* context, xmltooling::logging::Category& logger) const;
+
+    private:
+        const unsigned int m_keep_alive_interval;
+        const bool m_no_delay;
+        const unsigned int m_send_buffer;
+        const unsigned int m_receive_buffer;
+    };
+}
+
+#endif //SOCKET_OPTIONS_H
@@ -31,44 +31,121 @@
 
 #include "common.h"
 
+#include <algorithm>
 #include <cstring>
+#include <string>
+#include <vector>
 
 /**
- * A format sub-string for printf-family functions to format a given storage
- * StorageId (SID) object.
+ * A format sub-string for the hiredis command formatting functions to format
+ * a given storage StorageId (SID) object: the key preformatted by the object
+ * is passed as a binary-safe argument, so it is neither formatted nor measured
+ * again.
  * Parameters should be passed via @c SPREDIS_SID_FPARAM .
+ * This is not understood by printf-family functions, use @c SPREDIS_SID_LFMT
+ * for logging.
  *
  * Example use:
  * @code
  * StorageId my_sid = ...;
- * printf("sid: " SPREDIS_SID_FMT, SPREDIS_SID_FPARAM(my_sid));
+ * redisCommand(ctx, "GET " SPREDIS_SID_FMT, SPREDIS_SID_FPARAM(my_sid));
  * @endcode
  *
  * @see SPREDIS_SID_FPARAM
  */
-#define SPREDIS_SID_FMT "{%s:%s%s}"
+#define SPREDIS_SID_FMT "%b"
 
 /**
- * Passes a StorageId object to a printf-family function the way to be handled
- * by @c SPREDIS_SID_FMT .
+ * Passes a StorageId object to a hiredis command formatting function the way
+ * to be handled by @c SPREDIS_SID_FMT .
  *
  * @param sid The StorageId parameter to format
  *
  * @see SPREDIS_SID_FMT
  */
-#define SPREDIS_SID_FPARAM(sid) sid.context(), sid.prefix(), sid.key()
+#define SPREDIS_SID_FPARAM(sid) sid.wire(), sid.wireLength()
+
+/**
+ * A format sub-string for printf-family functions, e.g. the logger, to format
+ * a given StorageId object the same way it appears in Redis.
+ * Parameters should be passed via @c SPREDIS_SID_LPARAM .
+ *
+ * @see SPREDIS_SID_LPARAM
+ */
+#define SPREDIS_SID_LFMT "%s"
+
+/**
+ * Passes a StorageId object to a printf-family function the way to be handled
+ * by @c SPREDIS_SID_LFMT .
+ *
+ * @param sid The StorageId parameter to format
+ *
+ * @see SPREDIS_SID_LFMT
+ */
+#define SPREDIS_SID_LPARAM(sid) sid.wire()
 
 namespace spredis {
+    /**
+     * The part of the key of a record which is its hash tag, deciding the
+     * hash-slot, and thus the cluster node or shard, storing the record:
+     *  - HASH_TAG_KEY: the whole key, `{context:prefixkey}', spreading the
+     *    records of a context over every hash-slot;
+     *  - HASH_TAG_CONTEXT: the context, `{context:prefix}key', storing every
+     *    record of a context in the hash-slot of its index and epoch;
+     *  - HASH_TAG_BUCKETED: the context and a bucket picked by the key,
+     *    `{context:prefix#bucket}key', spreading the records of a context over
+     *    as many hash-slots as there are buckets.
+     */
+    enum HashTagStrategy {
+        HASH_TAG_KEY,
+        HASH_TAG_CONTEXT,
+        HASH_TAG_BUCKETED
+    };
+
     /**
      * A class encapsulating the multiple sections of making up the true key
      * of a value to be stored.
      * The class is immutable by design, because the key should not be changed
      * during processing, but purely passed through to Redis.
+     * The key as sent to Redis, e.g. `{context:prefixkey}', is built once by
+     * the constructor, and passed to every command of the operation as is.
      */
     class SHIBSP_HIDDEN StorageId SHIBSP_FINAL {
         const char* m_context;
         const char* m_key;
         const char* const m_prefix;
+        const HashTagStrategy m_hash_tag;
+        const unsigned int m_buckets;
+        std::string m_wire;
+        // the hash tag is the part of m_wire from after the opening brace up
+        // to this offset
+        std::string::size_type m_tag_end;
+
+        /**
+         * Returns the bucket of a key, out of buckets: the FNV-1a hash of the
+         * key, which is the same on every host, so the records written by one
+         * are found by the others.
+         */
+        static unsigned int bucketOf(const char* key, const size_t keyLength, const unsigned int buckets) {
+            unsigned int hash = 2166136261U;
+            for (size_t i = 0; i < keyLength; ++i) {
+                hash ^= static_cast<unsigned char>(key[i]);
+                hash *= 16777619U;
+            }
+            return buckets > 1 ? hash % buckets : 0;
+        }
+
+        static void appendContextTag(std::string& out, const char* context, const size_t contextLength,
+                                     const char* prefix, const size_t prefixLength) {
+            out.append(context, contextLength);
+            out.push_back(':');
+            out.append(prefix, prefixLength);
+        }
+
+        static void appendBucket(std::string& out, const unsigned int bucket) {
+            out.push_back('#');
+            out.append(std::to_string(bucket));
+        }
 
     public:
         /**
@@ -78,14 +155,41 @@ namespace spredis {
          * @param context The context of the identifier.
          * @param key The inner key to be stored.
          * @param prefix Optional prefix value to prepend to the key.
+         * @param hashTag The part of the key which is its hash tag.
+         * @param buckets The number of buckets of a context with
+         *                HASH_TAG_BUCKETED, ignored otherwise.
          */
         StorageId(
             const char* context,
             const char* key,
-            const char* const prefix = ""
+            const char* const prefix = "",
+            const HashTagStrategy hashTag = HASH_TAG_KEY,
+            const unsigned int buckets = 0
         ) : m_context(context),
             m_key(key),
-            m_prefix(prefix) {
+            m_prefix(prefix),
+            m_hash_tag(hashTag),
+            m_buckets(buckets),
+            m_wire(),
+            m_tag_end() {
+            const size_t contextLength = std::strlen(context);
+            const size_t keyLength = std::strlen(key);
+            const size_t prefixLength = std::strlen(prefix);
+            // the bucket takes at most 11 more characters
+            m_wire.reserve(contextLength + prefixLength + keyLength + 14);
+            m_wire.push_back('{');
+            appendContextTag(m_wire, context, contextLength, prefix, prefixLength);
+            if (hashTag == HASH_TAG_KEY) {
+                m_wire.append(key, keyLength);
+                m_tag_end = m_wire.size();
+                m_wire.push_back('}');
+                return;
+            }
+
+            if (hashTag == HASH_TAG_BUCKETED) appendBucket(m_wire, bucketOf(key, keyLength, buckets));
+            m_tag_end = m_wire.size();
+            m_wire.push_back('}');
+            m_wire.append(key, keyLength);
         }
 
         /**
@@ -118,15 +222,95 @@ namespace spredis {
             return m_prefix;
         }
 
+        /**
+         * Returns the part of the key which is its hash tag.
+         */
+        HashTagStrategy hashTag() const {
+            return m_hash_tag;
+        }
+
+        /**
+         * Returns the number of buckets of a context with HASH_TAG_BUCKETED.
+         */
+        unsigned int buckets() const {
+            return m_buckets;
+        }
+
+        /**
+         * Returns the key of the identifier as stored in Redis, e.g.
+         * `{context:prefixkey}'. NUL-terminated, and never contains NUL
+         * itself, as its parts are NUL-terminated strings; wireLength returns
+         * its length without measuring it again.
+         *
+         * @return The formatted key.
+         */
+        const char* wire() const {
+            return m_wire.c_str();
+        }
+
+        size_t wireLength() const {
+            return m_wire.size();
+        }
+
+        /**
+         * Returns the identifier of the index of the records in the context of
+         * this identifier, with the same prefix. The index is stored under
+         * `index.of:' followed by the formatted identifier; it has an empty
+         * key, so it never collides with a record.
+         * The index is `{context:prefix}' with every hash tag strategy, so it
+         * is found whichever one wrote it; with HASH_TAG_CONTEXT, it is in the
+         * hash-slot of the records of the context.
+         *
+         * @return The identifier of the context's index.
+         */
+        StorageId contextIndex() const {
+            return StorageId(m_context, "", m_prefix);
+        }
+
+        /**
+         * Returns the identifier with the same parts, with the hash tag of
+         * HASH_TAG_KEY: the key records had before the hash tag strategy was
+         * configurable.
+         */
+        StorageId perKeyTagged() const {
+            return StorageId(m_context, m_key, m_prefix);
+        }
+
         template<class HashStrategy>
         unsigned hashSlotUsing() const {
-            char colonBuf[] = ":";
-            unsigned context = HashStrategy::calculate(m_context, m_context + std::strlen(m_context));
-            unsigned colon = HashStrategy::calculate(colonBuf, colonBuf + 1, context);
-            unsigned prefix = HashStrategy::calculate(m_prefix, m_prefix + std::strlen(m_prefix), colon);
-            unsigned total = HashStrategy::calculate(m_key, m_key + std::strlen(m_key), prefix);
+            // hash between the opening brace and the end of the tag
+            const char* const tag = m_wire.data() + 1;
+            const unsigned total = HashStrategy::calculate(tag, m_wire.data() + m_tag_end);
             return total % HashStrategy::HashSlotCount;
         }
+
+        /**
+         * Returns the hash-slots which may store records of the context of
+         * this identifier, or nothing if these may be in any hash-slot, with
+         * HASH_TAG_KEY.
+         */
+        template<class HashStrategy>
+        std::vector<unsigned> contextSlotsUsing() const {
+            std::vector<unsigned> slots;
+            if (m_hash_tag == HASH_TAG_KEY) return slots;
+
+            std::string tag;
+            appendContextTag(tag, m_context, std::strlen(m_context), m_prefix, std::strlen(m_prefix));
+            if (m_hash_tag == HASH_TAG_CONTEXT) {
+                slots.push_back(HashStrategy::calculate(tag.data(), tag.data() + tag.size())
+                                % HashStrategy::HashSlotCount);
+                return slots;
+            }
+
+            const std::string::size_type contextTagLength = tag.size();
+            for (unsigned int bucket = 0; bucket < std::max(1U, m_buckets); ++bucket) {
+                tag.resize(contextTagLength);
+                appendBucket(tag, bucket);
+                slots.push_back(HashStrategy::calculate(tag.data(), tag.data() + tag.size())
+                                % HashStrategy::HashSlotCount);
+            }
+            return slots;
+        }
     };
 }
 
@@ -0,0 +1,203 @@
+/**
+ * Licensed to the University Corporation for Advanced Internet
+ * Development, Inc. (UCAID) under one or more contributor license
+ * agreements. See the NOTICE file distributed with this work for
+ * additional information regarding copyright ownership.
+ *
+ * UCAID licenses this file to you under the Apache License,
+ * Version 2.0 (the "License"); you may not use this file except
+ * in compliance with the License. You may obtain a copy of the
+ * License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+ */
+
+/**
+ * value-codec.cpp
+ *
+ * Implementation of the ValueCodec class.
+ */
+
+#include "value-codec.h"
+
+#include <cstring>
+
+// XXX Win32 - special config headers
+#include "config.h"
+
+#ifdef SHIBSP_HAVE_LZ4
+# include <lz4.h>
+#endif
+#ifdef SHIBSP_HAVE_ZSTD
+# include <zstd.h>
+#endif
+
+#include <xmltooling/exceptions.h>
+
+using namespace xmltooling;
+
+namespace {
+    // Shibboleth never stores values starting with a control character, so
+    // this marks the encoded values; escapeByte is the same byte in the
+    // escaped payload, where it introduces the escaped NUL and itself
+    const char headerByte = '\x01';
+    const char escapeByte = '\x01';
+    const char escapedNul = '\x01';
+    const char escapedEscape = '\x02';
+
+    const char codecNone = 'n';
+    const char codecLz4 = 'l';
+    const char codecZstd = 'z';
+
+    const size_t headerSize = 2;
+}
+
+spredis::ValueCodec::ValueCodec(const RedisConfig::Compression codec, const unsigned int threshold)
+    : m_codec(codec),
+      m_threshold(threshold) {
+}
+
+bool spredis::ValueCodec::encode(const char* const value, std::string& out_encoded) const {
+    const size_t length = std::strlen(value);
+
+    char codec = codecNone;
+    std::string payload;
+    if (m_codec != RedisConfig::COMPRESS_NONE && length >= m_threshold && compress(value, length, codec, payload)) {
+        out_encoded.assign(1, headerByte);
+        out_encoded.push_back(codec);
+        escape(payload, out_encoded);
+        return true;
+    }
+
+    // a value which looks encoded itself is stored with an explicit header
+    if (value[0] != headerByte) return false;
+    out_encoded.assign(1, headerByte);
+    out_encoded.push_back(codecNone);
+    escape(std::string(value, length), out_encoded);
+    return true;
+}
+
+bool spredis::ValueCodec::compress(const char* const value, const size_t length,
+                                   char& out_codec, std::string& payload) const {
+    switch (m_codec) {
+#ifdef SHIBSP_HAVE_LZ4
+    case RedisConfig::COMPRESS_LZ4: {
+        if (length > LZ4_MAX_INPUT_SIZE) return false;
+        // LZ4 blocks do not record their decompressed size
+        const int bound = LZ4_compressBound(static_cast<int>(length));
+        payload.resize(4 + static_cast<size_t>(bound));
+        for (int i = 0; i < 4; ++i) {
+            payload[i] = static_cast<char>((length >> (8 * i)) & 0xFF);
+        }
+        const int written = LZ4_compress_default(value, &payload[4], static_cast<int>(length), bound);
+        if (written <= 0) return false;
+        payload.resize(4 + static_cast<size_t>(written));
+        out_codec = codecLz4;
+        break;
+    }
+#endif
+#ifdef SHIBSP_HAVE_ZSTD
+    case RedisConfig::COMPRESS_ZSTD: {
+        payload.resize(ZSTD_compressBound(length));
+        const size_t written = ZSTD_compress(&payload[0], payload.size(), value, length, ZSTD_CLEVEL_DEFAULT);
+        if (ZSTD_isError(written)) return false;
+        payload.resize(written);
+        out_codec = codecZstd;
+        break;
+    }
+#endif
+    default:
+        // no codec compiled in: the configuration is refused before
+        (void) value;
+        (void) out_codec;
+        return false;
+    }
+
+    // not worth it: the value is stored as is (escaping adds a bit as well)
+    return payload.size() + headerSize < length;
+}
+
+void spredis::ValueCodec::escape(const std::string& raw, std::string& out_escaped) {
+    out_escaped.reserve(out_escaped.size() + raw.size() + raw.size() / 64);
+    for (size_t i = 0; i < raw.size(); ++i) {
+        if (raw[i] == '\0') {
+            out_escaped.push_back(escapeByte);
+            out_escaped.push_back(escapedNul);
+        } else if (raw[i] == escapeByte) {
+            out_escaped.push_back(escapeByte);
+            out_escaped.push_back(escapedEscape);
+        } else {
+            out_escaped.push_back(raw[i]);
+        }
+    }
+}
+
+void spredis::ValueCodec::unescape(const char* const escaped, const size_t length, std::string& out_raw) {
+    out_raw.clear();
+    out_raw.reserve(length);
+    for (size_t i = 0; i < length; ++i) {
+        if (escaped[i] != escapeByte) {
+            out_raw.push_back(escaped[i]);
+            continue;
+        }
+
+        if (++i == length) throw IOException("Redis value is corrupt: truncated escape sequence");
+        if (escaped[i] == escapedNul) out_raw.push_back('\0');
+        else if (escaped[i] == escapedEscape) out_raw.push_back(escapeByte);
+        else throw IOException("Redis value is corrupt: unknown escape sequence");
+    }
+}
+
+void spredis::ValueCodec::decode(std::string& value) const {
+    if (value.size() < headerSize || value[0] != headerByte) return;
+
+    const char codec = value[1];
+    std::string payload;
+    unescape(value.data() + headerSize, value.size() - headerSize, payload);
+
+    switch (codec) {
+    case codecNone:
+        value.swap(payload);
+        return;
+#ifdef SHIBSP_HAVE_LZ4
+    case codecLz4: {
+        if (payload.size() < 4) throw IOException("Redis value is corrupt: truncated LZ4 header");
+        size_t length = 0;
+        for (int i = 0; i < 4; ++i) {
+            length |= static_cast<size_t>(static_cast<unsigned char>(payload[i])) << (8 * i);
+        }
+
+        std::string decompressed(length, '\0');
+        const int read = LZ4_decompress_safe(payload.data() + 4, length ? &decompressed[0] : NULL,
+                                             static_cast<int>(payload.size() - 4), static_cast<int>(length));
+        if (read < 0 || static_cast<size_t>(read) != length)
+            throw IOException("Redis value is corrupt: cannot decompress LZ4 payload");
+        value.swap(decompressed);
+        return;
+    }
+#endif
+#ifdef SHIBSP_HAVE_ZSTD
+    case codecZstd: {
+        const unsigned long long length = ZSTD_getFrameContentSize(payload.data(), payload.size());
+        if (length == ZSTD_CONTENTSIZE_ERROR || length == ZSTD_CONTENTSIZE_UNKNOWN)
+            throw IOException("Redis value is corrupt: invalid zstd frame");
+
+        std::string decompressed(static_cast<size_t>(length), '\0');
+        const size_t read = ZSTD_decompress(length ? &decompressed[0] : NULL, decompressed.size(),
+                                            payload.data(), payload.size());
+        if (ZSTD_isError(read) || read != length)
+            throw IOException("Redis value is corrupt: cannot decompress zstd payload");
+        value.swap(decompressed);
+        return;
+    }
+#endif
+    default:
+        throw IOException("Redis value is compressed with a codec not supported by this build");
+    }
+}
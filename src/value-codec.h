@@ -0,0 +1,82 @@
+/**
+ * Licensed to the University Corporation for Advanced Internet
+ * Development, Inc. (UCAID) under one or more contributor license
+ * agreements. See the NOTICE file distributed with this work for
+ * additional information regarding copyright ownership.
+ *
+ * UCAID licenses this file to you under the Apache License,
+ * Version 2.0 (the "License"); you may not use this file except
+ * in compliance with the License. You may obtain a copy of the
+ * License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+ */
+
+/**
+ * value-codec.h
+ *
+ * Provides the ValueCodec class, which optionally compresses the values of
+ * records before they are stored in Redis.
+ */
+
+#ifndef VALUE_CODEC_H
+#define VALUE_CODEC_H
+
+#include <string>
+
+#include "common.h"
+#include "redis.h"
+
+namespace spredis {
+    /**
+     * Encodes the values of records as stored in Redis.
+     *
+     * Values longer than the threshold are compressed with the configured
+     * codec. Encoded values start with a header byte, followed by a byte
+     * naming the codec, so values are always decoded correctly, whatever
+     * codec is configured, and values written by earlier versions (which are
+     * never encoded) are read unchanged. Values are sent to Redis as C
+     * strings, so the compressed payload is escaped not to contain NUL.
+     */
+    class SHIBSP_HIDDEN ValueCodec SHIBSP_FINAL {
+    public:
+        ValueCodec(RedisConfig::Compression codec, unsigned int threshold);
+
+        /**
+         * Encodes the value into out_encoded, and returns true, or returns
+         * false if the value is to be stored as is.
+         */
+        bool encode(const char* value, std::string& out_encoded) const;
+
+        /**
+         * Decodes a value read from Redis in place. Values which are not
+         * encoded are left untouched.
+         */
+        void decode(std::string& value) const;
+
+    private:
+        /**
+         * Compresses the value with the configured codec into payload, and
+         * returns whether it is worth storing compressed.
+         */
+        bool compress(const char* value, size_t length, char& out_codec, std::string& payload) const;
+
+        /**
+         * Appends raw to out_escaped, with NUL and the escape byte escaped.
+         */
+        static void escape(const std::string& raw, std::string& out_escaped);
+
+        static void unescape(const char* escaped, size_t length, std::string& out_raw);
+
+        const RedisConfig::Compression m_codec;
+        const size_t m_threshold;
+    };
+}
+
+#endif //VALUE_CODEC_H